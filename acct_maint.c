@@ -24,6 +24,8 @@
 #include "auth.h"
 #include "xml_util.h"
 #include "certs.h"
+#include "certgraph.h"
+#include "tmetric.h"
 #include "aggregator.h"
 #include "db_ops.h"
 #include "proj.h"
@@ -33,6 +35,7 @@
 #include "diary.h"
 #include "site.h"
 #include "foaf.h"
+#include "session.h"
 #include "acct_maint.h"
 
 typedef struct _ProfileField ProfileField;
@@ -73,6 +76,8 @@ struct _NodeInfo {
   const char *surname;
 };
 
+static void
+acct_hot_remove (VirguleReq *vr, const char *u);
 
 /**
  * acct_kill: Remove a user account. Before an account is removed, all cert
@@ -151,6 +156,10 @@ acct_kill(VirguleReq *vr, const char *u)
 	  }
     }
 
+  /* Drop the account and its certs from the trust metric results */
+  virgule_certgraph_log_kill (vr, user);
+  virgule_tmetric_update (vr);
+
   /* Clear staff records */
   db_key2 = apr_psprintf (p, "acct/%s/staff-person.xml", user);
   staff = virgule_db_xml_get (p, vr->db, db_key2);
@@ -181,6 +190,10 @@ acct_kill(VirguleReq *vr, const char *u)
 
   /* <articlepointers>, <auth>, and <info> tags don't need attention */
 
+  /* Remove diary index, if any */
+  db_key2 = apr_psprintf (p, "acct/%s/diaryindex", user);
+  virgule_db_del (vr->db, db_key2);
+
   /* Remove diary backup, if any */
   diary = apr_psprintf (p, "acct/%s/diarybackup", user);
   virgule_db_del (vr->db, diary);
@@ -189,9 +202,12 @@ acct_kill(VirguleReq *vr, const char *u)
   db_key2 = apr_psprintf (p, "acct/%s/articles.xml", user);
   virgule_db_del (vr->db, db_key2);
 
+  /* Forget the user's session */
+  virgule_session_invalidate (vr->priv->base_path, user);
+
   /* Remove user from recent lists (if present) */
-  virgule_remove_recent (vr, "recent/acct.xml", user);
-  virgule_remove_recent (vr, "recent/diary.xml", user);
+  virgule_remove_recent (vr, "recent/acct", user);
+  virgule_remove_recent (vr, "recent/diary", user);
 
   /* Remove eigen data (if any) */
   virgule_eigen_cleanup (vr, user);
@@ -200,6 +216,10 @@ acct_kill(VirguleReq *vr, const char *u)
   virgule_db_del (vr->db, db_key);
   virgule_db_xml_free(p, profile);
 
+  /* Remove hot record and lastread table, if any, now that they can't
+     be built again from the profile */
+  acct_hot_remove (vr, user);
+
   /* Remove blog feed buffer, if any */
   db_key2 = apr_psprintf (p, "acct/%s/feed.xml", user);
   virgule_db_del (vr->db, db_key2);
@@ -252,8 +272,7 @@ acct_flag_as_spam(VirguleReq *vr, const char *u)
   if(u == NULL)
     return virgule_send_error_page (vr, vERROR, "account", "The specified user account was not found.\n");
 
-  if (strcmp (virgule_req_get_tmetric_level (vr, u),
-	      virgule_cert_level_to_name (vr, CERT_LEVEL_NONE)) != 0)
+  if (virgule_req_get_tmetric_cert_level (vr, u) != CERT_LEVEL_NONE)
     return virgule_send_error_page (vr, vERROR, "account", "Only untrusted observer accounts may be reported as spam.\n");
 
   db_key = virgule_acct_dbkey (vr, u);
@@ -271,8 +290,7 @@ acct_flag_as_spam(VirguleReq *vr, const char *u)
 	  char *issuer = (char *)xmlGetProp (flag, (xmlChar *)"issuer");
 	  if(issuer)
 	    {
-	      score += virgule_cert_level_from_name (vr, 
-	    		virgule_req_get_tmetric_level (vr, issuer));
+	      score += virgule_req_get_tmetric_cert_level (vr, issuer);
 	      if(!strcmp (issuer, vr->u))
 	        flagged = TRUE;
 	      xmlFree (issuer);
@@ -287,7 +305,7 @@ acct_flag_as_spam(VirguleReq *vr, const char *u)
   flag = xmlNewChild (spamtree, NULL, (xmlChar *)"flag", NULL);
   xmlSetProp (flag, (xmlChar *)"issuer", (xmlChar *)vr->u);
 
-  score += virgule_cert_level_from_name (vr, virgule_req_get_tmetric_level (vr, vr->u));
+  score += virgule_req_get_tmetric_cert_level (vr, vr->u);
   scorestr = (xmlChar *)apr_itoa (vr->r->pool, score);
   spamscore = virgule_xml_find_child(profile->xmlRootNode, "spamscore");
   if(spamscore == NULL)
@@ -307,99 +325,650 @@ acct_flag_as_spam(VirguleReq *vr, const char *u)
 }
 
 
-/* update an arbitrary pointer */
-int
-virgule_acct_set_lastread(VirguleReq *vr, const char *section, const char *location, int last_read)
+/* The hot record, acct/<u>/hot, holds the account fields that are
+   read or written on most requests, so that those don't parse and
+   rewrite a profile that grows with the account's certs: a copy of the
+   auth cookie, the lastlogin time and the number of old messages to
+   show. It is a binary record, an AcctHot. Numbers are in host order.
+   The lastread pointers are kept apart, in the lastread table below.
+
+   A new account gets its hot record when it is created. An older
+   account without one gets it the first time it is needed, built from
+   the profile. The lastlogin and pointers then belong to the hot record
+   and the lastread table and are removed from the profile; the cookie
+   and numold are still set in the profile and copied here.
+
+   The hot record is built and removed under a lock on its key, and an
+   account being removed loses its profile first, so that a request
+   racing the removal can't build the record again from the profile. */
+#define ACCT_HOT_MAGIC "HOT1"
+#define ACCT_HOT_COOKIE_MAX 64
+
+/* Fields for acct_hot_update. */
+#define ACCT_HOT_NUM_OLD (1 << 0)
+#define ACCT_HOT_LASTLOGIN (1 << 1)
+
+typedef struct {
+  char magic[4];
+  apr_int32_t num_old;       /* -1 for the default */
+  apr_int64_t lastlogin;     /* time_t, 0 if never */
+  char cookie[ACCT_HOT_COOKIE_MAX];  /* nul-terminated */
+} AcctHot;
+
+/* The lastread table, acct/<u>/lastread, holds for each location of
+   each section (a project, an article) the number of the last reply
+   the account has seen, and when. It is a hash table used as it is
+   stored: an AcctLastReadHeader, n_slots AcctLastReadSlot slots, and
+   the keys, each the section and the location nul-terminated. Slots
+   are found by linear probing from the FNV-1a hash of the key, so
+   getting or setting a pointer looks at a slot or two however many the
+   account has, and setting many at once writes the table once. Each
+   section also has a slot with an empty location, which tells whether
+   the account has read anything there. Numbers are in host order.
+
+   A table once loaded is kept in the request memo until it is
+   written. */
+#define ACCT_LASTREAD_MAGIC "LRD1"
+#define ACCT_LASTREAD_MIN_SLOTS 16
+#define ACCT_LASTREAD_KEY_MAX 1024
+
+typedef struct {
+  char magic[4];
+  apr_uint32_t n;            /* slots in use */
+  apr_uint32_t n_slots;      /* a power of two */
+  apr_uint32_t keys_size;
+} AcctLastReadHeader;
+
+typedef struct {
+  apr_int64_t date;          /* time_t of the last read, 0 if unknown */
+  apr_int32_t num;
+  apr_uint32_t hash;
+  apr_uint32_t key;          /* offset of the key plus one, 0 if empty */
+  apr_uint32_t pad;
+} AcctLastReadSlot;
+
+typedef struct {
+  AcctLastReadHeader *h;     /* the table, as stored */
+  AcctLastReadSlot *slots;
+  char *keys;
+  apr_size_t keys_max;       /* room for keys */
+} AcctLastRead;
+
+static char *
+acct_hot_key (apr_pool_t *p, const char *u)
+{
+  return apr_psprintf (p, "acct/%s/hot", u);
+}
+
+static char *
+acct_lastread_key (apr_pool_t *p, const char *u)
+{
+  return apr_psprintf (p, "acct/%s/lastread", u);
+}
+
+/* FNV-1a of the section, a nul and the location. */
+static apr_uint32_t
+acct_lastread_hash (const char *section, const char *location)
+{
+  apr_uint32_t h = 2166136261U;
+
+  for (; *section; section++)
+    h = (h ^ (unsigned char)*section) * 16777619U;
+  h *= 16777619U;
+  for (; *location; location++)
+    h = (h ^ (unsigned char)*location) * 16777619U;
+  return h;
+}
+
+/* Point @lr into @buf, which holds a table of @size bytes with room
+   for keys up to the end. */
+static void
+acct_lastread_layout (AcctLastRead *lr, char *buf, apr_size_t size)
+{
+  lr->h = (AcctLastReadHeader *)buf;
+  lr->slots = (AcctLastReadSlot *)(buf + sizeof (AcctLastReadHeader));
+  lr->keys = (char *)(lr->slots + lr->h->n_slots);
+  lr->keys_max = size - (lr->keys - buf);
+}
+
+static AcctLastRead *
+acct_lastread_new (apr_pool_t *p, apr_uint32_t n_slots, apr_size_t keys_max)
+{
+  AcctLastRead *lr = (AcctLastRead *)apr_palloc (p, sizeof (AcctLastRead));
+  apr_size_t size = sizeof (AcctLastReadHeader) +
+    n_slots * sizeof (AcctLastReadSlot) + keys_max;
+  char *buf = (char *)apr_pcalloc (p, size);
+
+  memcpy (buf, ACCT_LASTREAD_MAGIC, 4);
+  ((AcctLastReadHeader *)buf)->n_slots = n_slots;
+  acct_lastread_layout (lr, buf, size);
+  return lr;
+}
+
+static int
+acct_lastread_key_is (const AcctLastRead *lr, const AcctLastReadSlot *slot,
+		      const char *section, const char *location)
+{
+  apr_size_t off = slot->key - 1;
+  apr_size_t section_len = strlen (section);
+  apr_size_t location_len = strlen (location);
+
+  return off + section_len + location_len + 2 <= lr->h->keys_size &&
+    !memcmp (lr->keys + off, section, section_len + 1) &&
+    !memcmp (lr->keys + off + section_len + 1, location, location_len + 1);
+}
+
+/* Find the slot of a key, or the empty slot it would go in. NULL only
+   if the table is full, which a stored table shouldn't be. */
+static AcctLastReadSlot *
+acct_lastread_slot (const AcctLastRead *lr, const char *section,
+		    const char *location, apr_uint32_t hash)
+{
+  apr_uint32_t mask = lr->h->n_slots - 1;
+  apr_uint32_t i, j;
+
+  for (i = hash & mask, j = 0; j < lr->h->n_slots; i = (i + 1) & mask, j++)
+    {
+      AcctLastReadSlot *slot = &lr->slots[i];
+
+      if (slot->key == 0 ||
+	  (slot->hash == hash && acct_lastread_key_is (lr, slot, section,
+						       location)))
+	return slot;
+    }
+  return NULL;
+}
+
+static AcctLastReadSlot *
+acct_lastread_find (const AcctLastRead *lr, const char *section,
+		    const char *location)
+{
+  AcctLastReadSlot *slot;
+
+  slot = acct_lastread_slot (lr, section, location,
+			     acct_lastread_hash (section, location));
+  return slot != NULL && slot->key != 0 ? slot : NULL;
+}
+
+/* Move the table to a new buffer with @n_slots slots and room for
+   @keys_max bytes of keys. The hashes are kept, so no key is hashed
+   again. */
+static void
+acct_lastread_resize (apr_pool_t *p, AcctLastRead *lr, apr_uint32_t n_slots,
+		      apr_size_t keys_max)
+{
+  AcctLastRead *new_lr = acct_lastread_new (p, n_slots, keys_max);
+  apr_uint32_t mask = n_slots - 1;
+  apr_uint32_t i, j;
+
+  memcpy (new_lr->keys, lr->keys, lr->h->keys_size);
+  new_lr->h->keys_size = lr->h->keys_size;
+  new_lr->h->n = lr->h->n;
+  for (i = 0; i < lr->h->n_slots; i++)
+    if (lr->slots[i].key != 0)
+      {
+	for (j = lr->slots[i].hash & mask; new_lr->slots[j].key != 0;
+	     j = (j + 1) & mask)
+	  ;
+	new_lr->slots[j] = lr->slots[i];
+      }
+  *lr = *new_lr;
+}
+
+/* Get the slot of a key, adding it if it isn't there. */
+static AcctLastReadSlot *
+acct_lastread_add (apr_pool_t *p, AcctLastRead *lr, const char *section,
+		   const char *location)
+{
+  apr_uint32_t hash = acct_lastread_hash (section, location);
+  apr_size_t len = strlen (section) + strlen (location) + 2;
+  AcctLastReadSlot *slot;
+
+  slot = acct_lastread_slot (lr, section, location, hash);
+  if (slot != NULL && slot->key != 0)
+    return slot;
+
+  /* keep the table at most 3/4 full */
+  if ((lr->h->n + 1) * 4 > lr->h->n_slots * 3 ||
+      lr->h->keys_size + len > lr->keys_max)
+    {
+      apr_uint32_t n_slots = lr->h->n_slots;
+      apr_size_t keys_max = lr->keys_max;
+
+      while ((lr->h->n + 1) * 4 > n_slots * 3)
+	n_slots <<= 1;
+      if (lr->h->keys_size + len > keys_max)
+	keys_max = keys_max * 2 > lr->h->keys_size + len ?
+	  keys_max * 2 : lr->h->keys_size + len + 256;
+      acct_lastread_resize (p, lr, n_slots, keys_max);
+      slot = acct_lastread_slot (lr, section, location, hash);
+    }
+
+  strcpy (lr->keys + lr->h->keys_size, section);
+  strcpy (lr->keys + lr->h->keys_size + strlen (section) + 1, location);
+  slot->key = lr->h->keys_size + 1;
+  slot->hash = hash;
+  slot->num = -1;
+  slot->date = 0;
+  lr->h->keys_size += len;
+  lr->h->n++;
+  return slot;
+}
+
+/* Set a pointer. Unless @replace, a pointer that is already there is
+   left alone. Return value: 0 on success, -1 if the key is too long. */
+static int
+acct_lastread_set (apr_pool_t *p, AcctLastRead *lr, const char *section,
+		   const char *location, int num, apr_int64_t date,
+		   int replace)
+{
+  AcctLastReadSlot *slot;
+
+  if (strlen (section) + strlen (location) > ACCT_LASTREAD_KEY_MAX)
+    return -1;
+  if (!replace && acct_lastread_find (lr, section, location) != NULL)
+    return 0;
+  acct_lastread_add (p, lr, section, "");
+  slot = acct_lastread_add (p, lr, section, location);
+  slot->num = num;
+  slot->date = date;
+  return 0;
+}
+
+static AcctLastRead *
+acct_lastread_parse (apr_pool_t *p, char *buf, int size)
+{
+  AcctLastReadHeader h;
+  AcctLastRead *lr;
+  apr_uint32_t i, n = 0;
+
+  if (buf == NULL || size < (int)sizeof (AcctLastReadHeader))
+    return NULL;
+  memcpy (&h, buf, sizeof (AcctLastReadHeader));
+  if (memcmp (h.magic, ACCT_LASTREAD_MAGIC, 4) ||
+      h.n_slots < ACCT_LASTREAD_MIN_SLOTS || (h.n_slots & (h.n_slots - 1)) ||
+      h.n >= h.n_slots ||
+      h.n_slots > (size - sizeof (AcctLastReadHeader)) /
+      sizeof (AcctLastReadSlot) ||
+      size != (int)(sizeof (AcctLastReadHeader) +
+		    h.n_slots * sizeof (AcctLastReadSlot) + h.keys_size))
+    return NULL;
+  lr = (AcctLastRead *)apr_palloc (p, sizeof (AcctLastRead));
+  acct_lastread_layout (lr, buf, size);
+  if (h.keys_size > 0 && lr->keys[h.keys_size - 1] != 0)
+    return NULL;
+  /* the probes rely on the count being right */
+  for (i = 0; i < h.n_slots; i++)
+    if (lr->slots[i].key != 0)
+      {
+	if (lr->slots[i].key > h.keys_size)
+	  return NULL;
+	n++;
+      }
+  return n == h.n ? lr : NULL;
+}
+
+/* Load @u's lastread table, or an empty one. */
+static AcctLastRead *
+acct_lastread_load (VirguleReq *vr, const char *u)
+{
+  apr_pool_t *p = virgule_db_memo_pool (vr->db);
+  char *db_key = acct_lastread_key (vr->r->pool, u);
+  const void *doc;
+  AcctLastRead *lr;
+  char *buf;
+  int size;
+
+  if (virgule_db_memo_get_doc (vr->r->pool, vr->db, db_key, &doc))
+    return (AcctLastRead *)doc;
+  if (p == NULL)
+    p = vr->r->pool;
+  /* the memo counts the load when the table is kept */
+  buf = virgule_db_get_fresh (p, vr->db, db_key, &size);
+  lr = acct_lastread_parse (p, buf, size);
+  if (lr == NULL)
+    lr = acct_lastread_new (p, ACCT_LASTREAD_MIN_SLOTS, 256);
+  virgule_db_memo_set_doc (vr->r->pool, vr->db, db_key, lr);
+  return lr;
+}
+
+static int
+acct_lastread_store (VirguleReq *vr, const char *u, AcctLastRead *lr)
+{
+  apr_pool_t *p = vr->r->pool;
+
+  return virgule_db_put_p (p, vr->db, acct_lastread_key (p, u),
+			   (const char *)lr->h,
+			   sizeof (AcctLastReadHeader) +
+			   lr->h->n_slots * sizeof (AcctLastReadSlot) +
+			   lr->h->keys_size);
+}
+
+static void
+acct_hot_set_num_old (AcctHot *hot, const char *num_old)
+{
+  hot->num_old = num_old != NULL && *num_old ? atoi (num_old) : -1;
+}
+
+static AcctHot *
+acct_hot_parse (apr_pool_t *p, const char *buf, int size)
+{
+  AcctHot *hot;
+
+  if (buf == NULL || size != (int)sizeof (AcctHot))
+    return NULL;
+  hot = (AcctHot *)apr_palloc (p, sizeof (AcctHot));
+  memcpy (hot, buf, sizeof (AcctHot));
+  if (memcmp (hot->magic, ACCT_HOT_MAGIC, 4))
+    return NULL;
+  hot->cookie[ACCT_HOT_COOKIE_MAX - 1] = 0;
+  return hot;
+}
+
+static int
+acct_hot_store (VirguleReq *vr, const char *u, AcctHot *hot)
+{
+  apr_pool_t *p = vr->r->pool;
+
+  return virgule_db_put_p (p, vr->db, acct_hot_key (p, u),
+			   (const char *)hot, sizeof (AcctHot));
+}
+
+/* Build @u's hot record from the profile and store it, moving the
+   pointers to the lastread table, then remove the fields those now
+   hold from the profile. NULL if there is no such account, or it is an
+   alias. */
+static AcctHot *
+acct_hot_migrate (VirguleReq *vr, const char *u)
 {
   apr_pool_t *p = vr->r->pool;
-  Db *db = vr->db;
   char *db_key;
   xmlDoc *profile;
-  xmlNode *tree, *msgptr;
-  int status;
-
-  virgule_auth_user(vr);
-  if (vr->u == NULL)
-    return 0;
+  xmlNode *root, *tree, *next, *msgptr;
+  AcctHot *hot;
+  AcctLastRead *lr;
+  char *s;
+  int moved = 0;
 
-  db_key = virgule_acct_dbkey (vr, vr->u);
-  profile = virgule_db_xml_get (p, db, db_key);
+  db_key = virgule_acct_dbkey (vr, u);
+  if (db_key == NULL)
+    return NULL;
+  profile = virgule_db_xml_get (p, vr->db, db_key);
   if (profile == NULL)
-    return -1;
+    return NULL;
+  root = profile->xmlRootNode;
+  if (virgule_xml_find_child (root, "alias") != NULL)
+    {
+      virgule_db_xml_free (p, profile);
+      return NULL;
+    }
+
+  hot = (AcctHot *)apr_palloc (p, sizeof (AcctHot));
+  memset (hot, 0, sizeof (AcctHot));
+  memcpy (hot->magic, ACCT_HOT_MAGIC, 4);
+  lr = acct_lastread_load (vr, u);
 
-  tree = virgule_xml_ensure_child (profile->xmlRootNode, apr_psprintf(p, "%spointers", section));
+  tree = virgule_xml_find_child (root, "auth");
+  s = tree ? virgule_xml_get_prop (p, tree, (xmlChar *)"cookie") : NULL;
+  if (s != NULL && strlen (s) < ACCT_HOT_COOKIE_MAX)
+    strcpy (hot->cookie, s);
+  tree = virgule_xml_find_child (root, "info");
+  acct_hot_set_num_old (hot, tree ? virgule_xml_get_prop (p, tree, (xmlChar *)"numold") : NULL);
 
-  for (msgptr = tree->children; msgptr != NULL; msgptr = msgptr->next)
+  for (tree = root->children; tree != NULL; tree = next)
     {
-      if (msgptr->type == XML_ELEMENT_NODE &&
-	  !xmlStrcmp (msgptr->name, (xmlChar *)"lastread"))
+      const char *name = (const char *)tree->name;
+      size_t len = strlen (name);
+
+      next = tree->next;
+      if (tree->type != XML_ELEMENT_NODE)
+	continue;
+      if (!strcmp (name, "lastlogin"))
+	{
+	  s = virgule_xml_get_prop (p, tree, (xmlChar *)"date");
+	  if (s != NULL)
+	    hot->lastlogin = virgule_virgule_to_time_t (vr, s);
+	}
+      else if (len > 8 && !strcmp (name + len - 8, "pointers"))
 	{
-	  char *old_msgptr = (char *)xmlGetProp (msgptr, (xmlChar *)"location");
-	      
-	  if (old_msgptr)
+	  char *section = apr_pstrndup (p, name, len - 8);
+
+	  if (len - 8 <= ACCT_LASTREAD_KEY_MAX)
+	    acct_lastread_add (p, lr, section, "");
+	  for (msgptr = tree->children; msgptr != NULL; msgptr = msgptr->next)
 	    {
-	      if (!strcmp (old_msgptr, location))
-		{
-		  xmlFree (old_msgptr);
-		  break;
-		}
-	      xmlFree (old_msgptr);
+	      char *location;
+	      int num = -1;
+	      apr_int64_t date = 0;
+
+	      if (msgptr->type != XML_ELEMENT_NODE ||
+		  xmlStrcmp (msgptr->name, (xmlChar *)"lastread"))
+		continue;
+	      location = virgule_xml_get_prop (p, msgptr, (xmlChar *)"location");
+	      if (location == NULL)
+		continue;
+	      s = virgule_xml_get_prop (p, msgptr, (xmlChar *)"num");
+	      if (s != NULL)
+		num = atoi (s);
+	      s = virgule_xml_get_prop (p, msgptr, (xmlChar *)"date");
+	      if (s != NULL)
+		date = virgule_virgule_to_time_t (vr, s);
+	      /* the first of any duplicates is the one that was read */
+	      acct_lastread_set (p, lr, section, location, num, date, 0);
 	    }
 	}
+      else
+	continue;
+      xmlUnlinkNode (tree);
+      xmlFreeNode (tree);
+      moved = 1;
     }
-  if (msgptr == NULL)
+
+  /* store the pointers and the hot record first, so nothing is lost if
+     the profile can't be written */
+  if (acct_lastread_store (vr, u, lr) == 0 &&
+      acct_hot_store (vr, u, hot) == 0 && moved)
+    virgule_db_xml_put (p, vr->db, db_key, profile);
+  virgule_db_xml_free (p, profile);
+  return hot;
+}
+
+/* Get @u's hot record, migrating the account if it doesn't have one.
+   NULL if there is no such account. */
+static AcctHot *
+acct_hot_get (VirguleReq *vr, const char *u)
+{
+  apr_pool_t *p = vr->r->pool;
+  AcctHot *hot;
+  DbLock *lock;
+  char *buf;
+  int size;
+
+  if (virgule_validate_username (vr, u) != NULL)
+    return NULL;
+  buf = virgule_db_get_p (p, vr->db, acct_hot_key (p, u), &size);
+  hot = acct_hot_parse (p, buf, size);
+  if (hot != NULL)
+    return hot;
+
+  lock = virgule_db_lock_key (vr->db, acct_hot_key (p, u),
+			      APR_FLOCK_EXCLUSIVE);
+  if (lock == NULL)
+    return NULL;
+  /* another request may have built it while we waited */
+  buf = virgule_db_get_fresh (p, vr->db, acct_hot_key (p, u), &size);
+  hot = acct_hot_parse (p, buf, size);
+  if (hot == NULL)
+    hot = acct_hot_migrate (vr, u);
+  virgule_db_unlock (lock);
+  return hot;
+}
+
+/* Give the new account @u a hot record, replacing any left by an
+   earlier account of that name along with its lastread table. */
+static int
+acct_hot_create (VirguleReq *vr, const char *u, const char *cookie,
+		 const char *num_old)
+{
+  apr_pool_t *p = vr->r->pool;
+  AcctHot hot;
+  DbLock *lock;
+  int status;
+
+  memset (&hot, 0, sizeof (AcctHot));
+  memcpy (hot.magic, ACCT_HOT_MAGIC, 4);
+  if (cookie != NULL && strlen (cookie) < ACCT_HOT_COOKIE_MAX)
+    strcpy (hot.cookie, cookie);
+  acct_hot_set_num_old (&hot, num_old);
+
+  lock = virgule_db_lock_key (vr->db, acct_hot_key (p, u),
+			      APR_FLOCK_EXCLUSIVE);
+  if (lock == NULL)
+    return -1;
+  virgule_db_del (vr->db, acct_lastread_key (p, u));
+  status = acct_hot_store (vr, u, &hot);
+  virgule_db_unlock (lock);
+  return status;
+}
+
+/* Set the @fields of @u's hot record to those of @val. The record is
+   read again under its lock, so that concurrent updates of other
+   fields aren't lost; it isn't made again if it was removed meanwhile.
+   */
+static int
+acct_hot_update (VirguleReq *vr, const char *u, const AcctHot *val,
+		 int fields)
+{
+  apr_pool_t *p = vr->r->pool;
+  AcctHot *hot;
+  DbLock *lock;
+  char *buf;
+  int size;
+  int status = -1;
+
+  /* migrates the account if need be, which takes the lock itself */
+  if (acct_hot_get (vr, u) == NULL)
+    return -1;
+
+  lock = virgule_db_lock_key (vr->db, acct_hot_key (p, u),
+			      APR_FLOCK_EXCLUSIVE);
+  if (lock == NULL)
+    return -1;
+  buf = virgule_db_get_fresh (p, vr->db, acct_hot_key (p, u), &size);
+  hot = acct_hot_parse (p, buf, size);
+  if (hot != NULL)
     {
-      msgptr = xmlNewChild (tree, NULL, (xmlChar *)"lastread", NULL);
-      xmlSetProp (msgptr, (xmlChar *)"location", (xmlChar *)location);
+      if (fields & ACCT_HOT_NUM_OLD)
+	hot->num_old = val->num_old;
+      if (fields & ACCT_HOT_LASTLOGIN)
+	hot->lastlogin = val->lastlogin;
+      status = acct_hot_store (vr, u, hot);
     }
+  virgule_db_unlock (lock);
+  return status;
+}
+
+/* Remove @u's hot record and lastread table. The profile should be
+   gone already. */
+static void
+acct_hot_remove (VirguleReq *vr, const char *u)
+{
+  apr_pool_t *p = vr->r->pool;
+  DbLock *lock;
+
+  lock = virgule_db_lock_key (vr->db, acct_hot_key (p, u),
+			      APR_FLOCK_EXCLUSIVE);
+  virgule_db_del (vr->db, acct_hot_key (p, u));
+  virgule_db_del (vr->db, acct_lastread_key (p, u));
+  if (lock != NULL)
+    virgule_db_unlock (lock);
+}
 
-  xmlSetProp (msgptr, (xmlChar *)"num", (xmlChar *)apr_psprintf(p, "%d", last_read));
-  xmlSetProp (msgptr, (xmlChar *)"date", (xmlChar *)virgule_iso_now(p));
+/* Get @u's lastread table. NULL if there is no such account. */
+static AcctLastRead *
+acct_lastread_get (VirguleReq *vr, const char *u)
+{
+  if (acct_hot_get (vr, u) == NULL)
+    return NULL;
+  return acct_lastread_load (vr, u);
+}
 
-  status = virgule_db_xml_put (p, db, db_key, profile);
-  virgule_db_xml_free (p, profile);
+/**
+ * virgule_acct_get_cookie: Get the auth cookie of an account.
+ * @vr: The request.
+ * @u: The account name.
+ *
+ * Return value: The cookie, or NULL if there is no such account.
+ **/
+char *
+virgule_acct_get_cookie (VirguleReq *vr, const char *u)
+{
+  AcctHot *hot = acct_hot_get (vr, u);
 
-  return status;
+  if (hot == NULL || !hot->cookie[0])
+    return NULL;
+  return apr_pstrdup (vr->r->pool, hot->cookie);
 }
 
+/* update an arbitrary pointer */
 int
-virgule_acct_get_lastread(VirguleReq *vr, const char *section, const char *location)
+virgule_acct_set_lastread(VirguleReq *vr, const char *section, const char *location, int last_read)
 {
-  apr_pool_t *p = vr->r->pool;
-  Db *db = vr->db;
-  char *db_key;
-  xmlDoc *profile;
-  xmlNode *tree, *msgptr;
+  return virgule_acct_set_lastread_many (vr, section, 1, &location,
+					 &last_read);
+}
+
+/**
+ * virgule_acct_set_lastread_many: Update many pointers of a section.
+ * @vr: The request.
+ * @section: The section, such as "proj".
+ * @n: The number of pointers.
+ * @locations: The locations.
+ * @last_read: The last read number at each location.
+ *
+ * Sets the pointers of the logged in user, if any, writing them once.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_acct_set_lastread_many (VirguleReq *vr, const char *section, int n,
+				const char **locations, const int *last_read)
+{
+  AcctLastRead *lr;
+  apr_int64_t now = time (NULL);
+  int i;
 
   virgule_auth_user(vr);
   if (vr->u == NULL)
-    return -1;
+    return 0;
 
-  db_key = virgule_acct_dbkey (vr, vr->u);
-  profile = virgule_db_xml_get (p, db, db_key);
-  if (profile == NULL)
+  lr = acct_lastread_get (vr, vr->u);
+  if (lr == NULL)
     return -1;
 
-  tree = virgule_xml_find_child (profile->xmlRootNode, apr_psprintf(p, "%spointers", section));
-  if (tree == NULL)
+  for (i = 0; i < n; i++)
+    acct_lastread_set (vr->r->pool, lr, section, locations[i], last_read[i],
+		       now, 1);
+
+  return acct_lastread_store (vr, vr->u, lr);
+}
+
+int
+virgule_acct_get_lastread(VirguleReq *vr, const char *section, const char *location)
+{
+  AcctLastRead *lr;
+  AcctLastReadSlot *slot;
+
+  virgule_auth_user(vr);
+  if (vr->u == NULL)
     return -1;
 
-  for (msgptr = tree->children; msgptr != NULL; msgptr = msgptr->next)
-    {
-      if (msgptr->type == XML_ELEMENT_NODE &&
-	  !xmlStrcmp (msgptr->name, (xmlChar *)"lastread"))
-	{
-	  char *old_msgptr = (char *)xmlGetProp (msgptr, (xmlChar *)"location");
-	      
-	  if (old_msgptr)
-	    {
-	      if (!strcmp (old_msgptr, location))
-		return atoi ((char *)xmlGetProp (msgptr, (xmlChar *)"num"));
-	    }
-	}
-    }
+  lr = acct_lastread_get (vr, vr->u);
+  if (lr == NULL)
+    return -1;
 
-  return -1;
+  slot = acct_lastread_find (lr, section, location);
+  return slot ? slot->num : -1;
 }
 
 int
@@ -409,22 +978,12 @@ virgule_acct_get_num_old(VirguleReq *vr)
 
   if (vr->u)
     {
-      apr_pool_t *p = vr->r->pool;
-      char *db_key;
-      xmlDoc *profile;
-      xmlNode *tree;
-      char *num_old;
+      AcctHot *hot = acct_hot_get (vr, vr->u);
 
-      db_key = virgule_acct_dbkey (vr, vr->u);
-      profile = virgule_db_xml_get (p, vr->db, db_key);
-      tree = virgule_xml_find_child (profile->xmlRootNode, "info");
-
-      num_old = (char *)xmlGetProp (tree, (xmlChar *)"numold");
-
-      if (num_old == NULL || *num_old == '\0')
+      if (hot == NULL || hot->num_old < 0)
 	return 30;
       else
-	return atoi(num_old);
+	return hot->num_old;
     }
 
   return -1;
@@ -433,50 +992,28 @@ virgule_acct_get_num_old(VirguleReq *vr)
 char *
 virgule_acct_get_lastread_date(VirguleReq *vr, const char *section, const char *location)
 {
-  apr_pool_t *p = vr->r->pool;
-  Db *db = vr->db;
-  char *db_key;
-  xmlDoc *profile;
-  xmlNode *tree, *msgptr;
-  char *date;
-
+  AcctLastRead *lr;
+  AcctLastReadSlot *slot;
 
   virgule_auth_user(vr);
   if (vr->u == NULL)
     return NULL;
 
-  db_key = virgule_acct_dbkey (vr, vr->u);
-  profile = virgule_db_xml_get (p, db, db_key);
-  if (profile == NULL)
-    return NULL;
-
-  tree = virgule_xml_find_child (profile->xmlRootNode, apr_psprintf(p, "%spointers", section));
-  if (tree == NULL)
+  lr = acct_lastread_get (vr, vr->u);
+  if (lr == NULL)
     return NULL;
 
-  for (msgptr = tree->children; msgptr != NULL; msgptr = msgptr->next)
+  slot = acct_lastread_find (lr, section, location);
+  if (slot == NULL)
     {
-      if (msgptr->type == XML_ELEMENT_NODE &&
-	  !xmlStrcmp (msgptr->name, (xmlChar *)"lastread"))
-	{
-	  char *old_msgptr = (char *)xmlGetProp (msgptr, (xmlChar *)"location");
-	      
-	  if (old_msgptr)
-	    {
-	      if (!strcmp (old_msgptr, location))
-		{ 
-		  date = (char *)xmlGetProp (msgptr, (xmlChar *)"date");
-		  if (date == NULL)
-		    date = "1970-01-01 00:00:00";
-		  virgule_db_xml_free (p, profile);
-		  return date;
-		}
-	    }
-	}
+      /* as when the profile had no pointers element for the section */
+      return acct_lastread_find (lr, section, "") != NULL ?
+	"1970-01-01 00:00:00" : NULL;
     }
-
-  virgule_db_xml_free (p, profile);
-  return "1970-01-01 00:00:00"; 
+  if (slot->date <= 0)
+    return "1970-01-01 00:00:00";
+  return ap_ht_time (vr->r->pool, (apr_time_t)slot->date * 1000000,
+		     "%Y-%m-%d %H:%M:%S", 1);
 }
 
 /**
@@ -694,6 +1231,7 @@ acct_newsub_serve (VirguleReq *vr)
   int i;
   const char *date;
   char *u_lc;
+  char *givenname, *surname;
 
   if (!vr->priv->allow_account_creation)
     return virgule_send_error_page (vr, vERROR, "forbidden", "No new accounts may be created at this time.\n");
@@ -806,17 +1344,26 @@ acct_newsub_serve (VirguleReq *vr)
                                 "Only valid characters that use valid UTF-8 sequences may be submitted.");
     }
 
+  givenname = virgule_xml_get_prop (p, tree, (xmlChar *)"givenname");
+  surname = virgule_xml_get_prop (p, tree, (xmlChar *)"surname");
+
   status = virgule_db_xml_put (p, db, db_key, profile);
+  if (status == 0)
+    status = acct_hot_create (vr, u, cookie,
+			      virgule_xml_get_prop (p, tree, (xmlChar *)"numold"));
   if (status)
     return virgule_send_error_page (vr, vERROR,
 			    "internal",
 			    "There was an error storing the account profile.");
 
+  /* listed in the trust metric results by the next update */
+  virgule_certgraph_log_acct (vr, u, givenname, surname);
+
   acct_set_cookie (vr, u, cookie, 86400 * 365);
 
   vr->u = u;
 
-  virgule_add_recent (p, db, "recent/acct.xml", u, 100, 0);
+  virgule_add_recent (p, db, "recent/acct", u, 100, 0);
 
   /* store lower case alias if necessary */
   if (! (strcmp (u_lc, u) == 0))
@@ -1092,6 +1639,7 @@ acct_logout_serve (VirguleReq *vr)
   if (vr->u)
     {
       acct_set_cookie (vr, vr->u, "", -86400);
+      virgule_session_invalidate (vr->priv->base_path, vr->u);
       return virgule_send_error_page (vr, vINFO,
 			      "Logged out",
 			      "Logout of account <em>%s</em> ok.\n", vr->u);
@@ -1127,6 +1675,10 @@ acct_update_serve (VirguleReq *vr)
       char *db_key;
       xmlDoc *profile;
       xmlNode *info, *aggregate, *tree;
+      char *givenname, *surname;
+      const char *old_givenname, *old_surname;
+      AcctHot hot;
+      int names_changed;
       int i;
       int status;
 
@@ -1135,6 +1687,8 @@ acct_update_serve (VirguleReq *vr)
 
       info = virgule_xml_ensure_child (profile->xmlRootNode, "info");
       xmlSetProp (info, (xmlChar *)"format", (xmlChar *)"1");
+      givenname = virgule_xml_get_prop (p, info, (xmlChar *)"givenname");
+      surname = virgule_xml_get_prop (p, info, (xmlChar *)"surname");
       aggregate = virgule_xml_ensure_child (profile->xmlRootNode, "aggregate");
 
       for (i = 0; prof_fields[i].description; i++)
@@ -1169,6 +1723,14 @@ acct_update_serve (VirguleReq *vr)
                                     "Only valid characters that use valid UTF-8 sequences may be submitted.");
 	}
 
+      /* the trust metric results are sorted by surname */
+      old_givenname = givenname ? givenname : "";
+      old_surname = surname ? surname : "";
+      givenname = virgule_xml_get_prop (p, info, (xmlChar *)"givenname");
+      surname = virgule_xml_get_prop (p, info, (xmlChar *)"surname");
+      names_changed = strcmp (old_givenname, givenname ? givenname : "") ||
+		      strcmp (old_surname, surname ? surname : "");
+
       status = virgule_db_xml_put (p, vr->db, db_key, profile);
 
       if (status)
@@ -1176,6 +1738,14 @@ acct_update_serve (VirguleReq *vr)
 				"database",
 				"There was an error storing the account profile.");
 
+      /* the hot record keeps a copy of numold */
+      acct_hot_set_num_old (&hot, virgule_xml_get_prop (p, info, (xmlChar *)"numold"));
+      acct_hot_update (vr, vr->u, &hot, ACCT_HOT_NUM_OLD);
+
+      /* picked up by the next trust metric update */
+      if (names_changed)
+	virgule_certgraph_log_acct (vr, vr->u, givenname, surname);
+
       virgule_update_aggregator_list (vr);
 
       apr_table_add (vr->r->headers_out, "refresh",
@@ -1310,55 +1880,59 @@ acct_person_graph_serve (VirguleReq *vr)
   request_rec *r = vr->r;
   apr_pool_t *p = r->pool;
   Buffer *b = vr->b;
-  Db *db = vr->db;
-  DbCursor *dbc;
-  char *issuer;
+  apr_file_t *lock;
+  CertGraph *g;
+  CertGraphNode *nodes;
+  CertGraphEdge *edges;
+  int *out;
+  int i, j;
   const int threshold = 0;
 
+  /* the stored cert graph saves reading every profile; the lock keeps
+     the change log from being cut while we read it */
+  lock = virgule_certgraph_read_lock (vr, TRUE);
+  g = virgule_certgraph_load (vr);
+  if (g != NULL)
+    virgule_certgraph_apply_log (vr, g, NULL);
+  else
+    g = virgule_certgraph_build (vr);
+  if (lock != NULL)
+    virgule_certgraph_unlock (lock);
+  nodes = (CertGraphNode *)g->nodes->elts;
+  edges = (CertGraphEdge *)g->edges->elts;
+
+  /* chain each issuer's certs, in the order they were added */
+  out = (int *)apr_palloc (p, (g->nodes->nelts + g->edges->nelts) * sizeof (int));
+  for (i = 0; i < g->nodes->nelts; i++)
+    out[i] = -1;
+  for (j = g->edges->nelts - 1; j >= 0; j--)
+    {
+      out[g->nodes->nelts + j] = out[edges[j].issuer];
+      out[edges[j].issuer] = j;
+    }
+
   r->content_type = "text/plain; charset=UTF-8";
   virgule_buffer_printf (b, "digraph G {\n");
-  dbc = virgule_db_open_dir (db, "acct");
-  while ((issuer = virgule_db_read_dir_raw (dbc)) != NULL)
+  for (i = 1; i < g->nodes->nelts; i++)
     {
-      char *db_key;
-      xmlDoc *profile;
-      xmlNode *tree;
-      xmlNode *cert;
+      if (!nodes[i].is_acct)
+	continue;
 
-      virgule_buffer_printf (b, "   /* %s */\n", issuer);
+      virgule_buffer_printf (b, "   /* %s */\n", nodes[i].name);
 
-      db_key = virgule_acct_dbkey (vr, issuer);
-      if (db_key == NULL)
-        continue;
-      profile = virgule_db_xml_get (p, db, db_key);
-      if (profile == NULL)
-        continue;
-      tree = virgule_xml_find_child (profile->xmlRootNode, "certs");
-      if (tree == NULL)
+      if (virgule_req_get_tmetric_cert_level (vr, nodes[i].name) < threshold)
 	continue;
-      if (virgule_cert_level_from_name (vr, virgule_req_get_tmetric_level (vr, issuer)) < threshold)
-	continue;
-      for (cert = tree->children; cert != NULL; cert = cert->next)
+      for (j = out[i]; j >= 0; j = out[g->nodes->nelts + j])
 	{
-	  if (cert->type == XML_ELEMENT_NODE &&
-	      !xmlStrcmp (cert->name, (xmlChar *)"cert"))
-	    {
-	      char *cert_subj;
-
-	      cert_subj = virgule_xml_get_prop (p, cert, (xmlChar *)"subj");
-	      if (cert_subj &&
-		  virgule_cert_level_from_name (vr, virgule_req_get_tmetric_level (vr, cert_subj)) >= threshold)
-		{
-		  char *cert_level;
-
-                  cert_level = virgule_xml_get_prop (p, cert, (xmlChar *)"level");
-		  virgule_buffer_printf (b, "   %s -> %s [level=\"%s\"];\n",
-				 issuer, cert_subj, cert_level);
-		}
-	    }
+	  const char *cert_subj = nodes[edges[j].subj].name;
+
+	  if (edges[j].level > CERT_LEVEL_NONE &&
+	      virgule_req_get_tmetric_cert_level (vr, cert_subj) >= threshold)
+	    virgule_buffer_printf (b, "   %s -> %s [level=\"%s\"];\n",
+				   nodes[i].name, cert_subj,
+				   virgule_cert_level_to_name (vr, edges[j].level));
 	}
     }
-  virgule_db_close_dir (dbc);
 
   virgule_buffer_printf (b, "}\n");
   return virgule_send_response (vr);
@@ -1413,8 +1987,7 @@ acct_person_diary_rss_serve (VirguleReq *vr, char *u)
   xmlChar *mem;
   int size;
 
-  if ((!strcmp (virgule_req_get_tmetric_level (vr, u), 
-      virgule_cert_level_to_name (vr, CERT_LEVEL_NONE))) ||
+  if ((virgule_req_get_tmetric_cert_level (vr, u) == CERT_LEVEL_NONE) ||
       virgule_diary_exists (vr, u) == 0)
   {
     vr->r->status = 404;
@@ -1446,8 +2019,7 @@ acct_person_foaf_serve (VirguleReq *vr, char *u)
   xmlChar *mem;
   int size;
 
-  if (!strcmp (virgule_req_get_tmetric_level (vr, u), 
-      virgule_cert_level_to_name (vr, CERT_LEVEL_NONE)))
+  if (virgule_req_get_tmetric_cert_level (vr, u) == CERT_LEVEL_NONE)
   {
     vr->r->status = 404;
     return virgule_send_error_page (vr, vERROR, "not found", "No FOAF RDF record exists for this user at this time.");
@@ -1584,7 +2156,8 @@ acct_person_serve (VirguleReq *vr, const char *path)
   char *u;
   char *db_key;
   xmlDoc *profile, *staff, *artidx;
-  xmlNode *tree, *lastlogin;
+  xmlNode *tree;
+  AcctHot *hot;
   Buffer *b = vr->b;
   char *title;
   char *surname, *givenname;
@@ -1670,8 +2243,7 @@ acct_person_serve (VirguleReq *vr, const char *path)
   diaryused = virgule_diary_exists (vr, u);
 
   /* add a few things to the page header */
-  if (!strcmp (virgule_req_get_tmetric_level (vr, u), 
-      virgule_cert_level_to_name (vr, CERT_LEVEL_NONE)))
+  if (virgule_req_get_tmetric_cert_level (vr, u) == CERT_LEVEL_NONE)
     {
       observer = TRUE;
     }
@@ -1714,8 +2286,7 @@ acct_person_serve (VirguleReq *vr, const char *path)
     }
   else
     {
-      if (strcmp (virgule_req_get_tmetric_level (vr, vr->u),
-    		  virgule_cert_level_to_name (vr, CERT_LEVEL_NONE)) != 0)
+      if (virgule_req_get_tmetric_cert_level (vr, vr->u) != CERT_LEVEL_NONE)
         {
           virgule_buffer_printf(b, "<div class=\"spamscore\">Spam rating: %s "
 	                           "&nbsp;<form method=\"POST\" action=\"/person/%s/spam\">"
@@ -1750,9 +2321,23 @@ acct_person_serve (VirguleReq *vr, const char *path)
       virgule_buffer_printf (b, "Member since: %s<br />\n", date);
       date = NULL;
 
-      lastlogin = virgule_xml_find_child(profile->xmlRootNode, "lastlogin");
-      if(lastlogin) 
-        date = virgule_xml_get_prop (p, lastlogin, (xmlChar *)"date");
+      hot = acct_hot_get (vr, u);
+      if (hot != NULL && hot->lastlogin > 0)
+        date = ap_ht_time (p, (apr_time_t)hot->lastlogin * 1000000,
+			   "%Y-%m-%d %H:%M:%S", 1);
+      /* visits since lastlogin was written are only in the session table */
+      if (vr->priv->lastlogin_interval > 0)
+        {
+	  apr_time_t seen = virgule_session_seen (vr->priv->base_path, u);
+
+	  if (seen)
+	    {
+	      char *seendate = ap_ht_time (p, seen, "%Y-%m-%d %H:%M:%S", 1);
+
+	      if (!date || strcmp (seendate, date) > 0)
+		date = seendate;
+	    }
+	}
       if(!date)
         date = "N/A";
 	
@@ -1993,6 +2578,7 @@ acct_certify_serve (VirguleReq *vr)
 	return virgule_send_error_page (vr, vERROR,
 				"database",
 				"There was an error storing the certificate. This means there's something wrong with the site.");
+      virgule_tmetric_update (vr);
       apr_table_add (vr->r->headers_out, "refresh",
 		    apr_psprintf(vr->r->pool, "0;URL=/person/%s/#certs",
 				subject));
@@ -2044,49 +2630,24 @@ acct_killsub_serve(VirguleReq *vr)
 }
 
 /**
- * virgule_acct_touch: Touch user profile to record timestamp of this visit
+ * virgule_acct_touch: Record the time of this visit in the account's
+ * hot record.
+ *
+ * Most visits are only noted in the session table; the hot record is
+ * rewritten when its lastlogin is more than lastlogin_interval old.
  **/
 void
 virgule_acct_touch(VirguleReq *vr, const char *u)
 {
-  const char *newdate;
-  char *db_key, *db_key_lc, *u_lc;
-  xmlDoc *profile;
-  xmlNode *root, *tree, *lastlogin;
-  apr_pool_t *p = vr->r->pool;
-  
-  db_key = virgule_acct_dbkey (vr, u);
-  if (db_key == NULL) return;
-  
-  profile = virgule_db_xml_get (p, vr->db, db_key);
-  if (profile == NULL) return;
-  
-  root = profile->xmlRootNode;
-  tree = virgule_xml_find_child (root, "alias");
-
-  if (tree != NULL) {
-    u_lc = apr_pstrdup (p, u);
-    ap_str_tolower (u_lc);
-    db_key_lc = virgule_acct_dbkey (vr, u_lc);
-    profile = virgule_db_xml_get (p, vr->db, db_key);
-    if (profile == NULL) return;
-    root = profile->xmlRootNode;
-  }
-      
-  newdate = virgule_iso_now (p);
+  AcctHot hot;
 
-  lastlogin = virgule_xml_find_child(root, "lastlogin");
-  if(lastlogin == NULL) 
-  {
-    lastlogin = xmlNewChild (root, NULL, (xmlChar *)"lastlogin", NULL);
-    xmlSetProp (lastlogin, (xmlChar *)"date", (xmlChar *)newdate);
-  }
-  else
-  {
-    xmlSetProp (lastlogin, (xmlChar *)"date", (xmlChar *)newdate);
-  }
-  
-  virgule_db_xml_put (p, vr->db, db_key, profile);  
+  if (vr->priv->lastlogin_interval > 0 &&
+      !virgule_session_touch (vr->priv->base_path, u, apr_time_now (),
+			      apr_time_from_sec (vr->priv->lastlogin_interval)))
+    return;
+
+  hot.lastlogin = time (NULL);
+  acct_hot_update (vr, u, &hot, ACCT_HOT_LASTLOGIN);
 }
 
 
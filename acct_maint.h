@@ -4,6 +4,10 @@ virgule_acct_person_index_serve (VirguleReq *vr, int max);
 int
 virgule_acct_set_lastread(VirguleReq *vr, const char *section, const char *location, int last_read);
 
+int
+virgule_acct_set_lastread_many (VirguleReq *vr, const char *section, int n,
+				const char **locations, const int *last_read);
+
 int
 virgule_acct_get_lastread(VirguleReq *vr, const char *section, const char *location);
 
@@ -19,6 +23,9 @@ virgule_validate_username (VirguleReq *vr, const char *u);
 char *
 virgule_acct_dbkey (VirguleReq *vr, const char *u);
 
+char *
+virgule_acct_get_cookie (VirguleReq *vr, const char *u);
+
 int
 virgule_acct_login (VirguleReq *vr, const char *u, const char *pass,
 	    const char **ret1, const char **ret2);
@@ -506,10 +506,15 @@ aggregator_post_feed (VirguleReq *vr, xmlChar *user)
       xmlFreeNode(item->title);
     }
 
-  /* Post only one recentlog entry even if we get multiple new posts */
+  /* Post only one recentlog entry even if we get multiple new posts,
+     for the newest of them */
   if (post == 1)
-    virgule_add_recent (vr->r->pool, vr->db, "recent/diary.xml", (char *)user,
-			100, vr->priv->recentlog_as_posted);
+    virgule_add_recent_entry (vr->r->pool, vr->db, "recent/diary",
+			      (char *)user,
+			      virgule_db_dir_max (vr->db,
+				apr_psprintf (vr->r->pool, "acct/%s/diary",
+					      (char *)user)),
+			      100, vr->priv->recentlog_as_posted);
 
   return TRUE;
 }
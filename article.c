@@ -172,7 +172,7 @@ article_render_from_xml (VirguleReq *vr, int art_num, xmlDoc *doc, ArticleRender
   if (virgule_user_is_special(vr,author))
     cert_level = virgule_cert_num_levels (vr);
   else 
-    cert_level = virgule_cert_level_from_name(vr, virgule_req_get_tmetric_level (vr, author));
+    cert_level = virgule_req_get_tmetric_cert_level (vr, author);
 
   virgule_buffer_printf (b, "<h1 class=\"level%i\">", cert_level);
 
@@ -14,6 +14,7 @@
 #include "db_xml.h"
 #include "req.h"
 #include "acct_maint.h"
+#include "session.h"
 #include "xml_util.h"
 #include "auth.h"
 
@@ -21,12 +22,9 @@ void
 virgule_auth_user_with_cookie (VirguleReq *vr, const char *id_cookie)
 {
   request_rec *r = vr->r;
-  Db *db = vr->db;
   apr_pool_t *p = r->pool;
   char *u;
   char *db_key;
-  xmlDoc *profile;
-  xmlNode *root, *tree;
   char *stored_cookie;
 
   u = ap_getword (p, &id_cookie, ':');
@@ -35,21 +33,24 @@ virgule_auth_user_with_cookie (VirguleReq *vr, const char *id_cookie)
     /* cookie is invalid */
     return;
 
-  profile = virgule_db_xml_get (p, db, db_key);
-  if (profile == NULL)
-    /* account doesn't exist */
-    return;
-  root = profile->xmlRootNode;
-
-  tree = virgule_xml_find_child (root, "auth");
-  if (tree == NULL)
-    return;
-
-  stored_cookie = (char *)xmlGetProp (tree, (xmlChar *)"cookie");
-
-  if (strcmp (id_cookie, stored_cookie))
-    /* cookie doesn't match */
-    return;
+  /* a session checked recently needs no account record */
+  if (vr->priv->session_timeout <= 0 ||
+      !virgule_session_lookup (vr->priv->base_path, u, id_cookie))
+    {
+      stored_cookie = virgule_acct_get_cookie (vr, u);
+      if (stored_cookie == NULL)
+	/* account doesn't exist */
+	return;
+
+      if (strcmp (id_cookie, stored_cookie))
+	/* cookie doesn't match */
+	return;
+
+      if (vr->priv->session_timeout > 0)
+	virgule_session_store (vr->priv->base_path, u, id_cookie,
+			       apr_time_now () +
+			       apr_time_from_sec (vr->priv->session_timeout));
+    }
   vr->u = u;
   virgule_acct_touch(vr,u);
 
@@ -0,0 +1,48 @@
+/* Helpers shared by the standalone benchmarks: a small deterministic
+   random number generator, so runs can be repeated and every engine
+   sees the same graph, and a wall clock. */
+
+#include <stddef.h>
+#include <sys/time.h>
+
+#include "bench.h"
+
+static unsigned int bench_rand_state = 2463534242u;
+
+/**
+ * bench_srand: Restart the generator.
+ * @seed: The seed; must not be 0.
+ **/
+void
+bench_srand (unsigned int seed)
+{
+  bench_rand_state = seed;
+}
+
+/**
+ * bench_rand: Get the next number from the xorshift generator.
+ *
+ * Return value: A pseudo-random 32 bit number.
+ **/
+unsigned int
+bench_rand (void)
+{
+  bench_rand_state ^= bench_rand_state << 13;
+  bench_rand_state ^= bench_rand_state >> 17;
+  bench_rand_state ^= bench_rand_state << 5;
+  return bench_rand_state;
+}
+
+/**
+ * bench_now: Read the wall clock.
+ *
+ * Return value: The time in seconds.
+ **/
+double
+bench_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
@@ -0,0 +1,10 @@
+/* Helpers shared by the standalone benchmarks. */
+
+void
+bench_srand (unsigned int seed);
+
+unsigned int
+bench_rand (void);
+
+double
+bench_now (void);
@@ -0,0 +1,812 @@
+/* The cert graph: every account and the certs between them, with
+   account names interned as small integer ids.
+
+   The graph is stored in "tmetric/certgraph" in the database directory
+   in compressed sparse row form: a table of nodes, each pointing at
+   the start of its run of outgoing certs, sorted by level from highest
+   to lowest so that the certs at or above any level are a prefix of
+   the run. It is built from the account profiles by
+   virgule_certgraph_build() and from then on kept current through a
+   change log, "tmetric/certs.delta", which virgule_cert_set and the
+   account pages append to. Readers apply the log on top of the stored
+   graph; the trust metric update, holding the update lock, folds it in
+   and saves the result, cutting the log back to whatever was appended
+   in the meantime. Readers and appenders hold a shared lock on the log
+   itself, so the log isn't cut under them; the cut takes it
+   exclusively. Readers therefore never hold off an update.
+
+   Log records are one line each, with tab separated fields escaped
+   with ap_escape_uri:
+     c issuer subject level   - a cert was set (level 0 to remove it)
+     a user givenname surname - an account was created or renamed
+     k user                   - an account was deleted */
+
+#include <ctype.h>
+#include <unistd.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_file_io.h>
+#include <httpd.h>
+
+#include <libxml/tree.h>
+
+#include "private.h"
+#include "buffer.h"
+#include "db.h"
+#include "req.h"
+#include "db_xml.h"
+#include "acct_maint.h"
+#include "xml_util.h"
+#include "certs.h"
+#include "certgraph.h"
+
+#define CERTGRAPH_MAGIC 0x56434731 /* "VCG1" */
+
+#define CERTGRAPH_ACCT 1
+
+typedef struct {
+  apr_uint32_t magic;
+  apr_uint32_t n_levels;
+  apr_uint32_t n_nodes;
+  apr_uint32_t n_edges;
+  apr_uint32_t strings_size;
+  apr_uint32_t reserved;
+  apr_int64_t log_off;
+} CertGraphHeader;
+
+/* Name offsets are into the string table; givenname and surname are
+   offset + 1, or 0 if not set. */
+typedef struct {
+  apr_uint32_t name;
+  apr_uint32_t givenname;
+  apr_uint32_t surname;
+  apr_uint32_t flags;
+  apr_uint32_t flows;
+  apr_uint32_t out;   /* first outgoing cert; the run ends at the next node's */
+} CertGraphFileNode;
+
+typedef struct {
+  apr_uint32_t subj;
+  apr_uint32_t level;
+} CertGraphFileEdge;
+
+static char *
+certgraph_path (VirguleReq *vr, const char *name)
+{
+  return apr_pstrcat (vr->r->pool, vr->priv->base_path, "/tmetric/", name,
+		      NULL);
+}
+
+/**
+ * certgraph_new: Create an empty cert graph.
+ * @p: Pool for the graph.
+ * @n_levels: Number of cert levels configured for the site.
+ *
+ * Return value: The graph, containing only the root node.
+ **/
+CertGraph *
+virgule_certgraph_new (apr_pool_t *p, int n_levels)
+{
+  CertGraph *g = (CertGraph *)apr_pcalloc (p, sizeof (CertGraph));
+
+  g->pool = p;
+  g->n_levels = n_levels;
+  g->nodes = apr_array_make (p, 1024, sizeof (CertGraphNode));
+  g->node_ix = apr_hash_make (p);
+  g->edges = apr_array_make (p, 4096, sizeof (CertGraphEdge));
+  g->edge_ix = apr_hash_make (p);
+  (void) virgule_certgraph_node (g, "-");
+  return g;
+}
+
+/**
+ * certgraph_node: Find the node for an account, adding it if needed.
+ * @g: The cert graph.
+ * @u: The account name.
+ *
+ * Return value: The node index.
+ **/
+int
+virgule_certgraph_node (CertGraph *g, const char *u)
+{
+  CertGraphNode *n;
+  int *idx;
+
+  idx = apr_hash_get (g->node_ix, u, APR_HASH_KEY_STRING);
+  if (idx != NULL)
+    return *idx;
+
+  n = (CertGraphNode *)apr_array_push (g->nodes);
+  n->name = apr_pstrdup (g->pool, u);
+  n->givenname = NULL;
+  n->surname = NULL;
+  n->is_acct = 0;
+  n->flows = 0;
+  idx = (int *)apr_palloc (g->pool, sizeof (int));
+  *idx = g->nodes->nelts - 1;
+  apr_hash_set (g->node_ix, n->name, APR_HASH_KEY_STRING, idx);
+  return *idx;
+}
+
+/**
+ * certgraph_set_edge: Set the level of a cert.
+ * @g: The cert graph.
+ * @issuer: Node index of the certifying account.
+ * @subj: Node index of the certified account.
+ * @level: The level; CERT_LEVEL_NONE keeps the edge with no level.
+ *
+ * Return value: The edge index.
+ **/
+int
+virgule_certgraph_set_edge (CertGraph *g, int issuer, int subj,
+			    CertLevel level)
+{
+  CertGraphEdge *e;
+  int pair[2];
+  int *idx;
+
+  pair[0] = issuer;
+  pair[1] = subj;
+  idx = apr_hash_get (g->edge_ix, pair, sizeof (pair));
+  if (idx != NULL)
+    {
+      ((CertGraphEdge *)g->edges->elts)[*idx].level = level;
+      return *idx;
+    }
+
+  e = (CertGraphEdge *)apr_array_push (g->edges);
+  e->issuer = issuer;
+  e->subj = subj;
+  e->level = level;
+  e->prev = CERT_LEVEL_NONE;
+  idx = (int *)apr_palloc (g->pool, sizeof (int) + sizeof (pair));
+  *idx = g->edges->nelts - 1;
+  memcpy (idx + 1, pair, sizeof (pair));
+  apr_hash_set (g->edge_ix, idx + 1, sizeof (pair), idx);
+  return *idx;
+}
+
+/**
+ * certgraph_build: Build the cert graph from the account profiles.
+ * @vr: The request context.
+ *
+ * Reads every profile in the "acct" directory. The seeds are added as
+ * nodes whether or not they have profiles. The graph starts out
+ * reflecting the whole change log.
+ *
+ * Return value: The graph, with no trust metric flows.
+ **/
+CertGraph *
+virgule_certgraph_build (VirguleReq *vr)
+{
+  apr_pool_t *p = vr->r->pool;
+  Db *db = vr->db;
+  CertGraph *g;
+  int j;
+  DbCursor *dbc;
+  char *issuer;
+
+  g = virgule_certgraph_new (p, virgule_cert_num_levels (vr));
+  /* changes made while we scan the profiles are replayed afterwards */
+  g->log_off = virgule_certgraph_log_size (vr);
+
+  for (j = 0; vr->priv->seeds[j]; j++)
+    (void) virgule_certgraph_node (g, vr->priv->seeds[j]);
+
+  dbc = virgule_db_open_dir (db, "acct");
+  while ((issuer = virgule_db_read_dir_raw (dbc)) != NULL)
+    {
+      char *db_key;
+      xmlDoc *profile = NULL;
+      xmlNode *tree = NULL;
+      xmlNode *cert;
+      CertGraphNode *n;
+      int issuer_ix;
+
+      db_key = virgule_acct_dbkey (vr, issuer);
+
+      if(db_key == NULL)
+        continue;
+
+      profile = virgule_db_xml_get (p, db, db_key);
+      if (profile != NULL)
+        tree = virgule_xml_find_child (profile->xmlRootNode, "info");
+      if (tree == NULL)
+	{
+	  virgule_db_xml_free (p, profile);
+	  continue;
+	}
+
+      issuer_ix = virgule_certgraph_node (g, issuer);
+      n = &((CertGraphNode *)g->nodes->elts)[issuer_ix];
+      n->is_acct = 1;
+      n->givenname = virgule_xml_get_prop (p, tree, (xmlChar *)"givenname");
+      n->surname = virgule_xml_get_prop (p, tree, (xmlChar *)"surname");
+      tree = virgule_xml_find_child (profile->xmlRootNode, "certs");
+      for (cert = tree ? tree->children : NULL; cert != NULL; cert = cert->next)
+	{
+	  if (cert->type == XML_ELEMENT_NODE &&
+	      !strcmp ((char *)cert->name, "cert"))
+	    {
+	      char *cert_subj;
+
+	      cert_subj = virgule_xml_get_prop (p, cert, (xmlChar *)"subj");
+	      if (cert_subj)
+		{
+		  char *cert_level;
+		  CertLevel level;
+
+		  cert_level = (char *)xmlGetProp (cert, (xmlChar *)"level");
+		  level = virgule_cert_level_from_name (vr, cert_level);
+		  xmlFree (cert_level);
+		  virgule_certgraph_set_edge (g, issuer_ix,
+					      virgule_certgraph_node (g, cert_subj),
+					      level);
+		}
+	    }
+	}
+      virgule_db_xml_free (p, profile);
+    }
+  virgule_db_close_dir (dbc);
+
+  virgule_certgraph_apply_log (vr, g, NULL);
+  return g;
+}
+
+/* Read the whole of @fn from @off into a NUL terminated string. */
+static char *
+certgraph_read_file (apr_pool_t *p, const char *fn, apr_off_t off,
+		     apr_size_t *p_size)
+{
+  apr_file_t *fd;
+  apr_finfo_t finfo;
+  apr_size_t size;
+  apr_status_t status;
+  char *result;
+
+  if (apr_file_open (&fd, fn, APR_READ, APR_OS_DEFAULT, p) != APR_SUCCESS)
+    return NULL;
+  if (apr_file_info_get (&finfo, APR_FINFO_SIZE, fd) != APR_SUCCESS ||
+      finfo.size < off ||
+      apr_file_seek (fd, APR_SET, &off) != APR_SUCCESS)
+    {
+      apr_file_close (fd);
+      return NULL;
+    }
+  size = finfo.size - off;
+  result = apr_palloc (p, size + 1);
+  status = apr_file_read_full (fd, result, size, &size);
+  apr_file_close (fd);
+  if (status != APR_SUCCESS && status != APR_EOF)
+    return NULL;
+  result[size] = 0;
+  if (p_size)
+    *p_size = size;
+  return result;
+}
+
+/**
+ * certgraph_load: Load the stored cert graph.
+ * @vr: The request context.
+ *
+ * The change log is not applied; see virgule_certgraph_apply_log().
+ *
+ * Return value: The graph, or NULL if there is none, it is damaged, or
+ * it was built for a different number of cert levels.
+ **/
+CertGraph *
+virgule_certgraph_load (VirguleReq *vr)
+{
+  apr_pool_t *p = vr->r->pool;
+  CertGraph *g;
+  CertGraphHeader *h;
+  CertGraphFileNode *fn;
+  CertGraphFileEdge *fe;
+  CertGraphNode *n;
+  const char *strings;
+  apr_size_t size;
+  apr_uint32_t i, j, end;
+  char *buf;
+  int idx;
+
+  buf = certgraph_read_file (p, certgraph_path (vr, "certgraph"), 0, &size);
+  if (buf == NULL || size < sizeof (CertGraphHeader))
+    return NULL;
+
+  h = (CertGraphHeader *)buf;
+  if (h->magic != CERTGRAPH_MAGIC ||
+      h->n_levels != (apr_uint32_t)virgule_cert_num_levels (vr) ||
+      h->n_nodes == 0 ||
+      size != sizeof (CertGraphHeader) +
+	      h->n_nodes * sizeof (CertGraphFileNode) +
+	      h->n_edges * sizeof (CertGraphFileEdge) + h->strings_size ||
+      h->strings_size == 0)
+    return NULL;
+  fn = (CertGraphFileNode *)(h + 1);
+  fe = (CertGraphFileEdge *)(fn + h->n_nodes);
+  strings = (const char *)(fe + h->n_edges);
+  if (strings[h->strings_size - 1] != 0)
+    return NULL;
+
+  g = (CertGraph *)apr_pcalloc (p, sizeof (CertGraph));
+  g->pool = p;
+  g->n_levels = h->n_levels;
+  g->nodes = apr_array_make (p, h->n_nodes, sizeof (CertGraphNode));
+  g->node_ix = apr_hash_make (p);
+  g->edges = apr_array_make (p, h->n_edges + 1, sizeof (CertGraphEdge));
+  g->edge_ix = apr_hash_make (p);
+  g->log_off = h->log_off;
+
+  for (i = 0; i < h->n_nodes; i++)
+    {
+      if (fn[i].name >= h->strings_size ||
+	  fn[i].givenname > h->strings_size ||
+	  fn[i].surname > h->strings_size)
+	return NULL;
+      idx = virgule_certgraph_node (g, strings + fn[i].name);
+      if ((apr_uint32_t)idx != i)
+	return NULL;
+      n = &((CertGraphNode *)g->nodes->elts)[idx];
+      n->givenname = fn[i].givenname ? strings + fn[i].givenname - 1 : NULL;
+      n->surname = fn[i].surname ? strings + fn[i].surname - 1 : NULL;
+      n->is_acct = (fn[i].flags & CERTGRAPH_ACCT) != 0;
+      n->flows = fn[i].flows;
+    }
+  if (strcmp (((CertGraphNode *)g->nodes->elts)[0].name, "-"))
+    return NULL;
+
+  for (i = 0; i < h->n_nodes; i++)
+    {
+      end = i + 1 < h->n_nodes ? fn[i + 1].out : h->n_edges;
+      if (fn[i].out > end || end > h->n_edges)
+	return NULL;
+      for (j = fn[i].out; j < end; j++)
+	{
+	  if (fe[j].subj >= h->n_nodes)
+	    return NULL;
+	  virgule_certgraph_set_edge (g, i, fe[j].subj, fe[j].level);
+	}
+    }
+
+  return g;
+}
+
+static int
+certgraph_edge_compare (const void *a, const void *b)
+{
+  const CertGraphEdge *e1 = *(const CertGraphEdge **)a;
+  const CertGraphEdge *e2 = *(const CertGraphEdge **)b;
+
+  if (e1->issuer != e2->issuer)
+    return e1->issuer - e2->issuer;
+  return e2->level - e1->level;
+}
+
+/* Add @s to the string table, returning its offset. */
+static apr_uint32_t
+certgraph_intern (Buffer *b, apr_uint32_t *size, const char *s)
+{
+  apr_uint32_t off = *size;
+
+  virgule_buffer_write (b, s, strlen (s) + 1);
+  *size += strlen (s) + 1;
+  return off;
+}
+
+/**
+ * certgraph_save: Store the cert graph.
+ * @vr: The request context.
+ * @g: The cert graph.
+ *
+ * Writes the graph, without removed certs, to a temporary file which is
+ * then renamed over "tmetric/certgraph". The change log is then cut
+ * back to the records @g hasn't seen, and @g's log offset reset to
+ * match. The caller should hold the graph lock.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_certgraph_save (VirguleReq *vr, CertGraph *g)
+{
+  apr_pool_t *p = vr->r->pool;
+  CertGraphNode *nodes = (CertGraphNode *)g->nodes->elts;
+  CertGraphEdge *edges = (CertGraphEdge *)g->edges->elts;
+  CertGraphEdge **sorted;
+  CertGraphHeader h;
+  CertGraphFileNode *fn;
+  CertGraphFileEdge *fe;
+  Buffer *sb;
+  apr_uint32_t strings_size = 0;
+  char *path = certgraph_path (vr, "certgraph");
+  char *tmp_path = apr_psprintf (p, "%s.%ld", path, (long)getpid ());
+  char *log_path = certgraph_path (vr, "certs.delta");
+  char *strings;
+  char *tail = NULL;
+  apr_size_t tail_size = 0;
+  apr_file_t *fd, *log;
+  apr_status_t status;
+  int i, n_edges;
+
+  sorted = (CertGraphEdge **)apr_palloc (p, (g->edges->nelts + 1) *
+					 sizeof (CertGraphEdge *));
+  for (i = 0, n_edges = 0; i < g->edges->nelts; i++)
+    if (edges[i].level > CERT_LEVEL_NONE)
+      sorted[n_edges++] = &edges[i];
+  qsort (sorted, n_edges, sizeof (CertGraphEdge *), certgraph_edge_compare);
+
+  fn = (CertGraphFileNode *)apr_pcalloc (p, g->nodes->nelts *
+					 sizeof (CertGraphFileNode));
+  fe = (CertGraphFileEdge *)apr_palloc (p, (n_edges + 1) *
+					sizeof (CertGraphFileEdge));
+  sb = virgule_buffer_new (p);
+  for (i = 0; i < g->nodes->nelts; i++)
+    {
+      fn[i].name = certgraph_intern (sb, &strings_size, nodes[i].name);
+      if (nodes[i].givenname)
+	fn[i].givenname = certgraph_intern (sb, &strings_size,
+					    nodes[i].givenname) + 1;
+      if (nodes[i].surname)
+	fn[i].surname = certgraph_intern (sb, &strings_size,
+					  nodes[i].surname) + 1;
+      fn[i].flags = nodes[i].is_acct ? CERTGRAPH_ACCT : 0;
+      fn[i].flows = nodes[i].flows;
+    }
+  /* runs of certs start where the previous issuer's ended */
+  for (i = g->nodes->nelts - 1; i >= 0; i--)
+    fn[i].out = n_edges;
+  for (i = n_edges - 1; i >= 0; i--)
+    {
+      fe[i].subj = sorted[i]->subj;
+      fe[i].level = sorted[i]->level;
+      fn[sorted[i]->issuer].out = i;
+    }
+  for (i = g->nodes->nelts - 2; i >= 0; i--)
+    if (fn[i].out > fn[i + 1].out)
+      fn[i].out = fn[i + 1].out;
+  strings = virgule_buffer_extract (sb);
+
+  memset (&h, 0, sizeof (h));
+  h.magic = CERTGRAPH_MAGIC;
+  h.n_levels = g->n_levels;
+  h.n_nodes = g->nodes->nelts;
+  h.n_edges = n_edges;
+  h.strings_size = strings_size;
+  h.log_off = g->log_off;
+
+  /* Hold off appenders and keep what they added since @g was brought
+     up to date. The stored graph starts the log afresh: until the log
+     is cut it is replayed from the start, which is harmless since each
+     record sets its state outright. */
+  if (apr_file_open (&log, log_path, APR_READ|APR_WRITE|APR_APPEND,
+		     APR_OS_DEFAULT, p) != APR_SUCCESS)
+    log = NULL;
+  else if (apr_file_lock (log, APR_FLOCK_EXCLUSIVE) != APR_SUCCESS ||
+	   (tail = certgraph_read_file (p, log_path, g->log_off,
+					&tail_size)) == NULL)
+    {
+      apr_file_close (log);
+      log = NULL;
+    }
+  if (log != NULL)
+    {
+      /* no append is under way, so a last line without a newline was
+	 left by a writer that died: drop it rather than keep it at the
+	 end of the log, where it would stall every reader */
+      while (tail_size > 0 && tail[tail_size - 1] != '\n')
+	tail_size--;
+      h.log_off = 0;
+    }
+
+  if (apr_file_open (&fd, tmp_path, APR_WRITE|APR_CREATE|APR_TRUNCATE,
+		     APR_OS_DEFAULT, p) != APR_SUCCESS)
+    {
+      if (log != NULL)
+	apr_file_close (log);
+      return -1;
+    }
+  status = apr_file_write_full (fd, &h, sizeof (h), NULL);
+  if (status == APR_SUCCESS)
+    status = apr_file_write_full (fd, fn, h.n_nodes *
+				  sizeof (CertGraphFileNode), NULL);
+  if (status == APR_SUCCESS)
+    status = apr_file_write_full (fd, fe, n_edges *
+				  sizeof (CertGraphFileEdge), NULL);
+  if (status == APR_SUCCESS)
+    status = apr_file_write_full (fd, strings, strings_size, NULL);
+  apr_file_close (fd);
+  if (status != APR_SUCCESS ||
+      apr_file_rename (tmp_path, path, p) != APR_SUCCESS)
+    {
+      apr_file_remove (tmp_path, p);
+      if (log != NULL)
+	apr_file_close (log);
+      return -1;
+    }
+  g->log_off = h.log_off;
+
+  if (log != NULL)
+    {
+      status = apr_file_trunc (log, 0);
+      if (status == APR_SUCCESS && tail_size > 0)
+	status = apr_file_write_full (log, tail, tail_size, NULL);
+      /* closing releases the lock */
+      apr_file_close (log);
+      if (status != APR_SUCCESS)
+	return -1;
+    }
+  return 0;
+}
+
+/* Unescape the next tab separated field of *@line. */
+static char *
+certgraph_field (apr_pool_t *p, const char **line)
+{
+  char *field = ap_getword (p, line, '\t');
+
+  ap_unescape_url (field);
+  return field;
+}
+
+/**
+ * certgraph_log_size: Get the size of the change log.
+ * @vr: The request context.
+ *
+ * Return value: The size in bytes, 0 if there is no log.
+ **/
+apr_off_t
+virgule_certgraph_log_size (VirguleReq *vr)
+{
+  apr_finfo_t finfo;
+
+  if (apr_stat (&finfo, certgraph_path (vr, "certs.delta"), APR_FINFO_SIZE,
+		vr->r->pool) != APR_SUCCESS)
+    return 0;
+  return finfo.size;
+}
+
+/**
+ * certgraph_apply_log: Bring a cert graph up to date with the change log.
+ * @vr: The request context.
+ * @g: The cert graph.
+ * @changes: If not NULL, the indices of edges changed are pushed here.
+ *
+ * Sets each edge's prev field to its level before the changes, and sets
+ * nodes_changed if any account was added, deleted or renamed.
+ *
+ * Return value: The number of changes applied.
+ **/
+int
+virgule_certgraph_apply_log (VirguleReq *vr, CertGraph *g,
+			     apr_array_header_t *changes)
+{
+  apr_pool_t *p = vr->r->pool;
+  CertGraphEdge *e;
+  CertGraphNode *n;
+  char *buf, *line, *eol;
+  const char *rest;
+  char *kind;
+  apr_size_t size;
+  int issuer, subj, idx;
+  CertLevel level;
+  int count = 0;
+  int i;
+
+  for (i = 0; i < g->edges->nelts; i++)
+    {
+      e = &((CertGraphEdge *)g->edges->elts)[i];
+      e->prev = e->level;
+    }
+
+  buf = certgraph_read_file (p, certgraph_path (vr, "certs.delta"),
+			     g->log_off, &size);
+  if (buf == NULL || size == 0)
+    return 0;
+
+  for (line = buf; (eol = strchr (line, '\n')) != NULL; line = eol + 1)
+    {
+      *eol = 0;
+      rest = line;
+      kind = ap_getword (p, &rest, '\t');
+      if (!strcmp (kind, "c"))
+	{
+	  issuer = virgule_certgraph_node (g, certgraph_field (p, &rest));
+	  subj = virgule_certgraph_node (g, certgraph_field (p, &rest));
+	  level = atoi (rest);
+	  if (level < CERT_LEVEL_NONE || level >= g->n_levels)
+	    level = CERT_LEVEL_NONE;
+	  idx = virgule_certgraph_set_edge (g, issuer, subj, level);
+	  if (changes != NULL)
+	    *(int *)apr_array_push (changes) = idx;
+	}
+      else if (!strcmp (kind, "a"))
+	{
+	  idx = virgule_certgraph_node (g, certgraph_field (p, &rest));
+	  n = &((CertGraphNode *)g->nodes->elts)[idx];
+	  n->is_acct = 1;
+	  n->givenname = certgraph_field (p, &rest);
+	  n->surname = certgraph_field (p, &rest);
+	  g->nodes_changed = 1;
+	}
+      else if (!strcmp (kind, "k"))
+	{
+	  idx = virgule_certgraph_node (g, certgraph_field (p, &rest));
+	  ((CertGraphNode *)g->nodes->elts)[idx].is_acct = 0;
+	  g->nodes_changed = 1;
+	}
+      count++;
+    }
+  /* a torn last line is picked up next time, or dropped by
+     virgule_certgraph_save if its writer died */
+  g->log_off += line - buf;
+
+  return count;
+}
+
+/* Append one record to the change log. */
+static int
+certgraph_log (VirguleReq *vr, const char *rec)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_file_t *fd;
+  apr_status_t status;
+
+  apr_dir_make (apr_pstrcat (p, vr->priv->base_path, "/tmetric", NULL),
+		APR_OS_DEFAULT, p);
+  if (apr_file_open (&fd, certgraph_path (vr, "certs.delta"),
+		     APR_WRITE|APR_CREATE|APR_APPEND, APR_OS_DEFAULT,
+		     p) != APR_SUCCESS)
+    return -1;
+  /* the log isn't cut while we hold this */
+  if (apr_file_lock (fd, APR_FLOCK_SHARED) != APR_SUCCESS)
+    {
+      apr_file_close (fd);
+      return -1;
+    }
+  /* a single short O_APPEND write doesn't interleave with others */
+  status = apr_file_write_full (fd, rec, strlen (rec), NULL);
+  apr_file_close (fd);
+  return status == APR_SUCCESS ? 0 : -1;
+}
+
+static const char *
+certgraph_escape (apr_pool_t *p, const char *s)
+{
+  return s == NULL ? "" : ap_escape_uri (p, s);
+}
+
+/**
+ * certgraph_log_cert: Record a cert change.
+ * @vr: The request context.
+ * @issuer: The certifying account.
+ * @subject: The certified account.
+ * @level: The new level, or CERT_LEVEL_NONE if the cert was removed.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_certgraph_log_cert (VirguleReq *vr, const char *issuer,
+			    const char *subject, CertLevel level)
+{
+  apr_pool_t *p = vr->r->pool;
+
+  return certgraph_log (vr, apr_psprintf (p, "c\t%s\t%s\t%d\n",
+					  certgraph_escape (p, issuer),
+					  certgraph_escape (p, subject),
+					  level));
+}
+
+/**
+ * certgraph_log_acct: Record a new account or a change of name.
+ * @vr: The request context.
+ * @u: The account name.
+ * @givenname: Given name from the profile.
+ * @surname: Surname from the profile.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_certgraph_log_acct (VirguleReq *vr, const char *u,
+			    const char *givenname, const char *surname)
+{
+  apr_pool_t *p = vr->r->pool;
+
+  return certgraph_log (vr, apr_psprintf (p, "a\t%s\t%s\t%s\n",
+					  certgraph_escape (p, u),
+					  certgraph_escape (p, givenname),
+					  certgraph_escape (p, surname)));
+}
+
+/**
+ * certgraph_log_kill: Record the deletion of an account.
+ * @vr: The request context.
+ * @u: The account name.
+ *
+ * The account's certs should be removed separately.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_certgraph_log_kill (VirguleReq *vr, const char *u)
+{
+  apr_pool_t *p = vr->r->pool;
+
+  return certgraph_log (vr, apr_psprintf (p, "k\t%s\n",
+					  certgraph_escape (p, u)));
+}
+
+/**
+ * certgraph_lock: Lock the stored cert graph for update.
+ * @vr: The request context.
+ * @wait: If FALSE, fail rather than wait for another holder.
+ *
+ * Return value: The lock, or NULL if it couldn't be taken.
+ **/
+apr_file_t *
+virgule_certgraph_lock (VirguleReq *vr, int wait)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_file_t *fd;
+
+  apr_dir_make (apr_pstrcat (p, vr->priv->base_path, "/tmetric", NULL),
+		APR_OS_DEFAULT, p);
+  if (apr_file_open (&fd, certgraph_path (vr, "update.lock"),
+		     APR_READ|APR_WRITE|APR_CREATE, APR_OS_DEFAULT,
+		     p) != APR_SUCCESS)
+    return NULL;
+  if (apr_file_lock (fd, wait ? APR_FLOCK_EXCLUSIVE
+			      : APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK)
+      != APR_SUCCESS)
+    {
+      apr_file_close (fd);
+      return NULL;
+    }
+  return fd;
+}
+
+/**
+ * certgraph_read_lock: Lock the stored cert graph and its change log
+ * for reading.
+ * @vr: The request context.
+ * @wait: If FALSE, fail rather than wait for the log to be cut.
+ *
+ * While this is held the stored graph and the log match. It doesn't
+ * hold off virgule_certgraph_lock(), only the end of
+ * virgule_certgraph_save().
+ *
+ * Return value: The lock, or NULL if it couldn't be taken.
+ **/
+apr_file_t *
+virgule_certgraph_read_lock (VirguleReq *vr, int wait)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_file_t *fd;
+
+  apr_dir_make (apr_pstrcat (p, vr->priv->base_path, "/tmetric", NULL),
+		APR_OS_DEFAULT, p);
+  if (apr_file_open (&fd, certgraph_path (vr, "certs.delta"),
+		     APR_READ|APR_WRITE|APR_CREATE, APR_OS_DEFAULT,
+		     p) != APR_SUCCESS)
+    return NULL;
+  if (apr_file_lock (fd, wait ? APR_FLOCK_SHARED
+			      : APR_FLOCK_SHARED | APR_FLOCK_NONBLOCK)
+      != APR_SUCCESS)
+    {
+      apr_file_close (fd);
+      return NULL;
+    }
+  return fd;
+}
+
+/**
+ * certgraph_unlock: Release a lock taken by virgule_certgraph_lock()
+ * or virgule_certgraph_read_lock().
+ * @lock: The lock.
+ **/
+void
+virgule_certgraph_unlock (apr_file_t *lock)
+{
+  apr_file_unlock (lock);
+  apr_file_close (lock);
+}
@@ -0,0 +1,75 @@
+typedef struct _CertGraph CertGraph;
+typedef struct _CertGraphNode CertGraphNode;
+typedef struct _CertGraphEdge CertGraphEdge;
+
+struct _CertGraphNode {
+  const char *name;
+  const char *givenname;
+  const char *surname;
+  int is_acct;          /* has a profile, as opposed to only being certified */
+  unsigned int flows;   /* trust metric: bit i set if it got flow at level i */
+};
+
+struct _CertGraphEdge {
+  int issuer;
+  int subj;
+  CertLevel level;
+  CertLevel prev;       /* level before the last virgule_certgraph_apply_log */
+};
+
+struct _CertGraph {
+  apr_pool_t *pool;
+  int n_levels;
+  apr_array_header_t *nodes;  /* CertGraphNode; node 0 is the root, "-" */
+  apr_hash_t *node_ix;        /* name -> int node index */
+  apr_array_header_t *edges;  /* CertGraphEdge */
+  apr_hash_t *edge_ix;        /* issuer, subj indices -> int edge index */
+  apr_off_t log_off;          /* the change log has been applied up to here */
+  int nodes_changed;          /* accounts added, removed or renamed */
+};
+
+CertGraph *
+virgule_certgraph_new (apr_pool_t *p, int n_levels);
+
+int
+virgule_certgraph_node (CertGraph *g, const char *u);
+
+int
+virgule_certgraph_set_edge (CertGraph *g, int issuer, int subj,
+			    CertLevel level);
+
+CertGraph *
+virgule_certgraph_build (VirguleReq *vr);
+
+CertGraph *
+virgule_certgraph_load (VirguleReq *vr);
+
+int
+virgule_certgraph_save (VirguleReq *vr, CertGraph *g);
+
+apr_off_t
+virgule_certgraph_log_size (VirguleReq *vr);
+
+int
+virgule_certgraph_apply_log (VirguleReq *vr, CertGraph *g,
+			     apr_array_header_t *changes);
+
+int
+virgule_certgraph_log_cert (VirguleReq *vr, const char *issuer,
+			    const char *subject, CertLevel level);
+
+int
+virgule_certgraph_log_acct (VirguleReq *vr, const char *u,
+			    const char *givenname, const char *surname);
+
+int
+virgule_certgraph_log_kill (VirguleReq *vr, const char *u);
+
+apr_file_t *
+virgule_certgraph_lock (VirguleReq *vr, int wait);
+
+apr_file_t *
+virgule_certgraph_read_lock (VirguleReq *vr, int wait);
+
+void
+virgule_certgraph_unlock (apr_file_t *lock);
@@ -18,6 +18,7 @@
 #include "util.h"
 
 #include "certs.h"
+#include "certgraph.h"
 
 int
 virgule_cert_num_levels (VirguleReq *vr)
@@ -360,6 +361,10 @@ virgule_cert_set (VirguleReq *vr, const char *issuer, const char *subject, CertL
   status = virgule_db_xml_put (p, db, db_key, profile);
   virgule_db_xml_free (p, profile);
 
+  /* keep the cert graph current for the trust metric */
+  if (status == 0)
+    virgule_certgraph_log_cert (vr, issuer, subject, level);
+
   return status;
 }
 
@@ -374,16 +379,12 @@ virgule_cert_set (VirguleReq *vr, const char *issuer, const char *subject, CertL
 CertLevel
 virgule_render_cert_level_begin (VirguleReq *vr, const char *user, CertStyle cs)
 {
-  const char *level;
   CertLevel cert_level;
 
   if (virgule_user_is_special(vr,user))
     cert_level = virgule_cert_num_levels (vr);
   else
-    {
-      level = virgule_req_get_tmetric_level (vr, user);
-      cert_level = virgule_cert_level_from_name (vr, level);
-    }
+    cert_level = virgule_req_get_tmetric_cert_level (vr, user);
   virgule_buffer_printf (vr->b, "<%s class=\"level%d\">", cs, cert_level);
   return cert_level;
 }
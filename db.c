@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -18,19 +19,50 @@
 
 #include <apr.h>
 #include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_tables.h>
 #include <httpd.h>
 
 #include "db.h"
+#include "db_log.h"
 
 struct _Db {
   apr_pool_t *p;
   char *base_pathname;
+  DbLog *log; /* NULL unless using the log backend */
+  DbMemo *memo; /* NULL unless records are memoized for a request */
+};
+
+/* The request memo keeps the records and parsed documents a request
+   has loaded, keyed by filename so that different spellings of a key
+   share an entry, until the request ends or the record is written. */
+
+/* Keep at most this many records, and records no bigger than this. */
+#define DB_MEMO_MAX_RECORDS 1024
+#define DB_MEMO_MAX_SIZE (64 * 1024)
+
+typedef struct {
+  char *val;        /* NULL if the record doesn't exist */
+  int size;
+  int have_val;
+  const void *doc;  /* see db_memo_set_doc */
+  int have_doc;
+} DbMemoRecord;
+
+struct _DbMemo {
+  apr_pool_t *p;
+  apr_hash_t *records;  /* filename -> DbMemoRecord */
+  apr_hash_t *loads;    /* filename -> int, times loaded from the database */
+  int n_records;
+  DbMemoStats stats;
 };
 
 struct _DbCursor {
   Db *db;
   char *dir_pathname;
   DIR *dir;
+  apr_array_header_t *names; /* log backend: the merged listing */
+  int names_ix;
 };
 
 struct _DbLock {
@@ -38,6 +70,9 @@ struct _DbLock {
   apr_file_t *fd;
 };
 
+static void
+db_dir_max_update (apr_pool_t *p, Db *db, const char *key, int is_del);
+
 Db *
 virgule_db_new_filesystem (apr_pool_t *p, const char *base_pathname)
 {
@@ -45,10 +80,56 @@ virgule_db_new_filesystem (apr_pool_t *p, const char *base_pathname)
 
   result->p = p;
   result->base_pathname = apr_pstrdup (p, base_pathname);
+  result->log = NULL;
+  result->memo = NULL;
+
+  return result;
+}
+
+/**
+ * db_new_log: Open a database using the log-structured backend.
+ * @p: Pool for allocation.
+ * @base_pathname: The database directory.
+ *
+ * Records are written to a single append-only log in @base_pathname
+ * (see db_log.c). Keys that are not in the log are looked up as plain
+ * files, as with the filesystem backend, so static content such as
+ * config.xml and the templates can stay where it is.
+ *
+ * Return value: The database, or NULL if the log can't be opened.
+ **/
+Db *
+virgule_db_new_log (apr_pool_t *p, const char *base_pathname)
+{
+  Db *result;
+  DbLog *log;
+
+  log = virgule_db_log_open (base_pathname);
+  if (log == NULL)
+    return NULL;
+
+  result = virgule_db_new_filesystem (p, base_pathname);
+  result->log = log;
 
   return result;
 }
 
+/**
+ * db_get_log_stats: Get statistics of the log backend.
+ * @db: The database.
+ * @stats: Where to store the statistics.
+ *
+ * Return value: 0 on success, -1 if @db doesn't use the log backend.
+ **/
+int
+virgule_db_get_log_stats (Db *db, DbLogStats *stats)
+{
+  if (db->log == NULL)
+    return -1;
+  virgule_db_log_get_stats (db->log, stats);
+  return 0;
+}
+
 static const char *
 db_mangle_key_component (apr_pool_t *p, const char *comp)
 {
@@ -124,18 +205,208 @@ virgule_db_mk_filename (apr_pool_t *p, Db *db, const char *key)
 }
 
 /**
- * db_get_p: Get a record from the database, explicit pool.
- * @p: Pool for allocations.
+ * db_memo_new: Create a request memo.
+ * @p: Pool of the request; the memo lasts as long as it.
+ *
+ * Return value: The memo, to be attached with db_set_memo.
+ **/
+DbMemo *
+virgule_db_memo_new (apr_pool_t *p)
+{
+  DbMemo *memo = (DbMemo *)apr_pcalloc (p, sizeof (DbMemo));
+
+  memo->p = p;
+  memo->records = apr_hash_make (p);
+  memo->loads = apr_hash_make (p);
+  return memo;
+}
+
+/**
+ * db_set_memo: Memoize the records loaded through a database.
+ * @db: The database.
+ * @memo: The memo, or NULL to stop memoizing.
+ *
+ * Records loaded through @db are kept in @memo, so that loading one
+ * again doesn't read it from the database. Writing or deleting a
+ * record through @db drops it from @memo; changes made by other
+ * processes are not seen until the memo is dropped, so it should only
+ * live as long as a request.
+ **/
+void
+virgule_db_set_memo (Db *db, DbMemo *memo)
+{
+  db->memo = memo;
+}
+
+/* Count a load of the record at @fn. */
+static void
+db_memo_loaded (DbMemo *memo, const char *fn)
+{
+  int *n = apr_hash_get (memo->loads, fn, APR_HASH_KEY_STRING);
+
+  memo->stats.loads++;
+  if (n == NULL)
+    {
+      n = (int *)apr_pcalloc (memo->p, sizeof (int));
+      apr_hash_set (memo->loads, apr_pstrdup (memo->p, fn),
+		    APR_HASH_KEY_STRING, n);
+    }
+  else
+    memo->stats.reloads++;
+  (*n)++;
+}
+
+/* Get the memo record of @fn, adding it if there is room, or NULL. */
+static DbMemoRecord *
+db_memo_record (DbMemo *memo, const char *fn)
+{
+  DbMemoRecord *rec = apr_hash_get (memo->records, fn, APR_HASH_KEY_STRING);
+
+  if (rec != NULL)
+    return rec;
+  if (memo->n_records >= DB_MEMO_MAX_RECORDS)
+    {
+      memo->stats.full++;
+      return NULL;
+    }
+  rec = (DbMemoRecord *)apr_pcalloc (memo->p, sizeof (DbMemoRecord));
+  apr_hash_set (memo->records, apr_pstrdup (memo->p, fn),
+		APR_HASH_KEY_STRING, rec);
+  memo->n_records++;
+  return rec;
+}
+
+/* Drop the memo record of a key that was written or deleted. */
+static void
+db_memo_forget (apr_pool_t *p, Db *db, const char *key)
+{
+  char *fn;
+
+  if (db->memo == NULL)
+    return;
+  fn = virgule_db_mk_filename (p, db, key);
+  if (apr_hash_get (db->memo->records, fn, APR_HASH_KEY_STRING) != NULL)
+    {
+      apr_hash_set (db->memo->records, fn, APR_HASH_KEY_STRING, NULL);
+      db->memo->n_records--;
+    }
+}
+
+/**
+ * db_memo_pool: Get the pool documents kept in the memo should live in.
+ * @db: The database.
+ *
+ * Return value: The memo's pool, or NULL if @db has no memo.
+ **/
+apr_pool_t *
+virgule_db_memo_pool (Db *db)
+{
+  return db->memo ? db->memo->p : NULL;
+}
+
+/**
+ * db_memo_get_doc: Look up a parsed document in the memo.
+ * @p: Pool for temporary allocations.
  * @db: The database.
  * @key: The key.
- * @p_size: Where to store the size of the record.
+ * @p_doc: Where to store the document, NULL if the record doesn't exist.
  *
- * Gets the record named by @key from the database.
+ * Return value: TRUE if the memo has the document.
+ **/
+int
+virgule_db_memo_get_doc (apr_pool_t *p, Db *db, const char *key,
+			 const void **p_doc)
+{
+  DbMemoRecord *rec;
+
+  if (db->memo == NULL || key == NULL)
+    return 0;
+  rec = apr_hash_get (db->memo->records, virgule_db_mk_filename (p, db, key),
+		      APR_HASH_KEY_STRING);
+  if (rec == NULL || !rec->have_doc)
+    return 0;
+  db->memo->stats.hits++;
+  *p_doc = rec->doc;
+  return 1;
+}
+
+/**
+ * db_memo_set_doc: Count a parsed document as loaded, and keep it.
+ * @p: Pool for temporary allocations.
+ * @db: The database.
+ * @key: The key.
+ * @doc: The document, NULL if the record doesn't exist.
  *
- * Return value: The contents of the record, or NULL if not found.
+ * The document is opaque here; db_xml keeps shared, read-only trees
+ * and ties their lifetime to the pool from db_memo_pool.
+ *
+ * Return value: TRUE if the memo kept @doc.
+ **/
+int
+virgule_db_memo_set_doc (apr_pool_t *p, Db *db, const char *key,
+			 const void *doc)
+{
+  DbMemoRecord *rec;
+  char *fn;
+
+  if (db->memo == NULL || key == NULL)
+    return 0;
+  fn = virgule_db_mk_filename (p, db, key);
+  db_memo_loaded (db->memo, fn);
+  rec = db_memo_record (db->memo, fn);
+  if (rec == NULL)
+    return 0;
+  rec->doc = doc;
+  rec->have_doc = 1;
+  return 1;
+}
+
+/**
+ * db_memo_get_stats: Get the counters of a request memo.
+ * @memo: The memo.
+ * @stats: Where to store the counters.
+ **/
+void
+virgule_db_memo_get_stats (DbMemo *memo, DbMemoStats *stats)
+{
+  *stats = memo->stats;
+}
+
+/**
+ * db_memo_reloads: Describe the records a request loaded more than once.
+ * @p: Pool for the result.
+ * @memo: The memo.
+ *
+ * Records are loaded again when they were written in between, when
+ * the memo was full, or when they were loaded both as raw records and
+ * as documents; these are the places to look at for more savings.
+ *
+ * Return value: A list of filenames and load counts, or NULL if no
+ * record was loaded more than once.
  **/
 char *
-virgule_db_get_p (apr_pool_t *p, Db *db, const char *key, int *p_size)
+virgule_db_memo_reloads (apr_pool_t *p, DbMemo *memo)
+{
+  apr_hash_index_t *hi;
+  char *result = NULL;
+
+  for (hi = apr_hash_first (p, memo->loads); hi; hi = apr_hash_next (hi))
+    {
+      const void *fn;
+      void *val;
+      int n;
+
+      apr_hash_this (hi, &fn, NULL, &val);
+      n = *(int *)val;
+      if (n > 1)
+	result = apr_psprintf (p, "%s%s%s x%d", result ? result : "",
+			       result ? ", " : "", (const char *)fn, n);
+    }
+  return result;
+}
+
+static char *
+db_get (apr_pool_t *p, Db *db, const char *key, int *p_size)
 {
   char *fn;
   apr_file_t *fd;
@@ -147,6 +418,9 @@ virgule_db_get_p (apr_pool_t *p, Db *db, const char *key, int *p_size)
 
   if (!key)
     return NULL;
+
+  if (db->log && virgule_db_log_get (db->log, p, key, &result, p_size))
+    return result;
     
   fn = virgule_db_mk_filename (p, db, key);
 
@@ -185,6 +459,84 @@ virgule_db_get_p (apr_pool_t *p, Db *db, const char *key, int *p_size)
   return result;
 }
 
+/**
+ * db_get_p: Get a record from the database, explicit pool.
+ * @p: Pool for allocations.
+ * @db: The database.
+ * @key: The key.
+ * @p_size: Where to store the size of the record.
+ *
+ * Gets the record named by @key from the database, or from the
+ * request memo if @db has one and the record was loaded before.
+ *
+ * Return value: The contents of the record, or NULL if not found.
+ **/
+char *
+virgule_db_get_p (apr_pool_t *p, Db *db, const char *key, int *p_size)
+{
+  DbMemoRecord *rec;
+  char *fn;
+  char *result;
+
+  if (!key)
+    return NULL;
+
+  if (db->memo == NULL)
+    return db_get (p, db, key, p_size);
+
+  fn = virgule_db_mk_filename (p, db, key);
+  rec = apr_hash_get (db->memo->records, fn, APR_HASH_KEY_STRING);
+  if (rec != NULL && rec->have_val)
+    {
+      db->memo->stats.hits++;
+      if (rec->val == NULL)
+	return NULL;
+      result = (char *)apr_palloc (p, rec->size + 1);
+      memcpy (result, rec->val, rec->size + 1);
+      *p_size = rec->size;
+      return result;
+    }
+
+  result = db_get (p, db, key, p_size);
+  db_memo_loaded (db->memo, fn);
+  if (result == NULL || *p_size <= DB_MEMO_MAX_SIZE)
+    {
+      rec = db_memo_record (db->memo, fn);
+      if (rec != NULL)
+	{
+	  if (result != NULL)
+	    {
+	      rec->val = (char *)apr_palloc (db->memo->p, *p_size + 1);
+	      memcpy (rec->val, result, *p_size + 1);
+	      rec->size = *p_size;
+	    }
+	  rec->have_val = 1;
+	}
+    }
+  return result;
+}
+
+/**
+ * db_get_fresh: Get a record from the database, bypassing the memo.
+ * @p: Pool for allocations.
+ * @db: The database.
+ * @key: The key.
+ * @p_size: Where to store the size of the record.
+ *
+ * Like db_get_p, but always reads the record and doesn't keep it,
+ * for callers that keep a parsed form in the memo instead. db_xml
+ * also must not pair a stamp it has just taken with an older copy.
+ *
+ * Return value: The contents of the record, or NULL if not found.
+ **/
+char *
+virgule_db_get_fresh (apr_pool_t *p, Db *db, const char *key, int *p_size)
+{
+  if (!key)
+    return NULL;
+  return db_get (p, db, key, p_size);
+}
+
 /**
  * db_get: Get a record from the database.
  * @db: The database.
@@ -201,6 +553,53 @@ virgule_db_get (Db *db, const char *key, int *p_size)
   return virgule_db_get_p (db->p, db, key, p_size);
 }
 
+/**
+ * db_stamp: Get the version stamp of a record.
+ * @p: Pool for allocations.
+ * @db: The database.
+ * @key: The key.
+ * @stamp: Where to store the stamp.
+ *
+ * Fills in @stamp with the modification time, size and inode of the
+ * record named by @key, without reading it. Two stamps compare equal
+ * (see db_stamp_equal) only if the record has not been rewritten in
+ * between, which makes them suitable for validating cached copies.
+ *
+ * Return value: 0 on success, -1 if the record does not exist.
+ **/
+int
+virgule_db_stamp (apr_pool_t *p, Db *db, const char *key, DbStamp *stamp)
+{
+  char *fn;
+  apr_finfo_t finfo;
+
+  if (!key)
+    return -1;
+
+  if (db->log && virgule_db_log_stamp (db->log, p, key, stamp))
+    return 0;
+
+  fn = virgule_db_mk_filename (p, db, key);
+
+  if (apr_stat (&finfo, fn, APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_TYPE, p) != APR_SUCCESS)
+    return -1;
+
+  if (finfo.filetype != APR_REG)
+    return -1;
+
+  stamp->mtime = finfo.mtime;
+  stamp->size = finfo.size;
+  stamp->inode = finfo.inode;
+
+  return 0;
+}
+
+int
+virgule_db_stamp_equal (const DbStamp *a, const DbStamp *b)
+{
+  return a->mtime == b->mtime && a->size == b->size && a->inode == b->inode;
+}
+
 /* Ensure that the directory exists, return 1 on success. */
 static int
 db_ensure_dir (Db *db, const char *fn)
@@ -269,6 +668,11 @@ virgule_db_put_p (apr_pool_t *p, Db *db, const char *key, const char *val, int s
   apr_file_t *fd;
   apr_size_t bytes_written;
 
+  db_memo_forget (p, db, key);
+
+  if (db->log)
+    return virgule_db_log_put (db->log, p, key, val, size);
+
   fn = virgule_db_mk_filename (p, db, key);
 
   if (!db_ensure_dir (db, fn))
@@ -289,6 +693,8 @@ virgule_db_put_p (apr_pool_t *p, Db *db, const char *key, const char *val, int s
   if (bytes_written != size)
     return -1;
 
+  db_dir_max_update (p, db, key, 0);
+
   return 0;
 }
 
@@ -324,11 +730,19 @@ int
 virgule_db_del (Db *db, const char *key)
 {
   int status;
+  int log_status = -1;
   char *path,*fn,*n;
 
+  db_memo_forget (db->p, db, key);
+
+  if (db->log)
+    log_status = virgule_db_log_del (db->log, db->p, key);
+
   fn = virgule_db_mk_filename (db->p, db, key);
 
   status = apr_file_remove(fn, db->p);
+  if (log_status == 0)
+    status = 0;
 
   path = apr_pstrdup (db->p, fn);
   n = strrchr(path,'/');
@@ -336,6 +750,9 @@ virgule_db_del (Db *db, const char *key)
     *n = 0;
     apr_dir_remove(path, db->p);
   }
+
+  if (status == APR_SUCCESS && log_status != 0)
+    db_dir_max_update (db->p, db, key, 1);
   
   return status;
 }
@@ -357,6 +774,9 @@ virgule_db_is_dir (Db *db, const char *key)
   struct stat stat_buf;
   int status;
 
+  if (db->log && virgule_db_log_is_dir (db->log, db->p, key))
+    return 1;
+
   fn = virgule_db_mk_filename (db->p, db, key);
 
   /* Check for existence of parent dir. */
@@ -374,7 +794,9 @@ virgule_db_is_dir (Db *db, const char *key)
  * Note: a limitation of the current implementation is that numeric
  * keys are not properly reported, in other words they come back in
  * the file system format, not the "database key" format. It's not too
- * hard to fix, but right now we don't seem to need it.
+ * hard to fix, but right now we don't seem to need it. With the log
+ * backend, children in the log come back in key format, merged with
+ * any plain files in the directory, and without "." and "..".
  *
  * Return value: The cursor.
  **/
@@ -384,21 +806,56 @@ virgule_db_open_dir (Db *db, const char *key)
   DIR *dir;
   DbCursor *result;
   char *fn;
+  apr_array_header_t *names = NULL;
+
+  if (db->log)
+    names = virgule_db_log_list_dir (db->log, db->p, key);
 
   fn = virgule_db_mk_filename (db->p, db, key);
   dir = opendir (fn);
-  if (dir == NULL)
+  if (dir == NULL && names == NULL)
     return NULL;
 
+  if (db->log)
+    {
+      apr_hash_t *seen = apr_hash_make (db->p);
+      struct dirent *de;
+      int i;
+
+      if (names == NULL)
+	names = apr_array_make (db->p, 16, sizeof (char *));
+      for (i = 0; i < names->nelts; i++)
+	apr_hash_set (seen, ((char **)names->elts)[i], APR_HASH_KEY_STRING, "");
+      while (dir != NULL && (de = readdir (dir)) != NULL)
+	if (de->d_name[0] != '.' &&
+	    strcmp (de->d_name, "db.log") &&
+	    apr_hash_get (seen, de->d_name, APR_HASH_KEY_STRING) == NULL)
+	  *(char **)apr_array_push (names) = apr_pstrdup (db->p, de->d_name);
+      if (dir != NULL)
+	closedir (dir);
+      dir = NULL;
+    }
+
   result = (DbCursor *)apr_palloc (db->p, sizeof (DbCursor));
 
   result->db = db;
   result->dir_pathname = apr_pstrdup (db->p, key);
   result->dir = dir;
+  result->names = names;
+  result->names_ix = 0;
 
   return result;
 }
 
+/* Next name from a merged listing, or NULL if no more. */
+static char *
+db_cursor_next_name (DbCursor *dbc)
+{
+  if (dbc->names_ix >= dbc->names->nelts)
+    return NULL;
+  return ((char **)dbc->names->elts)[dbc->names_ix++];
+}
+
 /**
  * db_read_dir: Traverse a directory cursor.
  * @dbc: The database cursor.
@@ -411,6 +868,15 @@ char *
 virgule_db_read_dir (DbCursor *dbc)
 {
   struct dirent *de;
+  char *name;
+
+  if (dbc->names)
+    {
+      name = db_cursor_next_name (dbc);
+      if (name == NULL)
+	return NULL;
+      return ap_make_full_path (dbc->db->p, dbc->dir_pathname, name);
+    }
 
   de = readdir (dbc->dir);
   if (de == NULL)
@@ -431,6 +897,9 @@ virgule_db_read_dir_raw (DbCursor *dbc)
 {
   struct dirent *de;
 
+  if (dbc->names)
+    return db_cursor_next_name (dbc);
+
   do
     {
       de = readdir (dbc->dir);
@@ -444,6 +913,8 @@ virgule_db_read_dir_raw (DbCursor *dbc)
 int
 virgule_db_close_dir (DbCursor *dbc)
 {
+  if (dbc->dir == NULL)
+    return 0;
   return closedir (dbc->dir);
 }
 
@@ -502,17 +973,10 @@ db_dir_max_in_level (const char *fn, int top)
   return result;
 }
 
-/** 
- * db_dir_max: Find maximum integer key in directory.
- * @db: The database.
- * @key: The key of the directory.
- *
- * Return value: the maximum integer key, or -1 if none.
- **/
-int
-virgule_db_dir_max (Db *db, const char *key)
+/* Find the maximum integer key by walking the mangled hierarchy. */
+static int
+db_dir_max_walk (apr_pool_t *p, Db *db, const char *key)
 {
-  apr_pool_t *p = db->p;
   char *fn;
   int result;
   int level_max;
@@ -538,3 +1002,314 @@ virgule_db_dir_max (Db *db, const char *key)
   return result;
 }
 
+/* The maximum integer key of each directory is kept in a counter
+   file, DB_DIR_MAX_DIR/<dir key>/DB_DIR_MAX_FILE, under the database
+   root. Numeric components of the dir key are written without leading
+   zeroes and without mangling. Counters are raised on put, recomputed
+   by walking the directory when the current maximum is deleted, and
+   created on first use. They are always written as a single
+   fixed-width pwrite, so readers don't need to lock. */
+#define DB_DIR_MAX_DIR ".dirmax"
+#define DB_DIR_MAX_FILE ".max"
+#define DB_DIR_MAX_WIDTH 12
+#define DB_DIR_MAX_UNKNOWN (-2)
+
+static char *
+db_dir_max_filename (apr_pool_t *p, Db *db, const char *key)
+{
+  const char *component;
+  char *buf;
+  char *tail;
+  int n;
+
+  buf = ap_make_full_path (p, db->base_pathname, DB_DIR_MAX_DIR);
+  for (;;)
+    {
+      component = ap_getword (p, &key, '/');
+      if (component[0] == 0)
+	{
+	  if (key[0] == 0)
+	    break;
+	  else
+	    continue;
+	}
+      if (component[0] == '_' && isdigit (component[1]))
+	{
+	  n = strtol (component + 1, &tail, 10);
+	  component = apr_psprintf (p, "_%d%s", n, tail);
+	}
+      buf = apr_pstrcat (p, buf, "/", component, NULL);
+    }
+  return apr_pstrcat (p, buf, "/" DB_DIR_MAX_FILE, NULL);
+}
+
+static int
+db_dir_max_read_fd (int fd)
+{
+  char buf[DB_DIR_MAX_WIDTH + 1];
+  ssize_t n;
+
+  n = pread (fd, buf, DB_DIR_MAX_WIDTH, 0);
+  if (n != DB_DIR_MAX_WIDTH)
+    return DB_DIR_MAX_UNKNOWN;
+  buf[n] = 0;
+  return atoi (buf);
+}
+
+static void
+db_dir_max_write_fd (int fd, int val)
+{
+  char buf[DB_DIR_MAX_WIDTH + 1];
+
+  apr_snprintf (buf, sizeof (buf), "%11d\n", val);
+  if (pwrite (fd, buf, DB_DIR_MAX_WIDTH, 0) != DB_DIR_MAX_WIDTH)
+    ftruncate (fd, 0); /* leave it unknown rather than wrong */
+}
+
+/* Read a counter without locking; DB_DIR_MAX_UNKNOWN if there is none. */
+static int
+db_dir_max_read (apr_pool_t *p, Db *db, const char *key)
+{
+  int fd;
+  int result;
+
+  fd = open (db_dir_max_filename (p, db, key), O_RDONLY);
+  if (fd < 0)
+    return DB_DIR_MAX_UNKNOWN;
+  result = db_dir_max_read_fd (fd);
+  close (fd);
+  return result;
+}
+
+/**
+ * db_dir_max_adjust: Update the counter of one directory.
+ * @key: The directory key.
+ * @n: The numeric child that was added or removed.
+ * @is_del: TRUE if @n was removed.
+ *
+ * Raises the counter to @n on addition, building it from the directory
+ * if it is missing. On removal of the current maximum, recomputes it
+ * from the directory; a missing counter is left missing. The counter
+ * file is locked for the update.
+ **/
+static void
+db_dir_max_adjust (apr_pool_t *p, Db *db, const char *key, int n, int is_del)
+{
+  char *fn;
+  int fd;
+  int cur;
+
+  /* Cheap unlocked check for the common case of no change. On a
+     delete a missing counter is left to be built on demand by a later
+     db_dir_max. On a put it is built here, walking the directory under
+     the lock: skipping it could leave a db_dir_max that walked before
+     @n was added to store a counter without it. */
+  cur = db_dir_max_read (p, db, key);
+  if (cur == DB_DIR_MAX_UNKNOWN ? is_del : (is_del ? n < cur : n <= cur))
+    return;
+
+  fn = db_dir_max_filename (p, db, key);
+  if (!db_ensure_dir (db, fn))
+    return;
+  fd = open (fn, O_RDWR | O_CREAT, 0664);
+  if (fd < 0)
+    return;
+  if (flock (fd, LOCK_EX) == 0)
+    {
+      cur = db_dir_max_read_fd (fd);
+      if (cur == DB_DIR_MAX_UNKNOWN || (is_del && n >= cur))
+	db_dir_max_write_fd (fd, db_dir_max_walk (p, db, key));
+      else if (!is_del && n > cur)
+	db_dir_max_write_fd (fd, n);
+    }
+  close (fd); /* close implicitly unlocks */
+}
+
+/* Update the counters of every directory with a numeric child along
+   @key, after a put or delete of @key. */
+static void
+db_dir_max_update (apr_pool_t *p, Db *db, const char *key, int is_del)
+{
+  const char *component;
+  const char *dir = "";
+
+  for (;;)
+    {
+      component = ap_getword (p, &key, '/');
+      if (component[0] == 0)
+	{
+	  if (key[0] == 0)
+	    break;
+	  else
+	    continue;
+	}
+      if (component[0] == '_' && isdigit (component[1]))
+	db_dir_max_adjust (p, db, dir, atoi (component + 1), is_del);
+      dir = dir[0] ? apr_pstrcat (p, dir, "/", component, NULL) : component;
+    }
+}
+
+/** 
+ * db_dir_max: Find maximum integer key in directory.
+ * @db: The database.
+ * @key: The key of the directory.
+ *
+ * Uses the directory's counter, building it from the filesystem if
+ * it does not exist yet.
+ *
+ * Return value: the maximum integer key, or -1 if none.
+ **/
+int
+virgule_db_dir_max (Db *db, const char *key)
+{
+  apr_pool_t *p = db->p;
+  int result;
+  int log_max = -1;
+
+  if (db->log)
+    log_max = virgule_db_log_dir_max (db->log, p, key);
+
+  result = db_dir_max_read (p, db, key);
+  if (result == DB_DIR_MAX_UNKNOWN)
+    {
+      result = db_dir_max_walk (p, db, key);
+      /* don't litter counters for empty or missing directories */
+      if (result >= 0)
+	db_dir_max_adjust (p, db, key, result, 0);
+    }
+
+  return result > log_max ? result : log_max;
+}
+
+/* Recursively check the counters below @dir_fn, for dir key @key. */
+static int
+db_dir_max_check_dir (apr_pool_t *p, Db *db, const char *dir_fn,
+		      const char *key, DbDirMaxReport report, void *data)
+{
+  DIR *dir;
+  struct dirent *de;
+  int fd;
+  int stored;
+  int actual;
+  int n_fixed = 0;
+  char *fn;
+
+  dir = opendir (dir_fn);
+  if (dir == NULL)
+    return 0;
+  while ((de = readdir (dir)) != NULL)
+    {
+      if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+	continue;
+      fn = apr_pstrcat (p, dir_fn, "/", de->d_name, NULL);
+      if (strcmp (de->d_name, DB_DIR_MAX_FILE))
+	{
+	  n_fixed += db_dir_max_check_dir (p, db, fn,
+					   key[0] ? apr_pstrcat (p, key, "/", de->d_name, NULL) : de->d_name,
+					   report, data);
+	  continue;
+	}
+      fd = open (fn, O_RDWR);
+      if (fd < 0)
+	continue;
+      if (flock (fd, LOCK_EX) == 0)
+	{
+	  stored = db_dir_max_read_fd (fd);
+	  actual = db_dir_max_walk (p, db, key);
+	  if (stored != actual)
+	    {
+	      if (report)
+		report (data, key, stored, actual);
+	      db_dir_max_write_fd (fd, actual);
+	      n_fixed++;
+	    }
+	}
+      close (fd);
+    }
+  closedir (dir);
+  return n_fixed;
+}
+
+/**
+ * db_dir_max_check: Check all directory max-key counters.
+ * @p: Pool for temporary allocations.
+ * @db: The database.
+ * @report: Called for each counter that was wrong, or NULL.
+ * @data: Passed to @report.
+ *
+ * Recomputes every counter from the filesystem and rewrites the ones
+ * that don't match. Counters of keys kept in the log backend are
+ * derived from its index and are always consistent.
+ *
+ * Return value: The number of counters fixed.
+ **/
+int
+virgule_db_dir_max_check (apr_pool_t *p, Db *db, DbDirMaxReport report,
+			  void *data)
+{
+  return db_dir_max_check_dir (p, db,
+			       ap_make_full_path (p, db->base_pathname, DB_DIR_MAX_DIR),
+			       "", report, data);
+}
+
+/* Key locks are flocks on empty files in their own tree under the
+   database directory, DB_LOCK_DIR/<key>, so they work the same with
+   either backend and leave nothing beside the records themselves. */
+#define DB_LOCK_DIR ".locks"
+
+/**
+ * db_lock_key: Lock a key.
+ * @db: The database.
+ * @key: The key.
+ * @cmd: APR_FLOCK_SHARED or APR_FLOCK_EXCLUSIVE.
+ *
+ * Waits for the lock. The lock is advisory: it only keeps out others
+ * that take it.
+ *
+ * Return value: The lock, to be released with virgule_db_unlock(), or
+ * NULL on error.
+ **/
+DbLock *
+virgule_db_lock_key (Db *db, const char *key, int cmd)
+{
+  apr_pool_t *p;
+  DbLock *dbl;
+  char *fn;
+
+  if (apr_pool_create (&p, db->p) != APR_SUCCESS)
+    return NULL;
+  dbl = (DbLock *)apr_palloc (p, sizeof (DbLock));
+  dbl->p = p;
+  fn = virgule_db_mk_filename (p, db, apr_pstrcat (p, DB_LOCK_DIR "/", key,
+						   NULL));
+  if (!db_ensure_dir (db, fn) ||
+      apr_file_open (&dbl->fd, fn, APR_READ|APR_WRITE|APR_CREATE,
+		     APR_OS_DEFAULT, p) != APR_SUCCESS)
+    {
+      apr_pool_destroy (p);
+      return NULL;
+    }
+  if (apr_file_lock (dbl->fd, cmd) != APR_SUCCESS)
+    {
+      apr_pool_destroy (p);
+      return NULL;
+    }
+  return dbl;
+}
+
+/**
+ * db_unlock: Release a lock.
+ * @dbl: The lock.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_db_unlock (DbLock *dbl)
+{
+  apr_status_t status;
+
+  status = apr_file_unlock (dbl->fd);
+  /* destroying the pool closes the file */
+  apr_pool_destroy (dbl->p);
+  return status == APR_SUCCESS ? 0 : -1;
+}
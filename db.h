@@ -1,10 +1,31 @@
 typedef struct _Db Db;
 typedef struct _DbCursor DbCursor;
 typedef struct _DbLock DbLock;
+typedef struct _DbStamp DbStamp;
+typedef struct _DbMemo DbMemo;
+typedef struct _DbMemoStats DbMemoStats;
+
+/* Identifies one version of a record, for validating cached copies. */
+struct _DbStamp {
+  apr_time_t mtime;
+  apr_off_t size;
+  apr_ino_t inode;
+};
+
+/* Counters of a request memo. */
+struct _DbMemoStats {
+  unsigned long loads;    /* records and documents loaded from the database */
+  unsigned long hits;     /* loads saved by the memo */
+  unsigned long reloads;  /* loads of a record loaded before */
+  unsigned long full;     /* records not kept because the memo was full */
+};
 
 Db *
 virgule_db_new_filesystem (apr_pool_t *p, const char *base_pathname);
 
+Db *
+virgule_db_new_log (apr_pool_t *p, const char *base_pathname);
+
 /* This one is only public for testing purposes. */
 char *
 virgule_db_mk_filename (apr_pool_t *p, Db *db, const char *key);
@@ -12,9 +33,18 @@ virgule_db_mk_filename (apr_pool_t *p, Db *db, const char *key);
 char *
 virgule_db_get_p (apr_pool_t *p, Db *db, const char *key, int *p_size);
 
+char *
+virgule_db_get_fresh (apr_pool_t *p, Db *db, const char *key, int *p_size);
+
 char *
 virgule_db_get (Db *db, const char *key, int *p_size);
 
+int
+virgule_db_stamp (apr_pool_t *p, Db *db, const char *key, DbStamp *stamp);
+
+int
+virgule_db_stamp_equal (const DbStamp *a, const DbStamp *b);
+
 int
 virgule_db_put_p (apr_pool_t *p, Db *db, const char *key, const char *val, int size);
 
@@ -42,6 +72,12 @@ virgule_db_close_dir (DbCursor *dbc);
 int
 virgule_db_dir_max (Db *db, const char *key);
 
+typedef void (*DbDirMaxReport) (void *data, const char *key, int stored, int actual);
+
+int
+virgule_db_dir_max_check (apr_pool_t *p, Db *db, DbDirMaxReport report,
+			  void *data);
+
 DbLock *
 virgule_db_lock_key (Db *db, const char *key, int cmd);
 
@@ -56,3 +92,26 @@ virgule_db_lock_downgrade (DbLock *dbl);
 
 int
 virgule_db_unlock (DbLock *dbl);
+
+DbMemo *
+virgule_db_memo_new (apr_pool_t *p);
+
+void
+virgule_db_set_memo (Db *db, DbMemo *memo);
+
+apr_pool_t *
+virgule_db_memo_pool (Db *db);
+
+int
+virgule_db_memo_get_doc (apr_pool_t *p, Db *db, const char *key,
+			 const void **p_doc);
+
+int
+virgule_db_memo_set_doc (apr_pool_t *p, Db *db, const char *key,
+			 const void *doc);
+
+void
+virgule_db_memo_get_stats (DbMemo *memo, DbMemoStats *stats);
+
+char *
+virgule_db_memo_reloads (apr_pool_t *p, DbMemo *memo);
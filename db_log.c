@@ -0,0 +1,899 @@
+/* A log-structured backend for the Db layer. All records live in a
+   single append-only file, "db.log", in the database directory. Each
+   process keeps an in-memory index from key to the offset of the
+   latest version of the record, and catches up with records appended
+   by other processes whenever the file has grown.
+
+   Keys are normalized so that numeric components ("_N") compare equal
+   regardless of leading zeroes, matching the mangling done by the
+   filesystem backend. Keys not found in the log fall through to the
+   filesystem (see db.c), so an existing database can be switched over
+   without conversion; records migrate into the log as they are
+   rewritten.
+
+   Locking: within a process, append_lock serializes all use of flock
+   on the shared descriptor (flock locks belong to the open file, not
+   to the thread) and rwlock protects the index. Lock order is
+   append_lock, then flock, then rwlock. Across processes, appends
+   hold an exclusive flock and catch-up scans a shared one.
+
+   When more than half of the log is dead records, a background thread
+   copies the live records to a new file, renames it into place and
+   appends a "moved" record to the old file, which tells other
+   processes to reopen and rescan. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_tables.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_rwlock.h>
+#include <apr_thread_proc.h>
+#include <httpd.h>
+
+#include "db.h"
+#include "db_log.h"
+
+#define DB_LOG_NAME "db.log"
+#define DB_LOG_MAGIC 0x56444c31 /* "VDL1" */
+
+#define DB_LOG_KEY_MAX 4096
+#define DB_LOG_SCAN_BUF 65536
+
+/* Don't bother compacting logs smaller than this. */
+#define DB_LOG_COMPACT_MIN (16 * 1024 * 1024)
+
+enum {
+  DB_LOG_PUT,
+  DB_LOG_DEL,
+  DB_LOG_MOVED
+};
+
+typedef struct {
+  apr_uint32_t magic;
+  apr_uint32_t type;
+  apr_uint32_t key_len;
+  apr_uint32_t val_len;
+  apr_int64_t mtime;
+} DbLogHeader;
+
+typedef struct _DbLogEntry DbLogEntry;
+typedef struct _DbLogIndex DbLogIndex;
+
+struct _DbLogEntry {
+  const char *key;
+  apr_off_t off;      /* offset of the value */
+  apr_uint32_t size;
+  apr_time_t mtime;
+};
+
+struct _DbLogIndex {
+  apr_pool_t *pool;
+  apr_hash_t *keys;   /* key -> DbLogEntry */
+  apr_hash_t *dirs;   /* dir key -> (child name -> int count of keys) */
+  apr_hash_t *dir_max; /* dir key -> int max numeric child */
+  apr_off_t live_bytes;
+};
+
+struct _DbLog {
+  char *base_pathname;
+  char *log_pathname;
+  apr_pool_t *pool;
+  DbLogIndex *ix;
+  int fd;
+  apr_off_t scanned;  /* end of the last complete record indexed */
+  apr_off_t seen_size;  /* file size at the end of the last scan */
+  apr_thread_rwlock_t *rwlock;
+  apr_thread_mutex_t *append_lock;
+  int compacting;
+  unsigned long compactions;
+  DbLog *next;
+};
+
+static apr_pool_t *log_pool = NULL;
+static apr_thread_mutex_t *log_registry_lock = NULL;
+static DbLog *log_list = NULL;
+
+/**
+ * db_log_init: Set up the log backend for this process.
+ * @p: Process pool.
+ *
+ * Return value: APR_SUCCESS on success.
+ **/
+apr_status_t
+virgule_db_log_init (apr_pool_t *p)
+{
+  log_pool = p;
+  return apr_thread_mutex_create (&log_registry_lock,
+				  APR_THREAD_MUTEX_DEFAULT, p);
+}
+
+/* Normalize a key: drop empty components and leading zeroes of
+   numeric components. */
+static char *
+db_log_norm_key (apr_pool_t *p, const char *key)
+{
+  const char *component;
+  char *buf = NULL;
+  char *tail;
+  int n;
+
+  for (;;)
+    {
+      component = ap_getword (p, &key, '/');
+      if (component[0] == 0)
+	{
+	  if (key[0] == 0)
+	    break;
+	  else
+	    continue;
+	}
+      if (component[0] == '_' && isdigit (component[1]))
+	{
+	  n = strtol (component + 1, &tail, 10);
+	  component = apr_psprintf (p, "_%d%s", n, tail);
+	}
+      buf = buf ? apr_pstrcat (p, buf, "/", component, NULL)
+		: apr_pstrdup (p, component);
+    }
+  return buf ? buf : "";
+}
+
+static DbLogIndex *
+db_log_index_new (apr_pool_t *parent)
+{
+  apr_pool_t *p;
+  DbLogIndex *ix;
+
+  if (apr_pool_create (&p, parent) != APR_SUCCESS)
+    return NULL;
+  ix = (DbLogIndex *)apr_pcalloc (p, sizeof (DbLogIndex));
+  ix->pool = p;
+  ix->keys = apr_hash_make (p);
+  ix->dirs = apr_hash_make (p);
+  ix->dir_max = apr_hash_make (p);
+  return ix;
+}
+
+static apr_off_t
+db_log_rec_len (DbLogEntry *e)
+{
+  return sizeof (DbLogHeader) + strlen (e->key) + e->size;
+}
+
+/* Numeric value of a child name, or -1 if not numeric. The name may
+   run on into the rest of a key. */
+static int
+db_log_child_num (const char *name)
+{
+  if (name[0] != '_' || !isdigit (name[1]))
+    return -1;
+  return atoi (name + 1);
+}
+
+/* Keep the max numeric child of @dir, @dir_len bytes long, current
+   after @child was added to or removed from @children. */
+static void
+db_log_index_dir_max (DbLogIndex *ix, const char *dir, apr_ssize_t dir_len,
+		      apr_hash_t *children, const char *child, int delta)
+{
+  int n = db_log_child_num (child);
+  int *max;
+  apr_hash_index_t *hi;
+  const void *name;
+
+  if (n < 0)
+    return;
+  max = apr_hash_get (ix->dir_max, dir, dir_len);
+  if (delta > 0)
+    {
+      if (max == NULL)
+	{
+	  max = (int *)apr_palloc (ix->pool, sizeof (int));
+	  *max = -1;
+	  apr_hash_set (ix->dir_max, apr_pstrndup (ix->pool, dir, dir_len),
+			dir_len, max);
+	}
+      if (n > *max)
+	*max = n;
+    }
+  else if (max != NULL && n == *max)
+    {
+      /* the maximum went away, find the next one down */
+      *max = -1;
+      for (hi = apr_hash_first (NULL, children); hi; hi = apr_hash_next (hi))
+	{
+	  apr_hash_this (hi, &name, NULL, NULL);
+	  n = db_log_child_num ((const char *)name);
+	  if (n > *max)
+	    *max = n;
+	}
+    }
+}
+
+/* Adjust the child counts of every directory above @key by @delta.
+   Directories and children are looked up by their length within @key,
+   and only copied into the index when they are new to it. */
+static void
+db_log_index_dirs (DbLogIndex *ix, const char *key, int delta)
+{
+  const char *slash;
+  const char *rest = key;
+  apr_ssize_t dir_len = 0;
+  apr_ssize_t child_len;
+  apr_hash_t *children;
+  int *count;
+
+  for (;;)
+    {
+      slash = strchr (rest, '/');
+      child_len = slash ? slash - rest : (apr_ssize_t)strlen (rest);
+      children = apr_hash_get (ix->dirs, key, dir_len);
+      if (children == NULL)
+	{
+	  children = apr_hash_make (ix->pool);
+	  apr_hash_set (ix->dirs, apr_pstrndup (ix->pool, key, dir_len),
+			dir_len, children);
+	}
+      count = apr_hash_get (children, rest, child_len);
+      if (count == NULL)
+	{
+	  count = (int *)apr_pcalloc (ix->pool, sizeof (int));
+	  apr_hash_set (children, apr_pstrndup (ix->pool, rest, child_len),
+			child_len, count);
+	}
+      *count += delta;
+      if (*count <= 0)
+	{
+	  apr_hash_set (children, rest, child_len, NULL);
+	  db_log_index_dir_max (ix, key, dir_len, children, rest, -1);
+	}
+      else if (*count == 1 && delta > 0)
+	db_log_index_dir_max (ix, key, dir_len, children, rest, 1);
+      if (apr_hash_count (children) == 0)
+	apr_hash_set (ix->dirs, key, dir_len, NULL);
+      if (slash == NULL)
+	break;
+      dir_len = slash - key;
+      rest = slash + 1;
+    }
+}
+
+static void
+db_log_index_set (DbLogIndex *ix, const char *key, apr_off_t off,
+		  apr_uint32_t size, apr_time_t mtime)
+{
+  DbLogEntry *e;
+
+  e = apr_hash_get (ix->keys, key, APR_HASH_KEY_STRING);
+  if (e == NULL)
+    {
+      e = (DbLogEntry *)apr_palloc (ix->pool, sizeof (DbLogEntry));
+      e->key = apr_pstrdup (ix->pool, key);
+      apr_hash_set (ix->keys, e->key, APR_HASH_KEY_STRING, e);
+      db_log_index_dirs (ix, e->key, 1);
+    }
+  else
+    ix->live_bytes -= db_log_rec_len (e);
+  e->off = off;
+  e->size = size;
+  e->mtime = mtime;
+  ix->live_bytes += db_log_rec_len (e);
+}
+
+static void
+db_log_index_remove (DbLogIndex *ix, const char *key)
+{
+  DbLogEntry *e;
+
+  e = apr_hash_get (ix->keys, key, APR_HASH_KEY_STRING);
+  if (e == NULL)
+    return;
+  ix->live_bytes -= db_log_rec_len (e);
+  apr_hash_set (ix->keys, key, APR_HASH_KEY_STRING, NULL);
+  db_log_index_dirs (ix, e->key, -1);
+}
+
+static int
+db_log_open_file (DbLog *log)
+{
+  log->fd = open (log->log_pathname, O_RDWR | O_APPEND | O_CREAT, 0664);
+  log->scanned = 0;
+  log->seen_size = 0;
+  return log->fd < 0 ? -1 : 0;
+}
+
+/* Read @len bytes at @off, retrying short reads, or as many as there
+   are before the end of the file. Return value: the number of bytes
+   read, or -1 on error. */
+static ssize_t
+db_log_pread (int fd, char *buf, size_t len, apr_off_t off)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < len)
+    {
+      n = pread (fd, buf + done, len - done, off + done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
+	return -1;
+      if (n == 0)
+	break;
+      done += n;
+    }
+  return done;
+}
+
+/**
+ * db_log_scan: Index records appended since the last scan.
+ * @log: The log.
+ * @lock_op: The flock operation the caller holds the log with.
+ *
+ * The caller holds append_lock, a flock on the log, and the index
+ * write lock. Stops at the first torn or invalid record, which the next
+ * append cuts off. On a "moved" record, switches to the new file, takes
+ * the same flock on it, and rebuilds the index from it.
+ *
+ * A read that fails or comes up short of the size the file was seen
+ * at is an error, not a torn record: the log is left as it is.
+ *
+ * Return value: 0 on success.
+ **/
+static int
+db_log_scan (DbLog *log, int lock_op)
+{
+  struct stat st;
+  DbLogHeader h;
+  char *buf;
+  apr_off_t win_off = 0;
+  apr_off_t win_len = 0;
+  apr_off_t off;
+  apr_off_t rec_len;
+  ssize_t n;
+  char key[DB_LOG_KEY_MAX + 1];
+
+  buf = (char *)malloc (DB_LOG_SCAN_BUF);
+  if (buf == NULL)
+    return -1;
+
+ rescan:
+  if (fstat (log->fd, &st) < 0)
+    {
+      free (buf);
+      return -1;
+    }
+  win_len = 0;
+  off = log->scanned;
+  while (off + (apr_off_t)sizeof (DbLogHeader) <= st.st_size)
+    {
+      /* Keep header and key in the window; values are skipped. */
+      if (off < win_off || off + (apr_off_t)sizeof (DbLogHeader) + DB_LOG_KEY_MAX > win_off + win_len)
+	{
+	  n = db_log_pread (log->fd, buf, DB_LOG_SCAN_BUF, off);
+	  if (n < (ssize_t)sizeof (DbLogHeader))
+	    {
+	      free (buf);
+	      return -1;
+	    }
+	  win_off = off;
+	  win_len = n;
+	}
+      memcpy (&h, buf + (off - win_off), sizeof (h));
+      if (h.magic != DB_LOG_MAGIC || h.key_len > DB_LOG_KEY_MAX)
+	break;
+      rec_len = sizeof (h) + h.key_len + h.val_len;
+      if (off + rec_len > st.st_size)
+	break;
+      if (off + (apr_off_t)sizeof (h) + h.key_len > win_off + win_len)
+	{
+	  free (buf);
+	  return -1;
+	}
+      memcpy (key, buf + (off - win_off) + sizeof (h), h.key_len);
+      key[h.key_len] = 0;
+
+      if (h.type == DB_LOG_PUT)
+	db_log_index_set (log->ix, key, off + sizeof (h) + h.key_len,
+			  h.val_len, h.mtime);
+      else if (h.type == DB_LOG_DEL)
+	db_log_index_remove (log->ix, key);
+      else if (h.type == DB_LOG_MOVED)
+	{
+	  DbLogIndex *ix = db_log_index_new (log->pool);
+
+	  if (ix == NULL)
+	    break;
+	  close (log->fd);
+	  if (db_log_open_file (log))
+	    {
+	      apr_pool_destroy (ix->pool);
+	      free (buf);
+	      return -1;
+	    }
+	  flock (log->fd, lock_op);
+	  apr_pool_destroy (log->ix->pool);
+	  log->ix = ix;
+	  goto rescan;
+	}
+      off += rec_len;
+      log->scanned = off;
+    }
+  log->seen_size = st.st_size;
+  free (buf);
+  return 0;
+}
+
+/* Take the index read lock, first catching up with the file if it
+   has grown. */
+static void
+db_log_rdlock (DbLog *log)
+{
+  struct stat st;
+
+  apr_thread_rwlock_rdlock (log->rwlock);
+  if (fstat (log->fd, &st) < 0 || st.st_size == log->seen_size)
+    return;
+  apr_thread_rwlock_unlock (log->rwlock);
+
+  apr_thread_mutex_lock (log->append_lock);
+  flock (log->fd, LOCK_SH);
+  apr_thread_rwlock_wrlock (log->rwlock);
+  db_log_scan (log, LOCK_SH);
+  apr_thread_rwlock_unlock (log->rwlock);
+  flock (log->fd, LOCK_UN);
+  apr_thread_mutex_unlock (log->append_lock);
+
+  apr_thread_rwlock_rdlock (log->rwlock);
+}
+
+/**
+ * db_log_open: Get the log for a database directory.
+ * @base_pathname: The database directory.
+ *
+ * The log and its index are shared by every Db on the same directory
+ * within the process, and live as long as the process.
+ *
+ * Return value: The log, or NULL on error.
+ **/
+DbLog *
+virgule_db_log_open (const char *base_pathname)
+{
+  DbLog *log;
+  apr_pool_t *p;
+
+  if (log_registry_lock == NULL)
+    return NULL;
+
+  apr_thread_mutex_lock (log_registry_lock);
+  for (log = log_list; log != NULL; log = log->next)
+    if (!strcmp (log->base_pathname, base_pathname))
+      break;
+  if (log == NULL && apr_pool_create (&p, log_pool) == APR_SUCCESS)
+    {
+      log = (DbLog *)apr_pcalloc (p, sizeof (DbLog));
+      log->pool = p;
+      log->base_pathname = apr_pstrdup (p, base_pathname);
+      log->log_pathname = ap_make_full_path (p, base_pathname, DB_LOG_NAME);
+      log->ix = db_log_index_new (p);
+      if (log->ix == NULL || db_log_open_file (log) ||
+	  apr_thread_rwlock_create (&log->rwlock, p) != APR_SUCCESS ||
+	  apr_thread_mutex_create (&log->append_lock,
+				   APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS)
+	{
+	  if (log->fd >= 0)
+	    close (log->fd);
+	  apr_pool_destroy (p);
+	  log = NULL;
+	}
+      else
+	{
+	  flock (log->fd, LOCK_SH);
+	  db_log_scan (log, LOCK_SH);
+	  flock (log->fd, LOCK_UN);
+	  log->next = log_list;
+	  log_list = log;
+	}
+    }
+  apr_thread_mutex_unlock (log_registry_lock);
+  return log;
+}
+
+/**
+ * db_log_get: Get a record from the log.
+ * @log: The log.
+ * @p: Pool for allocations.
+ * @key: The key.
+ * @p_val: Where to store the record contents.
+ * @p_size: Where to store the size of the record.
+ *
+ * Return value: TRUE if the key is in the log.
+ **/
+int
+virgule_db_log_get (DbLog *log, apr_pool_t *p, const char *key,
+		    char **p_val, int *p_size)
+{
+  DbLogEntry *e;
+  char *val = NULL;
+  ssize_t n;
+  int found = 0;
+
+  key = db_log_norm_key (p, key);
+  db_log_rdlock (log);
+  e = apr_hash_get (log->ix->keys, key, APR_HASH_KEY_STRING);
+  if (e != NULL)
+    {
+      found = 1;
+      val = (char *)apr_palloc (p, e->size + 1);
+      n = db_log_pread (log->fd, val, e->size, e->off);
+      if (n == e->size)
+	{
+	  val[e->size] = 0;
+	  *p_size = e->size;
+	}
+      else
+	val = NULL;
+    }
+  apr_thread_rwlock_unlock (log->rwlock);
+  *p_val = val;
+  return found;
+}
+
+/**
+ * db_log_stamp: Get the version stamp of a record in the log.
+ *
+ * The record offset stands in for the inode, as it changes whenever
+ * the record is rewritten.
+ *
+ * Return value: TRUE if the key is in the log.
+ **/
+int
+virgule_db_log_stamp (DbLog *log, apr_pool_t *p, const char *key,
+		      DbStamp *stamp)
+{
+  DbLogEntry *e;
+
+  key = db_log_norm_key (p, key);
+  db_log_rdlock (log);
+  e = apr_hash_get (log->ix->keys, key, APR_HASH_KEY_STRING);
+  if (e != NULL)
+    {
+      stamp->mtime = e->mtime;
+      stamp->size = e->size;
+      stamp->inode = (apr_ino_t)e->off;
+    }
+  apr_thread_rwlock_unlock (log->rwlock);
+  return e != NULL;
+}
+
+static void * APR_THREAD_FUNC db_log_compact_thread (apr_thread_t *t, void *data);
+
+/* Start a background compaction if enough of the log is dead. The
+   caller holds append_lock. */
+static void
+db_log_maybe_compact (DbLog *log)
+{
+  apr_threadattr_t *attr;
+  apr_thread_t *t;
+
+  if (log->compacting || log->scanned < DB_LOG_COMPACT_MIN ||
+      log->scanned - log->ix->live_bytes < log->ix->live_bytes)
+    return;
+
+  log->compacting = 1;
+  if (apr_threadattr_create (&attr, log->pool) != APR_SUCCESS ||
+      apr_threadattr_detach_set (attr, 1) != APR_SUCCESS ||
+      apr_thread_create (&t, attr, db_log_compact_thread, log,
+			 log->pool) != APR_SUCCESS)
+    log->compacting = 0;
+}
+
+/* Append one record, with append_lock and the exclusive flock held
+   and the index caught up. Return value: offset of the record. */
+static apr_off_t
+db_log_append (DbLog *log, apr_pool_t *p, int type, const char *key,
+	       const char *val, apr_uint32_t size, apr_time_t mtime)
+{
+  DbLogHeader h;
+  apr_off_t off;
+  char *buf;
+  apr_size_t key_len = strlen (key);
+  apr_size_t len = sizeof (h) + key_len + size;
+  apr_size_t done;
+  ssize_t n;
+
+  /* Drop anything torn off by a writer that died mid-append. */
+  off = log->scanned;
+  if (log->seen_size != off && ftruncate (log->fd, off) < 0)
+    return -1;
+
+  h.magic = DB_LOG_MAGIC;
+  h.type = type;
+  h.key_len = key_len;
+  h.val_len = size;
+  h.mtime = mtime;
+
+  buf = (char *)apr_palloc (p, len);
+  memcpy (buf, &h, sizeof (h));
+  memcpy (buf + sizeof (h), key, key_len);
+  if (size)
+    memcpy (buf + sizeof (h) + key_len, val, size);
+
+  for (done = 0; done < len; done += n)
+    {
+      n = write (log->fd, buf + done, len - done);
+      if (n <= 0)
+	{
+	  if (ftruncate (log->fd, off) < 0)
+	    log->seen_size = -1;
+	  return -1;
+	}
+    }
+  log->scanned = log->seen_size = off + len;
+  return off;
+}
+
+/**
+ * db_log_put: Put a record in the log.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_db_log_put (DbLog *log, apr_pool_t *p, const char *key,
+		    const char *val, int size)
+{
+  apr_time_t now = apr_time_now ();
+  apr_off_t off = -1;
+
+  key = db_log_norm_key (p, key);
+  if (strlen (key) > DB_LOG_KEY_MAX || size < 0)
+    return -1;
+
+  apr_thread_mutex_lock (log->append_lock);
+  flock (log->fd, LOCK_EX);
+  apr_thread_rwlock_wrlock (log->rwlock);
+  if (db_log_scan (log, LOCK_EX) == 0)
+    off = db_log_append (log, p, DB_LOG_PUT, key, val, size, now);
+  if (off >= 0)
+    db_log_index_set (log->ix, key, off + sizeof (DbLogHeader) + strlen (key),
+		      size, now);
+  apr_thread_rwlock_unlock (log->rwlock);
+  flock (log->fd, LOCK_UN);
+  db_log_maybe_compact (log);
+  apr_thread_mutex_unlock (log->append_lock);
+
+  return off >= 0 ? 0 : -1;
+}
+
+/**
+ * db_log_del: Delete a record from the log.
+ *
+ * Return value: 0 if the key was in the log and has been deleted.
+ **/
+int
+virgule_db_log_del (DbLog *log, apr_pool_t *p, const char *key)
+{
+  apr_off_t off = -1;
+
+  key = db_log_norm_key (p, key);
+
+  apr_thread_mutex_lock (log->append_lock);
+  flock (log->fd, LOCK_EX);
+  apr_thread_rwlock_wrlock (log->rwlock);
+  if (db_log_scan (log, LOCK_EX) == 0 &&
+      apr_hash_get (log->ix->keys, key, APR_HASH_KEY_STRING) != NULL)
+    {
+      off = db_log_append (log, p, DB_LOG_DEL, key, NULL, 0, apr_time_now ());
+      if (off >= 0)
+	db_log_index_remove (log->ix, key);
+    }
+  apr_thread_rwlock_unlock (log->rwlock);
+  flock (log->fd, LOCK_UN);
+  db_log_maybe_compact (log);
+  apr_thread_mutex_unlock (log->append_lock);
+
+  return off >= 0 ? 0 : -1;
+}
+
+/**
+ * db_log_is_dir: Determine whether a key is a directory in the log.
+ *
+ * Return value: TRUE if any key in the log lies below @key.
+ **/
+int
+virgule_db_log_is_dir (DbLog *log, apr_pool_t *p, const char *key)
+{
+  int result;
+
+  key = db_log_norm_key (p, key);
+  db_log_rdlock (log);
+  result = apr_hash_get (log->ix->dirs, key, APR_HASH_KEY_STRING) != NULL;
+  apr_thread_rwlock_unlock (log->rwlock);
+  return result;
+}
+
+/**
+ * db_log_list_dir: List the children of a directory in the log.
+ *
+ * Unlike the filesystem backend, numeric children come back in key
+ * form ("_123"), not in mangled form.
+ *
+ * Return value: Array of child names, or NULL if not a directory.
+ **/
+apr_array_header_t *
+virgule_db_log_list_dir (DbLog *log, apr_pool_t *p, const char *key)
+{
+  apr_array_header_t *result = NULL;
+  apr_hash_t *children;
+  apr_hash_index_t *hi;
+  const void *name;
+
+  key = db_log_norm_key (p, key);
+  db_log_rdlock (log);
+  children = apr_hash_get (log->ix->dirs, key, APR_HASH_KEY_STRING);
+  if (children != NULL)
+    {
+      result = apr_array_make (p, apr_hash_count (children), sizeof (char *));
+      for (hi = apr_hash_first (p, children); hi; hi = apr_hash_next (hi))
+	{
+	  apr_hash_this (hi, &name, NULL, NULL);
+	  *(char **)apr_array_push (result) = apr_pstrdup (p, name);
+	}
+    }
+  apr_thread_rwlock_unlock (log->rwlock);
+  return result;
+}
+
+/**
+ * db_log_dir_max: Find maximum integer key of a directory in the log.
+ *
+ * Return value: the maximum integer key, or -1 if none.
+ **/
+int
+virgule_db_log_dir_max (DbLog *log, apr_pool_t *p, const char *key)
+{
+  int *max;
+  int result = -1;
+
+  key = db_log_norm_key (p, key);
+  db_log_rdlock (log);
+  max = apr_hash_get (log->ix->dir_max, key, APR_HASH_KEY_STRING);
+  if (max != NULL)
+    result = *max;
+  apr_thread_rwlock_unlock (log->rwlock);
+  return result;
+}
+
+void
+virgule_db_log_get_stats (DbLog *log, DbLogStats *stats)
+{
+  db_log_rdlock (log);
+  stats->log_bytes = log->scanned;
+  stats->live_bytes = log->ix->live_bytes;
+  stats->n_keys = apr_hash_count (log->ix->keys);
+  stats->compactions = log->compactions;
+  stats->compacting = log->compacting;
+  apr_thread_rwlock_unlock (log->rwlock);
+}
+
+/**
+ * db_log_compact: Rewrite the log with only the live records.
+ *
+ * Holds append_lock and the exclusive flock throughout, so appends
+ * in all processes wait, but readers in this process only block for
+ * the final swap of index and descriptor.
+ **/
+static void
+db_log_compact (DbLog *log)
+{
+  apr_pool_t *p;
+  char *tmp_pathname;
+  DbLogIndex *ix;
+  DbLogEntry *e;
+  apr_hash_index_t *hi;
+  void *val;
+  char *buf = NULL;
+  apr_size_t buf_size = 0;
+  int tmp_fd;
+  int new_fd;
+  apr_off_t off = 0;
+  DbLogHeader h;
+  apr_size_t key_len;
+  int ok = 1;
+
+  if (apr_pool_create (&p, log->pool) != APR_SUCCESS)
+    return;
+
+  apr_thread_mutex_lock (log->append_lock);
+  flock (log->fd, LOCK_EX);
+  apr_thread_rwlock_wrlock (log->rwlock);
+  if (db_log_scan (log, LOCK_EX))
+    ok = 0;
+  apr_thread_rwlock_unlock (log->rwlock);
+
+  tmp_pathname = apr_pstrcat (p, log->log_pathname, ".compact", NULL);
+  tmp_fd = open (tmp_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  ix = db_log_index_new (log->pool);
+  if (tmp_fd < 0 || ix == NULL)
+    ok = 0;
+
+  /* No appends or scans can happen while we hold append_lock, so the
+     index is stable under the read lock. */
+  apr_thread_rwlock_rdlock (log->rwlock);
+  for (hi = apr_hash_first (p, log->ix->keys); ok && hi; hi = apr_hash_next (hi))
+    {
+      apr_hash_this (hi, NULL, NULL, &val);
+      e = (DbLogEntry *)val;
+      key_len = strlen (e->key);
+      if (sizeof (h) + key_len + e->size > buf_size)
+	{
+	  buf_size = sizeof (h) + key_len + e->size;
+	  buf = (char *)apr_palloc (p, buf_size);
+	}
+      h.magic = DB_LOG_MAGIC;
+      h.type = DB_LOG_PUT;
+      h.key_len = key_len;
+      h.val_len = e->size;
+      h.mtime = e->mtime;
+      memcpy (buf, &h, sizeof (h));
+      memcpy (buf + sizeof (h), e->key, key_len);
+      if (db_log_pread (log->fd, buf + sizeof (h) + key_len, e->size, e->off) != e->size ||
+	  write (tmp_fd, buf, sizeof (h) + key_len + e->size) != (ssize_t)(sizeof (h) + key_len + e->size))
+	ok = 0;
+      db_log_index_set (ix, e->key, off + sizeof (h) + key_len, e->size, e->mtime);
+      off += sizeof (h) + key_len + e->size;
+    }
+  apr_thread_rwlock_unlock (log->rwlock);
+
+  if (ok && (fsync (tmp_fd) < 0 || rename (tmp_pathname, log->log_pathname) < 0))
+    ok = 0;
+  if (tmp_fd >= 0)
+    close (tmp_fd);
+
+  new_fd = -1;
+  if (ok)
+    new_fd = open (log->log_pathname, O_RDWR | O_APPEND, 0664);
+  if (new_fd >= 0)
+    {
+      /* Tell other processes to switch, then switch ourselves. */
+      db_log_append (log, p, DB_LOG_MOVED, "", NULL, 0, apr_time_now ());
+      apr_thread_rwlock_wrlock (log->rwlock);
+      close (log->fd);
+      log->fd = new_fd;
+      apr_pool_destroy (log->ix->pool);
+      log->ix = ix;
+      log->scanned = log->seen_size = off;
+      log->compactions++;
+      apr_thread_rwlock_unlock (log->rwlock);
+    }
+  else
+    {
+      if (ix != NULL)
+	apr_pool_destroy (ix->pool);
+      unlink (tmp_pathname);
+      flock (log->fd, LOCK_UN);
+    }
+
+  log->compacting = 0;
+  apr_thread_mutex_unlock (log->append_lock);
+  apr_pool_destroy (p);
+}
+
+static void * APR_THREAD_FUNC
+db_log_compact_thread (apr_thread_t *t, void *data)
+{
+  db_log_compact ((DbLog *)data);
+  apr_thread_exit (t, APR_SUCCESS);
+  return NULL;
+}
@@ -0,0 +1,46 @@
+typedef struct _DbLog DbLog;
+typedef struct _DbLogStats DbLogStats;
+
+struct _DbLogStats {
+  apr_off_t log_bytes;
+  apr_off_t live_bytes;
+  unsigned long n_keys;
+  unsigned long compactions;
+  int compacting;
+};
+
+apr_status_t
+virgule_db_log_init (apr_pool_t *p);
+
+DbLog *
+virgule_db_log_open (const char *base_pathname);
+
+int
+virgule_db_log_get (DbLog *log, apr_pool_t *p, const char *key,
+		    char **p_val, int *p_size);
+
+int
+virgule_db_log_stamp (DbLog *log, apr_pool_t *p, const char *key,
+		      DbStamp *stamp);
+
+int
+virgule_db_log_put (DbLog *log, apr_pool_t *p, const char *key,
+		    const char *val, int size);
+
+int
+virgule_db_log_del (DbLog *log, apr_pool_t *p, const char *key);
+
+int
+virgule_db_log_is_dir (DbLog *log, apr_pool_t *p, const char *key);
+
+apr_array_header_t *
+virgule_db_log_list_dir (DbLog *log, apr_pool_t *p, const char *key);
+
+int
+virgule_db_log_dir_max (DbLog *log, apr_pool_t *p, const char *key);
+
+void
+virgule_db_log_get_stats (DbLog *log, DbLogStats *stats);
+
+int
+virgule_db_get_log_stats (Db *db, DbLogStats *stats);
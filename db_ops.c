@@ -4,6 +4,7 @@
    relations, ontology, indexing, and some other things. */
 
 #include <string.h>
+#include <time.h>
 
 #include <apr.h>
 #include <apr_strings.h>
@@ -22,6 +23,209 @@
 #include "db_ops.h"
 
 
+/* Recent lists are kept as binary ring buffers: a RecentHeader,
+   then capacity fixed-size RecentRec slots, the oldest item in slot
+   head and the others following it around the ring. Numbers are in
+   host order. Appending writes one slot, dropping the oldest item
+   when the ring is full; removing a duplicate moves the newer items
+   down over it. A list with no binary record is read from the XML
+   document it replaces, key plus ".xml", which is converted on the
+   first write. */
+#define RECENT_MAGIC "RCL1"
+#define RECENT_KEY_MAX 52
+
+typedef struct {
+  char magic[4];
+  apr_uint32_t capacity;
+  apr_uint32_t head;
+  apr_uint32_t n;
+} RecentHeader;
+
+typedef struct {
+  apr_int64_t time;
+  apr_int32_t entry;
+  char key[RECENT_KEY_MAX];  /* nul-terminated */
+} RecentRec;
+
+typedef struct {
+  RecentHeader h;
+  RecentRec *recs;
+} RecentRing;
+
+#define RECENT_REC(ring, i) \
+  ((ring)->recs[((ring)->h.head + (i)) % (ring)->h.capacity])
+
+static void
+recent_ring_init (apr_pool_t *p, RecentRing *ring, int capacity)
+{
+  memcpy (ring->h.magic, RECENT_MAGIC, 4);
+  ring->h.capacity = capacity;
+  ring->h.head = 0;
+  ring->h.n = 0;
+  ring->recs = (RecentRec *)apr_pcalloc (p, capacity * sizeof (RecentRec));
+}
+
+/* Append an item, dropping the oldest one if the ring is full. */
+static void
+recent_ring_push (RecentRing *ring, const char *val, time_t t, int entry)
+{
+  RecentRec *rec;
+
+  if (ring->h.n == ring->h.capacity)
+    {
+      ring->h.head = (ring->h.head + 1) % ring->h.capacity;
+      ring->h.n--;
+    }
+  rec = &RECENT_REC (ring, ring->h.n);
+  memset (rec, 0, sizeof (RecentRec));
+  rec->time = t;
+  rec->entry = entry;
+  strcpy (rec->key, val);
+  ring->h.n++;
+}
+
+/* Remove the item at position @i, counting from the oldest. */
+static void
+recent_ring_remove (RecentRing *ring, int i)
+{
+  for (; i + 1 < (int)ring->h.n; i++)
+    RECENT_REC (ring, i) = RECENT_REC (ring, i + 1);
+  ring->h.n--;
+}
+
+/* Copy the newest items of @ring into a new ring of @capacity. */
+static void
+recent_ring_resize (apr_pool_t *p, RecentRing *ring, int capacity)
+{
+  RecentRing new_ring;
+  int i;
+
+  recent_ring_init (p, &new_ring, capacity);
+  i = (int)ring->h.n > capacity ? ring->h.n - capacity : 0;
+  for (; i < (int)ring->h.n; i++)
+    new_ring.recs[new_ring.h.n++] = RECENT_REC (ring, i);
+  *ring = new_ring;
+}
+
+/* Read the items of an old XML recent list, oldest first. */
+static int
+recent_ring_import (apr_pool_t *p, Db *db, const char *key, RecentRing *ring)
+{
+  const xmlDoc *doc;
+  xmlNode *tree;
+  int n = 0;
+
+  doc = virgule_db_xml_get_ro (p, db, apr_pstrcat (p, key, ".xml", NULL));
+  if (doc == NULL)
+    return -1;
+  for (tree = doc->xmlRootNode->children; tree != NULL; tree = tree->next)
+    if (!xmlIsBlankNode (tree))
+      n++;
+  recent_ring_init (p, ring, n > 0 ? n : 1);
+  for (tree = doc->xmlRootNode->children; tree != NULL; tree = tree->next)
+    {
+      char *val, *date;
+
+      if (xmlIsBlankNode (tree))
+	continue;
+      val = virgule_xml_get_string_contents (tree);
+      date = virgule_xml_get_prop (p, tree, (xmlChar *)"date");
+      if (val == NULL || strlen (val) >= RECENT_KEY_MAX)
+	continue;
+      recent_ring_push (ring, val, virgule_iso_to_time_t (date), -1);
+    }
+  return 0;
+}
+
+/**
+ * recent_ring_load: Load a recent list.
+ * @key: The key of the list.
+ * @ring: Where to store the list.
+ * @imported: Set to TRUE if the list came from its old XML document.
+ *
+ * Return value: 0 on success, -1 if the list does not exist or is
+ * damaged.
+ **/
+static int
+recent_ring_load (apr_pool_t *p, Db *db, const char *key, RecentRing *ring,
+		  int *imported)
+{
+  char *val;
+  int size;
+  int i;
+
+  *imported = 0;
+  val = virgule_db_get_p (p, db, key, &size);
+  if (val == NULL)
+    {
+      *imported = recent_ring_import (p, db, key, ring) == 0;
+      return *imported ? 0 : -1;
+    }
+  if (size < (int)sizeof (RecentHeader))
+    return -1;
+  memcpy (&ring->h, val, sizeof (RecentHeader));
+  if (memcmp (ring->h.magic, RECENT_MAGIC, 4) || ring->h.capacity == 0 ||
+      ring->h.head >= ring->h.capacity || ring->h.n > ring->h.capacity ||
+      ring->h.capacity > (apr_uint32_t)size / sizeof (RecentRec) ||
+      sizeof (RecentHeader) + ring->h.capacity * sizeof (RecentRec) !=
+      (apr_size_t)size)
+    return -1;
+  ring->recs = (RecentRec *)apr_palloc (p, ring->h.capacity *
+					sizeof (RecentRec));
+  memcpy (ring->recs, val + sizeof (RecentHeader),
+	  ring->h.capacity * sizeof (RecentRec));
+  for (i = 0; i < (int)ring->h.capacity; i++)
+    ring->recs[i].key[RECENT_KEY_MAX - 1] = 0;
+  return 0;
+}
+
+static int
+recent_ring_store (apr_pool_t *p, Db *db, const char *key,
+		   const RecentRing *ring)
+{
+  apr_size_t size = ring->h.capacity * sizeof (RecentRec);
+  char *buf = apr_palloc (p, sizeof (RecentHeader) + size);
+
+  memcpy (buf, &ring->h, sizeof (RecentHeader));
+  memcpy (buf + sizeof (RecentHeader), ring->recs, size);
+  return virgule_db_put_p (p, db, key, buf, sizeof (RecentHeader) + size);
+}
+
+/**
+ * virgule_recent_get: Get the items of a recent list.
+ * @p: Pool for allocations.
+ * @db: The database.
+ * @key: The key of the list, such as "recent/diary".
+ * @n_max: The maximum number of items to return, or -1 for all.
+ *
+ * Return value: An array of #RecentItem, newest first, or NULL if
+ * the list does not exist.
+ **/
+apr_array_header_t *
+virgule_recent_get (apr_pool_t *p, Db *db, const char *key, int n_max)
+{
+  RecentRing ring;
+  apr_array_header_t *result;
+  int imported;
+  int i;
+
+  if (recent_ring_load (p, db, key, &ring, &imported))
+    return NULL;
+  result = apr_array_make (p, ring.h.n ? ring.h.n : 1, sizeof (RecentItem));
+  for (i = ring.h.n - 1; i >= 0 && (n_max < 0 || result->nelts < n_max); i--)
+    {
+      RecentRec *rec = &RECENT_REC (&ring, i);
+      RecentItem *item = (RecentItem *)apr_array_push (result);
+
+      item->key = apr_pstrdup (p, rec->key);
+      item->time = rec->time;
+      item->date = ap_ht_time (p, (apr_time_t)rec->time * APR_USEC_PER_SEC,
+			       "%Y-%m-%d %H:%M:%S", 1);
+      item->entry = rec->entry;
+    }
+  return result;
+}
+
 /**
  * virgule_remove_recent: Removes recent items matching the specified
  * user account name. Called by acct_kill as part of account removal.
@@ -29,72 +233,88 @@
 void
 virgule_remove_recent (VirguleReq *vr, const char *key, const char *val)
 {
-  xmlDoc *recent;
-  xmlNode *item, *next;
+  apr_pool_t *p = vr->r->pool;
+  RecentRing ring;
+  int imported;
+  int i, n_removed = 0;
 
   if (key == NULL || val == NULL)
     return;
-  
-  recent = virgule_db_xml_get (vr->r->pool, vr->db, key);
-  if (recent == NULL)
+
+  if (recent_ring_load (p, vr->db, key, &ring, &imported))
     return;
 
-  for (item = recent->xmlRootNode->children; item != NULL; item = next)
-    {
-      next = item->next;
-      if(!strcmp (val, virgule_xml_get_string_contents (item)))
-        {
-          xmlUnlinkNode (item);
-	  xmlFreeNode (item);
-	}
-    }
-  virgule_db_xml_put (vr->r->pool, vr->db, key, recent);
+  for (i = ring.h.n - 1; i >= 0; i--)
+    if (!strncmp (RECENT_REC (&ring, i).key, val, RECENT_KEY_MAX))
+      {
+	recent_ring_remove (&ring, i);
+	n_removed++;
+      }
+  if (n_removed || imported)
+    recent_ring_store (p, vr->db, key, &ring);
 }
 
 
-/* careful: val better not have any xml metacharacters */
+/**
+ * virgule_add_recent_entry: Add an item to a recent list.
+ * @p: Pool for allocations.
+ * @db: The database.
+ * @key: The key of the list, such as "recent/diary".
+ * @val: The item, an account or project name.
+ * @entry: The diary entry number the item is for, or -1.
+ * @n_max: The number of items the list keeps, or -1 for no limit. A
+ * list already longer than @n_max is not cut back.
+ * @dup: If FALSE, an older item with the same name is removed.
+ *
+ * Return value: 0 on success.
+ **/
 int
-virgule_add_recent (apr_pool_t *p, Db *db, const char *key, const char *val, int n_max, int dup)
+virgule_add_recent_entry (apr_pool_t *p, Db *db, const char *key,
+			  const char *val, int entry, int n_max, int dup)
 {
-  xmlDoc *doc;
-  xmlNode *root, *tree;
-  int n;
-  const char *date;
+  RecentRing ring;
+  int imported;
+  int removed = FALSE;
+  int i, status;
 
-  if (val == NULL || !strcmp (val, ""))
+  if (val == NULL || !strcmp (val, "") || strlen (val) >= RECENT_KEY_MAX)
     return -1;
 
-  doc = virgule_db_xml_get (p, db, key);
-  if (doc == NULL)
-    {
-      doc = virgule_db_xml_doc_new (p);
-      root = xmlNewDocNode (doc, NULL, (xmlChar *)"recent", NULL);
-      doc->xmlRootNode = root;
-    }
-  else
-    root = doc->xmlRootNode;
-
-  tree = xmlNewTextChild (root, NULL, (xmlChar *)"item", (xmlChar *)val);
-  if (tree == NULL)
-    return -1;
-    
-  date = virgule_iso_now (p);
-  xmlSetProp (tree, (xmlChar *)"date", (xmlChar *)date);
+  if (recent_ring_load (p, db, key, &ring, &imported))
+    recent_ring_init (p, &ring, n_max > 0 ? n_max : 64);
 
-  n = 0;
-  for (tree = root->last; tree != NULL; tree = tree->prev)
-    {
-      if ((!dup && n > 0 && !strcmp (val, virgule_xml_get_string_contents (tree))) ||
-	  n == n_max)
+  if (!dup)
+    for (i = ring.h.n - 1; i >= 0; i--)
+      if (!strcmp (RECENT_REC (&ring, i).key, val))
 	{
-	  xmlUnlinkNode (tree);
-	  xmlFreeNode (tree);
+	  recent_ring_remove (&ring, i);
+	  removed = TRUE;
 	  break;
 	}
-      n++;
-    }
 
-  return virgule_db_xml_put (p, db, key, doc);
+  /* unlimited lists grow by doubling. A list may be appended to with
+     different limits, so a limited add never shrinks it: one kept
+     longer stays at its length, dropping just the oldest item */
+  if (n_max > 0 && ring.h.capacity < (apr_uint32_t)n_max)
+    recent_ring_resize (p, &ring, n_max);
+  else if (n_max <= 0 && ring.h.n == ring.h.capacity)
+    recent_ring_resize (p, &ring, ring.h.capacity * 2);
+  else if (n_max > 0 && !removed && ring.h.n >= (apr_uint32_t)n_max &&
+	   ring.h.n < ring.h.capacity)
+    recent_ring_remove (&ring, 0);
+
+  recent_ring_push (&ring, val, time (NULL), entry);
+
+  status = recent_ring_store (p, db, key, &ring);
+  if (status == 0 && imported)
+    virgule_db_del (db, apr_pstrcat (p, key, ".xml", NULL));
+  return status;
+}
+
+int
+virgule_add_recent (apr_pool_t *p, Db *db, const char *key, const char *val, int n_max, int dup)
+{
+  return virgule_add_recent_entry (p, db, key, val, -1, n_max, dup);
 }
 
 /**
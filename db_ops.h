@@ -4,9 +4,24 @@
    relations, ontology, indexing, and some other things. */
 
 
+/* An item of a recent list. */
+typedef struct {
+  const char *key;    /* account or project name */
+  const char *date;   /* when it was added, in iso format */
+  apr_int64_t time;   /* the same as a time_t */
+  int entry;          /* diary entry number, or -1 */
+} RecentItem;
+
 int
 virgule_add_recent (apr_pool_t *p, Db *db, const char *key, const char *val, int n_max, int dup);
 
+int
+virgule_add_recent_entry (apr_pool_t *p, Db *db, const char *key,
+			  const char *val, int entry, int n_max, int dup);
+
+apr_array_header_t *
+virgule_recent_get (apr_pool_t *p, Db *db, const char *key, int n_max);
+
 
 /* Relations */
 
@@ -1,7 +1,12 @@
 /* Access to the database with XML. */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <apr.h>
 #include <apr_pools.h>
+#include <apr_hash.h>
+#include <apr_thread_mutex.h>
 #include <httpd.h>
 
 #include <libxml/tree.h>
@@ -11,6 +16,43 @@
 #include "db.h"
 #include "db_xml.h"
 
+/* The parsed document cache. Documents are shared by all threads of
+   the process, keyed by the full filename of the record, and checked
+   against the record's DbStamp on every lookup so that changes made
+   by other processes are picked up. A cached tree is never modified;
+   virgule_db_xml_get hands out private copies while
+   virgule_db_xml_get_ro lets the caller read the shared tree. */
+
+/* Don't cache records modified less than this long ago, as a rewrite
+   within the timestamp resolution would not change the stamp. */
+#define DB_XML_CACHE_RACY_USEC (2 * APR_USEC_PER_SEC)
+
+/* Rough ratio of parsed tree size to serialized size, used to charge
+   entries against the cache size limit. */
+#define DB_XML_CACHE_TREE_RATIO 8
+
+#define DB_XML_CACHE_DEFAULT_MAX (8192 * 1024)
+
+typedef struct _DbXmlCacheEntry DbXmlCacheEntry;
+
+struct _DbXmlCacheEntry {
+  char *fn;
+  xmlDoc *doc;
+  DbStamp stamp;
+  apr_size_t cost;
+  int refcount;
+  int stale; /* no longer in the table, free once refcount drops to 0 */
+  DbXmlCacheEntry *prev;
+  DbXmlCacheEntry *next;
+};
+
+static apr_thread_mutex_t *cache_lock = NULL;
+static apr_hash_t *cache_table = NULL;
+static DbXmlCacheEntry *cache_head = NULL; /* most recently used */
+static DbXmlCacheEntry *cache_tail = NULL;
+static apr_size_t cache_max = DB_XML_CACHE_DEFAULT_MAX;
+static DbXmlCacheStats cache_stats;
+
 static apr_status_t
 db_xml_cleanup (void *data)
 {
@@ -18,25 +60,391 @@ db_xml_cleanup (void *data)
 
   if (doc != NULL)
     xmlFreeDoc (doc);
-  
+
   return APR_SUCCESS;
 }
 
-xmlDoc *
-virgule_db_xml_get (apr_pool_t *p, Db *db, const char *key)
+/**
+ * db_xml_cache_init: Set up the parsed document cache.
+ * @p: Process pool.
+ *
+ * Called once per child process, before any threads start serving
+ * requests. Without it, documents are parsed on every get.
+ *
+ * Return value: APR_SUCCESS on success.
+ **/
+apr_status_t
+virgule_db_xml_cache_init (apr_pool_t *p)
+{
+  apr_status_t status;
+
+  status = apr_thread_mutex_create (&cache_lock, APR_THREAD_MUTEX_DEFAULT, p);
+  if (status != APR_SUCCESS)
+    {
+      cache_lock = NULL;
+      return status;
+    }
+  cache_table = apr_hash_make (p);
+  memset (&cache_stats, 0, sizeof (cache_stats));
+  return APR_SUCCESS;
+}
+
+static void
+db_xml_entry_free (DbXmlCacheEntry *ce)
+{
+  xmlFreeDoc (ce->doc);
+  free (ce->fn);
+  free (ce);
+}
+
+/* Unlink an entry from table and LRU list. Caller holds cache_lock. */
+static void
+db_xml_entry_unlink (DbXmlCacheEntry *ce)
+{
+  apr_hash_set (cache_table, ce->fn, APR_HASH_KEY_STRING, NULL);
+  if (ce->prev)
+    ce->prev->next = ce->next;
+  else
+    cache_head = ce->next;
+  if (ce->next)
+    ce->next->prev = ce->prev;
+  else
+    cache_tail = ce->prev;
+  ce->prev = ce->next = NULL;
+  cache_stats.entries--;
+  cache_stats.bytes -= ce->cost;
+  if (ce->refcount)
+    ce->stale = 1;
+  else
+    db_xml_entry_free (ce);
+}
+
+/* Evict least recently used entries until under the limit. Caller
+   holds cache_lock. */
+static void
+db_xml_cache_trim (void)
 {
+  while (cache_tail != NULL && cache_stats.bytes > cache_max)
+    {
+      db_xml_entry_unlink (cache_tail);
+      cache_stats.evictions++;
+    }
+}
+
+/**
+ * db_xml_cache_set_max: Set the cache size limit.
+ * @max: Limit in bytes of estimated tree size; 0 disables the cache.
+ **/
+void
+virgule_db_xml_cache_set_max (apr_size_t max)
+{
+  if (cache_lock == NULL)
+    return;
+  apr_thread_mutex_lock (cache_lock);
+  cache_max = max;
+  db_xml_cache_trim ();
+  apr_thread_mutex_unlock (cache_lock);
+}
+
+/**
+ * db_xml_cache_get_stats: Copy out the cache counters.
+ * @stats: Where to store the counters.
+ **/
+void
+virgule_db_xml_cache_get_stats (DbXmlCacheStats *stats)
+{
+  if (cache_lock == NULL)
+    {
+      memset (stats, 0, sizeof (*stats));
+      return;
+    }
+  apr_thread_mutex_lock (cache_lock);
+  *stats = cache_stats;
+  stats->max_bytes = cache_max;
+  apr_thread_mutex_unlock (cache_lock);
+}
+
+static void
+db_xml_entry_release (DbXmlCacheEntry *ce)
+{
+  apr_thread_mutex_lock (cache_lock);
+  if (--ce->refcount == 0 && ce->stale)
+    db_xml_entry_free (ce);
+  apr_thread_mutex_unlock (cache_lock);
+}
+
+static apr_status_t
+db_xml_entry_cleanup (void *data)
+{
+  db_xml_entry_release ((DbXmlCacheEntry *)data);
+  return APR_SUCCESS;
+}
+
+/**
+ * db_xml_cache_lookup: Find a referenced, up to date cache entry.
+ *
+ * On a miss, reads and parses the record, and adds it to the cache if
+ * it qualifies. In that case *@p_doc is set to the freshly parsed
+ * document and NULL is returned if it could not be cached; the caller
+ * then owns *@p_doc.
+ *
+ * Return value: The entry, with a reference held for the caller.
+ **/
+static DbXmlCacheEntry *
+db_xml_cache_lookup (apr_pool_t *p, Db *db, const char *key, xmlDoc **p_doc)
+{
+  DbXmlCacheEntry *ce;
+  DbStamp stamp;
+  char *fn;
+  char *val;
   int val_size;
-  char *val = virgule_db_get_p (p, db, key, &val_size);
+  xmlDoc *doc;
+  apr_size_t cost;
+
+  *p_doc = NULL;
+  fn = virgule_db_mk_filename (p, db, key);
+  stamp.size = -1;
+
+  if (virgule_db_stamp (p, db, key, &stamp) == 0)
+    {
+      apr_thread_mutex_lock (cache_lock);
+      ce = apr_hash_get (cache_table, fn, APR_HASH_KEY_STRING);
+      if (ce != NULL)
+	{
+	  if (virgule_db_stamp_equal (&ce->stamp, &stamp))
+	    {
+	      ce->refcount++;
+	      cache_stats.hits++;
+	      /* move to front of LRU list */
+	      if (ce->prev)
+		{
+		  ce->prev->next = ce->next;
+		  if (ce->next)
+		    ce->next->prev = ce->prev;
+		  else
+		    cache_tail = ce->prev;
+		  ce->prev = NULL;
+		  ce->next = cache_head;
+		  cache_head->prev = ce;
+		  cache_head = ce;
+		}
+	      apr_thread_mutex_unlock (cache_lock);
+	      return ce;
+	    }
+	  db_xml_entry_unlink (ce);
+	  cache_stats.invalidations++;
+	}
+      cache_stats.misses++;
+      apr_thread_mutex_unlock (cache_lock);
+    }
+
+  /* the stamp must not be paired with an older copy from the memo */
+  val = virgule_db_get_fresh (p, db, key, &val_size);
+  if (val == NULL)
+    return NULL;
+  doc = xmlParseMemory (val, val_size);
+  if (doc == NULL)
+    return NULL;
+  *p_doc = doc;
+
+  /* The stamp was taken before the read, so the cached tree can only
+     be newer than its stamp says, which at worst costs a reparse. */
+  cost = (apr_size_t)val_size * DB_XML_CACHE_TREE_RATIO;
+  if (stamp.size != val_size ||
+      apr_time_now () - stamp.mtime < DB_XML_CACHE_RACY_USEC)
+    return NULL;
+
+  apr_thread_mutex_lock (cache_lock);
+  if (cost > cache_max)
+    {
+      apr_thread_mutex_unlock (cache_lock);
+      return NULL;
+    }
+  ce = apr_hash_get (cache_table, fn, APR_HASH_KEY_STRING);
+  if (ce != NULL)
+    db_xml_entry_unlink (ce);
+
+  ce = (DbXmlCacheEntry *)malloc (sizeof (DbXmlCacheEntry));
+  if (ce == NULL || (ce->fn = strdup (fn)) == NULL)
+    {
+      free (ce);
+      apr_thread_mutex_unlock (cache_lock);
+      return NULL;
+    }
+  ce->doc = doc;
+  ce->stamp = stamp;
+  ce->cost = cost;
+  ce->refcount = 1;
+  ce->stale = 0;
+  ce->prev = NULL;
+  ce->next = cache_head;
+  if (cache_head)
+    cache_head->prev = ce;
+  else
+    cache_tail = ce;
+  cache_head = ce;
+  apr_hash_set (cache_table, ce->fn, APR_HASH_KEY_STRING, ce);
+  cache_stats.entries++;
+  cache_stats.bytes += cost;
+  db_xml_cache_trim ();
+  apr_thread_mutex_unlock (cache_lock);
+
+  *p_doc = NULL;
+  return ce;
+}
+
+/* Keep a shared document, or the fact that the record doesn't exist,
+   in the request memo. The memo then holds the cache entry or the
+   document until the request ends. Return TRUE if the memo kept it. */
+static int
+db_xml_memo_keep (apr_pool_t *p, Db *db, const char *key, xmlDoc *doc,
+		  DbXmlCacheEntry *ce)
+{
+  apr_pool_t *mp;
+
+  if (!virgule_db_memo_set_doc (p, db, key, doc))
+    return 0;
+  mp = virgule_db_memo_pool (db);
+  if (ce != NULL)
+    apr_pool_cleanup_register (mp, ce, db_xml_entry_cleanup, apr_pool_cleanup_null);
+  else if (doc != NULL)
+    apr_pool_cleanup_register (mp, doc, db_xml_cleanup, apr_pool_cleanup_null);
+  return 1;
+}
+
+/* Load a record for sharing, through the cache if there is one.
+   Return the document, which the caller must see released: either
+   *@p_ce holds a cache entry reference, or the caller owns the tree. */
+static xmlDoc *
+db_xml_load (apr_pool_t *p, Db *db, const char *key, DbXmlCacheEntry **p_ce)
+{
+  int val_size;
+  char *val;
   xmlDoc *result;
 
+  *p_ce = NULL;
+  if (cache_lock != NULL && cache_max > 0 && key != NULL)
+    {
+      *p_ce = db_xml_cache_lookup (p, db, key, &result);
+      return *p_ce != NULL ? (*p_ce)->doc : result;
+    }
+
+  /* the memo keeps the document rather than the record */
+  val = virgule_db_get_fresh (p, db, key, &val_size);
   if (val == NULL)
     return NULL;
-  result = xmlParseMemory (val, val_size);
+  return xmlParseMemory (val, val_size);
+}
+
+/**
+ * db_xml_get: Get an XML record from the database.
+ * @p: Pool the document is tied to.
+ * @db: The database.
+ * @key: The key.
+ *
+ * The document is private to the caller, who is free to modify it
+ * (and to free it early with db_xml_free).
+ *
+ * Return value: The parsed document, or NULL if not found.
+ **/
+xmlDoc *
+virgule_db_xml_get (apr_pool_t *p, Db *db, const char *key)
+{
+  const void *memo_doc;
+  xmlDoc *result;
+  DbXmlCacheEntry *ce;
+
+  /* the request has this one already */
+  if (virgule_db_memo_get_doc (p, db, key, &memo_doc))
+    {
+      if (memo_doc == NULL)
+	return NULL;
+      result = xmlCopyDoc ((xmlDoc *)memo_doc, 1);
+      apr_pool_cleanup_register (p, result, db_xml_cleanup, apr_pool_cleanup_null);
+      return result;
+    }
+
+  result = db_xml_load (p, db, key, &ce);
+  if (ce != NULL)
+    {
+      xmlDoc *shared = result;
+
+      result = xmlCopyDoc (shared, 1);
+      if (!db_xml_memo_keep (p, db, key, shared, ce))
+	db_xml_entry_release (ce);
+    }
+  else if (db_xml_memo_keep (p, db, key, result, NULL) && result != NULL)
+    /* the memo has the parsed tree, so the caller gets a copy */
+    result = xmlCopyDoc (result, 1);
+
   if (result != NULL)
     apr_pool_cleanup_register (p, result, db_xml_cleanup, apr_pool_cleanup_null);
   return result;
 }
 
+/**
+ * db_xml_get_ro: Get a read-only view of an XML record.
+ * @p: Pool the view is tied to.
+ * @db: The database.
+ * @key: The key.
+ *
+ * Like db_xml_get, but the document may be shared with other threads
+ * through the cache, or with the rest of the request through the
+ * memo, so it must not be modified or passed to db_xml_free. It stays
+ * valid until @p is cleared, or until the request ends if @db has a
+ * request memo.
+ *
+ * Return value: The parsed document, or NULL if not found.
+ **/
+const xmlDoc *
+virgule_db_xml_get_ro (apr_pool_t *p, Db *db, const char *key)
+{
+  const void *memo_doc;
+  xmlDoc *result;
+  DbXmlCacheEntry *ce;
+
+  if (virgule_db_memo_get_doc (p, db, key, &memo_doc))
+    return (const xmlDoc *)memo_doc;
+
+  result = db_xml_load (p, db, key, &ce);
+  if (db_xml_memo_keep (p, db, key, result, ce))
+    return result;
+  if (ce != NULL)
+    apr_pool_cleanup_register (p, ce, db_xml_entry_cleanup, apr_pool_cleanup_null);
+  else if (result != NULL)
+    apr_pool_cleanup_register (p, result, db_xml_cleanup, apr_pool_cleanup_null);
+  return result;
+}
+
+/**
+ * db_xml_invalidate: Drop any cached copy of a record.
+ * @p: Pool for temporary allocations.
+ * @db: The database.
+ * @key: The key.
+ *
+ * Stale entries are caught by the stamp check anyway; this just makes
+ * sure a record we rewrote ourselves is never served from the cache.
+ **/
+void
+virgule_db_xml_invalidate (apr_pool_t *p, Db *db, const char *key)
+{
+  DbXmlCacheEntry *ce;
+  char *fn;
+
+  if (cache_lock == NULL || key == NULL)
+    return;
+
+  fn = virgule_db_mk_filename (p, db, key);
+  apr_thread_mutex_lock (cache_lock);
+  ce = apr_hash_get (cache_table, fn, APR_HASH_KEY_STRING);
+  if (ce != NULL)
+    {
+      db_xml_entry_unlink (ce);
+      cache_stats.invalidations++;
+    }
+  apr_thread_mutex_unlock (cache_lock);
+}
+
 int
 virgule_db_xml_put (apr_pool_t *p, Db *db, const char *key, xmlDoc *val)
 {
@@ -48,6 +456,7 @@ virgule_db_xml_put (apr_pool_t *p, Db *db, const char *key, xmlDoc *val)
   xmlDocDumpFormatMemory (val, &buf, &buf_size, 1);
   status = virgule_db_put (db, key, (char *)buf, buf_size);
   xmlFree (buf);
+  virgule_db_xml_invalidate (p, db, key);
   return status;
 }
 
@@ -1,6 +1,33 @@
+typedef struct _DbXmlCacheStats DbXmlCacheStats;
+
+struct _DbXmlCacheStats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long invalidations;
+  unsigned long entries;
+  apr_size_t bytes;
+  apr_size_t max_bytes;
+};
+
+apr_status_t
+virgule_db_xml_cache_init (apr_pool_t *p);
+
+void
+virgule_db_xml_cache_set_max (apr_size_t max);
+
+void
+virgule_db_xml_cache_get_stats (DbXmlCacheStats *stats);
+
 xmlDoc *
 virgule_db_xml_get (apr_pool_t *p, Db *db, const char *key);
 
+const xmlDoc *
+virgule_db_xml_get_ro (apr_pool_t *p, Db *db, const char *key);
+
+void
+virgule_db_xml_invalidate (apr_pool_t *p, Db *db, const char *key);
+
 int
 virgule_db_xml_put (apr_pool_t *p, Db *db, const char *key, xmlDoc *val);
 
@@ -1,5 +1,7 @@
 /* A module for managing diaries. */
 
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <apr.h>
@@ -153,8 +155,7 @@ virgule_diary_entry_render (VirguleReq *vr, const char *u, int n, EigenVecEl *ev
       virgule_buffer_puts (b, "<div class=\"content\">\n");
       if (title)
         virgule_buffer_printf (b, "<p><b>%s</b></p>\n", title);
-      if (strcmp (virgule_req_get_tmetric_level (vr, u),
-         virgule_cert_level_to_name (vr, CERT_LEVEL_NONE)) == 0)
+      if (virgule_req_get_tmetric_cert_level (vr, u) == CERT_LEVEL_NONE)
         virgule_buffer_puts (b, virgule_add_nofollow (vr, contents_nice));
       else
         virgule_buffer_puts (b, contents_nice);
@@ -318,6 +319,298 @@ diary_preview_serve (VirguleReq *vr)
 }
 
 
+/* The diary index, acct/<u>/diaryindex, lets the aggregator find
+   entries by feed id or feed post time without parsing them. It is a
+   binary record: a DiaryIndexHeader, a DiaryIndexEntry for each entry
+   number, then the entries' feed id hashes and feed post times, each
+   sorted with the newest entry first among equal keys. Numbers are in
+   host order. The index is updated whenever an entry is stored, and
+   rebuilt from the entries if it is missing or doesn't cover them. */
+#define DIARY_INDEX_MAGIC "DIX1"
+
+#define DIARY_INDEX_PRESENT 1
+#define DIARY_INDEX_ID 2
+#define DIARY_INDEX_FEED 4
+
+typedef struct {
+  char magic[4];
+  apr_uint32_t n;            /* number of entries, the max entry plus one */
+  apr_uint32_t n_ids;
+  apr_uint32_t n_times;
+  apr_int64_t latest_feed;   /* post time of the newest syndicated entry */
+} DiaryIndexHeader;
+
+typedef struct {
+  apr_int64_t date;
+  apr_int64_t feedposttime;
+  apr_uint32_t id_hash;
+  apr_uint32_t title_hash;
+  apr_uint32_t flags;
+  apr_uint32_t pad;
+} DiaryIndexEntry;
+
+typedef struct {
+  apr_uint32_t hash;
+  apr_int32_t entry;
+} DiaryIndexId;
+
+typedef struct {
+  apr_int64_t time;
+  apr_int32_t entry;
+  apr_int32_t pad;
+} DiaryIndexTime;
+
+typedef struct {
+  DiaryIndexHeader h;
+  DiaryIndexEntry *entries;
+  DiaryIndexId *ids;
+  DiaryIndexTime *times;
+} DiaryIndex;
+
+/* FNV-1a, so hashes are the same from run to run. */
+static apr_uint32_t
+diary_index_hash (const char *s)
+{
+  apr_uint32_t h = 2166136261U;
+
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619U;
+  return h;
+}
+
+static int
+diary_index_id_cmp (const void *a, const void *b)
+{
+  const DiaryIndexId *ia = a, *ib = b;
+
+  if (ia->hash != ib->hash)
+    return ia->hash < ib->hash ? -1 : 1;
+  return ib->entry - ia->entry;
+}
+
+static int
+diary_index_time_cmp (const void *a, const void *b)
+{
+  const DiaryIndexTime *ta = a, *tb = b;
+
+  if (ta->time != tb->time)
+    return ta->time < tb->time ? -1 : 1;
+  return tb->entry - ta->entry;
+}
+
+static char *
+diary_index_key (apr_pool_t *p, const char *u)
+{
+  return apr_psprintf (p, "acct/%s/diaryindex", u);
+}
+
+/* Fill in the index entry of a diary entry, or of a missing one if
+   @root is NULL. */
+static void
+diary_index_fill (VirguleReq *vr, DiaryIndexEntry *e, xmlNode *root)
+{
+  char *s;
+
+  memset (e, 0, sizeof (DiaryIndexEntry));
+  e->feedposttime = -1;
+  if (root == NULL)
+    return;
+  e->flags = DIARY_INDEX_PRESENT;
+  s = virgule_xml_find_child_string (root, "date", NULL);
+  if (s != NULL)
+    e->date = virgule_virgule_to_time_t (vr, s);
+  s = virgule_xml_find_child_string (root, "feedposttime", NULL);
+  if (s != NULL)
+    {
+      e->feedposttime = virgule_virgule_to_time_t (vr, s);
+      e->flags |= DIARY_INDEX_FEED;
+    }
+  s = virgule_xml_find_child_string (root, "id", NULL);
+  if (s != NULL)
+    {
+      e->id_hash = diary_index_hash (s);
+      e->flags |= DIARY_INDEX_ID;
+    }
+  s = virgule_xml_find_child_string (root, "title", NULL);
+  if (s != NULL)
+    e->title_hash = diary_index_hash (s);
+}
+
+/* Rebuild the sorted id and time arrays and the latest feed time from
+   the entries. */
+static void
+diary_index_sort (apr_pool_t *p, DiaryIndex *ix)
+{
+  int i;
+
+  ix->ids = (DiaryIndexId *)apr_palloc (p, (ix->h.n + 1) *
+					sizeof (DiaryIndexId));
+  ix->times = (DiaryIndexTime *)apr_pcalloc (p, (ix->h.n + 1) *
+					     sizeof (DiaryIndexTime));
+  ix->h.n_ids = 0;
+  ix->h.n_times = 0;
+  ix->h.latest_feed = 0;
+  for (i = 0; i < (int)ix->h.n; i++)
+    {
+      DiaryIndexEntry *e = &ix->entries[i];
+
+      if (e->flags & DIARY_INDEX_ID)
+	{
+	  ix->ids[ix->h.n_ids].hash = e->id_hash;
+	  ix->ids[ix->h.n_ids++].entry = i;
+	}
+      if (e->flags & DIARY_INDEX_FEED)
+	{
+	  ix->times[ix->h.n_times].time = e->feedposttime;
+	  ix->times[ix->h.n_times++].entry = i;
+	  ix->h.latest_feed = e->feedposttime;
+	}
+    }
+  qsort (ix->ids, ix->h.n_ids, sizeof (DiaryIndexId), diary_index_id_cmp);
+  qsort (ix->times, ix->h.n_times, sizeof (DiaryIndexTime),
+	 diary_index_time_cmp);
+}
+
+static int
+diary_index_store (VirguleReq *vr, const char *u, const DiaryIndex *ix)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_size_t e_size = ix->h.n * sizeof (DiaryIndexEntry);
+  apr_size_t i_size = ix->h.n_ids * sizeof (DiaryIndexId);
+  apr_size_t t_size = ix->h.n_times * sizeof (DiaryIndexTime);
+  apr_size_t size = sizeof (DiaryIndexHeader) + e_size + i_size + t_size;
+  char *buf = apr_palloc (p, size);
+  char *q = buf;
+
+  memcpy (q, &ix->h, sizeof (DiaryIndexHeader));
+  q += sizeof (DiaryIndexHeader);
+  memcpy (q, ix->entries, e_size);
+  q += e_size;
+  memcpy (q, ix->ids, i_size);
+  q += i_size;
+  memcpy (q, ix->times, t_size);
+  return virgule_db_put_p (p, vr->db, diary_index_key (p, u), buf, size);
+}
+
+/* Build the index of @u's diary from the entries, and store it. */
+static DiaryIndex *
+diary_index_build (VirguleReq *vr, const char *u)
+{
+  apr_pool_t *p = vr->r->pool;
+  DiaryIndex *ix = (DiaryIndex *)apr_palloc (p, sizeof (DiaryIndex));
+  int n, i;
+
+  n = virgule_db_dir_max (vr->db, apr_psprintf (p, "acct/%s/diary", u));
+  memset (&ix->h, 0, sizeof (DiaryIndexHeader));
+  memcpy (ix->h.magic, DIARY_INDEX_MAGIC, 4);
+  ix->h.n = n + 1;
+  ix->entries = (DiaryIndexEntry *)apr_palloc (p, (n + 1) *
+					       sizeof (DiaryIndexEntry));
+  for (i = 0; i <= n; i++)
+    {
+      char *key = apr_psprintf (p, "acct/%s/diary/_%d", u, i);
+      xmlDoc *entry = virgule_db_xml_get (p, vr->db, key);
+
+      diary_index_fill (vr, &ix->entries[i],
+			entry ? xmlDocGetRootElement (entry) : NULL);
+      virgule_db_xml_free (p, entry);
+    }
+  diary_index_sort (p, ix);
+  diary_index_store (vr, u, ix);
+  return ix;
+}
+
+/* Load the index of @u's diary; NULL if there is none or it is
+   damaged. */
+static DiaryIndex *
+diary_index_load (VirguleReq *vr, const char *u)
+{
+  apr_pool_t *p = vr->r->pool;
+  DiaryIndex *ix;
+  char *val;
+  int size;
+  apr_size_t e_size, i_size, t_size;
+
+  val = virgule_db_get_p (p, vr->db, diary_index_key (p, u), &size);
+  if (val == NULL || size < (int)sizeof (DiaryIndexHeader))
+    return NULL;
+  ix = (DiaryIndex *)apr_palloc (p, sizeof (DiaryIndex));
+  memcpy (&ix->h, val, sizeof (DiaryIndexHeader));
+  if (memcmp (ix->h.magic, DIARY_INDEX_MAGIC, 4) ||
+      ix->h.n > (apr_uint32_t)size || ix->h.n_ids > ix->h.n ||
+      ix->h.n_times > ix->h.n)
+    return NULL;
+  e_size = ix->h.n * sizeof (DiaryIndexEntry);
+  i_size = ix->h.n_ids * sizeof (DiaryIndexId);
+  t_size = ix->h.n_times * sizeof (DiaryIndexTime);
+  if (sizeof (DiaryIndexHeader) + e_size + i_size + t_size != (apr_size_t)size)
+    return NULL;
+
+  /* copied, as the record need not be aligned */
+  ix->entries = (DiaryIndexEntry *)apr_palloc (p, e_size + 1);
+  ix->ids = (DiaryIndexId *)apr_palloc (p, i_size + 1);
+  ix->times = (DiaryIndexTime *)apr_palloc (p, t_size + 1);
+  val += sizeof (DiaryIndexHeader);
+  memcpy (ix->entries, val, e_size);
+  memcpy (ix->ids, val + e_size, i_size);
+  memcpy (ix->times, val + e_size + i_size, t_size);
+  return ix;
+}
+
+/* Get the index of @u's diary, rebuilding it if it doesn't cover the
+   entries. */
+static DiaryIndex *
+diary_index_get (VirguleReq *vr, const char *u)
+{
+  DiaryIndex *ix = diary_index_load (vr, u);
+  int n;
+
+  n = virgule_db_dir_max (vr->db, apr_psprintf (vr->r->pool, "acct/%s/diary",
+						u));
+  if (ix == NULL || (int)ix->h.n != n + 1)
+    ix = diary_index_build (vr, u);
+  return ix;
+}
+
+/* Update the index after entry @n of @u's diary was stored. */
+static void
+diary_index_update (VirguleReq *vr, const char *u, int n, xmlNode *root)
+{
+  apr_pool_t *p = vr->r->pool;
+  DiaryIndex *ix = diary_index_load (vr, u);
+
+  if (n < 0)
+    return;
+  if (ix == NULL || n > (int)ix->h.n)
+    {
+      /* missing, or entries were stored without updating it */
+      diary_index_build (vr, u);
+      return;
+    }
+  if (n == (int)ix->h.n)
+    {
+      DiaryIndexEntry *entries;
+
+      entries = (DiaryIndexEntry *)apr_palloc (p, (n + 1) *
+					       sizeof (DiaryIndexEntry));
+      memcpy (entries, ix->entries, n * sizeof (DiaryIndexEntry));
+      ix->entries = entries;
+      ix->h.n = n + 1;
+    }
+  diary_index_fill (vr, &ix->entries[n], root);
+  diary_index_sort (p, ix);
+  diary_index_store (vr, u, ix);
+}
+
+/* The entry number at the end of a diary entry key, "_N". */
+static int
+diary_key_entry (const char *key)
+{
+  const char *num = key ? strrchr (key, '_') : NULL;
+
+  return num ? atoi (num + 1) : -1;
+}
+
 /**
  * virgule_diary_store_feed_item - Store a diary entry based on the contents
  * of the passed feed item. This will store a couple of extra elements in
@@ -334,13 +627,14 @@ virgule_diary_store_feed_item (VirguleReq *vr, xmlChar *user, FeedItem *item)
   const char *diary, *key;
   char *str;
   int format_type = 1;
+  int n, status;
   xmlDoc *entry_doc;
   xmlNode *root, *tree;
 //  xmlOutputBuffer *xbuf;
   
   diary = apr_psprintf (vr->r->pool, "acct/%s/diary", (char *)user);
-  key = apr_psprintf (vr->r->pool, "%s/_%d", 
-                      diary, virgule_db_dir_max (vr->db, diary) + 1);
+  n = virgule_db_dir_max (vr->db, diary) + 1;
+  key = apr_psprintf (vr->r->pool, "%s/_%d", diary, n);
   
   entry_doc = virgule_db_xml_doc_new (vr->r->pool);
   root = xmlNewDocNode (entry_doc, NULL, (xmlChar *)"entry", NULL);
@@ -369,48 +663,38 @@ virgule_diary_store_feed_item (VirguleReq *vr, xmlChar *user, FeedItem *item)
 
   virgule_buffer_printf (vr->b, "<br />Posted entry: [%s]", virgule_time_t_to_iso(vr,item->post_time));
 
-  return virgule_db_xml_put (vr->r->pool, vr->db, key, entry_doc);
+  status = virgule_db_xml_put (vr->r->pool, vr->db, key, entry_doc);
+  if (status == 0)
+    diary_index_update (vr, (char *)user, n, root);
+  return status;
 }
 
 
 /**
  * find_entry_by_feedposttime - Search for an entry that has a matching
- * feedposttime field. Start with the most recent entry and search
- * backwards to minimize search time.
+ * feedposttime field, using the diary index. The most recent matching
+ * entry is returned.
  **/
 static char *
 find_entry_by_feedposttime (VirguleReq *vr, xmlChar *user, time_t posttime)
 {
-  int n, i;
-  time_t ptime;
-  char *key = NULL;
-  char *diary = NULL;
-  char *feedposttime = NULL;
-  xmlDoc *entry = NULL;
-  xmlNode *root = NULL;
-
-  diary = apr_psprintf (vr->r->pool, "acct/%s/diary", (char *)user);
-  n = virgule_db_dir_max (vr->db, diary);
+  DiaryIndex *ix = diary_index_get (vr, (char *)user);
+  int lo = 0, hi = ix->h.n_times;
 
-  for (i = n; i >= 0; i--)
+  while (lo < hi)
     {
-      key = apr_psprintf (vr->r->pool, "acct/%s/diary/_%d", (char *)user, i);
-      entry = virgule_db_xml_get (vr->r->pool, vr->db, key);
-      if (entry != NULL)
-        {
-	  root = xmlDocGetRootElement (entry);
-	  if (root == NULL)
-	    continue;
-	  feedposttime = virgule_xml_find_child_string (root, "feedposttime", NULL);
-	  if (feedposttime == NULL)
-	    continue;
-	  ptime = virgule_virgule_to_time_t (vr, feedposttime);
-	  if (posttime == ptime)
-	    return key;
-	}
+      int mid = (lo + hi) / 2;
+
+      if (ix->times[mid].time < posttime)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
-    
-  return NULL;
+  if (lo == (int)ix->h.n_times || ix->times[lo].time != posttime)
+    return NULL;
+
+  return apr_psprintf (vr->r->pool, "acct/%s/diary/_%d", (char *)user,
+		       ix->times[lo].entry);
 }
 
 
@@ -427,6 +711,7 @@ virgule_diary_update_feed_item (VirguleReq *vr, xmlChar *user, FeedItem *item, i
   char *key = NULL;
   char *feedupdatetime = NULL;
   time_t utime;
+  int status;
   xmlNode *root, *tmpNode;
   xmlDoc *entry;
 
@@ -470,7 +755,10 @@ virgule_diary_update_feed_item (VirguleReq *vr, xmlChar *user, FeedItem *item, i
   
   virgule_buffer_printf (vr->b, "<br />Updated entry: [%s]", virgule_time_t_to_iso(vr,item->post_time));
 
-  return virgule_db_xml_put (vr->r->pool, vr->db, key, entry);
+  status = virgule_db_xml_put (vr->r->pool, vr->db, key, entry);
+  if (status == 0)
+    diary_index_update (vr, (char *)user, diary_key_entry (key), root);
+  return status;
 }
 
 
@@ -487,6 +775,7 @@ virgule_diary_store_entry (VirguleReq *vr, const char *key, const char *entry)
   const char *date = virgule_iso_now (p);
   xmlDoc *entry_doc;
   xmlNode *root, *tree;
+  int status;
 
   /* read the old entry */
   entry_doc = virgule_db_xml_get (p, vr->db, key);
@@ -501,8 +790,9 @@ virgule_diary_store_entry (VirguleReq *vr, const char *key, const char *entry)
       entry_doc->xmlRootNode = root;
       tree = xmlNewChild (root, NULL, (xmlChar *)"date", (xmlChar *)date);
       xmlNewChild (root, NULL, (xmlChar *)"format", (xmlChar *)"1");
-      virgule_add_recent (p, vr->db, "recent/diary.xml", vr->u, 100,
-		  vr->priv->recentlog_as_posted);
+      virgule_add_recent_entry (p, vr->db, "recent/diary", vr->u,
+				diary_key_entry (key), 100,
+				vr->priv->recentlog_as_posted);
     }
   else
     {
@@ -517,7 +807,10 @@ virgule_diary_store_entry (VirguleReq *vr, const char *key, const char *entry)
     }
 
   /* write the entry back to the data store */
-  return virgule_db_xml_put (p, vr->db, key, entry_doc);    
+  status = virgule_db_xml_put (p, vr->db, key, entry_doc);
+  if (status == 0)
+    diary_index_update (vr, vr->u, diary_key_entry (key), root);
+  return status;
 }
 
     
@@ -844,79 +1137,66 @@ virgule_diary_rss_export (VirguleReq *vr, xmlNode *root, char *u)
 /**
  * virgule_diary_latest_feed_entry - return the Unix time_t value of the most
  * recent syndicated diary entry for the specified user. If the user has no 
- * diary entries yet, a value of 0 is returned. This function should only be
- * called for valid usernames. It does not validate the username.
+ * syndicated diary entries yet, a value of 0 is returned. This function
+ * should only be called for valid usernames. It does not validate the
+ * username.
  *
  * Because some users post entries locally and use the syndication feature,
  * it's possible that the most recent entry doesn't have a feedposttime tag.
- * So, we search back a maximum of 20 entries looking for one.
+ * The diary index records the newest one that does.
  **/
 time_t
 virgule_diary_latest_feed_entry (VirguleReq *vr, xmlChar *u)
 {
-  int i, n;
-  char *diary, *key;
-  xmlDoc *entry = NULL;
-  xmlNode *date = NULL;
-  time_t result;
-  
-  diary = apr_psprintf (vr->r->pool, "acct/%s/diary", (char *)u);
-  n = virgule_db_dir_max (vr->db, diary);
-  if (n < 0)
-    return 0;
-
-  for (result = 0, i = n; result == 0 && i > n - 20; i--)
-    {
-      key = apr_psprintf (vr->r->pool, "acct/%s/diary/_%d", (char *)u, i);
-      entry = virgule_db_xml_get (vr->r->pool, vr->db, key);
-      if (entry == NULL)
-        continue;
-
-      date = virgule_xml_find_child (entry->xmlRootNode, "feedposttime");
-      if (date == NULL)
-        continue;
-
-      result = virgule_iso_to_time_t (virgule_xml_get_string_contents (date));
-    }
-
-  return result;
+  return diary_index_get (vr, (char *)u)->h.latest_feed;
 }
 
 
 /**
  * Search for the specified entry ID value. If no match is found, the return
  * value is -1. If a match is found, the diary entry number is returned.
+ * Entries whose ID hash matches in the diary index are checked newest
+ * first.
  */
 int
 virgule_diary_entry_id_exists(VirguleReq *vr, xmlChar *u, char *id)
 {
-  int i, n;
-  int e = -1;
-  char *diary, *key, *eid;
+  DiaryIndex *ix;
+  apr_uint32_t hash;
+  int lo, hi;
+  char *key, *eid;
   xmlDoc *entry = NULL;
 
   if (id == NULL)
     return -1;
 
-  diary = apr_psprintf (vr->r->pool, "acct/%s/diary", (char *)u);
-  n = virgule_db_dir_max (vr->db, diary);
-  if (n < 0)
-    return -1;
+  ix = diary_index_get (vr, (char *)u);
+  hash = diary_index_hash (id);
+  lo = 0;
+  hi = ix->h.n_ids;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+
+      if (ix->ids[mid].hash < hash)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
 
-  for (i = n; e < 0 && i >= 0; i--)
+  for (; lo < (int)ix->h.n_ids && ix->ids[lo].hash == hash; lo++)
     {
-      key = apr_psprintf (vr->r->pool, "acct/%s/diary/_%d", (char *)u, i);
+      key = apr_psprintf (vr->r->pool, "acct/%s/diary/_%d", (char *)u,
+			  ix->ids[lo].entry);
       entry = virgule_db_xml_get (vr->r->pool, vr->db, key);
       if (entry == NULL)
         continue;
 
       eid = virgule_xml_find_child_string (entry->xmlRootNode, "id", NULL);
-      if (eid == NULL)
-        continue;
-
-      if (strcmp (eid, id) == 0)
-        e = i;
+      if (eid != NULL && strcmp (eid, id) == 0)
+        return ix->ids[lo].entry;
     }
     
-  return e;
+  return -1;
 }
+
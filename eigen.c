@@ -3,10 +3,15 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
 
 #include <apr.h>
 #include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_file_io.h>
+#include <apr_thread_proc.h>
 #include <httpd.h>
+#include <http_log.h>
 
 #include <libxml/tree.h>
 
@@ -20,16 +25,58 @@
 #include "util.h"
 #include "acct_maint.h"
 #include "certs.h"
+#include "certgraph.h"
 #include "eigen.h"
 
-/* On-disk format is one entry per line, of format:
+#define EIGEN_DAMPING 0.95
+
+/* The old text format is one entry per line, of format:
    timestamp rating subj
+   for eigen/local records, and
+   confidence rating rating_sq subj
+   for eigen/vec records.
+
+   Records are now written in a binary format: an EigenBinHeader,
+   then an array of EigenLocalBin or EigenVecBin sorted by subject,
+   then the strings they refer to, each terminated by a nul. String
+   offsets are from the start of the strings. Numbers are in host
+   byte order. Both formats are read.
 */
 typedef struct {
   double rating;
   const char *timestamp;
 } EigenLocal;
 
+#define EIGEN_LOCAL_MAGIC "EGL1"
+#define EIGEN_VEC_MAGIC "EGV1"
+
+typedef struct {
+  char magic[4];
+  apr_uint32_t n;
+} EigenBinHeader;
+
+typedef struct {
+  apr_uint32_t subj;
+  apr_uint32_t timestamp;
+  double rating;
+} EigenLocalBin;
+
+typedef struct {
+  apr_uint32_t subj;
+  apr_uint32_t pad;
+  double confidence;
+  double rating;
+  double rating_sq;
+} EigenVecBin;
+
+struct _EigenVec {
+  const char *entries;   /* binary record: EigenVecBin array, unaligned */
+  int n;
+  const char *strings;
+  apr_uint32_t strings_size;
+  HashTable *ht;         /* text record */
+};
+
 static int
 parse3 (char *val, int val_size, int i, char **p0, char **p1, char **p2)
 {
@@ -80,18 +127,127 @@ parse4 (char *val, int val_size, int i,
   return i;
 }
 
+/* Check for a binary record; return the number of entries, or -1 if
+   @val is not one. */
+static int
+eigen_bin_check (const char *val, int val_size, const char *magic,
+		 size_t entry_size, const char **p_strings,
+		 apr_uint32_t *p_strings_size)
+{
+  EigenBinHeader h;
+  size_t head;
+
+  if (val == NULL || val_size < (int)sizeof (EigenBinHeader))
+    return -1;
+  memcpy (&h, val, sizeof (EigenBinHeader));
+  if (memcmp (h.magic, magic, 4))
+    return -1;
+  head = sizeof (EigenBinHeader) + (size_t)h.n * entry_size;
+  if (h.n > (apr_uint32_t)val_size || head > (size_t)val_size)
+    return -1;
+  if (head < (size_t)val_size && val[val_size - 1] != 0)
+    return -1;
+  *p_strings = val + head;
+  *p_strings_size = val_size - head;
+  return h.n;
+}
+
+static int
+eigen_strcmp (const void *a, const void *b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* The keys of @ht, sorted. */
+static const char **
+eigen_sorted_keys (apr_pool_t *p, HashTable *ht, int *p_n)
+{
+  apr_array_header_t *keys;
+  HashTableIter *iter;
+  const char *key;
+  void *val;
+
+  keys = apr_array_make (p, virgule_hash_table_count (ht) + 1,
+			 sizeof (char *));
+  for (iter = virgule_hash_table_iter (p, ht);
+       virgule_hash_table_iter_get (iter, &key, &val);
+       virgule_hash_table_iter_next (iter))
+    *(const char **)apr_array_push (keys) = key;
+  qsort (keys->elts, keys->nelts, sizeof (char *), eigen_strcmp);
+  *p_n = keys->nelts;
+  return (const char **)keys->elts;
+}
+
+/* Pack a vector into a binary record; @subj must be sorted. */
+static char *
+eigen_vec_pack (apr_pool_t *p, int n, const char **subj,
+		const EigenVecEl *els, int *p_size)
+{
+  EigenBinHeader h;
+  EigenVecBin e;
+  size_t strings_size = 0, len, head;
+  char *buf;
+  int i;
+
+  for (i = 0; i < n; i++)
+    strings_size += strlen (subj[i]) + 1;
+  head = sizeof (EigenBinHeader) + n * sizeof (EigenVecBin);
+  buf = apr_palloc (p, head + strings_size + 1);
+
+  memcpy (h.magic, EIGEN_VEC_MAGIC, 4);
+  h.n = n;
+  memcpy (buf, &h, sizeof (EigenBinHeader));
+  strings_size = 0;
+  memset (&e, 0, sizeof (EigenVecBin));
+  for (i = 0; i < n; i++)
+    {
+      e.subj = strings_size;
+      e.confidence = els[i].confidence;
+      e.rating = els[i].rating;
+      e.rating_sq = els[i].rating_sq;
+      memcpy (buf + sizeof (EigenBinHeader) + i * sizeof (EigenVecBin), &e,
+	      sizeof (EigenVecBin));
+      len = strlen (subj[i]) + 1;
+      memcpy (buf + head + strings_size, subj[i], len);
+      strings_size += len;
+    }
+  *p_size = head + strings_size;
+  return buf;
+}
+
 HashTable *
 virgule_eigen_local_load (apr_pool_t *p, VirguleReq *vr, const char *dbkey)
 {
   HashTable *result;
   int val_size;
   char *val = virgule_db_get_p (p, vr->db, dbkey, &val_size);
-  int i;
+  const char *strings;
+  apr_uint32_t strings_size;
+  int i, n;
 
   if (val == NULL)
     return NULL;
 
   result = virgule_hash_table_new (p);
+  n = eigen_bin_check (val, val_size, EIGEN_LOCAL_MAGIC,
+		       sizeof (EigenLocalBin), &strings, &strings_size);
+  virgule_hash_table_reserve (p, result, n);
+  for (i = 0; i < n; i++)
+    {
+      EigenLocal *el = (EigenLocal *)apr_palloc (p, sizeof(EigenLocal));
+      EigenLocalBin e;
+
+      memcpy (&e, val + sizeof (EigenBinHeader) + i * sizeof (EigenLocalBin),
+	      sizeof (EigenLocalBin));
+      if (e.subj >= strings_size || e.timestamp >= strings_size)
+	continue;
+      el->rating = e.rating;
+      el->timestamp = strings + e.timestamp;
+      virgule_hash_table_set (p, result, strings + e.subj, (void *)el);
+    }
+  if (n >= 0)
+    return result;
+
   for (i = 0; i < val_size;)
     {
       EigenLocal *el = (EigenLocal *)apr_palloc (p, sizeof(EigenLocal));
@@ -107,26 +263,54 @@ virgule_eigen_local_load (apr_pool_t *p, VirguleReq *vr, const char *dbkey)
   return result;
 }
 
-void
-virgule_eigen_local_store (VirguleReq *vr, HashTable *ht, const char *dbkey)
+static void
+eigen_local_store (apr_pool_t *p, VirguleReq *vr, HashTable *ht,
+		   const char *dbkey)
 {
-  apr_pool_t *p = vr->r->pool;
-  HashTableIter *iter;
-  const char *key;
-  void *val;
-  char *bigbuf;
-  Buffer *b = virgule_buffer_new (p);
+  EigenBinHeader h;
+  EigenLocalBin e;
+  const char **keys;
+  size_t strings_size = 0, len, head;
+  char *buf;
+  int i, n;
 
-  /* todo: we probably want a subpool */
-  for (iter = virgule_hash_table_iter (p, ht);
-       virgule_hash_table_iter_get (iter, &key, &val);
-       virgule_hash_table_iter_next (iter))
+  keys = eigen_sorted_keys (p, ht, &n);
+  for (i = 0; i < n; i++)
+    {
+      EigenLocal *el = virgule_hash_table_get (ht, keys[i]);
+
+      strings_size += strlen (keys[i]) + strlen (el->timestamp) + 2;
+    }
+  head = sizeof (EigenBinHeader) + n * sizeof (EigenLocalBin);
+  buf = apr_palloc (p, head + strings_size + 1);
+
+  memcpy (h.magic, EIGEN_LOCAL_MAGIC, 4);
+  h.n = n;
+  memcpy (buf, &h, sizeof (EigenBinHeader));
+  strings_size = 0;
+  for (i = 0; i < n; i++)
     {
-      EigenLocal *el = (EigenLocal *)val;
-      virgule_buffer_printf (b, "%s %.2g %s\n", el->timestamp, el->rating, key);
+      EigenLocal *el = virgule_hash_table_get (ht, keys[i]);
+
+      e.subj = strings_size;
+      len = strlen (keys[i]) + 1;
+      memcpy (buf + head + strings_size, keys[i], len);
+      strings_size += len;
+      e.timestamp = strings_size;
+      len = strlen (el->timestamp) + 1;
+      memcpy (buf + head + strings_size, el->timestamp, len);
+      strings_size += len;
+      e.rating = el->rating;
+      memcpy (buf + sizeof (EigenBinHeader) + i * sizeof (EigenLocalBin), &e,
+	      sizeof (EigenLocalBin));
     }
-  bigbuf = virgule_buffer_extract (b);
-  virgule_db_put (vr->db, dbkey, bigbuf, strlen(bigbuf));
+  virgule_db_put_p (p, vr->db, dbkey, buf, head + strings_size);
+}
+
+void
+virgule_eigen_local_store (VirguleReq *vr, HashTable *ht, const char *dbkey)
+{
+  eigen_local_store (vr->r->pool, vr, ht, dbkey);
 }
 
 int
@@ -149,7 +333,7 @@ virgule_eigen_set_local (VirguleReq *vr, const char *subj, double rating)
   virgule_hash_table_set (p, elt, subj, (void *)el);
 
   virgule_eigen_local_store (vr, elt, dbkey);
-  return 0;
+  return virgule_eigen_mark_dirty (vr, vr->u);
 }
 
 HashTable *
@@ -158,13 +342,35 @@ virgule_eigen_vec_load (apr_pool_t *p, VirguleReq *vr, const char *dbkey)
   HashTable *result;
   int val_size;
   char *val = virgule_db_get_p (p, vr->db, dbkey, &val_size);
-  int i;
+  const char *strings;
+  apr_uint32_t strings_size;
+  int i, n;
 
   result = virgule_hash_table_new (p);
 
   if (val == NULL)
     return result;
 
+  n = eigen_bin_check (val, val_size, EIGEN_VEC_MAGIC, sizeof (EigenVecBin),
+		       &strings, &strings_size);
+  virgule_hash_table_reserve (p, result, n);
+  for (i = 0; i < n; i++)
+    {
+      EigenVecEl *eve = (EigenVecEl *)apr_palloc (p, sizeof(EigenVecEl));
+      EigenVecBin e;
+
+      memcpy (&e, val + sizeof (EigenBinHeader) + i * sizeof (EigenVecBin),
+	      sizeof (EigenVecBin));
+      if (e.subj >= strings_size)
+	continue;
+      eve->confidence = e.confidence;
+      eve->rating = e.rating;
+      eve->rating_sq = e.rating_sq;
+      virgule_hash_table_set (p, result, strings + e.subj, (void *)eve);
+    }
+  if (n >= 0)
+    return result;
+
   for (i = 0; i < val_size;)
     {
       EigenVecEl *eve = (EigenVecEl *)apr_palloc (p, sizeof(EigenVecEl));
@@ -182,31 +388,223 @@ virgule_eigen_vec_load (apr_pool_t *p, VirguleReq *vr, const char *dbkey)
   return result;
 }
 
+/**
+ * virgule_eigen_vec_open: Open a user's ratings vector for lookups.
+ * @p: Pool for the vector.
+ * @vr: The #VirguleReq context.
+ * @u: The user.
+ *
+ * A binary record is looked up in place; an old text record is
+ * parsed into a table.
+ *
+ * Return value: The vector, or NULL if the user has none.
+ **/
+EigenVec *
+virgule_eigen_vec_open (apr_pool_t *p, VirguleReq *vr, const char *u)
+{
+  EigenVec *ev;
+  char *dbkey = apr_pstrcat (p, "eigen/vec/", u, NULL);
+  int val_size;
+  char *val = virgule_db_get_p (p, vr->db, dbkey, &val_size);
+
+  if (val == NULL)
+    return NULL;
+
+  ev = (EigenVec *)apr_pcalloc (p, sizeof (EigenVec));
+  ev->n = eigen_bin_check (val, val_size, EIGEN_VEC_MAGIC,
+			   sizeof (EigenVecBin), &ev->strings,
+			   &ev->strings_size);
+  if (ev->n >= 0)
+    ev->entries = val + sizeof (EigenBinHeader);
+  else
+    ev->ht = virgule_eigen_vec_load (p, vr, dbkey);
+  return ev;
+}
+
+/* Binary search a binary record from entry @lo on. Sets @p_pos to
+   where @subj is or would be. */
+static int
+eigen_vec_search (const EigenVec *ev, const char *subj, int lo, int *p_pos,
+		  EigenVecEl *result)
+{
+  int hi = ev->n;
+
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      EigenVecBin e;
+      int cmp;
+
+      memcpy (&e, ev->entries + mid * sizeof (EigenVecBin),
+	      sizeof (EigenVecBin));
+      if (e.subj >= ev->strings_size)
+	break;
+      cmp = strcmp (subj, ev->strings + e.subj);
+      if (cmp == 0)
+	{
+	  result->confidence = e.confidence;
+	  result->rating = e.rating;
+	  result->rating_sq = e.rating_sq;
+	  *p_pos = mid;
+	  return 1;
+	}
+      if (cmp < 0)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+  *p_pos = lo;
+  return 0;
+}
+
+/**
+ * virgule_eigen_vec_lookup: Look up one subject in a ratings vector.
+ * @ev: The vector, from virgule_eigen_vec_open.
+ * @subj: The subject.
+ * @result: Where to store the subject's entry.
+ *
+ * Return value: 1 if the subject was found, 0 if not.
+ **/
+int
+virgule_eigen_vec_lookup (const EigenVec *ev, const char *subj,
+			  EigenVecEl *result)
+{
+  int pos;
+
+  if (ev->ht != NULL)
+    {
+      EigenVecEl *eve = virgule_hash_table_get (ev->ht, subj);
+
+      if (eve == NULL)
+	return 0;
+      *result = *eve;
+      return 1;
+    }
+
+  return eigen_vec_search (ev, subj, 0, &pos, result);
+}
+
+static int
+eigen_strpcmp (const void *a, const void *b)
+{
+  return strcmp (**(const char ***)a, **(const char ***)b);
+}
 
 /**
- * rsr notes: Couldn't we use an APR sprintf string allocation function
- * instead of all the overhead of creating a temporary virgule buffer here?
+ * virgule_eigen_vec_lookup_many: Look up a set of subjects in a user's
+ * ratings vector.
+ * @p: Pool for the results.
+ * @vr: The #VirguleReq context.
+ * @u: The user.
+ * @keys: NULL-terminated array of subjects.
+ *
+ * Only the requested subjects are read: they are looked up in sorted
+ * order, each search starting where the last one ended.
+ *
+ * Return value: An array parallel to @keys of the entries found, NULL
+ * where the subject is not in the vector, or NULL if the user has no
+ * vector.
  **/
+EigenVecEl **
+virgule_eigen_vec_lookup_many (apr_pool_t *p, VirguleReq *vr, const char *u,
+			       const char **keys)
+{
+  EigenVec *ev = virgule_eigen_vec_open (p, vr, u);
+  EigenVecEl **result;
+  const char ***order;
+  EigenVecEl el;
+  int i, n, pos = 0;
+
+  if (ev == NULL)
+    return NULL;
+
+  for (n = 0; keys[n]; n++)
+    ;
+  result = (EigenVecEl **)apr_pcalloc (p, (n + 1) * sizeof (EigenVecEl *));
+  order = (const char ***)apr_palloc (p, (n + 1) * sizeof (const char **));
+  for (i = 0; i < n; i++)
+    order[i] = &keys[i];
+  if (ev->ht == NULL)
+    qsort (order, n, sizeof (const char **), eigen_strpcmp);
+
+  for (i = 0; i < n; i++)
+    {
+      int found;
+
+      if (ev->ht != NULL)
+	found = virgule_eigen_vec_lookup (ev, *order[i], &el);
+      else
+	found = eigen_vec_search (ev, *order[i], pos, &pos, &el);
+      if (found)
+	result[order[i] - keys] = apr_pmemdup (p, &el, sizeof (EigenVecEl));
+    }
+  return result;
+}
+
 static void
 eigen_vec_store (apr_pool_t *p, VirguleReq *vr, HashTable *ht, const char *dbkey)
 {
-  HashTableIter *iter;
-  const char *key;
-  void *val;
-  char *bigbuf;
-  Buffer *b = virgule_buffer_new (p);
+  const char **keys;
+  EigenVecEl *els;
+  char *buf;
+  int i, n, size;
 
-  /* todo: we probably want a subpool */
-  for (iter = virgule_hash_table_iter (p, ht);
-       virgule_hash_table_iter_get (iter, &key, &val);
-       virgule_hash_table_iter_next (iter))
+  keys = eigen_sorted_keys (p, ht, &n);
+  els = (EigenVecEl *)apr_palloc (p, (n + 1) * sizeof (EigenVecEl));
+  for (i = 0; i < n; i++)
+    els[i] = *(EigenVecEl *)virgule_hash_table_get (ht, keys[i]);
+  buf = eigen_vec_pack (p, n, keys, els, &size);
+  virgule_db_put_p (p, vr->db, dbkey, buf, size);
+}
+
+/**
+ * virgule_eigen_convert: Convert a ratings record to the binary format.
+ * @vr: The #VirguleReq context.
+ * @dbkey: The eigen/vec or eigen/local record.
+ *
+ * Return value: 1 if the record was converted, 0 if it was already
+ * binary or does not exist, -1 if @dbkey is not a ratings record.
+ **/
+int
+virgule_eigen_convert (VirguleReq *vr, const char *dbkey)
+{
+  apr_pool_t *p;
+  HashTable *ht;
+  const char *strings;
+  apr_uint32_t strings_size;
+  int is_vec, val_size;
+  char *val;
+
+  if (!strncmp (dbkey, "eigen/vec/", 10))
+    is_vec = 1;
+  else if (!strncmp (dbkey, "eigen/local/", 12))
+    is_vec = 0;
+  else
+    return -1;
+
+  apr_pool_create (&p, vr->r->pool);
+  val = virgule_db_get_p (p, vr->db, dbkey, &val_size);
+  if (val == NULL ||
+      eigen_bin_check (val, val_size, is_vec ? EIGEN_VEC_MAGIC : EIGEN_LOCAL_MAGIC,
+		       is_vec ? sizeof (EigenVecBin) : sizeof (EigenLocalBin),
+		       &strings, &strings_size) >= 0)
+    {
+      apr_pool_destroy (p);
+      return 0;
+    }
+
+  if (is_vec)
+    {
+      ht = virgule_eigen_vec_load (p, vr, dbkey);
+      eigen_vec_store (p, vr, ht, dbkey);
+    }
+  else
     {
-      EigenVecEl *eve = (EigenVecEl *)val;
-      virgule_buffer_printf (b, "%.3g %.5g %.5g %s\n",
-		     eve->confidence, eve->rating, eve->rating_sq, key);
+      ht = virgule_eigen_local_load (p, vr, dbkey);
+      eigen_local_store (p, vr, ht, dbkey);
     }
-  bigbuf = virgule_buffer_extract (b);
-  virgule_db_put_p (p, vr->db, dbkey, bigbuf, strlen(bigbuf));
+  apr_pool_destroy (p);
+  return 1;
 }
 
 /* Add in a vector from another user. */
@@ -245,7 +643,7 @@ eigen_add_in (apr_pool_t *p, VirguleReq *vr, HashTable *ev, const char *u)
 int
 virgule_eigen_crank (apr_pool_t *p, VirguleReq *vr, const char *u)
 {
-  double damping = 0.95;
+  double damping = EIGEN_DAMPING;
   char *dbkey;
   xmlDoc *profile;
   xmlNode *tree;
@@ -324,6 +722,956 @@ virgule_eigen_crank (apr_pool_t *p, VirguleReq *vr, const char *u)
   return 0;
 }
 
+/* The cert graph as it stands, from the stored graph and its change
+   log if there is one. Unless @wait, NULL if the log is being cut or
+   no graph has been stored, rather than waiting for the cut or
+   building the graph from every profile. */
+static CertGraph *
+eigen_cert_graph (VirguleReq *vr, int wait)
+{
+  apr_file_t *lock;
+  CertGraph *g = NULL;
+
+  lock = virgule_certgraph_read_lock (vr, wait);
+  if (lock != NULL)
+    {
+      g = virgule_certgraph_load (vr);
+      if (g != NULL)
+	virgule_certgraph_apply_log (vr, g, NULL);
+      else if (wait)
+	g = virgule_certgraph_build (vr);
+      virgule_certgraph_unlock (lock);
+    }
+  else if (wait)
+    g = virgule_certgraph_build (vr);
+  return g;
+}
+
+/* Dirty set. A change to a user's local ratings is recorded as an
+   empty eigen/dirty/<user> record. virgule_eigen_update recranks the
+   marked users and the users whose vectors depend on theirs. Users it
+   had no time for are left in eigen/pending/<user> records holding
+   how much the changes reach them, so the next update carries on
+   where it stopped. */
+
+/**
+ * virgule_eigen_mark_dirty: Record that a user's local ratings changed.
+ * @vr: The #VirguleReq context.
+ * @u: The user.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_eigen_mark_dirty (VirguleReq *vr, const char *u)
+{
+  return virgule_db_put (vr->db, apr_pstrcat (vr->r->pool, "eigen/dirty/",
+					      u, NULL), "", 0);
+}
+
+/* Take the marks in @dir out of the dirty set, into @marks, a hash of
+   user to the weight the changes reach them with. A record in
+   eigen/dirty has weight 1; one in eigen/pending holds its weight. */
+static void
+eigen_take_marks (VirguleReq *vr, const char *dir, apr_hash_t *marks)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_array_header_t *users = apr_array_make (p, 16, sizeof (char *));
+  DbCursor *dbc;
+  char *u, *key, *val;
+  double *weight, w;
+  int i, size;
+
+  dbc = virgule_db_open_dir (vr->db, dir);
+  if (dbc == NULL)
+    return;
+  while ((u = virgule_db_read_dir_raw (dbc)) != NULL)
+    *(char **)apr_array_push (users) = apr_pstrdup (p, u);
+  virgule_db_close_dir (dbc);
+
+  /* users marked again from here on are cranked next time round */
+  for (i = 0; i < users->nelts; i++)
+    {
+      u = ((char **)users->elts)[i];
+      key = apr_pstrcat (p, dir, "/", u, NULL);
+      val = virgule_db_get_p (p, vr->db, key, &size);
+      virgule_db_del (vr->db, key);
+      if (val == NULL)
+	continue;
+      weight = apr_hash_get (marks, u, APR_HASH_KEY_STRING);
+      if (weight == NULL)
+	{
+	  weight = apr_pcalloc (p, sizeof (double));
+	  apr_hash_set (marks, u, APR_HASH_KEY_STRING, weight);
+	}
+      w = size > 0 ? atof (val) : 1.0;
+      if (w > *weight)
+	*weight = w;
+    }
+}
+
+/* Leave a user for the next update, as taken by eigen_take_marks. */
+static void
+eigen_put_mark (VirguleReq *vr, const char *u, double weight)
+{
+  apr_pool_t *p = vr->r->pool;
+  char *val;
+
+  if (weight >= 1.0)
+    {
+      virgule_eigen_mark_dirty (vr, u);
+      return;
+    }
+  val = apr_psprintf (p, "%.17g", weight);
+  virgule_db_put (vr->db, apr_pstrcat (p, "eigen/pending/", u, NULL),
+		  val, strlen (val));
+}
+
+/* TRUE if any user is marked in eigen/dirty. */
+static int
+eigen_dirty_any (VirguleReq *vr)
+{
+  DbCursor *dbc;
+  int result;
+
+  dbc = virgule_db_open_dir (vr->db, "eigen/dirty");
+  if (dbc == NULL)
+    return 0;
+  result = virgule_db_read_dir_raw (dbc) != NULL;
+  virgule_db_close_dir (dbc);
+  return result;
+}
+
+typedef struct {
+  int node;
+  double weight;
+} EigenDirty;
+
+static int
+eigen_dirty_compare (const void *a, const void *b)
+{
+  const EigenDirty *d1 = (const EigenDirty *)a;
+  const EigenDirty *d2 = (const EigenDirty *)b;
+
+  if (d1->weight != d2->weight)
+    return d1->weight < d2->weight ? 1 : -1;
+  return d1->node - d2->node;
+}
+
+/**
+ * eigen_invalidated: Find the vectors invalidated by local rating changes.
+ * @vr: The #VirguleReq context.
+ * @g: The cert graph.
+ * @roots: The marked users and the weights the changes reach them with.
+ * @p_n: Where to store the number of nodes returned.
+ *
+ * A change to a user's vector reaches each user certifying them
+ * scaled by the damping over the certifier's number of successors,
+ * and so on transitively. Users the change reaches with a weight
+ * below the crank tolerance are left alone.
+ *
+ * Return value: The invalidated nodes, most affected first.
+ **/
+static EigenDirty *
+eigen_invalidated (VirguleReq *vr, CertGraph *g, apr_hash_t *roots,
+		   int *p_n)
+{
+  apr_pool_t *p = vr->r->pool;
+  CertGraphEdge *edges = (CertGraphEdge *)g->edges->elts;
+  int n_nodes = g->nodes->nelts;
+  int *pred_start, *pred, *n_succ, *fill, *queue, *queued;
+  double *weight;
+  EigenDirty *result;
+  apr_hash_index_t *hi;
+  int head = 0, tail = 0, n = 0;
+  int i, u;
+
+  pred_start = apr_pcalloc (p, (n_nodes + 1) * sizeof (int));
+  n_succ = apr_pcalloc (p, (n_nodes + 1) * sizeof (int));
+  for (i = 0; i < g->edges->nelts; i++)
+    if (edges[i].level > CERT_LEVEL_NONE && edges[i].issuer != edges[i].subj)
+      {
+	pred_start[edges[i].subj + 1]++;
+	n_succ[edges[i].issuer]++;
+      }
+  for (u = 0; u < n_nodes; u++)
+    pred_start[u + 1] += pred_start[u];
+  pred = apr_palloc (p, (pred_start[n_nodes] + 1) * sizeof (int));
+  fill = apr_pcalloc (p, (n_nodes + 1) * sizeof (int));
+  for (i = 0; i < g->edges->nelts; i++)
+    if (edges[i].level > CERT_LEVEL_NONE && edges[i].issuer != edges[i].subj)
+      pred[pred_start[edges[i].subj] + fill[edges[i].subj]++] =
+	edges[i].issuer;
+
+  weight = apr_pcalloc (p, (n_nodes + 1) * sizeof (double));
+  queued = apr_pcalloc (p, (n_nodes + 1) * sizeof (int));
+  /* a node is in the queue at most once at a time; it is queued again
+     when its weight rises, so the queue is circular */
+  queue = apr_palloc (p, (n_nodes + 1) * sizeof (int));
+  for (hi = apr_hash_first (p, roots); hi; hi = apr_hash_next (hi))
+    {
+      const void *key;
+      void *val;
+      int *ix;
+
+      apr_hash_this (hi, &key, NULL, &val);
+      ix = apr_hash_get (g->node_ix, key, APR_HASH_KEY_STRING);
+      if (ix == NULL || queued[*ix])
+	continue;  /* users outside the graph are cranked by the caller */
+      weight[*ix] = *(double *)val;
+      queued[*ix] = 1;
+      queue[tail++] = *ix;
+    }
+
+  while (head != tail)
+    {
+      u = queue[head];
+      head = (head + 1) % (n_nodes + 1);
+      queued[u] = 0;
+      for (i = pred_start[u]; i < pred_start[u + 1]; i++)
+	{
+	  int v = pred[i];
+	  double w = weight[u] * EIGEN_DAMPING / n_succ[v];
+
+	  if (w <= weight[v] || w < vr->priv->eigen_tolerance)
+	    continue;
+	  weight[v] = w;
+	  if (!queued[v])
+	    {
+	      queued[v] = 1;
+	      queue[tail] = v;
+	      tail = (tail + 1) % (n_nodes + 1);
+	    }
+	}
+    }
+
+  for (u = 0; u < n_nodes; u++)
+    if (weight[u] > 0)
+      n++;
+  result = apr_palloc (p, (n + 1) * sizeof (EigenDirty));
+  for (n = 0, u = 0; u < n_nodes; u++)
+    if (weight[u] > 0)
+      {
+	result[n].node = u;
+	result[n].weight = weight[u];
+	n++;
+      }
+  qsort (result, n, sizeof (EigenDirty), eigen_dirty_compare);
+  *p_n = n;
+  return result;
+}
+
+static apr_file_t *
+eigen_lock (VirguleReq *vr, int wait)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_file_t *fd;
+
+  if (apr_file_open (&fd, apr_pstrcat (p, vr->priv->base_path,
+				       "/eigen.lock", NULL),
+		     APR_READ|APR_WRITE|APR_CREATE, APR_OS_DEFAULT,
+		     p) != APR_SUCCESS)
+    return NULL;
+  if (apr_file_lock (fd, wait ? APR_FLOCK_EXCLUSIVE
+			      : APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK)
+      != APR_SUCCESS)
+    {
+      apr_file_close (fd);
+      return NULL;
+    }
+  return fd;
+}
+
+static void
+eigen_unlock (apr_file_t *lock)
+{
+  apr_file_unlock (lock);
+  apr_file_close (lock);
+}
+
+/**
+ * virgule_eigen_update: Recrank the vectors invalidated by local rating
+ * changes.
+ * @vr: The #VirguleReq context.
+ * @max: The most vectors to recrank, 0 for no limit.
+ *
+ * Takes the users marked by virgule_eigen_mark_dirty and recranks them
+ * and the users whose vectors depend on theirs, most affected first, so
+ * each sees the vectors updated before it. Those beyond @max are left
+ * for the next update. If another update is running it returns at
+ * once; that update picks up the new marks before it finishes.
+ *
+ * With a limit, nothing is recranked while the cert graph is being
+ * updated or if none has been stored; without one, it waits for the
+ * update or builds the graph.
+ *
+ * Return value: The number of vectors recranked.
+ **/
+int
+virgule_eigen_update (VirguleReq *vr, int max)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_file_t *lock;
+  apr_hash_t *marks;
+  apr_hash_index_t *hi;
+  CertGraph *g = NULL;
+  CertGraphNode *nodes;
+  EigenDirty *dirty;
+  apr_pool_t *sp;
+  int count = 0, stop = 0;
+  int i, n;
+
+  do
+    {
+      lock = eigen_lock (vr, 0);
+      if (lock == NULL)
+	break;
+
+      while (!stop)
+	{
+	  marks = apr_hash_make (p);
+	  eigen_take_marks (vr, "eigen/dirty", marks);
+	  eigen_take_marks (vr, "eigen/pending", marks);
+	  if (apr_hash_count (marks) == 0)
+	    break;
+
+	  if (g == NULL && (g = eigen_cert_graph (vr, max <= 0)) == NULL)
+	    {
+	      for (hi = apr_hash_first (p, marks); hi; hi = apr_hash_next (hi))
+		{
+		  const void *key;
+		  void *val;
+
+		  apr_hash_this (hi, &key, NULL, &val);
+		  eigen_put_mark (vr, key, *(double *)val);
+		}
+	      stop = 1;
+	      break;
+	    }
+	  nodes = (CertGraphNode *)g->nodes->elts;
+
+	  for (hi = apr_hash_first (p, marks); hi; hi = apr_hash_next (hi))
+	    {
+	      const void *key;
+	      void *val;
+
+	      apr_hash_this (hi, &key, NULL, &val);
+	      if (apr_hash_get (g->node_ix, key, APR_HASH_KEY_STRING) != NULL)
+		continue;
+	      if (max > 0 && count >= max)
+		{
+		  eigen_put_mark (vr, key, *(double *)val);
+		  stop = 1;
+		  continue;
+		}
+	      apr_pool_create (&sp, p);
+	      if (virgule_eigen_crank (sp, vr, key) == 0)
+		count++;
+	      apr_pool_destroy (sp);
+	    }
+
+	  dirty = eigen_invalidated (vr, g, marks, &n);
+	  for (i = 0; i < n; i++)
+	    {
+	      if (!nodes[dirty[i].node].is_acct)
+		continue;
+	      if (max > 0 && count >= max)
+		{
+		  eigen_put_mark (vr, nodes[dirty[i].node].name,
+				  dirty[i].weight);
+		  stop = 1;
+		  continue;
+		}
+	      apr_pool_create (&sp, p);
+	      if (virgule_eigen_crank (sp, vr, nodes[dirty[i].node].name) == 0)
+		count++;
+	      apr_pool_destroy (sp);
+	    }
+	}
+
+      eigen_unlock (lock);
+    }
+  /* users marked after the last take but before the unlock were left
+     to us by the requests that marked them */
+  while (!stop && eigen_dirty_any (vr));
+
+  return count;
+}
+
+/* The in-memory crank. Subjects are numbered, and each account's
+   vector is an array of EigenEntry sorted by subject number. */
+typedef struct {
+  int subj;
+  double confidence;
+  double rating;
+  double rating_sq;
+} EigenEntry;
+
+typedef struct {
+  int n;
+  EigenEntry *el;
+} EigenRow;
+
+typedef struct {
+  int subj;
+  double rating;
+} EigenLocalEntry;
+
+typedef struct {
+  int n;
+  EigenLocalEntry *el;
+} EigenLocalRow;
+
+/* Accounts are handed out to the workers this many at a time. */
+#define EIGEN_CHUNK 64
+
+typedef struct _EigenCrank EigenCrank;
+typedef struct _EigenWorker EigenWorker;
+
+struct _EigenCrank {
+  int n_nodes;
+  const CertGraphNode *nodes;
+  const int *succ_start;        /* successors of node u are succ[succ_start[u]] */
+  const int *succ;              /* to succ[succ_start[u + 1] - 1] */
+  const EigenLocalRow *local;
+  const EigenRow *cur;          /* vectors from the last iteration */
+  EigenRow *next;               /* vectors being computed */
+  int n_workers;
+  EigenWorker *workers;
+  apr_pool_t *thread_pool;      /* threads are made in this, NULL for none */
+#if APR_HAS_THREADS
+  apr_thread_t **threads;
+#endif
+};
+
+struct _EigenWorker {
+  EigenCrank *c;
+  apr_pool_t *pools[2];         /* rows of alternate iterations, each with
+				   an allocator only this worker uses */
+  apr_pool_t *next_pool;
+  double *acc_conf;             /* accumulators, indexed by subject */
+  double *acc_rating;
+  double *acc_rating_sq;
+  int *mark;                    /* subject's accumulators are in use if == stamp */
+  int *touched;
+  int stamp;
+  volatile apr_uint32_t chunk;  /* next of this worker's chunks */
+  apr_uint32_t end;             /* end of this worker's chunks */
+  double delta;                 /* largest change this iteration */
+};
+
+static int
+eigen_subj_id (apr_pool_t *p, HashTable *ix, apr_array_header_t *names,
+	       const char *subj)
+{
+  int *id = virgule_hash_table_get (ix, subj);
+
+  if (id == NULL)
+    {
+      id = apr_palloc (p, sizeof (int));
+      *id = names->nelts;
+      subj = apr_pstrdup (p, subj);
+      *(const char **)apr_array_push (names) = subj;
+      virgule_hash_table_set (p, ix, subj, id);
+    }
+  return *id;
+}
+
+static int
+eigen_int_compare (const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+static int
+eigen_entry_compare (const void *a, const void *b)
+{
+  return ((const EigenEntry *)a)->subj - ((const EigenEntry *)b)->subj;
+}
+
+/* The largest change in confidence or rating between two vectors. */
+static double
+eigen_row_delta (const EigenRow *a, const EigenRow *b)
+{
+  double delta = 0, d;
+  int i = 0, j = 0;
+
+  while (i < a->n || j < b->n)
+    {
+      if (j == b->n || (i < a->n && a->el[i].subj < b->el[j].subj))
+	d = a->el[i++].confidence;
+      else if (i == a->n || b->el[j].subj < a->el[i].subj)
+	d = b->el[j++].confidence;
+      else
+	{
+	  d = fabs (a->el[i].confidence - b->el[j].confidence);
+	  if (fabs (a->el[i].rating - b->el[j].rating) > d)
+	    d = fabs (a->el[i].rating - b->el[j].rating);
+	  i++;
+	  j++;
+	}
+      if (d > delta)
+	delta = d;
+    }
+  return delta;
+}
+
+/* Compute one account's vector for the next iteration, the same way
+   virgule_eigen_crank does, from the current vectors. */
+static void
+eigen_crank_node (EigenWorker *w, int u)
+{
+  EigenCrank *c = w->c;
+  const EigenLocalRow *local = &c->local[u];
+  EigenRow *row = &c->next[u];
+  int n_succ = c->succ_start[u + 1] - c->succ_start[u];
+  int n_touched = 0;
+  int i, j;
+  double d;
+
+  row->n = 0;
+  row->el = NULL;
+  if (!c->nodes[u].is_acct)
+    return;
+  w->stamp++;
+
+  for (i = c->succ_start[u]; i < c->succ_start[u + 1]; i++)
+    {
+      const EigenRow *succ_row = &c->cur[c->succ[i]];
+
+      for (j = 0; j < succ_row->n; j++)
+	{
+	  const EigenEntry *e = &succ_row->el[j];
+
+	  if (w->mark[e->subj] != w->stamp)
+	    {
+	      w->mark[e->subj] = w->stamp;
+	      w->touched[n_touched++] = e->subj;
+	      w->acc_conf[e->subj] = 0;
+	      w->acc_rating[e->subj] = 0;
+	      w->acc_rating_sq[e->subj] = 0;
+	    }
+	  w->acc_conf[e->subj] += e->confidence;
+	  w->acc_rating[e->subj] += e->confidence * e->rating;
+	  w->acc_rating_sq[e->subj] += e->confidence * e->rating_sq;
+	}
+    }
+  if (n_succ)
+    {
+      double scale = EIGEN_DAMPING / n_succ;
+
+      for (i = 0; i < n_touched; i++)
+	{
+	  int s = w->touched[i];
+
+	  if (w->acc_conf[s] > 0)
+	    {
+	      w->acc_rating[s] /= w->acc_conf[s];
+	      w->acc_rating_sq[s] /= w->acc_conf[s];
+	    }
+	  w->acc_conf[s] *= scale;
+	}
+    }
+
+  for (i = 0; i < local->n; i++)
+    {
+      int s = local->el[i].subj;
+      double r = local->el[i].rating;
+
+      if (w->mark[s] != w->stamp)
+	{
+	  w->mark[s] = w->stamp;
+	  w->touched[n_touched++] = s;
+	}
+      w->acc_conf[s] = 1.0;
+      w->acc_rating[s] = r;
+      w->acc_rating_sq[s] = r * r;
+    }
+
+  qsort (w->touched, n_touched, sizeof (int), eigen_int_compare);
+  row->n = n_touched;
+  row->el = apr_palloc (w->next_pool, (n_touched + 1) * sizeof (EigenEntry));
+  for (i = 0; i < n_touched; i++)
+    {
+      int s = w->touched[i];
+
+      row->el[i].subj = s;
+      row->el[i].confidence = w->acc_conf[s];
+      row->el[i].rating = w->acc_rating[s];
+      row->el[i].rating_sq = w->acc_rating_sq[s];
+    }
+  d = eigen_row_delta (&c->cur[u], row);
+  if (d > w->delta)
+    w->delta = d;
+}
+
+/* Crank this worker's own chunks of accounts, then steal what is left
+   of the others'. Every chunk is claimed by exactly one worker, and
+   each vector only depends on the current ones, so the result does not
+   depend on which worker cranks what. */
+static void
+eigen_crank_chunks (EigenWorker *w)
+{
+  EigenCrank *c = w->c;
+  int self = w - c->workers;
+  int k, u, end;
+
+  for (k = 0; k < c->n_workers; k++)
+    {
+      EigenWorker *victim = &c->workers[(self + k) % c->n_workers];
+      apr_uint32_t chunk;
+
+      while ((chunk = apr_atomic_inc32 (&victim->chunk)) < victim->end)
+	{
+	  end = (chunk + 1) * EIGEN_CHUNK;
+	  if (end > c->n_nodes)
+	    end = c->n_nodes;
+	  for (u = chunk * EIGEN_CHUNK; u < end; u++)
+	    eigen_crank_node (w, u);
+	}
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC
+eigen_crank_thread (apr_thread_t *thd, void *data)
+{
+  eigen_crank_chunks ((EigenWorker *)data);
+  apr_thread_exit (thd, APR_SUCCESS);
+  return NULL;
+}
+#endif
+
+/* Run one iteration over all the accounts; return the largest change. */
+static double
+eigen_crank_iteration (EigenCrank *c, int iter)
+{
+  apr_uint32_t n_chunks = (c->n_nodes + EIGEN_CHUNK - 1) / EIGEN_CHUNK;
+  double delta = 0;
+  int i;
+#if APR_HAS_THREADS
+  apr_thread_t **threads = c->threads;
+  apr_status_t thread_status;
+#endif
+
+  for (i = 0; i < c->n_workers; i++)
+    {
+      EigenWorker *w = &c->workers[i];
+
+      w->next_pool = w->pools[iter & 1];
+      apr_pool_clear (w->next_pool);
+      apr_atomic_set32 (&w->chunk, n_chunks * i / c->n_workers);
+      w->end = n_chunks * (i + 1) / c->n_workers;
+      w->delta = 0;
+    }
+
+#if APR_HAS_THREADS
+  /* the workers without a thread have their chunks stolen */
+  for (i = 1; i < c->n_workers; i++)
+    if (c->thread_pool == NULL ||
+	apr_thread_create (&threads[i], NULL, eigen_crank_thread,
+			   &c->workers[i], c->thread_pool) != APR_SUCCESS)
+      threads[i] = NULL;
+  eigen_crank_chunks (&c->workers[0]);
+  for (i = 1; i < c->n_workers; i++)
+    if (threads[i] != NULL)
+      apr_thread_join (&thread_status, threads[i]);
+#else
+  eigen_crank_chunks (&c->workers[0]);
+#endif
+
+  for (i = 0; i < c->n_workers; i++)
+    if (c->workers[i].delta > delta)
+      delta = c->workers[i].delta;
+  return delta;
+}
+
+/* Destroy the pools of a crank, once its threads are joined. */
+static void
+eigen_crank_cleanup (EigenCrank *c)
+{
+  int i;
+
+  for (i = 0; i < c->n_workers; i++)
+    {
+      if (c->workers[i].pools[0] != NULL)
+	apr_pool_destroy (c->workers[i].pools[0]);
+      if (c->workers[i].pools[1] != NULL)
+	apr_pool_destroy (c->workers[i].pools[1]);
+    }
+  if (c->thread_pool != NULL)
+    apr_pool_destroy (c->thread_pool);
+}
+
+/* The number of workers to crank with. */
+static int
+eigen_n_workers (VirguleReq *vr, int n_nodes)
+{
+  int n = vr->priv->eigen_threads;
+
+#if APR_HAS_THREADS
+#ifdef _SC_NPROCESSORS_ONLN
+  if (n <= 0)
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+#else
+  n = 1;
+#endif
+  if (n > (n_nodes + EIGEN_CHUNK - 1) / EIGEN_CHUNK)
+    n = (n_nodes + EIGEN_CHUNK - 1) / EIGEN_CHUNK;
+  return n < 1 ? 1 : n;
+}
+
+/**
+ * virgule_eigen_crank_all: Crank the ratings of every account.
+ * @vr: The #VirguleReq context.
+ * @p_delta: Where to store the largest change in the last iteration.
+ *
+ * Loads the cert graph and every account's local ratings once, then
+ * iterates the same propagation as virgule_eigen_crank over all the
+ * accounts in memory, each iteration computing every vector from the
+ * previous iteration's vectors of its successors, starting from the
+ * stored ones. The accounts of an iteration are shared out between
+ * worker threads. It stops when no confidence or rating changes by more
+ * than the configured tolerance or after the configured number of
+ * iterations, then writes all the eigen/vec records and recranks any
+ * users marked meanwhile. Stopping at the limit is logged; a @p_delta
+ * above the tolerance tells the caller.
+ *
+ * Return value: the number of iterations run, or -1 on error.
+ **/
+int
+virgule_eigen_crank_all (VirguleReq *vr, double *p_delta)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_pool_t *sp;
+  apr_file_t *lock;
+  CertGraph *g;
+  CertGraphNode *nodes;
+  CertGraphEdge *edges;
+  HashTable *subj_ix = virgule_hash_table_new (p);
+  apr_array_header_t *subj_names = apr_array_make (p, 1024, sizeof (char *));
+  const char **names, **unsorted;
+  apr_hash_t *marks;
+  EigenCrank c;
+  EigenLocalRow *local;
+  EigenRow *cur, *next, *tmp;
+  int *succ_start, *succ, *fill;
+  int n_nodes, n_subj, iter, u, i;
+  double delta = 0;
+
+  /* everyone is cranked, so the dirty set can go */
+  lock = eigen_lock (vr, 1);
+  if (lock == NULL)
+    return -1;
+  marks = apr_hash_make (p);
+  eigen_take_marks (vr, "eigen/dirty", marks);
+  eigen_take_marks (vr, "eigen/pending", marks);
+  g = eigen_cert_graph (vr, 1);
+  if (g == NULL)
+    {
+      eigen_unlock (lock);
+      return -1;
+    }
+
+  n_nodes = g->nodes->nelts;
+  nodes = (CertGraphNode *)g->nodes->elts;
+  edges = (CertGraphEdge *)g->edges->elts;
+
+  /* successors: the accounts certified above None, as in
+     virgule_eigen_crank */
+  succ_start = apr_pcalloc (p, (n_nodes + 1) * sizeof (int));
+  for (i = 0; i < g->edges->nelts; i++)
+    if (edges[i].level > CERT_LEVEL_NONE && edges[i].issuer != edges[i].subj)
+      succ_start[edges[i].issuer + 1]++;
+  for (u = 0; u < n_nodes; u++)
+    succ_start[u + 1] += succ_start[u];
+  succ = apr_palloc (p, (succ_start[n_nodes] + 1) * sizeof (int));
+  fill = apr_pcalloc (p, (n_nodes + 1) * sizeof (int));
+  for (i = 0; i < g->edges->nelts; i++)
+    if (edges[i].level > CERT_LEVEL_NONE && edges[i].issuer != edges[i].subj)
+      succ[succ_start[edges[i].issuer] + fill[edges[i].issuer]++] =
+	edges[i].subj;
+
+  /* local ratings */
+  local = apr_pcalloc (p, n_nodes * sizeof (EigenLocalRow));
+  apr_pool_create (&sp, p);
+  for (u = 0; u < n_nodes; u++)
+    {
+      HashTable *el;
+      HashTableIter *hti;
+      const char *key;
+      EigenLocal *val;
+
+      if (!nodes[u].is_acct)
+	continue;
+      el = virgule_eigen_local_load (sp, vr,
+				     apr_pstrcat (sp, "eigen/local/",
+						  nodes[u].name, NULL));
+      if (el != NULL)
+	{
+	  local[u].n = virgule_hash_table_count (el);
+	  local[u].el = apr_palloc (p, local[u].n * sizeof (EigenLocalEntry));
+	  for (i = 0, hti = virgule_hash_table_iter (sp, el);
+	       virgule_hash_table_iter_get (hti, &key, (void **)&val);
+	       virgule_hash_table_iter_next (hti), i++)
+	    {
+	      local[u].el[i].subj = eigen_subj_id (p, subj_ix, subj_names, key);
+	      local[u].el[i].rating = val->rating;
+	    }
+	}
+      apr_pool_clear (sp);
+    }
+
+  /* number the subjects in name order, so the vectors come out sorted
+     as the binary records want them */
+  n_subj = subj_names->nelts;
+  unsorted = (const char **)subj_names->elts;
+  names = apr_palloc (p, (n_subj + 1) * sizeof (char *));
+  memcpy (names, unsorted, n_subj * sizeof (char *));
+  qsort (names, n_subj, sizeof (char *), eigen_strcmp);
+  for (i = 0; i < n_subj; i++)
+    *(int *)virgule_hash_table_get (subj_ix, names[i]) = i;
+  for (u = 0; u < n_nodes; u++)
+    for (i = 0; i < local[u].n; i++)
+      local[u].el[i].subj =
+	*(int *)virgule_hash_table_get (subj_ix, unsorted[local[u].el[i].subj]);
+
+  /* start from the stored vectors, which are usually close; subjects
+     no one rates any more can't be in the result, so they are left out */
+  cur = apr_pcalloc (p, n_nodes * sizeof (EigenRow));
+  next = apr_pcalloc (p, n_nodes * sizeof (EigenRow));
+  for (u = 0; u < n_nodes; u++)
+    {
+      HashTable *ev;
+      HashTableIter *hti;
+      const char *key;
+      EigenVecEl *val;
+      int *id;
+
+      if (!nodes[u].is_acct)
+	continue;
+      ev = virgule_eigen_vec_load (sp, vr, apr_pstrcat (sp, "eigen/vec/",
+							nodes[u].name, NULL));
+      cur[u].el = apr_palloc (p, (virgule_hash_table_count (ev) + 1) *
+			      sizeof (EigenEntry));
+      for (hti = virgule_hash_table_iter (sp, ev);
+	   virgule_hash_table_iter_get (hti, &key, (void **)&val);
+	   virgule_hash_table_iter_next (hti))
+	if ((id = virgule_hash_table_get (subj_ix, key)) != NULL)
+	  {
+	    EigenEntry *e = &cur[u].el[cur[u].n++];
+
+	    e->subj = *id;
+	    e->confidence = val->confidence;
+	    e->rating = val->rating;
+	    e->rating_sq = val->rating_sq;
+	  }
+      qsort (cur[u].el, cur[u].n, sizeof (EigenEntry), eigen_entry_compare);
+      apr_pool_clear (sp);
+    }
+
+  c.n_nodes = n_nodes;
+  c.nodes = nodes;
+  c.succ_start = succ_start;
+  c.succ = succ;
+  c.local = local;
+  c.n_workers = eigen_n_workers (vr, n_nodes);
+  c.workers = apr_pcalloc (p, c.n_workers * sizeof (EigenWorker));
+#if APR_HAS_THREADS
+  c.threads = apr_pcalloc (p, c.n_workers * sizeof (apr_thread_t *));
+#endif
+  /* the workers allocate at the same time, so none of their pools may
+     share an allocator, and threads come and go in a pool of their own
+     whose allocator is locked */
+  c.thread_pool = NULL;
+  if (c.n_workers > 1 &&
+      virgule_pool_create_private (&c.thread_pool, 1) != APR_SUCCESS)
+    c.thread_pool = NULL;
+  for (i = 0; i < c.n_workers; i++)
+    {
+      EigenWorker *w = &c.workers[i];
+
+      w->c = &c;
+      if (virgule_pool_create_private (&w->pools[0], 0) != APR_SUCCESS)
+	w->pools[0] = NULL;
+      if (virgule_pool_create_private (&w->pools[1], 0) != APR_SUCCESS)
+	w->pools[1] = NULL;
+      if (w->pools[0] == NULL || w->pools[1] == NULL)
+	{
+	  c.n_workers = i + 1;
+	  eigen_crank_cleanup (&c);
+	  apr_pool_destroy (sp);
+	  eigen_unlock (lock);
+	  return -1;
+	}
+      w->acc_conf = apr_palloc (p, (n_subj + 1) * sizeof (double));
+      w->acc_rating = apr_palloc (p, (n_subj + 1) * sizeof (double));
+      w->acc_rating_sq = apr_palloc (p, (n_subj + 1) * sizeof (double));
+      w->mark = apr_pcalloc (p, (n_subj + 1) * sizeof (int));
+      w->touched = apr_palloc (p, (n_subj + 1) * sizeof (int));
+    }
+
+  /* iterate, with the vectors of the current and the next iteration
+     in alternate pools */
+  for (iter = 1; ; iter++)
+    {
+      c.cur = cur;
+      c.next = next;
+      delta = eigen_crank_iteration (&c, iter);
+
+      tmp = cur;
+      cur = next;
+      next = tmp;
+
+      if (delta <= vr->priv->eigen_tolerance)
+	break;
+      if (iter >= vr->priv->eigen_iterations)
+	{
+	  ap_log_rerror (APLOG_MARK, APLOG_WARNING, APR_SUCCESS, vr->r,
+			 "mod_virgule: eigen crank stopped after %d iterations "
+			 "without converging (change %g, tolerance %g)",
+			 iter, delta, vr->priv->eigen_tolerance);
+	  break;
+	}
+    }
+
+  for (u = 0; u < n_nodes; u++)
+    {
+      const char **subj;
+      EigenVecEl *els;
+      char *buf;
+      int size;
+
+      if (!nodes[u].is_acct)
+	continue;
+      subj = apr_palloc (sp, (cur[u].n + 1) * sizeof (char *));
+      els = apr_palloc (sp, (cur[u].n + 1) * sizeof (EigenVecEl));
+      for (i = 0; i < cur[u].n; i++)
+	{
+	  subj[i] = names[cur[u].el[i].subj];
+	  els[i].confidence = cur[u].el[i].confidence;
+	  els[i].rating = cur[u].el[i].rating;
+	  els[i].rating_sq = cur[u].el[i].rating_sq;
+	}
+      buf = eigen_vec_pack (sp, cur[u].n, subj, els, &size);
+      virgule_db_put_p (sp, vr->db,
+			apr_pstrcat (sp, "eigen/vec/", nodes[u].name, NULL),
+			buf, size);
+      apr_pool_clear (sp);
+    }
+  apr_pool_destroy (sp);
+  eigen_crank_cleanup (&c);
+  eigen_unlock (lock);
+
+  /* ratings changed during the crank were marked, but their updates
+     found the lock taken and left them to us */
+  virgule_eigen_update (vr, vr->priv->eigen_update_max);
+
+  if (p_delta != NULL)
+    *p_delta = delta;
+  return iter;
+}
+
 /* Report results, for debugging purposes. */
 int
 virgule_eigen_report (VirguleReq *vr, const char *u)
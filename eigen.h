@@ -4,6 +4,8 @@ typedef struct {
   double rating_sq;
 } EigenVecEl;
 
+typedef struct _EigenVec EigenVec;
+
 HashTable *
 virgule_eigen_local_load (apr_pool_t *p, VirguleReq *vr, const char *dbkey);
 
@@ -16,9 +18,32 @@ virgule_eigen_set_local (VirguleReq *vr, const char *subj, double rating);
 HashTable *
 virgule_eigen_vec_load (apr_pool_t *p, VirguleReq *vr, const char *dbkey);
 
+EigenVec *
+virgule_eigen_vec_open (apr_pool_t *p, VirguleReq *vr, const char *u);
+
+int
+virgule_eigen_vec_lookup (const EigenVec *ev, const char *subj,
+			  EigenVecEl *result);
+
+EigenVecEl **
+virgule_eigen_vec_lookup_many (apr_pool_t *p, VirguleReq *vr, const char *u,
+			       const char **keys);
+
+int
+virgule_eigen_convert (VirguleReq *vr, const char *dbkey);
+
 int
 virgule_eigen_crank (apr_pool_t *p, VirguleReq *vr, const char *u);
 
+int
+virgule_eigen_crank_all (VirguleReq *vr, double *p_delta);
+
+int
+virgule_eigen_mark_dirty (VirguleReq *vr, const char *u);
+
+int
+virgule_eigen_update (VirguleReq *vr, int max);
+
 int
 virgule_eigen_report (VirguleReq *vr, const char *u);
 
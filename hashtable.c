@@ -1,24 +1,34 @@
-/* Nice hash table for Apache runtime. */
+/* Nice hash table for Apache runtime.
 
-/* rsr note: shouldn't this whole pile of code be replaced with the
-   hash implementation that is part of the Apache runtime? Does this
-   code provide features not present in the normal Apache APR hash
-   routines? */
+   Open addressing with Robin Hood probing. Each slot holds the key,
+   the value and the key's full hash inline, along with how far the
+   entry sits from its home slot. An insert takes the slot of any entry
+   nearer its home than the new one is, so probe lengths stay short
+   and even, and a lookup can stop as soon as it meets an entry nearer
+   home than the key would be. Removal shifts the entries after the
+   removed one back a slot, so no tombstones are left. The hash is
+   kept, so growing the table never rehashes a key.
+
+   Keys are not copied; they must live as long as the table. */
+
+#include <string.h>
 
 #include <apr.h>
-#include <httpd.h>
+#include <apr_pools.h>
 
 #include "hashtable.h"
 
 typedef struct {
   const char *key;
   void *val;
-} HashBucket;
+  apr_uint32_t hash;
+  apr_uint32_t dist;    /* distance from the home slot plus one, 0 if empty */
+} HashSlot;
 
 struct _HashTable {
   int n;
-  int n_max;
-  HashBucket **buckets;
+  int n_max;            /* number of slots, a power of two */
+  HashSlot *slots;
 };
 
 struct _HashTableIter {
@@ -26,21 +36,80 @@ struct _HashTableIter {
   int index;
 };
 
-/* This hash function, the choice of 2^k for the size, and the linear
-   search are all relatively unsophisticated. It should be good enough
-   for government use, though. */
-static unsigned int
-hash_func (const char *string)
+/* Keep the table at most 7/8 full. */
+#define HASH_TABLE_FULL(n, n_max) ((n) * 8 > (n_max) * 7)
+
+#define PRIME32_1 2654435761U
+#define PRIME32_2 2246822519U
+#define PRIME32_3 3266489917U
+#define PRIME32_4 668265263U
+#define PRIME32_5 374761393U
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static apr_uint32_t
+hash_read32 (const unsigned char *p)
 {
-  unsigned int result;
-  int c;
-  int i;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((apr_uint32_t)p[3] << 24);
+}
 
-  result = 0;
-  for (i = 0; (c = ((unsigned char *)string)[i]) != '\0'; i++)
-    result += (result << 3) + c;
+static apr_uint32_t
+hash_round (apr_uint32_t acc, apr_uint32_t input)
+{
+  acc += input * PRIME32_2;
+  acc = ROTL32 (acc, 13);
+  return acc * PRIME32_1;
+}
 
-  return result;
+/* xxHash32 with a zero seed. Bytes are read little-endian, so hashes
+   and iteration order are the same on every host. */
+static apr_uint32_t
+hash_func (const char *key)
+{
+  const unsigned char *p = (const unsigned char *)key;
+  size_t len = strlen (key);
+  const unsigned char *end = p + len;
+  apr_uint32_t h;
+
+  if (len >= 16)
+    {
+      apr_uint32_t v1 = PRIME32_1 + PRIME32_2;
+      apr_uint32_t v2 = PRIME32_2;
+      apr_uint32_t v3 = 0;
+      apr_uint32_t v4 = 0 - PRIME32_1;
+
+      do
+	{
+	  v1 = hash_round (v1, hash_read32 (p));
+	  v2 = hash_round (v2, hash_read32 (p + 4));
+	  v3 = hash_round (v3, hash_read32 (p + 8));
+	  v4 = hash_round (v4, hash_read32 (p + 12));
+	  p += 16;
+	}
+      while (p + 16 <= end);
+      h = ROTL32 (v1, 1) + ROTL32 (v2, 7) + ROTL32 (v3, 12) + ROTL32 (v4, 18);
+    }
+  else
+    h = PRIME32_5;
+
+  h += (apr_uint32_t)len;
+  for (; p + 4 <= end; p += 4)
+    {
+      h += hash_read32 (p) * PRIME32_3;
+      h = ROTL32 (h, 17) * PRIME32_4;
+    }
+  for (; p < end; p++)
+    {
+      h += *p * PRIME32_5;
+      h = ROTL32 (h, 11) * PRIME32_1;
+    }
+
+  h ^= h >> 15;
+  h *= PRIME32_2;
+  h ^= h >> 13;
+  h *= PRIME32_3;
+  h ^= h >> 16;
+  return h;
 }
 
 HashTable *
@@ -50,105 +119,167 @@ virgule_hash_table_new (apr_pool_t *p)
   result = (HashTable *)apr_palloc (p, sizeof(HashTable));
 
   result->n = 0;
-  result->n_max = 4;
-  result->buckets = (HashBucket **)apr_palloc (p, sizeof(HashBucket *) * result->n_max);
-
-  memset (result->buckets, 0, sizeof(HashBucket *) * result->n_max);
+  result->n_max = 8;
+  result->slots = (HashSlot *)apr_pcalloc (p, sizeof(HashSlot) * result->n_max);
 
   return result;
 }
 
-void *
-virgule_hash_table_get (const HashTable *ht, const char *key)
+/* Find the slot holding @key, or -1. */
+static int
+hash_table_find (const HashTable *ht, const char *key, apr_uint32_t hash)
 {
-  unsigned int hash;
+  unsigned int mask = ht->n_max - 1;
+  unsigned int i = hash & mask;
+  apr_uint32_t dist;
+
+  for (dist = 1; ; dist++)
+    {
+      const HashSlot *slot = &ht->slots[i];
+
+      /* an empty slot, or an entry nearer home than the key would be */
+      if (slot->dist < dist)
+	return -1;
+      if (slot->hash == hash && !strcmp (slot->key, key))
+	return i;
+      i = (i + 1) & mask;
+    }
+}
 
-  hash = hash_func (key) % ht->n_max;
+/* Place an entry known not to be present. */
+static void
+hash_table_place (HashSlot *slots, int n_max, HashSlot entry)
+{
+  unsigned int mask = n_max - 1;
+  unsigned int i = entry.hash & mask;
 
-  while (ht->buckets[hash] != NULL)
+  entry.dist = 1;
+  for (;;)
     {
-      if (!strcmp (ht->buckets[hash]->key, key))
-	return ht->buckets[hash]->val;
-      hash = (hash + 1) % ht->n_max;
+      if (slots[i].dist == 0)
+	{
+	  slots[i] = entry;
+	  return;
+	}
+      if (slots[i].dist < entry.dist)
+	{
+	  HashSlot tmp = slots[i];
+
+	  slots[i] = entry;
+	  entry = tmp;
+	}
+      i = (i + 1) & mask;
+      entry.dist++;
     }
-  return NULL;
 }
 
 static void
-hash_table_insert_bucket (apr_pool_t *p, HashBucket **buckets, int n_max,
-		     HashBucket *bucket)
+hash_table_resize (apr_pool_t *p, HashTable *ht, int new_n_max)
 {
-  unsigned int hash;
+  HashSlot *old_slots = ht->slots;
+  int old_n_max = ht->n_max;
+  int i;
 
-  hash = hash_func (bucket->key) % n_max;
+  ht->slots = (HashSlot *)apr_pcalloc (p, sizeof(HashSlot) * new_n_max);
+  ht->n_max = new_n_max;
+  for (i = 0; i < old_n_max; i++)
+    if (old_slots[i].dist != 0)
+      hash_table_place (ht->slots, new_n_max, old_slots[i]);
+}
 
-  while (buckets[hash] != NULL)
-    hash = (hash + 1) % n_max;
+/**
+ * virgule_hash_table_reserve: Make room for a number of entries.
+ * @p: Pool for the new slots.
+ * @ht: The table.
+ * @n: The number of entries the table should hold without growing.
+ **/
+void
+virgule_hash_table_reserve (apr_pool_t *p, HashTable *ht, int n)
+{
+  int n_max = ht->n_max;
 
-  buckets[hash] = bucket;
+  while (HASH_TABLE_FULL (n, n_max))
+    n_max <<= 1;
+  if (n_max != ht->n_max)
+    hash_table_resize (p, ht, n_max);
 }
 
-/* Internal insert function. Assumes that key is not already present. */
-static void
-hash_table_insert (apr_pool_t *p, HashBucket **buckets, int n_max,
-	     const char *key, void *val)
+void *
+virgule_hash_table_get (const HashTable *ht, const char *key)
 {
-  HashBucket *bucket = (HashBucket *)apr_palloc (p, sizeof(HashBucket));
+  int i = hash_table_find (ht, key, hash_func (key));
 
-  bucket->key = key;
-  bucket->val = val;
-  hash_table_insert_bucket (p, buckets, n_max, bucket);
+  return i < 0 ? NULL : ht->slots[i].val;
 }
 
 void
 virgule_hash_table_set (apr_pool_t *p, HashTable *ht, const char *key, void *val)
 {
-  unsigned int hash;
-  int n_max;
-
-  hash = hash_func (key) % ht->n_max;
+  HashSlot entry;
+  int i;
 
-  while (ht->buckets[hash] != NULL)
+  entry.hash = hash_func (key);
+  i = hash_table_find (ht, key, entry.hash);
+  if (i >= 0)
     {
-      if (!strcmp (ht->buckets[hash]->key, key))
-	{
-	  ht->buckets[hash]->val = val;
-	  return;
-	}
-      hash = (hash + 1) % ht->n_max;
+      ht->slots[i].val = val;
+      return;
     }
+
   ht->n++;
-  n_max = ht->n_max;
-  if (ht->n > (n_max >> 1))
-    {
-      /* rehash */
+  if (HASH_TABLE_FULL (ht->n, ht->n_max))
+    hash_table_resize (p, ht, ht->n_max << 1);
+  entry.key = key;
+  entry.val = val;
+  hash_table_place (ht->slots, ht->n_max, entry);
+}
 
-      int new_n_max = n_max << 1;
-      HashBucket **old_buckets = ht->buckets;
-      HashBucket **new_buckets = (HashBucket **)apr_palloc (p, sizeof(HashBucket *) * new_n_max);
-      int i;
+/**
+ * virgule_hash_table_remove: Remove a key from the table.
+ * @ht: The table.
+ * @key: The key.
+ *
+ * Return value: The value the key had, or NULL if it was not present.
+ **/
+void *
+virgule_hash_table_remove (HashTable *ht, const char *key)
+{
+  unsigned int mask = ht->n_max - 1;
+  int i = hash_table_find (ht, key, hash_func (key));
+  unsigned int j;
+  void *val;
 
-      memset (new_buckets, 0, sizeof(HashBucket *) * new_n_max); 
+  if (i < 0)
+    return NULL;
+  val = ht->slots[i].val;
 
-      for (i = 0; i < n_max; i++)
-	{
-	  if (old_buckets[i] != NULL)
-	    hash_table_insert_bucket (p, new_buckets, new_n_max,
-				      old_buckets[i]);
-	}
-      hash_table_insert (p, new_buckets, new_n_max, key, val);
-      ht->n_max = new_n_max;
-      ht->buckets = new_buckets;
-    }
-  else
+  /* shift the following entries back until one is at home */
+  for (j = (i + 1) & mask; ht->slots[j].dist > 1; j = (j + 1) & mask)
     {
-      HashBucket *bucket = (HashBucket *)apr_palloc (p, sizeof(HashBucket));
-      ht->buckets[hash] = bucket;
-      bucket->key = key;
-      bucket->val = val;
+      ht->slots[i] = ht->slots[j];
+      ht->slots[i].dist--;
+      i = j;
     }
+  memset (&ht->slots[i], 0, sizeof(HashSlot));
+  ht->n--;
+  return val;
+}
+
+/**
+ * virgule_hash_table_count: Number of entries in the table.
+ * @ht: The table.
+ *
+ * Return value: The number of entries.
+ **/
+int
+virgule_hash_table_count (const HashTable *ht)
+{
+  return ht->n;
 }
 
+/* Iteration visits the slots in order. The order only depends on the
+   keys and the order they were set in, so it is the same from run to
+   run. The table must not be changed while an iterator is in use. */
 HashTableIter *
 virgule_hash_table_iter (apr_pool_t *p, const HashTable *ht)
 {
@@ -168,10 +299,10 @@ virgule_hash_table_iter_get (HashTableIter *iter, const char **pkey, void **pval
 
   for (; iter->index < ht->n_max; iter->index++)
     {
-      if (ht->buckets[iter->index] != NULL)
+      if (ht->slots[iter->index].dist != 0)
 	{
-	  *pkey = ht->buckets[iter->index]->key;
-	  *pval = ht->buckets[iter->index]->val;
+	  *pkey = ht->slots[iter->index].key;
+	  *pval = ht->slots[iter->index].val;
 	  return 1;
 	}
     }
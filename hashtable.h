@@ -6,12 +6,21 @@ typedef struct _HashTableIter HashTableIter;
 HashTable *
 virgule_hash_table_new (apr_pool_t *p);
 
+void
+virgule_hash_table_reserve (apr_pool_t *p, HashTable *ht, int n);
+
 void *
 virgule_hash_table_get (const HashTable *ht, const char *key);
 
 void
 virgule_hash_table_set (apr_pool_t *p, HashTable *ht, const char *key, void *val);
 
+void *
+virgule_hash_table_remove (HashTable *ht, const char *key);
+
+int
+virgule_hash_table_count (const HashTable *ht);
+
 HashTableIter *
 virgule_hash_table_iter (apr_pool_t *p, const HashTable *ht);
 
@@ -0,0 +1,320 @@
+/* Microbenchmark of the HashTable against the table it replaced and
+   apr_hash.
+
+   Keys look like the subjects of rating vectors, "d/" and a user
+   name. For each table, times setting every key, looking up every key,
+   looking up as many keys that are not there, iterating, and, where
+   the table supports it, removing half the keys. Each phase is
+   reported in nanoseconds per operation.
+
+   Build with "make hashtable_bench". Usage:
+
+     hashtable_bench [-n keys] [-r rounds]
+
+   With no -n, runs 100, 10000 and 1000000 keys. The old table is only
+   run up to 100000 keys; beyond that its clustering makes it take
+   minutes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+
+#include "hashtable.h"
+#include "bench.h"
+
+/* The table hashtable.c used to have: an additive hash, linear probing
+   at most half full, and a bucket allocated per entry. */
+
+typedef struct {
+  const char *key;
+  void *val;
+} OldBucket;
+
+typedef struct {
+  int n;
+  int n_max;
+  OldBucket **buckets;
+} OldTable;
+
+static unsigned int
+old_hash (const char *string)
+{
+  unsigned int result = 0;
+  int c, i;
+
+  for (i = 0; (c = ((unsigned char *)string)[i]) != '\0'; i++)
+    result += (result << 3) + c;
+  return result;
+}
+
+static OldTable *
+old_new (apr_pool_t *p)
+{
+  OldTable *t = (OldTable *)apr_palloc (p, sizeof (OldTable));
+
+  t->n = 0;
+  t->n_max = 4;
+  t->buckets = (OldBucket **)apr_pcalloc (p, sizeof (OldBucket *) * t->n_max);
+  return t;
+}
+
+static void *
+old_get (const OldTable *t, const char *key)
+{
+  unsigned int h = old_hash (key) % t->n_max;
+
+  while (t->buckets[h] != NULL)
+    {
+      if (!strcmp (t->buckets[h]->key, key))
+	return t->buckets[h]->val;
+      h = (h + 1) % t->n_max;
+    }
+  return NULL;
+}
+
+static void
+old_insert_bucket (OldBucket **buckets, int n_max, OldBucket *b)
+{
+  unsigned int h = old_hash (b->key) % n_max;
+
+  while (buckets[h] != NULL)
+    h = (h + 1) % n_max;
+  buckets[h] = b;
+}
+
+static void
+old_set (apr_pool_t *p, OldTable *t, const char *key, void *val)
+{
+  unsigned int h = old_hash (key) % t->n_max;
+  OldBucket *b;
+
+  while (t->buckets[h] != NULL)
+    {
+      if (!strcmp (t->buckets[h]->key, key))
+	{
+	  t->buckets[h]->val = val;
+	  return;
+	}
+      h = (h + 1) % t->n_max;
+    }
+  b = (OldBucket *)apr_palloc (p, sizeof (OldBucket));
+  b->key = key;
+  b->val = val;
+  if (++t->n > (t->n_max >> 1))
+    {
+      int new_n_max = t->n_max << 1;
+      OldBucket **nb = (OldBucket **)apr_pcalloc (p, sizeof (OldBucket *) *
+						  new_n_max);
+      int i;
+
+      for (i = 0; i < t->n_max; i++)
+	if (t->buckets[i] != NULL)
+	  old_insert_bucket (nb, new_n_max, t->buckets[i]);
+      t->buckets = nb;
+      t->n_max = new_n_max;
+      old_insert_bucket (nb, new_n_max, b);
+    }
+  else
+    t->buckets[h] = b;
+}
+
+static void
+bench_report (const char *name, const char *phase, int n_ops, double t)
+{
+  printf ("  %-10s %-8s %8.1f ns/op\n", name, phase, t * 1e9 / n_ops);
+}
+
+static long
+bench_new (apr_pool_t *p, char **keys, char **misses, int n)
+{
+  HashTable *ht;
+  HashTableIter *iter;
+  const char *key;
+  void *val;
+  double t0;
+  long sum = 0;
+  int i;
+
+  t0 = bench_now ();
+  ht = virgule_hash_table_new (p);
+  for (i = 0; i < n; i++)
+    virgule_hash_table_set (p, ht, keys[i], keys[i]);
+  bench_report ("HashTable", "set", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    sum += virgule_hash_table_get (ht, keys[i]) != NULL;
+  bench_report ("HashTable", "hit", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    sum += virgule_hash_table_get (ht, misses[i]) != NULL;
+  bench_report ("HashTable", "miss", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (iter = virgule_hash_table_iter (p, ht);
+       virgule_hash_table_iter_get (iter, &key, &val);
+       virgule_hash_table_iter_next (iter))
+    sum++;
+  bench_report ("HashTable", "iterate", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i += 2)
+    sum += virgule_hash_table_remove (ht, keys[i]) != NULL;
+  bench_report ("HashTable", "remove", (n + 1) / 2, bench_now () - t0);
+
+  t0 = bench_now ();
+  ht = virgule_hash_table_new (p);
+  virgule_hash_table_reserve (p, ht, n);
+  for (i = 0; i < n; i++)
+    virgule_hash_table_set (p, ht, keys[i], keys[i]);
+  bench_report ("HashTable", "reserved", n, bench_now () - t0);
+
+  return sum;
+}
+
+static long
+bench_old (apr_pool_t *p, char **keys, char **misses, int n)
+{
+  OldTable *t;
+  double t0;
+  long sum = 0;
+  int i;
+
+  t0 = bench_now ();
+  t = old_new (p);
+  for (i = 0; i < n; i++)
+    old_set (p, t, keys[i], keys[i]);
+  bench_report ("old", "set", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    sum += old_get (t, keys[i]) != NULL;
+  bench_report ("old", "hit", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    sum += old_get (t, misses[i]) != NULL;
+  bench_report ("old", "miss", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < t->n_max; i++)
+    sum += t->buckets[i] != NULL;
+  bench_report ("old", "iterate", n, bench_now () - t0);
+
+  return sum;
+}
+
+static long
+bench_apr (apr_pool_t *p, char **keys, char **misses, int n)
+{
+  apr_hash_t *h;
+  apr_hash_index_t *hi;
+  double t0;
+  long sum = 0;
+  int i;
+
+  t0 = bench_now ();
+  h = apr_hash_make (p);
+  for (i = 0; i < n; i++)
+    apr_hash_set (h, keys[i], APR_HASH_KEY_STRING, keys[i]);
+  bench_report ("apr_hash", "set", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    sum += apr_hash_get (h, keys[i], APR_HASH_KEY_STRING) != NULL;
+  bench_report ("apr_hash", "hit", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    sum += apr_hash_get (h, misses[i], APR_HASH_KEY_STRING) != NULL;
+  bench_report ("apr_hash", "miss", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (hi = apr_hash_first (p, h); hi; hi = apr_hash_next (hi))
+    sum++;
+  bench_report ("apr_hash", "iterate", n, bench_now () - t0);
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i += 2)
+    apr_hash_set (h, keys[i], APR_HASH_KEY_STRING, NULL);
+  bench_report ("apr_hash", "remove", (n + 1) / 2, bench_now () - t0);
+
+  return sum;
+}
+
+static void
+bench_run (apr_pool_t *parent, int n, int rounds)
+{
+  apr_pool_t *p;
+  char **keys, **misses;
+  long sum = 0;
+  int i, r;
+
+  apr_pool_create (&p, parent);
+  keys = (char **)apr_palloc (p, n * sizeof (char *));
+  misses = (char **)apr_palloc (p, n * sizeof (char *));
+  for (i = 0; i < n; i++)
+    {
+      keys[i] = apr_psprintf (p, "d/user%d", i);
+      misses[i] = apr_psprintf (p, "d/nobody%d", i);
+    }
+
+  printf ("%d keys\n", n);
+  for (r = 0; r < rounds; r++)
+    {
+      apr_pool_t *sp;
+
+      apr_pool_create (&sp, p);
+      sum += bench_new (sp, keys, misses, n);
+      apr_pool_clear (sp);
+      if (n <= 100000)
+	{
+	  sum += bench_old (sp, keys, misses, n);
+	  apr_pool_clear (sp);
+	}
+      sum += bench_apr (sp, keys, misses, n);
+      apr_pool_destroy (sp);
+    }
+  /* keep the lookups from being optimised away */
+  if (sum == 42)
+    printf ("\n");
+  apr_pool_destroy (p);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int sizes[] = { 100, 10000, 1000000 };
+  apr_pool_t *p;
+  int n = 0, rounds = 1;
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (!strcmp (argv[i], "-n") && i + 1 < argc)
+	n = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-r") && i + 1 < argc)
+	rounds = atoi (argv[++i]);
+      else
+	{
+	  fprintf (stderr, "usage: %s [-n keys] [-r rounds]\n", argv[0]);
+	  return 2;
+	}
+    }
+
+  apr_initialize ();
+  apr_pool_create (&p, NULL);
+  for (i = 0; i < (n ? 1 : 3); i++)
+    bench_run (p, n ? n : sizes[i], rounds);
+  apr_pool_destroy (p);
+  apr_terminate ();
+
+  return 0;
+}
@@ -43,13 +43,16 @@
 #include "rss_export.h"
 #include "style.h"
 #include "tmetric.h"
+#include "tmetric_table.h"
 #include "auth.h"
 #include "db_ops.h"
 #include "util.h"
 #include "xmlrpc.h"
 #include "db_xml.h"
+#include "db_log.h"
 #include "xml_util.h"
 #include "rating.h"
+#include "session.h"
 
 /* Process specific pool */
 static apr_pool_t *ppool = NULL;
@@ -61,6 +64,7 @@ static apr_threadkey_t *tkey;
 typedef struct {
   char *dir;
   char *db;
+  int db_log;
   apr_array_header_t *pass_dirs;
 } virgule_dir_conf;
 
@@ -80,6 +84,7 @@ virgule_create_dir_config (apr_pool_t *p, char *dir)
 
   result->dir = apr_pstrdup (p, dir);
   result->db = NULL;
+  result->db_log = 0;
   result->pass_dirs = apr_array_make(p, 16, sizeof(char *));
 
   return result;
@@ -88,10 +93,13 @@ virgule_create_dir_config (apr_pool_t *p, char *dir)
 
 /**
  * Apache config file option handler (called by Apache).
- * Sets the Virgule database from the httpd.conf option
+ * Sets the Virgule database from the httpd.conf option. The optional
+ * second argument selects the storage backend, "filesystem" (one file
+ * per record, the default) or "log" (single append-only log).
  **/
 static const char *
-set_virgule_db (cmd_parms *parms, void *mconfig, const char *db)
+set_virgule_db (cmd_parms *parms, void *mconfig, const char *db,
+		const char *backend)
 {
   apr_finfo_t finfo;
   virgule_dir_conf *cfg = (virgule_dir_conf *)mconfig;
@@ -103,6 +111,13 @@ set_virgule_db (cmd_parms *parms, void *mconfig, const char *db)
       finfo.filetype != APR_DIR )
     return apr_pstrcat(parms->pool,"Invalid VirguleDB path: ",db,NULL);
 
+  if (backend == NULL || !strcasecmp (backend, "filesystem"))
+    cfg->db_log = 0;
+  else if (!strcasecmp (backend, "log"))
+    cfg->db_log = 1;
+  else
+    return apr_pstrcat(parms->pool,"Unknown VirguleDb backend: ",backend,NULL);
+
   cfg->db = (char *)apr_pstrdup (parms->pool, db);
   return NULL;
 }
@@ -143,6 +158,10 @@ info_page (VirguleReq *vr)
   int i;
   char tm[APR_CTIME_LEN];
   char *args;
+  DbXmlCacheStats xcs;
+  DbLogStats dls;
+  const TmetricTable *tmt;
+  TmetricTableInfo tmi;
 
   r->content_type = "text/html; charset=UTF-8";
 
@@ -177,8 +196,15 @@ info_page (VirguleReq *vr)
   virgule_buffer_printf (b, "<tr><td>Apache thread ID (apr_os_thread_current())</td><td>%lu</td></tr>\n", apr_os_thread_current());
   if (cfg)
     virgule_buffer_printf (b, "<tr><td>Configured virgule DB</td><td>"
-                           "[cfg->db=\"%s\"] [cfg->dir=\"%s\"]</td></tr>\n",
-			   cfg->db, cfg->dir);
+                           "[cfg->db=\"%s\"] [cfg->dir=\"%s\"] [%s backend]</td></tr>\n",
+			   cfg->db, cfg->dir, cfg->db_log ? "log" : "filesystem");
+
+  if (virgule_db_get_log_stats (vr->db, &dls) == 0)
+    virgule_buffer_printf (b, "<tr><td>DB log</td><td>%lu keys, %lu of %lu KB live, "
+			   "%lu compactions%s</td></tr>\n",
+			   dls.n_keys, (unsigned long)(dls.live_bytes / 1024),
+			   (unsigned long)(dls.log_bytes / 1024), dls.compactions,
+			   dls.compacting ? " (compacting)" : "");
 
   /* Dump pass-through directory names read from httpd.conf */
   virgule_buffer_puts (b, "<tr><td>Configured Pass-through Directories:</td><td><ul>");
@@ -267,9 +293,49 @@ info_page (VirguleReq *vr)
   else
     virgule_buffer_puts (b, "<tr><td>Diary rating</td><td>Off</td></tr>\n");
 
+  virgule_buffer_printf (b, "<tr><td>Ratings crank</td><td>tolerance %g, "
+		 "at most %d iterations, ",
+		 vr->priv->eigen_tolerance, vr->priv->eigen_iterations);
+  if (vr->priv->eigen_threads > 0)
+    virgule_buffer_printf (b, "%d threads</td></tr>\n", vr->priv->eigen_threads);
+  else
+    virgule_buffer_puts (b, "one thread per CPU</td></tr>\n");
+
+  if (vr->priv->eigen_update_max > 0)
+    virgule_buffer_printf (b, "<tr><td>Ratings update</td><td>at most %d "
+			   "recranks per rating</td></tr>\n",
+			   vr->priv->eigen_update_max);
+  else
+    virgule_buffer_puts (b, "<tr><td>Ratings update</td><td>no limit</td></tr>\n");
+
+  if (vr->priv->session_timeout > 0)
+    {
+      SessionStats ss;
+
+      virgule_session_get_stats (&ss);
+      virgule_buffer_printf (b, "<tr><td>Session table</td><td>%d seconds, "
+			     "%lu slots, %lu hits, %lu misses</td></tr>\n",
+			     vr->priv->session_timeout, ss.slots, ss.hits,
+			     ss.misses);
+    }
+  else
+    virgule_buffer_puts (b, "<tr><td>Session table</td><td>Off</td></tr>\n");
+
+  if (vr->priv->lastlogin_interval > 0)
+    virgule_buffer_printf (b, "<tr><td>Lastlogin updates</td><td>every %d "
+			   "seconds</td></tr>\n", vr->priv->lastlogin_interval);
+  else
+    virgule_buffer_puts (b, "<tr><td>Lastlogin updates</td><td>every visit"
+			 "</td></tr>\n");
+
   virgule_buffer_printf (b, "<tr><td>Recentlog style</td><td>%s</td></tr>\n",
 		 vr->priv->recentlog_as_posted ? "As Posted" : "Unique");
 
+  virgule_buffer_printf (b, "<tr><td>Trust metric engine</td><td>%s</td></tr>\n",
+		 vr->priv->tmetric_engine == TMETRIC_ENGINE_AUGMENT ? "augment" :
+		 vr->priv->tmetric_engine == TMETRIC_ENGINE_DINIC ? "dinic" :
+		 "default");
+
   virgule_buffer_printf (b, "<tr><td>Account creation</td><td>%s</td></tr>\n",
 		 vr->priv->allow_account_creation ? "allowed" : "not allowed");
 
@@ -288,12 +354,63 @@ info_page (VirguleReq *vr)
   virgule_buffer_printf (b, "<tr><td>Article editable period</td><td>%i days</td></tr>\n", 
                  vr->priv->article_days_to_edit);
 
+  tmt = virgule_tmetric_table_acquire (r->pool, vr->priv->base_path);
+  if (tmt != NULL)
+    {
+      virgule_tmetric_table_get_info (tmt, &tmi);
+      apr_ctime (tm, tmi.mtime);
+      virgule_buffer_printf (b, "<tr><td>Trust metric table</td><td>generation %lu, "
+			     "%lu accounts, %lu KB, cranked %s</td></tr>\n",
+			     (unsigned long)tmi.generation, tmi.n_entries,
+			     (unsigned long)tmi.bytes / 1024, tm);
+    }
+  else
+    virgule_buffer_puts (b, "<tr><td>Trust metric table</td><td>none (using per-thread cache)</td></tr>\n");
+
+  virgule_db_xml_cache_get_stats (&xcs);
+  virgule_buffer_printf (b, "<tr><td>XML document cache</td><td>"
+			 "%lu hits, %lu misses, %lu evictions, %lu invalidations<br>"
+			 "%lu entries, %lu of %lu KB used</td></tr>\n",
+			 xcs.hits, xcs.misses, xcs.evictions, xcs.invalidations,
+			 xcs.entries, (unsigned long)xcs.bytes / 1024,
+			 (unsigned long)xcs.max_bytes / 1024);
+
   virgule_buffer_puts (b, "</table></body></html>\n");
 
   return virgule_send_response (vr);
 }
 
 
+/* Reports a counter fixed by virgule_db_dir_max_check() */
+static void
+dirmax_check_report (void *data, const char *key, int stored, int actual)
+{
+  VirguleReq *vr = (VirguleReq *)data;
+
+  virgule_buffer_printf (vr->b, "<li>%s: was %d, now %d</li>\n",
+			 ap_escape_html (vr->r->pool, key), stored, actual);
+}
+
+/* Rebuilds the directory max-key counters from the filesystem if
+   /admin/check-dirmax.html is requested */
+static int
+dirmax_check_page (VirguleReq *vr)
+{
+  int n;
+
+  if (virgule_set_temp_buffer (vr) != 0)
+    return HTTP_INTERNAL_SERVER_ERROR;
+
+  virgule_buffer_puts (vr->b, "<h2>Checking directory max-key counters</h2>\n<ul>\n");
+  n = virgule_db_dir_max_check (vr->r->pool, vr->db, dirmax_check_report, vr);
+  virgule_buffer_printf (vr->b, "</ul>\n<p>%d counter%s repaired.</p>\n",
+			 n, n == 1 ? "" : "s");
+
+  virgule_set_main_buffer (vr);
+  return virgule_render_in_template (vr, "/templates/default.xml", "content", "Directory Counter Check");
+}
+
+
 /**
  * private_destroy: Destroys the virgule thread specific pool
  **/
@@ -318,6 +435,22 @@ static void virgule_child_init(apr_pool_t *p, server_rec *s)
     ap_log_error(APLOG_MARK,APLOG_CRIT,status,s,"mod_virgule: Unable to create thread private key");
 
   xmlInitParser();
+
+  /* Set up the log-structured DB backend, opened on first use */
+  if((status = virgule_db_log_init(ppool)) != APR_SUCCESS)
+    ap_log_error(APLOG_MARK,APLOG_ERR,status,s,"mod_virgule: Unable to initialize DB log");
+
+  /* Trust metric table shared by all threads, mapped on first use */
+  if((status = virgule_tmetric_table_init(ppool)) != APR_SUCCESS)
+    ap_log_error(APLOG_MARK,APLOG_ERR,status,s,"mod_virgule: Unable to initialize tmetric table");
+
+  /* Session table shared by all threads and children, mapped on first use */
+  if((status = virgule_session_init(ppool)) != APR_SUCCESS)
+    ap_log_error(APLOG_MARK,APLOG_ERR,status,s,"mod_virgule: Unable to initialize session table");
+
+  /* Create the process-wide parsed XML document cache */
+  if((status = virgule_db_xml_cache_init(ppool)) != APR_SUCCESS)
+    ap_log_error(APLOG_MARK,APLOG_ERR,status,s,"mod_virgule: Unable to create XML document cache");
 }
 
 
@@ -425,6 +558,7 @@ read_site_config (VirguleReq *vr)
   vr->priv->tmetric = NULL;
   vr->priv->tm_pool = NULL;
   vr->priv->tm_mtime = 0L;
+  vr->priv->tm_index = NULL;
 
   /* Figure out the local time zone offset using thread-safe POSIX func */
   now = time(NULL);
@@ -481,6 +615,53 @@ read_site_config (VirguleReq *vr)
     return virgule_send_error_page (vr, vERROR, "config",
 			    "Unknown project style found in site config.");
 
+  /* read the ratings crank convergence tolerance and iteration cap */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "eigentolerance", "");
+  vr->priv->eigen_tolerance = atof (text);
+  if (vr->priv->eigen_tolerance <= 0)
+    vr->priv->eigen_tolerance = 0.0001;
+
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "eigeniterations", "");
+  vr->priv->eigen_iterations = atoi (text);
+  if (vr->priv->eigen_iterations <= 0)
+    vr->priv->eigen_iterations = 50;
+
+  /* read the number of ratings crank threads, 0 for one per CPU */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "eigenthreads", "");
+  vr->priv->eigen_threads = atoi (text);
+  if (vr->priv->eigen_threads < 0)
+    vr->priv->eigen_threads = 0;
+
+  /* read the most ratings recranked by a diary rating, 0 for no limit */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "eigenupdatemax", "100");
+  vr->priv->eigen_update_max = atoi (text);
+  if (vr->priv->eigen_update_max < 0)
+    vr->priv->eigen_update_max = 0;
+
+  /* read how long a checked login cookie is trusted, 0 to always check */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "sessiontimeout", "900");
+  vr->priv->session_timeout = atoi (text);
+  if (vr->priv->session_timeout < 0)
+    vr->priv->session_timeout = 0;
+
+  /* read how often an account's lastlogin is written, 0 for every visit */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "lastlogininterval", "600");
+  vr->priv->lastlogin_interval = atoi (text);
+  if (vr->priv->lastlogin_interval < 0)
+    vr->priv->lastlogin_interval = 0;
+
+  /* read the trust metric max flow engine */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "tmetricengine", "");
+  if (!*text)
+    vr->priv->tmetric_engine = TMETRIC_ENGINE_DEFAULT;
+  else if (!strcasecmp (text, "augment"))
+    vr->priv->tmetric_engine = TMETRIC_ENGINE_AUGMENT;
+  else if (!strcasecmp (text, "dinic"))
+    vr->priv->tmetric_engine = TMETRIC_ENGINE_DINIC;
+  else
+    return virgule_send_error_page (vr, vERROR, "config",
+			    "Unknown trust metric engine found in site config.");
+
   /* read the recentlog style */
   text = virgule_xml_find_child_string (doc->xmlRootNode, "recentlogstyle", "Unique");
   if (!strcasecmp (text, "Unique"))
@@ -801,6 +982,11 @@ read_site_config (VirguleReq *vr)
   if(vr->priv->acct_spam_threshold == 0)
     vr->priv->acct_spam_threshold = 15; 
 
+  /* read the XML document cache size (in KB, 0 disables the cache) */
+  text = virgule_xml_find_child_string (doc->xmlRootNode, "xmlcachesize", NULL);
+  if (text)
+    virgule_db_xml_cache_set_max ((apr_size_t)atoi (text) * 1024);
+
   /* read the sitemap navigation options */
   stack = apr_array_make (vr->priv->pool, 10, sizeof (NavOption *));
   node = virgule_xml_find_child (doc->xmlRootNode, "sitemap");
@@ -867,6 +1053,26 @@ ap_log_rerror(APLOG_MARK, APLOG_CRIT, APR_SUCCESS, vr->r,"Debug: read config.xml
 }
 
 
+/* Log the records a request loaded more than once, to find where
+   the memo doesn't help. */
+static apr_status_t
+memo_report (void *data)
+{
+  VirguleReq *vr = (VirguleReq *)data;
+  DbMemoStats ms;
+  char *reloads;
+
+  virgule_db_memo_get_stats (vr->memo, &ms);
+  if (ms.reloads == 0)
+    return APR_SUCCESS;
+  reloads = virgule_db_memo_reloads (vr->r->pool, vr->memo);
+  ap_log_rerror (APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, vr->r,
+		 "mod_virgule: %s: %lu loads, %lu from memo, %lu duplicate "
+		 "(%lu not kept): %s", vr->r->uri, ms.loads, ms.hits,
+		 ms.reloads, ms.full, reloads);
+  return APR_SUCCESS;
+}
+
 /**
  * virgule_handler: Generates the content to fill a request
  */
@@ -894,7 +1100,23 @@ static int virgule_handler(request_rec *r)
   vr->b = virgule_buffer_new (r->pool);
   vr->hb = virgule_buffer_new (r->pool);
   vr->tb = NULL;
-  vr->db = virgule_db_new_filesystem (r->pool, cfg->db); /* hack */
+  if (cfg->db_log)
+    {
+      vr->db = virgule_db_new_log (r->pool, cfg->db);
+      if (vr->db == NULL)
+        {
+          ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                        "mod_virgule: Unable to open DB log in %s", cfg->db);
+          return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+  else
+    vr->db = virgule_db_new_filesystem (r->pool, cfg->db); /* hack */
+
+  /* records loaded more than once by this request come from the memo */
+  vr->memo = virgule_db_memo_new (r->pool);
+  virgule_db_set_memo (vr->db, vr->memo);
+  apr_pool_cleanup_register (r->pool, vr, memo_report, apr_pool_cleanup_null);
 
   if (cfg->dir && !strncmp (r->uri, cfg->dir, strlen (cfg->dir)))
     {
@@ -1009,6 +1231,9 @@ static int virgule_handler(request_rec *r)
   if (!strcmp (virgule_match_prefix(r->uri, vr->prefix), "/admin/info.html"))
     return info_page (vr);
 
+  if (!strcmp (virgule_match_prefix(r->uri, vr->prefix), "/admin/check-dirmax.html"))
+    return dirmax_check_page (vr);
+
   return HTTP_NOT_FOUND;
 }
 
@@ -1053,7 +1278,7 @@ xlat_handler (request_rec *r)
 /* Dispatch table of functions to handle Virgule httpd.conf directives */
 static const command_rec virgule_cmds[] =
 {
-  AP_INIT_TAKE1("VirguleDb", set_virgule_db, NULL, OR_ALL, "the virgule database"),
+  AP_INIT_TAKE12("VirguleDb", set_virgule_db, NULL, OR_ALL, "the virgule database and optional backend (filesystem or log)"),
   AP_INIT_ITERATE("VirgulePass", set_virgule_pass, NULL, OR_ALL, "virgule passthrough directories"),
   {NULL}
 };
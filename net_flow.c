@@ -1,10 +1,22 @@
 /* Implementation of the group trust metric as network flow in C. */
 
+#include <string.h>
 #include <glib.h>
 #include "net_flow.h"
 
 #define TWEAK TRUE
 
+/* The engine used unless virgule_net_flow_set_engine() says otherwise;
+   build with -DNET_FLOW_ENGINE_DEFAULT=NET_FLOW_DINIC to change it. */
+#ifndef NET_FLOW_ENGINE_DEFAULT
+#define NET_FLOW_ENGINE_DEFAULT NET_FLOW_AUGMENT
+#endif
+
+/* The graph in compressed sparse row form, built by net_flow_init_graph
+   once all edges are added. Edges are numbered in order of source, so
+   the out edges of node i are edges out_start[i] to out_start[i + 1] - 1;
+   in_edges lists edge numbers in order of destination, those of node i
+   starting at in_start[i]. */
 struct _NetFlowPriv {
   int n_edges;
 
@@ -14,12 +26,16 @@ struct _NetFlowPriv {
 
   int *node_sink; /* 1 if there is flow from this node to the supersink */
   int *node_flow; /* total flow through the node */
-  int *node_in_degree;
-  int *node_in_degree_max;
-  int **node_in_edges;
-  int *node_out_degree;
-  int *node_out_degree_max;
-  int **node_out_edges;
+  int *out_start;
+  int *in_start;
+  int *in_edges;
+
+  /* scratch space for net_flow_augment */
+  gboolean *visited_in;
+  gboolean *visited_out;
+  int *queue;
+  gboolean *queue_dir;
+  int *pred;
 };
 
 NetFlow *
@@ -29,17 +45,42 @@ virgule_net_flow_new (void)
 
   result->n_nodes = 0;
   result->n_nodes_max = 16;
-  result->n_succs = g_new (int, result->n_nodes_max);
-  result->n_succs_max = g_new (int, result->n_nodes_max);
-  result->succs = g_new (int *, result->n_nodes_max);
+  result->n_edges = 0;
+  result->n_edges_max = 64;
+  result->edge_src = g_new (int, result->n_edges_max);
+  result->edge_dst = g_new (int, result->n_edges_max);
   result->capacity = NULL;
   result->node_id = g_hash_table_new (g_str_hash, g_str_equal);
   result->names = NULL;
+  result->engine = NET_FLOW_ENGINE_DEFAULT;
+  result->n_augment = 0;
   result->priv = NULL;
 
   return result;
 }
 
+/**
+ * net_flow_new_nodes: Create a flow graph of unnamed nodes.
+ * @n_nodes: The number of nodes.
+ *
+ * Creates a graph with nodes numbered 0 to @n_nodes - 1, for callers
+ * that already have their own numbering, such as the cert graph. Add
+ * edges with net_flow_add_edge_ix().
+ *
+ * Return value: The new #NetFlow context.
+ **/
+NetFlow *
+virgule_net_flow_new_nodes (int n_nodes)
+{
+  NetFlow *result = virgule_net_flow_new ();
+
+  result->n_nodes = n_nodes;
+  if (n_nodes > result->n_nodes_max)
+    result->n_nodes_max = n_nodes;
+
+  return result;
+}
+
 static void
 net_flow_free_helper (gpointer key, gpointer value, gpointer user_data)
 {
@@ -50,17 +91,12 @@ void
 virgule_net_flow_free (NetFlow *self)
 {
   NetFlowPriv *priv;
-  int i;
 
   g_hash_table_foreach (self->node_id, net_flow_free_helper, NULL);
   g_hash_table_destroy (self->node_id);
 
-
-  for (i = 0; i < self->n_nodes; i++)
-    g_free (self->succs[i]);
-  g_free (self->n_succs);
-  g_free (self->n_succs_max);
-  g_free (self->succs);
+  g_free (self->edge_src);
+  g_free (self->edge_dst);
   if (self->capacity != NULL)
     g_free (self->capacity);
   if (self->names != NULL)
@@ -69,31 +105,38 @@ virgule_net_flow_free (NetFlow *self)
   priv = self->priv;
   if (priv)
     {
-      for (i = 0; i < self->n_nodes; i++)
-	{
-	  g_free (priv->node_in_edges[i]);
-	  g_free (priv->node_out_edges[i]);
-	}
-
       g_free (priv->edge_src);
       g_free (priv->edge_dst);
       g_free (priv->edge_flow);
 
-
       g_free (priv->node_sink);
       g_free (priv->node_flow);
-      g_free (priv->node_in_degree);
-      g_free (priv->node_in_degree_max);
-      g_free (priv->node_in_edges);
-      g_free (priv->node_out_degree);
-      g_free (priv->node_out_degree_max);
-      g_free (priv->node_out_edges);
+      g_free (priv->out_start);
+      g_free (priv->in_start);
+      g_free (priv->in_edges);
+
+      g_free (priv->visited_in);
+      g_free (priv->visited_out);
+      g_free (priv->queue);
+      g_free (priv->queue_dir);
+      g_free (priv->pred);
       g_free (priv);
     }
 
   g_free (self);
 }
 
+/**
+ * net_flow_set_engine: Choose the max flow algorithm.
+ * @self: The #NetFlow context.
+ * @engine: The engine to use in net_flow_max_flow().
+ **/
+void
+virgule_net_flow_set_engine (NetFlow *self, NetFlowEngine engine)
+{
+  self->engine = engine;
+}
+
 gint
 virgule_net_flow_find_node (NetFlow *self, const char *name)
 {
@@ -110,18 +153,10 @@ virgule_net_flow_find_node (NetFlow *self, const char *name)
   if (self->n_nodes == self->n_nodes_max)
     {
       self->n_nodes_max <<= 1;
-      self->n_succs = g_realloc (self->n_succs,
-				 sizeof(int) * self->n_nodes_max);
-      self->n_succs_max = g_realloc (self->n_succs_max,
-				     sizeof(int) * self->n_nodes_max);
-      self->succs = g_realloc (self->succs, sizeof(int *) * self->n_nodes_max);
       if (self->capacity != NULL)
 	self->capacity = g_realloc (self->capacity,
 				    sizeof(int) * self->n_nodes_max);
     }
-  self->n_succs[self->n_nodes] = 0;
-  self->n_succs_max[self->n_nodes] = 16;
-  self->succs[self->n_nodes] = g_new (int, self->n_succs_max[self->n_nodes]);
 
   return self->n_nodes++;
 }
@@ -154,13 +189,38 @@ virgule_net_flow_node_name (NetFlow *self, int node)
      method. */
   if (!self->names)
     {
-      self->names = g_new (char *, self->n_nodes);
+      /* nodes from net_flow_new_nodes() have no names */
+      self->names = g_new0 (char *, self->n_nodes);
       g_hash_table_foreach (self->node_id, net_flow_node_name_helper, self);
     }
 
   return self->names[node];
 }
 
+/**
+ * net_flow_add_edge_ix: Add an edge between numbered nodes.
+ * @self: The #NetFlow context.
+ * @src: The source node number.
+ * @dst: The destination node number.
+ *
+ * Edges must all be added before net_flow_max_flow() is called.
+ **/
+void
+virgule_net_flow_add_edge_ix (NetFlow *self, int src, int dst)
+{
+  if (self->n_edges == self->n_edges_max)
+    {
+      self->n_edges_max <<= 1;
+      self->edge_src = g_realloc (self->edge_src,
+				  self->n_edges_max * sizeof(int));
+      self->edge_dst = g_realloc (self->edge_dst,
+				  self->n_edges_max * sizeof(int));
+    }
+  self->edge_src[self->n_edges] = src;
+  self->edge_dst[self->n_edges] = dst;
+  self->n_edges++;
+}
+
 void
 virgule_net_flow_add_edge (NetFlow *self, const char *src, const char *dst)
 {
@@ -169,19 +229,87 @@ virgule_net_flow_add_edge (NetFlow *self, const char *src, const char *dst)
 
   src_id = virgule_net_flow_find_node (self, src);
   dst_id = virgule_net_flow_find_node (self, dst);
-  if (self->n_succs[src_id] == self->n_succs_max[src_id])
+  virgule_net_flow_add_edge_ix (self, src_id, dst_id);
+}
+
+/* This method initializes the graph data structures used for network
+   flow computation, based on the edge list created by repeated
+   invocation of add_edge(). The edges are counting sorted into
+   compressed sparse row form, keeping the order they were added in
+   for each node, and the edge list is then freed. */
+
+static void
+net_flow_init_graph (NetFlow *self)
+{
+  NetFlowPriv *priv;
+  int n_nodes = self->n_nodes;
+  int n_edges;
+  int *next;
+  int i, e;
+
+  if (self->priv != NULL)
+    return;
+
+  priv = g_new (NetFlowPriv, 1);
+
+  /* count edges per node, leaving out self-edges */
+  priv->out_start = g_new0 (int, n_nodes + 1);
+  priv->in_start = g_new0 (int, n_nodes + 1);
+  for (i = 0; i < self->n_edges; i++)
+    if (self->edge_src[i] != self->edge_dst[i])
+      {
+	priv->out_start[self->edge_src[i] + 1]++;
+	priv->in_start[self->edge_dst[i] + 1]++;
+      }
+  for (i = 0; i < n_nodes; i++)
     {
-      self->n_succs_max[src_id] <<= 1;
-      self->succs[src_id] = g_realloc (self->succs[src_id],
-				       self->n_succs_max[src_id] *
-				       sizeof(int));
+      priv->out_start[i + 1] += priv->out_start[i];
+      priv->in_start[i + 1] += priv->in_start[i];
     }
-  self->succs[src_id][self->n_succs[src_id]++] = dst_id;
+  n_edges = priv->out_start[n_nodes];
+
+  priv->edge_src = g_new (int, n_edges + 1);
+  priv->edge_dst = g_new (int, n_edges + 1);
+  priv->edge_flow = g_new0 (int, n_edges + 1);
+  priv->in_edges = g_new (int, n_edges + 1);
+
+  next = g_new (int, n_nodes + 1);
+  memcpy (next, priv->out_start, n_nodes * sizeof (int));
+  for (i = 0; i < self->n_edges; i++)
+    if (self->edge_src[i] != self->edge_dst[i])
+      {
+	e = next[self->edge_src[i]]++;
+	priv->edge_src[e] = self->edge_src[i];
+	priv->edge_dst[e] = self->edge_dst[i];
+      }
+  memcpy (next, priv->in_start, n_nodes * sizeof (int));
+  for (e = 0; e < n_edges; e++)
+    priv->in_edges[next[priv->edge_dst[e]]++] = e;
+  g_free (next);
+
+  g_free (self->edge_src);
+  g_free (self->edge_dst);
+  self->edge_src = NULL;
+  self->edge_dst = NULL;
+  self->n_edges = 0;
+
+  priv->node_sink = g_new0 (int, n_nodes);
+  priv->node_flow = g_new0 (int, n_nodes);
+
+  priv->visited_in = g_new (gboolean, n_nodes);
+  priv->visited_out = g_new (gboolean, n_nodes);
+  priv->queue = g_new (int, n_nodes * 2);
+  priv->queue_dir = g_new (gboolean, n_nodes * 2);
+  priv->pred = g_new (int, n_nodes * 2);
+
+  priv->n_edges = n_edges;
+  self->priv = priv;
 }
 
 static void
 net_flow_assign_capacities (NetFlow *self, gint seed, const int *caps, int n_caps)
 {
+  NetFlowPriv *priv = self->priv;
   int i, j, k;
   gint *node_list;
   int beg_nl, end_nl;
@@ -213,11 +341,9 @@ net_flow_assign_capacities (NetFlow *self, gint seed, const int *caps, int n_cap
       for (j = beg_nl; j < end_nl; j++)
 	{
 	  int ix = node_list[j];
-	  int *succs = self->succs[ix];
-	  int n_succs = self->n_succs[ix];
-	  for (k = 0; k < n_succs; k++)
+	  for (k = priv->out_start[ix]; k < priv->out_start[ix + 1]; k++)
 	    {
-	      int succ = succs[k];
+	      int succ = priv->edge_dst[k];
 	      if (capacity[succ] == -1)
 		{
 		  capacity[succ] = cap;
@@ -245,6 +371,7 @@ net_flow_assign_capacities (NetFlow *self, gint seed, const int *caps, int n_cap
 int *
 virgule_net_flow_assign_tree (NetFlow *self, gint seed, const int *caps, int n_caps)
 {
+  NetFlowPriv *priv;
   int n_nodes = self->n_nodes;
   int *pred;
   int *n_children;
@@ -256,6 +383,8 @@ virgule_net_flow_assign_tree (NetFlow *self, gint seed, const int *caps, int n_c
   int level;
   int *child_ix;
 
+  net_flow_init_graph (self);
+  priv = self->priv;
   net_flow_assign_capacities (self, seed, caps, n_caps);
 
   pred = g_new (int, n_nodes);
@@ -290,8 +419,8 @@ virgule_net_flow_assign_tree (NetFlow *self, gint seed, const int *caps, int n_c
 	  {
 	    /* add children of cur_node to tree, respecting capacity
 	       constraint */
-	    int n_succ = self->n_succs[cur_node];
-	    int *succ = self->succs[cur_node];
+	    int n_succ = priv->out_start[cur_node + 1] - priv->out_start[cur_node];
+	    int *succ = priv->edge_dst + priv->out_start[cur_node];
 	    int j;
 
 	    n_children[cur_node] = 0;
@@ -435,106 +564,6 @@ virgule_net_flow_sanity_check_tree (NetFlow *self, int seed, int *pred)
   return result;
 }
 
-static int
-net_flow_n_edges (NetFlow *self)
-{
-  int i;
-  int result;
-
-  result = 0;
-  for (i = 0; i < self->n_nodes; i++)
-    result += self->n_succs[i];
-  return result;
-}
-
-/* This method initializes the graph data structures used for network
-   flow computation, based on the successor list created by repeated
-   invocation of add_edge(). */
-
-static void
-net_flow_init_graph (NetFlow *self)
-{
-  NetFlowPriv *priv;
-  int i;
-  int n_edges;
-  int e = 0; /* allocation index for new edges */
-  int src;
-
-  priv = g_new (NetFlowPriv, 1);
-
-  n_edges = net_flow_n_edges (self);
-
-  priv->edge_src = g_new (int, n_edges);
-  priv->edge_dst = g_new (int, n_edges);
-  priv->edge_flow = g_new (int, n_edges);
-
-  priv->node_sink = g_new (int, self->n_nodes);
-  priv->node_flow = g_new (int, self->n_nodes);
-  priv->node_in_degree = g_new (int, self->n_nodes);
-  priv->node_in_degree_max = g_new (int, self->n_nodes);
-  priv->node_in_edges = g_new (int *, self->n_nodes);
-  priv->node_out_degree = g_new (int, self->n_nodes);
-  priv->node_out_degree_max = g_new (int, self->n_nodes);
-  priv->node_out_edges = g_new (int *, self->n_nodes);
-
-  for (i = 0; i < self->n_nodes; i++)
-    {
-      priv->node_sink[i] = 0;
-      priv->node_flow[i] = 0;
-      priv->node_in_degree[i] = 0;
-      priv->node_in_degree_max[i] = 16;
-      priv->node_in_edges[i] = g_new (int, priv->node_in_degree_max[i]);
-      priv->node_out_degree[i] = 0;
-      priv->node_out_degree_max[i] = 16;
-      priv->node_out_edges[i] = g_new (int, priv->node_out_degree_max[i]);
-    }
-
-  for (src = 0; src < self->n_nodes; src++)
-    {
-      int n_succ = self->n_succs[src];
-      int *succ = self->succs[src];
-      int j;
-
-      for (j = 0; j < n_succ; j++)
-	{
-	  int dst = succ[j];
-
-	  if (src != dst)
-	    {
-	      int degree_src, degree_dst;
-
-	      priv->edge_src[e] = src;
-	      priv->edge_dst[e] = dst;
-	      priv->edge_flow[e] = 0;
-
-	      degree_src = priv->node_out_degree[src];
-	      if (degree_src == priv->node_out_degree_max[src])
-		priv->node_out_edges[src] =
-		  g_realloc (priv->node_out_edges[src],
-			     sizeof (int) *
-			     (priv->node_out_degree_max[src] <<= 1));
-	      priv->node_out_edges[src][degree_src] = e;
-	      priv->node_out_degree[src]++;
-
-	      degree_dst = priv->node_in_degree[dst];
-	      if (degree_dst == priv->node_in_degree_max[dst])
-		priv->node_in_edges[dst] =
-		  g_realloc (priv->node_in_edges[dst],
-			     sizeof (int) *
-			     (priv->node_in_degree_max[dst] <<= 1));
-	      priv->node_in_edges[dst][degree_dst] = e;
-	      priv->node_in_degree[dst]++;
-
-	      e++;
-	    }
-	}
-    }
-
-  /* e <= n_edges, because e doesn't count self-edges */
-  priv->n_edges = e;
-  self->priv = priv;
-}
-
 /**
  * net_flow_from_tree: Set up flows in graph based on tree assignment.
  * @self: The #NetFlow context.
@@ -563,15 +592,11 @@ net_flow_from_tree (NetFlow *self, int *pred_list)
 	      if (ix != next)
 		{
 		  /* find edge from next to ix and increment flow */
-		  int *edges;
-		  int n_edges;
 		  int j;
 
-		  edges = priv->node_in_edges[ix];
-		  n_edges = priv->node_in_degree[ix];
-		  for (j = 0; j < n_edges; j++)
+		  for (j = priv->in_start[ix]; j < priv->in_start[ix + 1]; j++)
 		    {
-		      int edge = edges[j];
+		      int edge = priv->in_edges[j];
 		      if (priv->edge_src[edge] == next)
 			{
 			  priv->edge_flow[edge]++;
@@ -599,11 +624,11 @@ net_flow_augment (NetFlow *self, int seed)
 {
   NetFlowPriv *priv = self->priv;
   int n_nodes = self->n_nodes;
-  gboolean *visited_in = g_new (gboolean, n_nodes);
-  gboolean *visited_out = g_new (gboolean, n_nodes);
-  int *queue = g_new (int, n_nodes * 2);
-  gboolean *queue_dir = g_new (gboolean, n_nodes * 2); /* out = true */
-  int *pred = g_new (int, n_nodes * 2);
+  gboolean *visited_in = priv->visited_in;
+  gboolean *visited_out = priv->visited_out;
+  int *queue = priv->queue;
+  gboolean *queue_dir = priv->queue_dir; /* out = true */
+  int *pred = priv->pred;
   int q_beg, q_end;
   gboolean result = FALSE;
   int i;
@@ -683,14 +708,12 @@ net_flow_augment (NetFlow *self, int seed)
 		    {
 		      /* find the edge from pred_node to node and
                          increment flow */
-		      int *edges = priv->node_in_edges[node];
-		      int degree = priv->node_in_degree[node];
 		      int edge = -1;
 		      int j;
 
-		      for (j = 0; j < degree; j++)
+		      for (j = priv->in_start[node]; j < priv->in_start[node + 1]; j++)
 			{
-			  edge = edges[j];
+			  edge = priv->in_edges[j];
 			  if (priv->edge_src[edge] == pred_node)
 			    break;
 			}
@@ -703,14 +726,10 @@ net_flow_augment (NetFlow *self, int seed)
 		    {
 		      /* find the edge from node to pred_node and
 			 decrement flow */
-		      int *edges = priv->node_out_edges[node];
-		      int degree = priv->node_out_degree[node];
 		      int edge = -1;
-		      int j;
 
-		      for (j = 0; j < degree; j++)
+		      for (edge = priv->out_start[node]; edge < priv->out_start[node + 1]; edge++)
 			{
-			  edge = edges[j];
 			  if (priv->edge_dst[edge] == pred_node)
 			    break;
 			}
@@ -760,13 +779,10 @@ net_flow_augment (NetFlow *self, int seed)
 	  if (node_dir)
 	    {
 	      /* outgoing edges */
-	      int *edges = priv->node_out_edges[node];
-	      int degree = priv->node_out_degree[node];
-	      int j;
+	      int edge;
 
-	      for (j = 0; j < degree; j++)
+	      for (edge = priv->out_start[node]; edge < priv->out_start[node + 1]; edge++)
 		{
-		  int edge = edges[j];
 		  int dst = priv->edge_dst[edge];
 
 		  if (!visited_in[dst])
@@ -785,13 +801,11 @@ net_flow_augment (NetFlow *self, int seed)
 	  else
 	    {
 	      /* ingoing edges */
-	      int *edges = priv->node_in_edges[node];
-	      int degree = priv->node_in_degree[node];
 	      int j;
 
-	      for (j = 0; j < degree; j++)
+	      for (j = priv->in_start[node]; j < priv->in_start[node + 1]; j++)
 		{
-		  int edge = edges[j];
+		  int edge = priv->in_edges[j];
 		  int src = priv->edge_src[edge];
 
 		  if (!visited_out[src] && priv->edge_flow[edge] > 0)
@@ -811,13 +825,183 @@ net_flow_augment (NetFlow *self, int seed)
 	} /* if ((node_dir) == !TWEAK ...) */
     } /* for (q_beg = 0...) */
 
-  g_free (pred);
-  g_free (queue_dir);
+  return result;
+}
+
+/* Dinic's algorithm works on the same split graph as net_flow_augment:
+   each node has an in half, vertex 2 * node, and an out half, vertex
+   2 * node + 1. The in half has an arc to the out half with the node's
+   remaining capacity and a unit arc to the supersink, vertex
+   2 * n_nodes. Edges run from out halves to in halves without limit.
+   In the residual graph the arcs out of a vertex are numbered:
+
+     in half:  0 supersink, 1 own out half, 2 + j back along in edge j
+     out half: 0 back to own in half, 1 + j along out edge j
+
+   Every path ends with a unit supersink arc, so each carries one unit. */
+
+static int
+net_flow_dinic_n_arcs (NetFlow *self, int x)
+{
+  NetFlowPriv *priv = self->priv;
+  int node = x >> 1;
+
+  if (x & 1)
+    return 1 + priv->out_start[node + 1] - priv->out_start[node];
+  return 2 + priv->in_start[node + 1] - priv->in_start[node];
+}
+
+/* Return the vertex arc @arc of @x leads to, or -1 if the arc has no
+   residual capacity. */
+static int
+net_flow_dinic_arc (NetFlow *self, int x, int arc)
+{
+  NetFlowPriv *priv = self->priv;
+  int node = x >> 1;
+  int edge;
+
+  if (x & 1)
+    {
+      if (arc == 0)
+	return priv->node_flow[node] > 0 ? x - 1 : -1;
+      edge = priv->out_start[node] + arc - 1;
+      return 2 * priv->edge_dst[edge];
+    }
+  if (arc == 0)
+    return priv->node_sink[node] == 0 ? 2 * self->n_nodes : -1;
+  if (arc == 1)
+    return priv->node_flow[node] < self->capacity[node] ? x + 1 : -1;
+  edge = priv->in_edges[priv->in_start[node] + arc - 2];
+  return priv->edge_flow[edge] > 0 ? 2 * priv->edge_src[edge] + 1 : -1;
+}
+
+/* Push one unit along arc @arc of @x. */
+static void
+net_flow_dinic_push (NetFlow *self, int x, int arc)
+{
+  NetFlowPriv *priv = self->priv;
+  int node = x >> 1;
+
+  if (x & 1)
+    {
+      if (arc == 0)
+	priv->node_flow[node]--;
+      else
+	priv->edge_flow[priv->out_start[node] + arc - 1]++;
+    }
+  else if (arc == 0)
+    priv->node_sink[node] = 1;
+  else if (arc == 1)
+    priv->node_flow[node]++;
+  else
+    priv->edge_flow[priv->in_edges[priv->in_start[node] + arc - 2]]--;
+}
+
+/* Label vertices with their distance from seed-in in the residual
+   graph. Return the distance of the supersink, or -1 if unreachable. */
+static int
+net_flow_dinic_levels (NetFlow *self, int seed, int *level, int *queue)
+{
+  int n_vertices = 2 * self->n_nodes;
+  int sink = n_vertices;
+  int q_beg, q_end;
+  int x, y, arc, n_arcs;
+  int i;
+
+  for (i = 0; i <= n_vertices; i++)
+    level[i] = -1;
+
+  q_end = 0;
+  queue[q_end++] = 2 * seed;
+  level[2 * seed] = 0;
+  for (q_beg = 0; q_beg < q_end; q_beg++)
+    {
+      x = queue[q_beg];
+      /* nothing past the supersink's level can be on a shortest path */
+      if (level[sink] >= 0 && level[x] + 1 >= level[sink])
+	break;
+      n_arcs = net_flow_dinic_n_arcs (self, x);
+      for (arc = 0; arc < n_arcs; arc++)
+	{
+	  y = net_flow_dinic_arc (self, x, arc);
+	  if (y >= 0 && level[y] == -1)
+	    {
+	      level[y] = level[x] + 1;
+	      if (y != sink)
+		queue[q_end++] = y;
+	    }
+	}
+    }
+  return level[sink];
+}
+
+/**
+ * net_flow_dinic: Augment the flow to a maximum with Dinic's algorithm.
+ * @self: The #NetFlow context.
+ * @seed: The seed.
+ *
+ * Return value: The number of units of flow added.
+ **/
+static int
+net_flow_dinic (NetFlow *self, int seed)
+{
+  int n_vertices = 2 * self->n_nodes;
+  int sink = n_vertices;
+  int *level = g_new (int, n_vertices + 1);
+  int *queue = g_new (int, n_vertices + 1);
+  int *cur = g_new (int, n_vertices);
+  int *path;
+  int depth, x, y, i;
+  int n_aug = 0;
+
+  while (net_flow_dinic_levels (self, seed, level, queue) > 0)
+    {
+      /* path[i] is the vertex at distance i, left along arc cur[path[i]] */
+      path = queue;
+      for (i = 0; i < n_vertices; i++)
+	cur[i] = 0;
+
+      depth = 0;
+      path[0] = 2 * seed;
+      while (depth >= 0)
+	{
+	  x = path[depth];
+	  if (x == sink)
+	    {
+	      for (i = 0; i < depth; i++)
+		net_flow_dinic_push (self, path[i], cur[path[i]]);
+	      n_aug++;
+	      depth = 0;
+	      continue;
+	    }
+
+	  y = -1;
+	  for (; cur[x] < net_flow_dinic_n_arcs (self, x); cur[x]++)
+	    {
+	      y = net_flow_dinic_arc (self, x, cur[x]);
+	      if (y >= 0 && level[y] == level[x] + 1)
+		break;
+	      y = -1;
+	    }
+
+	  if (y >= 0)
+	    path[++depth] = y;
+	  else
+	    {
+	      /* dead end; no blocking path goes through x */
+	      level[x] = -1;
+	      depth--;
+	      if (depth >= 0)
+		cur[path[depth]]++;
+	    }
+	}
+    }
+
+  g_free (cur);
   g_free (queue);
-  g_free (visited_out);
-  g_free (visited_in);
+  g_free (level);
 
-  return result;
+  return n_aug;
 }
 
 /**
@@ -828,7 +1012,8 @@ net_flow_augment (NetFlow *self, int seed)
  * @n_caps: The number of elements in @caps.
  *
  * Computes a network flow, storing the results in the priv element
- * of @self.
+ * of @self. The flow starts from a greedy tree assignment and is then
+ * augmented by the engine chosen with net_flow_set_engine().
  **/
 void
 virgule_net_flow_max_flow (NetFlow *self, gint seed, const int *caps, int n_caps)
@@ -861,19 +1046,23 @@ virgule_net_flow_max_flow (NetFlow *self, gint seed, const int *caps, int n_caps
   virgule_net_flow_sanity_check (self, seed);
 
   n_aug = 0;
-  while (net_flow_augment (self, seed))
-    {
-      n_aug++;
+  if (self->engine == NET_FLOW_DINIC)
+    n_aug = net_flow_dinic (self, seed);
+  else
+    while (net_flow_augment (self, seed))
+      {
+	n_aug++;
 #ifdef VERBOSE
-      if (n_aug % 100 == 0)
-	g_print ("%d augmentations\n", n_aug);
+	if (n_aug % 100 == 0)
+	  g_print ("%d augmentations\n", n_aug);
 #endif	
-    }
+      }
 #ifdef VERBOSE
   g_print ("total flow %d with %d augmentations\n",
 	   priv->node_flow[seed],
 	   n_aug);
 #endif
+  self->n_augment = n_aug;
 
   virgule_net_flow_sanity_check (self, seed);
 }
@@ -937,13 +1126,10 @@ virgule_net_flow_sanity_check (NetFlow *self, gint seed)
 	}
       if (n != seed)
 	{
-	  int *in_edges = priv->node_in_edges[n];
-	  int in_degree = priv->node_in_degree[n];
-
 	  flow = 0;
-	  for (j = 0; j < in_degree; j++)
+	  for (j = priv->in_start[n]; j < priv->in_start[n + 1]; j++)
 	    {
-	      e = in_edges[j];
+	      e = priv->in_edges[j];
 	      if (priv->edge_dst[e] != n)
 		{
 		  g_warning ("Edge/node data structure inconsistency\n");
@@ -958,13 +1144,9 @@ virgule_net_flow_sanity_check (NetFlow *self, gint seed)
 	    }
 	}
       {
-	int *out_edges = priv->node_out_edges[n];
-	int out_degree = priv->node_out_degree[n];
-
 	flow = 0;
-	for (j = 0; j < out_degree; j++)
+	for (e = priv->out_start[n]; e < priv->out_start[n + 1]; e++)
 	  {
-	    e = out_edges[j];
 	    if (priv->edge_src[e] != n)
 	      {
 		g_warning ("Edge/node data structure inconsistency\n");
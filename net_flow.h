@@ -1,18 +1,33 @@
 typedef struct _NetFlow NetFlow;
 typedef struct _NetFlowPriv NetFlowPriv;
 
+/* How virgule_net_flow_max_flow() augments the initial tree flow. Both
+   find a maximum flow, but may accept different sets of nodes when
+   more than one maximum flow exists. */
+typedef enum {
+  NET_FLOW_AUGMENT,	/* one unit augmenting path per breadth first search */
+  NET_FLOW_DINIC	/* blocking flows in a level graph (Dinic) */
+} NetFlowEngine;
+
 struct _NetFlow {
   int n_nodes;
   int n_nodes_max;
-  int *n_succs;
-  int *n_succs_max;
-  int **succs;
+
+  /* edges as added; moved into priv by net_flow_max_flow */
+  int n_edges;
+  int n_edges_max;
+  int *edge_src;
+  int *edge_dst;
+
   int *capacity;
 
   GHashTable *node_id; /* maps node objects to node numbers */
 
   char **names; /* maps node numbers to names */
 
+  NetFlowEngine engine;
+  int n_augment; /* units added to the tree flow by net_flow_max_flow */
+
   NetFlowPriv *priv;
 };
 
@@ -22,6 +37,9 @@ virgule_net_flow_new (void);
 void
 virgule_net_flow_free (NetFlow *self);
 
+void
+virgule_net_flow_set_engine (NetFlow *self, NetFlowEngine engine);
+
 gint
 virgule_net_flow_find_node (NetFlow *self, const char *name);
 
@@ -31,6 +49,12 @@ virgule_net_flow_node_name (NetFlow *self, int node);
 void
 virgule_net_flow_add_edge (NetFlow *self, const char *src, const char *dst);
 
+NetFlow *
+virgule_net_flow_new_nodes (int n_nodes);
+
+void
+virgule_net_flow_add_edge_ix (NetFlow *self, int src, int dst);
+
 int *
 virgule_net_flow_assign_tree (NetFlow *self, gint seed, const int *caps, int n_caps);
 
@@ -47,7 +47,14 @@ struct virgule_private {
   char 		    *tmetric;	  /* Trust metric cache */
   apr_time_t	     tm_mtime;    /* Time of last tmetric change */
   apr_pool_t	    *tm_pool;     /* Subpool used for tmetric cache */
+  struct apr_hash_t *tm_index;    /* username -> CertLevel, built in tm_pool */
   int                render_diaryratings;
+  double             eigen_tolerance;  /* ratings crank convergence */
+  int                eigen_iterations; /* ratings crank iteration cap */
+  int                eigen_threads;    /* ratings crank threads, 0 for one per CPU */
+  int                eigen_update_max; /* recranks per diary rating, 0 for no limit */
+  int                session_timeout;  /* seconds a checked cookie is trusted, 0 for off */
+  int                lastlogin_interval; /* seconds between lastlogin writes, 0 for every visit */
   int                allow_account_creation;
   int		     allow_account_extendedcharset;
   int		     use_article_title_links;
@@ -69,5 +76,10 @@ struct virgule_private {
     PROJSTYLE_NICK,
     PROJSTYLE_STEVE
   }               projstyle;
+  enum {
+    TMETRIC_ENGINE_DEFAULT,
+    TMETRIC_ENGINE_AUGMENT,
+    TMETRIC_ENGINE_DINIC
+  }               tmetric_engine;
 };
 
@@ -130,8 +130,7 @@ proj_ok_to_edit (VirguleReq *vr, xmlDoc *doc)
   if (vr->u == NULL)
     return 0;
 
-  if (strcmp (virgule_req_get_tmetric_level (vr, vr->u),
-		  virgule_cert_level_to_name (vr, CERT_LEVEL_NONE)))
+  if (virgule_req_get_tmetric_cert_level (vr, vr->u) != CERT_LEVEL_NONE)
     return 1;
 
   tree = virgule_xml_find_child (doc->xmlRootNode, "info");
@@ -291,8 +290,8 @@ proj_newsub_serve (VirguleReq *vr)
 			    "database",
 			    "There was an error storing the <x>project</x>. This means there's something wrong with the site.");
 
-  virgule_add_recent (p, db, "recent/proj-c.xml", name, 50, 0);
-  virgule_add_recent (p, db, "recent/proj-m.xml", name,
+  virgule_add_recent (p, db, "recent/proj-c", name, 50, 0);
+  virgule_add_recent (p, db, "recent/proj-m", name,
               vr->priv->projstyle == PROJSTYLE_RAPH ? 50 : -1, 0);
 
   return virgule_send_error_page (vr, vINFO,
@@ -629,18 +628,18 @@ static int
 proj_next_new_serve (VirguleReq *vr)
 {
   apr_pool_t *p = vr->r->pool;
-  xmlDoc *doc;
-  xmlNode *root, *tree;
+  apr_array_header_t *items;
+  int i;
 
-  doc = virgule_db_xml_get (p, vr->db, "recent/proj-m.xml");
-  if (doc == NULL)
+  items = virgule_recent_get (p, vr->db, "recent/proj-m", -1);
+  if (items == NULL)
     return virgule_send_error_page (vr, vERROR, "database",
 			    "The modification log was not found.");
-  root = doc->xmlRootNode;
-  for (tree = root->children; tree != NULL; tree = tree->next)
+  /* oldest first */
+  for (i = items->nelts - 1; i >= 0; i--)
     {
-      char *name = virgule_xml_get_string_contents (tree);
-      char *date = virgule_xml_get_prop (p, tree, (xmlChar *)"date");
+      const char *name = ((RecentItem *)items->elts)[i].key;
+      const char *date = ((RecentItem *)items->elts)[i].date;
       char *lastread_date = virgule_acct_get_lastread_date (vr, "proj", name);
   
       if (lastread_date != NULL)
@@ -662,7 +661,6 @@ proj_next_new_serve (VirguleReq *vr)
 				    name);
 	  }
     }
-  virgule_db_xml_free (p, doc);
   apr_table_add (vr->r->headers_out, "refresh", "0;URL=/");
   return virgule_send_error_page (vr, vINFO, "Next room", "There are no more rooms with new messages.");
 }
@@ -775,7 +773,7 @@ proj_editsub_serve (VirguleReq *vr)
     return virgule_send_error_page (vr, vERROR, "forbidden",
 			    "There was an error storing the <x>project</x>. This means there's something wrong with the site.");
 
-  virgule_add_recent (p, db, "recent/proj-m.xml", name, 
+  virgule_add_recent (p, db, "recent/proj-m", name, 
 	      vr->priv->projstyle != PROJSTYLE_NICK ? 50 : -1, 0);
 
   return virgule_send_error_page (vr, vINFO, "<x>Project</x> Updated",
@@ -904,10 +902,13 @@ proj_update_all_pointers_serve (VirguleReq *vr)
   Db *db = vr->db;
   DbCursor *dbc;
   char *proj;
+  apr_array_header_t *projs, *last_read;
 
   virgule_auth_user (vr);
 
   dbc = virgule_db_open_dir (db, "proj");
+  projs = apr_array_make (p, 64, sizeof (char *));
+  last_read = apr_array_make (p, 64, sizeof (int));
 
   while ((proj = virgule_db_read_dir_raw (dbc)) != NULL)
     {
@@ -916,8 +917,13 @@ proj_update_all_pointers_serve (VirguleReq *vr)
 
 	base = apr_psprintf (p, "proj/%s", proj);
 	n_reply = virgule_db_dir_max (db, base);
-	virgule_acct_set_lastread(vr, "proj", proj, n_reply -1);
+	*(char **)apr_array_push (projs) = proj;
+	*(int *)apr_array_push (last_read) = n_reply - 1;
     }
+  /* one write of the pointers, not one per project */
+  virgule_acct_set_lastread_many (vr, "proj", projs->nelts,
+				  (const char **)projs->elts,
+				  (const int *)last_read->elts);
   apr_table_add (vr->r->headers_out, "refresh", "0;URL=/");
   return virgule_send_error_page (vr, vINFO, "Updated", "Your pointers have all been updated.");
 }
@@ -1041,7 +1047,7 @@ proj_reply_submit_serve (VirguleReq *vr)
 			    "There was an error storing the reply. This means there's something wrong with the site.");
 
   /* update the info page */
-  virgule_add_recent (p, vr->db, "recent/proj-m.xml", name, -1, 0);
+  virgule_add_recent (p, vr->db, "recent/proj-m", name, -1, 0);
 
   if (status)
     virgule_send_error_page (vr, vERROR, "database",
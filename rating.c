@@ -78,6 +78,7 @@ rating_rate_diary (VirguleReq *vr)
 				"Ratings must be from 1 to 10.");
       subj = apr_pstrcat (vr->r->pool, "d/", subject, NULL);
       virgule_eigen_set_local (vr, subj, (double)rating);
+      virgule_eigen_update (vr, vr->priv->eigen_update_max);
       return virgule_send_error_page (vr, vINFO, "Submitted",
 			     "Your rating of %s's blog as %d is noted. Thanks.",
 			     subject, rating);
@@ -112,40 +113,45 @@ rating_crank (VirguleReq *vr, const char *u)
 
 
 /**
- * rating_crank_all: This is a complete rewrite of Raph's original. There
- * is an approximate 30% speed improvement from using the presorted tmetric
- * cache instead of looping through every account in the XML acct tree and
- * testing to see if it's an alias or not. 
- * There is room for further improvement. The memory pool allocation in
- * each iteration of the loop is a work around for a memory leak somewhere 
- * in the eigen code.
+ * rating_crank_all: Crank the ratings of every account to convergence
+ * with the in-memory engine, virgule_eigen_crank_all.
  **/
 static int
 rating_crank_all (VirguleReq *vr)
 {
-  char *tmetric = virgule_req_get_tmetric (vr);
-  char *user;
-  int i = 0;
-  int j, k;
-  apr_pool_t *sp;
+  double delta;
+  int n_iter = virgule_eigen_crank_all (vr, &delta);
+
+  if (n_iter < 0)
+    return virgule_send_error_page (vr, vERROR, "rating",
+				    "Error loading the cert graph.");
+  if (delta > vr->priv->eigen_tolerance)
+    return virgule_send_error_page (vr, vINFO, "rating",
+				    "Ratings cranked for all nodes, but they "
+				    "had not converged after the limit of %d "
+				    "iterations (largest change in the last, "
+				    "%g, tolerance %g).",
+				    n_iter, delta, vr->priv->eigen_tolerance);
+  return virgule_send_error_page (vr, vINFO, "rating",
+				  "Ratings cranked for all nodes in %d "
+				  "iterations (largest change in the last, %g).",
+				  n_iter, delta);
+}
 
-  while(tmetric[i])
-    {
-      for(j = 0; tmetric[i + j] && tmetric[i + j] != '\n'; j++); /* EOL */
-      for(k = j; k > 0 && tmetric[i + k] != ' '; k--); /* username */
-      user = apr_palloc (vr->r->pool, k + 1);
-      memcpy (user, tmetric + i, k);
-      user[k] = 0;
-      i += j;
-      if (tmetric[i] == '\n')
-        i++;
-
-      apr_pool_create(&sp,vr->r->pool);   
-      virgule_eigen_crank (sp, vr, user);
-      apr_pool_destroy (sp);
-    }
 
-  return virgule_send_error_page (vr, vINFO, "rating", "Ratings cranked for all nodes.");
+/**
+ * rating_update: Recrank the ratings invalidated by rating changes not
+ * yet cranked. Rating a diary does this itself, up to the configured
+ * number of recranks, so this is only needed to catch up on the rest
+ * or after an update was interrupted.
+ **/
+static int
+rating_update (VirguleReq *vr)
+{
+  int n = virgule_eigen_update (vr, 0);
+
+  return virgule_send_error_page (vr, vINFO, "rating",
+				  "Ratings updated for %d nodes.", n);
 }
 
 
@@ -175,19 +181,14 @@ rating_report (VirguleReq *vr, const char *u)
 /**
  * rating_clean - Remove rating files for accounts that no longer exist. Read
  * rating files for the remaining good accounts and remove any ratings of 
- * nonexistent users. Because Raph's hash implementation does not provide a
- * way of removing a key from the hash, it's necesary to create a new hash 
- * for each rating table, leaving out the keys that should be deleted. At 
- * some point, Raph's hash implementation should be replaced with the one in
- * the Apache APR and this code can be simplified.
+ * nonexistent users.
  */
 static int
 rating_clean (VirguleReq *vr)
 {
-  apr_finfo_t finfo;
-  apr_status_t status;
+  DbStamp stamp;
   DbCursor *dbc;
-  char *u, *eigenkey, *profilekey, *profile;
+  char *u, *eigenkey, *profilekey;
   
   if (virgule_set_temp_buffer (vr) != 0)
     return HTTP_INTERNAL_SERVER_ERROR;
@@ -199,33 +200,36 @@ rating_clean (VirguleReq *vr)
     {
       eigenkey = apr_pstrcat (vr->r->pool, "eigen/local/", u, NULL);
       profilekey = apr_pstrcat (vr->r->pool, "acct/", u, "/profile.xml", NULL);
-      profile = virgule_db_mk_filename (vr->r->pool, vr->db, profilekey);    
-      status = apr_stat (&finfo, profile, APR_FINFO_MIN, vr->r->pool);
-      if (status == APR_SUCCESS)
+      if (virgule_db_stamp (vr->r->pool, vr->db, profilekey, &stamp) == 0)
         {
           const char *key;
           void *val;
-	  HashTable *elt1, *elt2;
+	  HashTable *elt;
 	  HashTableIter *iter;
-	  elt1 = virgule_eigen_local_load (vr->r->pool, vr, eigenkey);
-	  elt2 = virgule_hash_table_new (vr->r->pool);
-          for (iter = virgule_hash_table_iter (vr->r->pool, elt1);
+	  apr_array_header_t *gone;
+	  int i;
+
+	  elt = virgule_eigen_local_load (vr->r->pool, vr, eigenkey);
+	  if (elt == NULL)
+	    continue;
+	  gone = apr_array_make (vr->r->pool, 4, sizeof (char *));
+          for (iter = virgule_hash_table_iter (vr->r->pool, elt);
               virgule_hash_table_iter_get (iter, &key, &val);
               virgule_hash_table_iter_next (iter))
 	    {
               profilekey = apr_pstrcat (vr->r->pool, "acct/", key+2, "/profile.xml", NULL);
-              profile = virgule_db_mk_filename (vr->r->pool, vr->db, profilekey);
-              status = apr_stat (&finfo, profile, APR_FINFO_MIN, vr->r->pool);
-              if (status != APR_SUCCESS)
+              if (virgule_db_stamp (vr->r->pool, vr->db, profilekey, &stamp) != 0)
 	        {
                   virgule_buffer_printf (vr->b, "Removed rating of nonexistent user: %s by user: %s<br/>\n", key+2, u);
+		  *(const char **)apr_array_push (gone) = key;
                 }
-	      else 
-	        {
-		  virgule_hash_table_set (vr->r->pool, elt2, key, val);
-		}
 	    }
-	  virgule_eigen_local_store (vr, elt2, eigenkey);
+	  if (gone->nelts == 0)
+	    continue;
+	  for (i = 0; i < gone->nelts; i++)
+	    virgule_hash_table_remove (elt, ((const char **)gone->elts)[i]);
+	  virgule_eigen_local_store (vr, elt, eigenkey);
+	  virgule_eigen_mark_dirty (vr, u);
 	}
       else
         {
@@ -240,6 +244,46 @@ rating_clean (VirguleReq *vr)
 }
 
 
+/**
+ * rating_convert: Convert the eigen/vec and eigen/local records still in
+ * the old text format to the binary format. Called by hitting
+ * /admin/convert-diaryratings.html
+ */
+static int
+rating_convert (VirguleReq *vr)
+{
+  static const char *dirs[] = { "eigen/vec", "eigen/local", NULL };
+  DbCursor *dbc;
+  char *u;
+  int i, n_converted, n_records;
+
+  if (virgule_set_temp_buffer (vr) != 0)
+    return HTTP_INTERNAL_SERVER_ERROR;
+
+  for (i = 0; dirs[i]; i++)
+    {
+      n_converted = 0;
+      n_records = 0;
+      dbc = virgule_db_open_dir (vr->db, dirs[i]);
+      if (dbc == NULL)
+	continue;
+      while ((u = virgule_db_read_dir_raw (dbc)) != NULL)
+	{
+	  if (virgule_eigen_convert (vr, apr_pstrcat (vr->r->pool, dirs[i],
+						      "/", u, NULL)) > 0)
+	    n_converted++;
+	  n_records++;
+	}
+      virgule_db_close_dir (dbc);
+      virgule_buffer_printf (vr->b, "<p>%s: converted %d of %d records.</p>\n",
+			     dirs[i], n_converted, n_records);
+    }
+
+  virgule_set_main_buffer (vr);
+  return virgule_render_in_template (vr, "/templates/default.xml", "content", "Diary Rating Maintenance");
+}
+
+
 int
 virgule_rating_serve (VirguleReq *vr)
 {
@@ -249,8 +293,12 @@ virgule_rating_serve (VirguleReq *vr)
     return rating_rate_diary (vr);
   if (!strcmp (vr->uri, "/admin/crank-diaryratings.html"))
     return rating_crank_all (vr);
+  if (!strcmp (vr->uri, "/admin/update-diaryratings.html"))
+    return rating_update (vr);
   if (!strcmp (vr->uri, "/admin/clean-diaryratings.html"))
     return rating_clean (vr);
+  if (!strcmp (vr->uri, "/admin/convert-diaryratings.html"))
+    return rating_convert (vr);
   if ((tail = virgule_match_prefix (vr->uri, "/rating/crank/")) != NULL)
     return rating_crank (vr, tail);
   if ((tail = virgule_match_prefix (vr->uri, "/rating/report/")) != NULL)
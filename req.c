@@ -1,5 +1,6 @@
 #include <apr.h>
 #include <apr_strings.h>
+#include <apr_hash.h>
 #include <httpd.h>
 #include <http_log.h>
 
@@ -13,6 +14,7 @@
 #include "certs.h"
 #include "auth.h"
 #include "tmetric.h"
+#include "tmetric_table.h"
 #include "util.h"
 
 /* Send http header and buffer. Probably redunant at this point? */
@@ -58,14 +60,66 @@ virgule_get_args_table (VirguleReq *vr)
   return result;
 }
 
+/**
+ * req_tmetric_index: Build a lookup index over the trust metric cache.
+ * @vr: The #VirguleReq context.
+ * @tmetric: The trust metric cache text.
+ *
+ * Parses the "escapedname level" lines of the trust metric cache into a
+ * hash mapping the unescaped account name to its #CertLevel. The index
+ * and its keys live in the tmetric sub pool so they are rebuilt and
+ * freed along with the cache itself.
+ *
+ * Return value: The index.
+ **/
+static apr_hash_t *
+req_tmetric_index (VirguleReq *vr, const char *tmetric)
+{
+  apr_pool_t *p = vr->priv->tm_pool;
+  apr_hash_t *index = apr_hash_make (p);
+  int n_levels = virgule_cert_num_levels (vr);
+  CertLevel *levels;
+  const char *line, *eol, *sp;
+  char *user, *level_name;
+  CertLevel cl;
+  int i;
+
+  /* every entry points at one of these shared values */
+  levels = apr_palloc (p, n_levels * sizeof(CertLevel));
+  for (i = 0; i < n_levels; i++)
+    levels[i] = i;
+
+  for (line = tmetric; *line; line = *eol ? eol + 1 : eol)
+    {
+      eol = strchr (line, '\n');
+      if (eol == NULL)
+	eol = line + strlen (line);
+      /* names are escaped, so the first space ends the name */
+      sp = memchr (line, ' ', eol - line);
+      if (sp == NULL || sp == line)
+	continue;
+
+      level_name = apr_pstrmemdup (vr->r->pool, sp + 1, eol - sp - 1);
+      cl = virgule_cert_level_from_name (vr, level_name);
+      if (cl <= CERT_LEVEL_NONE || cl >= n_levels)
+	continue;
+
+      user = apr_pstrmemdup (p, line, sp - line);
+      ap_unescape_url (user);
+      apr_hash_set (index, user, APR_HASH_KEY_STRING, &levels[cl]);
+    }
+
+  return index;
+}
+
 /**
  * req_get_tmetric: Get the trust metric results.
  * @vr: The #VirguleReq context.
  *
- * Gets the trust metric results in simple username->level ap table
- * form. Note: ap tables are (as of the time of writing) stored
- * linearly and not in a tree or hash table format. Thus, if you're
- * doing a lot of queries, performance could kinda suck.
+ * Gets the trust metric results as the raw cache text, one
+ * "username level" pair per line, sorted by level. Lookups of a single
+ * user should go through virgule_req_get_tmetric_cert_level(), which
+ * uses an index built alongside the cache.
  *
  * Currently, this only bothers with the default trust root, but that
  * could easily change. In that case, this routine will suck trust
@@ -84,87 +138,102 @@ virgule_get_args_table (VirguleReq *vr)
 char *
 virgule_req_get_tmetric (VirguleReq *vr)
 {
-  apr_finfo_t finfo;
+  DbStamp stamp;
 
-  /* Stat the trust metric cache file */
-  apr_stat(&finfo, ap_make_full_path (vr->r->pool, vr->priv->base_path, "tmetric/default"),
-           APR_FINFO_MIN, vr->r->pool);
+  /* Stat the trust metric cache record (which may live in the DB log) */
+  if (virgule_db_stamp (vr->r->pool, vr->db, "tmetric/default", &stamp) != 0)
+    stamp.mtime = 0L;
 
   /* Load the trust metric cache and reset timestamp */
-  if (vr->priv->tmetric == NULL || finfo.mtime != vr->priv->tm_mtime)
+  if (vr->priv->tmetric == NULL || stamp.mtime != vr->priv->tm_mtime)
     {
       /* free existing memory if needed */
-      if(vr->priv->tmetric != NULL)
+      if(vr->priv->tm_pool != NULL)
         {
           apr_pool_destroy (vr->priv->tm_pool);
+	  vr->priv->tm_pool = NULL;
+	  vr->priv->tmetric = NULL;
+	  vr->priv->tm_index = NULL;
 	  vr->priv->tm_mtime = 0L;
 	}
 
       /* allocate a sub pool and load the tmetric cache */
       apr_pool_create(&vr->priv->tm_pool, vr->priv->pool);
       vr->priv->tmetric = virgule_tmetric_get (vr);
-      vr->priv->tm_mtime = finfo.mtime;
+      if (vr->priv->tmetric != NULL)
+	vr->priv->tm_index = req_tmetric_index (vr, vr->priv->tmetric);
+      vr->priv->tm_mtime = stamp.mtime;
     }
 
   return vr->priv->tmetric;
 }
 
-
 /**
- * req_get_tmetric_level: Get the trust metric level of a user.
+ * req_get_tmetric_cert_level: Get the trust metric level of a user.
  * @vr: The #VirguleReq context.
  * @u: The account name.
  *
  * Gets the certification level of @u according to the default trust
- * metric.
+ * metric. The shared table written by the last crank is used when
+ * there is one; it's acquired once per request and looking it up
+ * needs no stat or allocation. Otherwise this falls back to the index
+ * built when this thread loaded the trust metric cache.
  *
- * Return value: The certification level, as a string.
+ * Return value: The certification level.
  **/
-const char *
-virgule_req_get_tmetric_level (VirguleReq *vr, const char *u)
+CertLevel
+virgule_req_get_tmetric_cert_level (VirguleReq *vr, const char *u)
 {
-  char *result;
-  char *user = NULL;
-  char *tmetric = NULL;
-  int i, j;
+  TmetricTableInfo info;
+  CertLevel *cl;
+  int level;
 
   if (u == NULL || *u == 0)
-    return virgule_cert_level_to_name (vr, CERT_LEVEL_NONE);
-
-  user = ap_escape_uri(vr->r->pool,u);
+    return CERT_LEVEL_NONE;
 
-  tmetric = virgule_req_get_tmetric (vr);
-  
-  if (tmetric == NULL)
-    return virgule_cert_level_to_name (vr, CERT_LEVEL_NONE);
-
-  /* This is a hackish linear scan through the tmetric table.
-     At some point, we may want to use a real binary tree. */
-  for (i = 0; tmetric[i];)
+  if (!vr->tm_table_checked)
     {
-      for (j = 0; user[j]; j++)
-	if (tmetric[i++] != user[j])
-	  break;
-      if (user[j] == 0 && tmetric[i++] == ' ')
-	{
-	  /* found */
-	  for (j = 0; tmetric[i + j] && tmetric[i + j] != '\n'; j++);
-	  result = apr_palloc (vr->r->pool, j + 1);
-	  memcpy (result, tmetric + i, j);
-	  result[j] = 0;
-	  return result;
-	}
-      else
+      vr->tm_table_checked = 1;
+      vr->tm_table = virgule_tmetric_table_acquire (vr->r->pool,
+						    vr->priv->base_path);
+      /* a table cranked under a different level config is no use */
+      if (vr->tm_table != NULL)
 	{
-	  /* skip to next line */
-	  while (tmetric[i] && tmetric[i] != '\n')
-	    i++;
-	  if (tmetric[i] == '\n')
-	    i++;
+	  virgule_tmetric_table_get_info (vr->tm_table, &info);
+	  if (info.n_levels != virgule_cert_num_levels (vr))
+	    vr->tm_table = NULL;
 	}
     }
 
-  return virgule_cert_level_to_name (vr, CERT_LEVEL_NONE);
+  if (vr->tm_table != NULL)
+    {
+      level = virgule_tmetric_table_lookup (vr->tm_table, u);
+      return level > CERT_LEVEL_NONE ? level : CERT_LEVEL_NONE;
+    }
+
+  if (virgule_req_get_tmetric (vr) == NULL || vr->priv->tm_index == NULL)
+    return CERT_LEVEL_NONE;
+
+  cl = apr_hash_get (vr->priv->tm_index, u, APR_HASH_KEY_STRING);
+  return cl ? *cl : CERT_LEVEL_NONE;
+}
+
+/**
+ * req_get_tmetric_level: Get the trust metric level name of a user.
+ * @vr: The #VirguleReq context.
+ * @u: The account name.
+ *
+ * Gets the certification level of @u according to the default trust
+ * metric.
+ *
+ * Return value: The certification level, as a string. The string is
+ * owned by the site configuration and must not be modified.
+ **/
+const char *
+virgule_req_get_tmetric_level (VirguleReq *vr, const char *u)
+{
+  return virgule_cert_level_to_name (vr,
+				     virgule_req_get_tmetric_cert_level (vr, u));
 }
 
 /**
@@ -194,7 +263,7 @@ virgule_req_ok_to_post (VirguleReq *vr)
         if(strcmp(vr->u,*s) == 0)
 	  return 1;
     }
-  else if(virgule_cert_level_from_name(vr, virgule_req_get_tmetric_level (vr, vr->u)) >= vr->priv->level_articlepost)
+  else if(virgule_req_get_tmetric_cert_level (vr, vr->u) >= vr->priv->level_articlepost)
     return 1;
 
   return 0;
@@ -217,7 +286,7 @@ virgule_req_ok_to_reply (VirguleReq *vr)
   if (vr->u == NULL)
     return 0;
 
-  if (virgule_cert_level_from_name(vr, virgule_req_get_tmetric_level (vr, vr->u)) >= vr->priv->level_articlereply)
+  if (virgule_req_get_tmetric_cert_level (vr, vr->u) >= vr->priv->level_articlereply)
     return 1;
 
   if(virgule_user_is_special(vr, vr->u))
@@ -244,7 +313,7 @@ virgule_req_ok_to_create_project (VirguleReq *vr)
   if (vr->u == NULL)
     return 0;
 
-  if (virgule_cert_level_from_name(vr, virgule_req_get_tmetric_level (vr, vr->u)) >= vr->priv->level_projectcreate)
+  if (virgule_req_get_tmetric_cert_level (vr, vr->u) >= vr->priv->level_projectcreate)
     return 1;
 
   if(virgule_user_is_special(vr, vr->u))
@@ -272,7 +341,7 @@ virgule_req_ok_to_syndicate_blog (VirguleReq *vr)
   if (vr->u == NULL)
     return 0;
 
-  if (virgule_cert_level_from_name(vr, virgule_req_get_tmetric_level (vr, vr->u)) >= vr->priv->level_blogsyndicate)
+  if (virgule_req_get_tmetric_cert_level (vr, vr->u) >= vr->priv->level_blogsyndicate)
     return 1;
 
   if(virgule_user_is_special(vr, vr->u))
@@ -8,12 +8,15 @@ struct _VirguleReq {
   Buffer *tb;  /* template buffer */
   Buffer *hb;  /* header buffer */
   Db *db;
+  DbMemo *memo; /* records loaded by this request */
   char *uri;
   const char *u; /* authenticated username */
   char *args;
 //  int sitemap_rendered; /* TRUE if the sitemap has already been rendered */
   char *prefix; /* Prefix of <Location> directive, to be added to links */
   apr_table_t *render_data;
+  const struct _TmetricTable *tm_table; /* shared tmetric table, if any */
+  int tm_table_checked;
 };
 
 int
@@ -28,6 +31,9 @@ virgule_req_get_tmetric (VirguleReq *vr);
 const char *
 virgule_req_get_tmetric_level (VirguleReq *vr, const char *u);
 
+int
+virgule_req_get_tmetric_cert_level (VirguleReq *vr, const char *u);
+
 int
 virgule_req_ok_to_post (VirguleReq *vr);
 
@@ -0,0 +1,443 @@
+/* A table of authenticated sessions shared by every thread of every
+   child, so a request with a valid id cookie doesn't have to parse the
+   account's profile to check it.
+
+   The table, "session.tbl" in the database directory, is a
+   SessionTableHeader followed by n_buckets buckets of SESSION_WAYS
+   SessionSlot records, mapped read-write and shared. An account's
+   session can only live in the bucket its name hashes to, so
+   invalidating an account looks at one bucket. The table is only a
+   cache: a session that isn't found is checked against the profile
+   and stored again, so slots may be overwritten at any time.
+
+   Slots are not locked. Each has a sequence number which a writer
+   makes odd while it changes the slot, with a compare-and-swap that
+   also keeps other writers out, and even again when it is done. A
+   reader copies the slot and uses the copy only if the sequence
+   number was even and unchanged around the copy. A store that finds
+   the slot busy just gives up; an invalidation waits for it.
+
+   Slots also note when the account was last seen and when its
+   profile's lastlogin was last written, so that lastlogin is written
+   at most once an interval however many requests the account makes.
+   An account needs no session to have its visits noted this way. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#include <httpd.h>
+
+#include "session.h"
+
+#define SESSION_TABLE_NAME "session.tbl"
+#define SESSION_TABLE_MAGIC 0x56534553 /* "VSES" */
+#define SESSION_TABLE_VERSION 2
+#define SESSION_BUCKETS 2048
+#define SESSION_WAYS 4
+#define SESSION_STALE apr_time_from_sec (1)
+
+#define SESSION_USER_MAX 48
+#define SESSION_COOKIE_MAX 64
+
+typedef struct {
+  apr_uint32_t magic;
+  apr_uint32_t version;
+  apr_uint32_t n_buckets;
+  apr_uint32_t pad;
+} SessionTableHeader;
+
+typedef struct {
+  volatile apr_uint32_t seq;   /* odd while being written */
+  apr_uint32_t pad;
+  apr_int64_t expires;         /* apr_time_t; 0 if there is no session */
+  apr_int64_t seen;            /* apr_time_t of the last visit noted */
+  apr_int64_t touched;         /* apr_time_t lastlogin was last written */
+  char user[SESSION_USER_MAX];
+  char cookie[SESSION_COOKIE_MAX];
+} SessionSlot;
+
+/* One per database directory */
+typedef struct {
+  SessionTableHeader *hdr;
+  SessionSlot *slots;
+} SessionTable;
+
+static apr_pool_t *session_pool = NULL;
+static apr_thread_mutex_t *session_lock = NULL;
+static apr_hash_t *session_tables = NULL;
+static apr_uint32_t session_hits = 0;
+static apr_uint32_t session_misses = 0;
+
+/**
+ * session_init: Set up the session table for this process.
+ * @p: Process pool.
+ *
+ * Return value: APR_SUCCESS on success.
+ **/
+apr_status_t
+virgule_session_init (apr_pool_t *p)
+{
+  session_pool = p;
+  session_tables = apr_hash_make (p);
+  return apr_thread_mutex_create (&session_lock, APR_THREAD_MUTEX_DEFAULT, p);
+}
+
+/* Open and map the table file, creating it if needed, or return NULL. */
+static SessionTable *
+session_table_map (const char *pathname)
+{
+  SessionTable *t;
+  SessionTableHeader h;
+  size_t size = sizeof (SessionTableHeader) +
+    (size_t)SESSION_BUCKETS * SESSION_WAYS * sizeof (SessionSlot);
+  struct stat st;
+  void *addr;
+  int fd;
+
+  fd = open (pathname, O_RDWR | O_CREAT, 0660);
+  if (fd < 0)
+    return NULL;
+
+  /* the first process to get here sizes the file; zeroed slots are empty */
+  if (flock (fd, LOCK_EX) < 0 || fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+  if (st.st_size != (off_t)size ||
+      pread (fd, &h, sizeof (h), 0) != sizeof (h) ||
+      h.magic != SESSION_TABLE_MAGIC || h.version != SESSION_TABLE_VERSION ||
+      h.n_buckets != SESSION_BUCKETS)
+    {
+      h.magic = SESSION_TABLE_MAGIC;
+      h.version = SESSION_TABLE_VERSION;
+      h.n_buckets = SESSION_BUCKETS;
+      h.pad = 0;
+      if (ftruncate (fd, 0) < 0 || ftruncate (fd, size) < 0 ||
+	  pwrite (fd, &h, sizeof (h), 0) != sizeof (h))
+	{
+	  close (fd);
+	  return NULL;
+	}
+    }
+
+  addr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd); /* close implicitly unlocks */
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  t = (SessionTable *)apr_palloc (session_pool, sizeof (SessionTable));
+  t->hdr = (SessionTableHeader *)addr;
+  t->slots = (SessionSlot *)(t->hdr + 1);
+  return t;
+}
+
+/* Get the table of a database directory, mapping it on first use. */
+static SessionTable *
+session_table_get (const char *base_pathname)
+{
+  SessionTable *t;
+
+  if (session_lock == NULL)
+    return NULL;
+
+  apr_thread_mutex_lock (session_lock);
+  t = apr_hash_get (session_tables, base_pathname, APR_HASH_KEY_STRING);
+  if (t == NULL)
+    {
+      t = session_table_map (apr_pstrcat (session_pool, base_pathname, "/",
+					  SESSION_TABLE_NAME, NULL));
+      /* remember failures too, rather than retrying on every request */
+      apr_hash_set (session_tables, apr_pstrdup (session_pool, base_pathname),
+		    APR_HASH_KEY_STRING, t ? t : (void *)session_tables);
+    }
+  apr_thread_mutex_unlock (session_lock);
+
+  return t == (void *)session_tables ? NULL : t;
+}
+
+/* The first slot of the bucket @u hashes to (FNV-1a). */
+static SessionSlot *
+session_bucket (SessionTable *t, const char *u)
+{
+  apr_uint32_t h = 2166136261U;
+
+  for (; *u; u++)
+    h = (h ^ (unsigned char)*u) * 16777619U;
+  return &t->slots[(h % t->hdr->n_buckets) * SESSION_WAYS];
+}
+
+/* Copy a slot consistently; return 0 if it was being written. */
+static int
+session_slot_read (SessionSlot *slot, SessionSlot *copy)
+{
+  apr_uint32_t seq;
+
+  /* a compare-and-swap that changes nothing is a read with a barrier */
+  seq = apr_atomic_cas32 (&slot->seq, 0, 0);
+  if (seq & 1)
+    return 0;
+  memcpy (copy, slot, sizeof (SessionSlot));
+  return apr_atomic_cas32 (&slot->seq, seq, seq) == seq;
+}
+
+/* Take a slot for writing; return 0 if another writer has it. */
+static int
+session_slot_begin (SessionSlot *slot)
+{
+  apr_uint32_t seq = apr_atomic_cas32 (&slot->seq, 0, 0);
+
+  return !(seq & 1) && apr_atomic_cas32 (&slot->seq, seq + 1, seq) == seq;
+}
+
+/* Take a slot for writing, waiting for another writer. A slot that
+   stays busy with the same sequence number for SESSION_STALE belonged
+   to a writer that died, and is taken over by moving it on to the next
+   odd number with a compare-and-swap, so only one waiter gets it. */
+static void
+session_slot_take (SessionSlot *slot)
+{
+  apr_uint32_t seq, busy = 0;
+  apr_time_t since = 0;
+
+  while (!session_slot_begin (slot))
+    {
+      seq = apr_atomic_cas32 (&slot->seq, 0, 0);
+      if (!(seq & 1))
+	continue;
+      if (seq != busy)
+	{
+	  busy = seq;
+	  since = apr_time_now ();
+	}
+      else if (apr_time_now () - since > SESSION_STALE &&
+	       apr_atomic_cas32 (&slot->seq, seq + 2, seq) == seq)
+	return;
+      /* let the writer finish, if it is on this CPU */
+      apr_thread_yield ();
+    }
+}
+
+static void
+session_slot_end (SessionSlot *slot)
+{
+  apr_atomic_inc32 (&slot->seq);
+}
+
+/* The slot of @u's bucket that @u has, or else an empty one or the
+   one whose session expires soonest. NULL if every slot is busy. */
+static SessionSlot *
+session_slot_find (SessionTable *t, const char *u)
+{
+  SessionSlot *bucket, *slot = NULL, copy;
+  apr_time_t oldest = 0;
+  int i;
+
+  bucket = session_bucket (t, u);
+  for (i = 0; i < SESSION_WAYS; i++)
+    {
+      if (!session_slot_read (&bucket[i], &copy))
+	continue;
+      if (!strncmp (copy.user, u, SESSION_USER_MAX))
+	return &bucket[i];
+      if (slot == NULL || copy.expires < oldest)
+	{
+	  slot = &bucket[i];
+	  oldest = copy.expires;
+	}
+    }
+  return slot;
+}
+
+/* Give a slot taken for writing to @u, clearing it if it was another
+   account's. */
+static void
+session_slot_claim (SessionSlot *slot, const char *u)
+{
+  if (!strncmp (slot->user, u, SESSION_USER_MAX))
+    return;
+  slot->expires = 0;
+  slot->seen = 0;
+  slot->touched = 0;
+  memset (slot->user, 0, SESSION_USER_MAX);
+  strcpy (slot->user, u);
+  memset (slot->cookie, 0, SESSION_COOKIE_MAX);
+}
+
+/**
+ * session_lookup: Check an id cookie against the session table.
+ * @base_pathname: The database directory.
+ * @u: The account name from the cookie.
+ * @cookie: The rest of the cookie.
+ *
+ * Return value: TRUE if @u has an unexpired session with @cookie.
+ **/
+int
+virgule_session_lookup (const char *base_pathname, const char *u,
+			const char *cookie)
+{
+  SessionTable *t = session_table_get (base_pathname);
+  SessionSlot *bucket, copy;
+  apr_time_t now = apr_time_now ();
+  int i;
+
+  if (t == NULL)
+    return 0;
+  bucket = session_bucket (t, u);
+  for (i = 0; i < SESSION_WAYS; i++)
+    if (session_slot_read (&bucket[i], &copy) && copy.expires > now &&
+	!strncmp (copy.user, u, SESSION_USER_MAX) &&
+	!strncmp (copy.cookie, cookie, SESSION_COOKIE_MAX))
+      {
+	apr_atomic_inc32 (&session_hits);
+	return 1;
+      }
+  apr_atomic_inc32 (&session_misses);
+  return 0;
+}
+
+/**
+ * session_store: Remember a checked id cookie.
+ * @base_pathname: The database directory.
+ * @u: The account name.
+ * @cookie: The account's cookie.
+ * @expires: When the session should next be checked against the profile.
+ *
+ * Replaces @u's session if it has one, or else an empty, expired or
+ * the soonest to expire slot of its bucket.
+ **/
+void
+virgule_session_store (const char *base_pathname, const char *u,
+		       const char *cookie, apr_time_t expires)
+{
+  SessionTable *t = session_table_get (base_pathname);
+  SessionSlot *slot;
+
+  if (t == NULL || strlen (u) >= SESSION_USER_MAX ||
+      strlen (cookie) >= SESSION_COOKIE_MAX)
+    return;
+  slot = session_slot_find (t, u);
+  if (slot == NULL || !session_slot_begin (slot))
+    return;
+  session_slot_claim (slot, u);
+  slot->expires = expires;
+  memset (slot->cookie, 0, SESSION_COOKIE_MAX);
+  strcpy (slot->cookie, cookie);
+  session_slot_end (slot);
+}
+
+/**
+ * session_touch: Note a visit by an account.
+ * @base_pathname: The database directory.
+ * @u: The account name.
+ * @now: The time of the visit.
+ * @interval: How often the account's lastlogin should be written.
+ *
+ * Return value: TRUE if the caller should write @u's lastlogin now,
+ * because it wasn't written in the last @interval or the visit
+ * couldn't be noted.
+ **/
+int
+virgule_session_touch (const char *base_pathname, const char *u,
+		       apr_time_t now, apr_time_t interval)
+{
+  SessionTable *t = session_table_get (base_pathname);
+  SessionSlot *slot;
+  int write;
+
+  if (t == NULL || strlen (u) >= SESSION_USER_MAX)
+    return 1;
+  slot = session_slot_find (t, u);
+  if (slot == NULL)
+    return 1;
+  /* a busy slot is most likely another request by the same account */
+  if (!session_slot_begin (slot))
+    return 0;
+  session_slot_claim (slot, u);
+  slot->seen = now;
+  write = slot->touched <= now - interval;
+  if (write)
+    slot->touched = now;
+  session_slot_end (slot);
+  return write;
+}
+
+/**
+ * session_seen: Get the time of an account's last noted visit.
+ * @base_pathname: The database directory.
+ * @u: The account name.
+ *
+ * Return value: The time, or 0 if the table doesn't know it. The
+ * account's lastlogin may be older by up to the interval given to
+ * virgule_session_touch().
+ **/
+apr_time_t
+virgule_session_seen (const char *base_pathname, const char *u)
+{
+  SessionTable *t = session_table_get (base_pathname);
+  SessionSlot *bucket, copy;
+  int i;
+
+  if (t == NULL)
+    return 0;
+  bucket = session_bucket (t, u);
+  for (i = 0; i < SESSION_WAYS; i++)
+    if (session_slot_read (&bucket[i], &copy) &&
+	!strncmp (copy.user, u, SESSION_USER_MAX))
+      return copy.seen;
+  return 0;
+}
+
+/**
+ * session_invalidate: Forget an account's session.
+ * @base_pathname: The database directory.
+ * @u: The account name.
+ *
+ * Called on logout and when the account is removed, so that the
+ * next request checks the cookie against the profile again. The
+ * account's visit times are kept.
+ **/
+void
+virgule_session_invalidate (const char *base_pathname, const char *u)
+{
+  SessionTable *t = session_table_get (base_pathname);
+  SessionSlot *bucket;
+  int i;
+
+  if (t == NULL)
+    return;
+  bucket = session_bucket (t, u);
+  for (i = 0; i < SESSION_WAYS; i++)
+    {
+      session_slot_take (&bucket[i]);
+      if (!strncmp (bucket[i].user, u, SESSION_USER_MAX))
+	{
+	  bucket[i].expires = 0;
+	  memset (bucket[i].cookie, 0, SESSION_COOKIE_MAX);
+	}
+      session_slot_end (&bucket[i]);
+    }
+}
+
+/**
+ * session_get_stats: Get this process's session table statistics.
+ * @stats: Where to store the statistics.
+ **/
+void
+virgule_session_get_stats (SessionStats *stats)
+{
+  stats->hits = apr_atomic_read32 (&session_hits);
+  stats->misses = apr_atomic_read32 (&session_misses);
+  stats->slots = SESSION_BUCKETS * SESSION_WAYS;
+}
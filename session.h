@@ -0,0 +1,31 @@
+typedef struct _SessionStats SessionStats;
+
+struct _SessionStats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long slots;
+};
+
+apr_status_t
+virgule_session_init (apr_pool_t *p);
+
+int
+virgule_session_lookup (const char *base_pathname, const char *u,
+			const char *cookie);
+
+void
+virgule_session_store (const char *base_pathname, const char *u,
+		       const char *cookie, apr_time_t expires);
+
+int
+virgule_session_touch (const char *base_pathname, const char *u,
+		       apr_time_t now, apr_time_t interval);
+
+apr_time_t
+virgule_session_seen (const char *base_pathname, const char *u);
+
+void
+virgule_session_invalidate (const char *base_pathname, const char *u);
+
+void
+virgule_session_get_stats (SessionStats *stats);
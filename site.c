@@ -19,6 +19,7 @@
 #include "buffer.h"
 #include "db.h"
 #include "req.h"
+#include "db_ops.h"
 #include "style.h"
 #include "db_xml.h"
 #include "xml_util.h"
@@ -81,28 +82,22 @@ static void
 site_render_recent_acct (VirguleReq *vr, const char *list, int n_max)
 {
   apr_pool_t *p = vr->r->pool;
-  char *key;
-  xmlDoc *doc;
-  xmlNode *root, *tree;
-  int n;
+  apr_array_header_t *items;
+  int i;
 
-  key = apr_psprintf (p, "recent/%s.xml", list);
-  doc = virgule_db_xml_get (p, vr->db, key);
-  if (doc == NULL)
+  items = virgule_recent_get (p, vr->db, apr_psprintf (p, "recent/%s", list),
+			      n_max);
+  if (items == NULL)
     return;
-  root = doc->xmlRootNode;
-  n = 0;
-  for (tree = root->last; tree != NULL && n < n_max; tree = tree->prev)
+  for (i = 0; i < items->nelts; i++)
     {
+      RecentItem *item = &((RecentItem *)items->elts)[i];
       CertLevel cl;
-      char *name = virgule_xml_get_string_contents (tree);
-      char *date = virgule_xml_get_prop (p, tree, (xmlChar *)"date");
-      cl = virgule_render_cert_level_begin (vr, name, CERT_STYLE_SMALL);
-      virgule_buffer_printf (vr->b, " %s ", virgule_render_date (vr, date, 0));
-      virgule_site_render_person_link (vr, name, cl);
-      virgule_render_cert_level_text (vr, name);
+      cl = virgule_render_cert_level_begin (vr, item->key, CERT_STYLE_SMALL);
+      virgule_buffer_printf (vr->b, " %s ", virgule_render_date (vr, item->date, 0));
+      virgule_site_render_person_link (vr, item->key, cl);
+      virgule_render_cert_level_text (vr, item->key);
       virgule_render_cert_level_end (vr, CERT_STYLE_SMALL);
-      n++;
     }
 }
 
@@ -125,20 +120,18 @@ static void
 site_render_recent_changelog (VirguleReq *vr, int n_max)
 {
   apr_pool_t *p = vr->r->pool;
-  char *key;
-  xmlDoc *doc;
-  xmlNode *root, *tree;
-  int n;
-  HashTable *ev = NULL;
+  apr_array_header_t *items;
+  int n, i;
+  apr_array_header_t *names, *dkeys;
+  EigenVecEl **ev = NULL;
   apr_table_t *args;
   const char *thresh_str;
   double thresh = 0;
   int suppress_count = 0;
   apr_table_t *entries = NULL;
 
-  key = apr_psprintf (p, "recent/%s.xml", "diary");
-  doc = virgule_db_xml_get (p, vr->db, key);
-  if (doc == NULL)
+  items = virgule_recent_get (p, vr->db, "recent/diary", -1);
+  if (items == NULL)
     return;
 
   args = virgule_get_args_table (vr);
@@ -147,31 +140,37 @@ site_render_recent_changelog (VirguleReq *vr, int n_max)
       thresh = atof (thresh_str);
     }
 
-  virgule_auth_user (vr);
-  if (vr->priv->render_diaryratings && vr->u)
+  /* the diarists, newest first */
+  names = apr_array_make (p, 64, sizeof (char *));
+  dkeys = apr_array_make (p, 64, sizeof (char *));
+  for (i = 0; i < items->nelts; i++)
     {
-        char *eigen_key = apr_pstrcat (p, "eigen/vec/", vr->u, NULL);
-	ev = virgule_eigen_vec_load (p, vr, eigen_key);
+      const char *name = ((RecentItem *)items->elts)[i].key;
+
+      *(const char **)apr_array_push (names) = name;
+      *(char **)apr_array_push (dkeys) = apr_pstrcat (p, "d/", name, NULL);
     }
+  *(char **)apr_array_push (dkeys) = NULL;
+
+  /* only the diarists on the page are looked up in the viewer's ratings */
+  virgule_auth_user (vr);
+  if (vr->priv->render_diaryratings && vr->u)
+    ev = virgule_eigen_vec_lookup_many (p, vr, vr->u,
+					(const char **)dkeys->elts);
 
   if (vr->priv->recentlog_as_posted)
     entries = apr_table_make (p, 4);
 
-  root = doc->xmlRootNode;
   n = 0;
-  for (tree = root->last; tree != NULL && n < n_max; tree = tree->prev)
+  for (i = 0; i < names->nelts && n < n_max; i++)
     {
-      char *name = virgule_xml_get_string_contents (tree);
+      char *name = ((char **)names->elts)[i];
       EigenVecEl *eve = NULL;
       int entry;
 
-      if (xmlIsBlankNode(tree))
-        continue;
-
       if (ev)
 	{
-	  char *dkey = apr_pstrcat (p, "d/", name, NULL);
-	  eve = virgule_hash_table_get (ev, dkey);
+	  eve = ev[i];
 
 	  if (eve && eve->rating < thresh)
 	    {
@@ -180,17 +179,21 @@ site_render_recent_changelog (VirguleReq *vr, int n_max)
 	    }
 	}
 
+      /* items added before entry numbers were recorded have none */
+      entry = ((RecentItem *)items->elts)[i].entry;
       if (vr->priv->recentlog_as_posted)
 	{
 	  const char *result = apr_table_get (entries, name);
-	  if (result)
+	  if (entry >= 0)
+	    ;
+	  else if (result)
 	    entry = atoi(result);
 	  else
 	    entry = virgule_db_dir_max (vr->db, apr_psprintf (p, "acct/%s/diary", name));
 
 	  apr_table_set (entries, name, apr_psprintf (p, "%d", entry - 1));
 	}
-      else
+      else if (entry < 0)
 	entry = virgule_db_dir_max (vr->db, apr_psprintf (p, "acct/%s/diary", name));
 
       if (entry >= 0)
@@ -211,32 +214,29 @@ static void
 site_render_recent_proj (VirguleReq *vr, const char *list, int n_max)
 {
   apr_pool_t *p = vr->r->pool;
-  char *key;
-  xmlDoc *doc;
-  xmlNode *root, *tree;
-  int n;
+  apr_array_header_t *items;
+  int n, i;
 
-  key = apr_psprintf (p, "recent/%s.xml", list);
-  doc = virgule_db_xml_get (p, vr->db, key);
-  if (doc == NULL)
+  items = virgule_recent_get (p, vr->db, apr_psprintf (p, "recent/%s", list),
+			      -1);
+  if (items == NULL)
     return;
-  root = doc->xmlRootNode;
   n = 0;
-  for (tree = root->last; tree != NULL && n < n_max; tree = tree->prev)
+  for (i = 0; i < items->nelts && n < n_max; i++)
     {
-      char *name = virgule_xml_get_string_contents (tree);
-      char *date = virgule_xml_get_prop (p, tree, (xmlChar *)"date");
+      const char *name = ((RecentItem *)items->elts)[i].key;
+      const char *date = ((RecentItem *)items->elts)[i].date;
       
       if (vr->priv->projstyle == PROJSTYLE_NICK)
 	{
 	  char *creator;
 	  char *db_key = apr_psprintf (p, "proj/%s/info.xml", name);
-	  xmlDoc *proj_doc;
+	  const xmlDoc *proj_doc;
 	  xmlNode *proj_tree;
 	  char *lastread_date;
 	  char *newmarker = "";
   
-	  proj_doc = virgule_db_xml_get (p, vr->db, db_key);
+	  proj_doc = virgule_db_xml_get_ro (p, vr->db, db_key);
 	  if (proj_doc == NULL) {
 	    /* the project doesn't exist, so skip it */
 	    continue;
@@ -261,7 +261,6 @@ site_render_recent_proj (VirguleReq *vr, const char *list, int n_max)
 			 virgule_render_proj_name (vr, name));
 	  virgule_render_cert_level_text (vr, creator);
 	  virgule_render_cert_level_end (vr, CERT_STYLE_SMALL);
-	  virgule_db_xml_free (p, proj_doc);
 	}        
       else
         {
@@ -277,10 +276,10 @@ static void
 site_render_include (RenderCtx *ctx, VirguleReq *vr, char *path)
 {
   apr_pool_t *p = vr->r->pool;
-  xmlDoc *doc;
+  const xmlDoc *doc;
   xmlNode *root;
 
-  doc = virgule_db_xml_get (p, vr->db, path);
+  doc = virgule_db_xml_get_ro (p, vr->db, path);
   if (doc == NULL)
     return;
   root = doc->xmlRootNode;
@@ -628,18 +627,16 @@ virgule_site_serve (VirguleReq *vr)
 
   r->content_type = content_type;
 
-  val = virgule_db_get (db, key, &val_size);
-
-  if (val == NULL)
-    return DECLINED;
-
   if (is_xml)
     {
       xmlDoc *doc;
 
-      doc = xmlParseMemory (val, val_size);
+      /* page rendering modifies the tree, so take a private copy */
+      doc = virgule_db_xml_get (r->pool, db, key);
       if (doc == NULL)
 	{
+	  if (virgule_db_get (db, key, &val_size) == NULL)
+	    return DECLINED;
 	  virgule_buffer_puts (b, "xml parsing error\n");
 	}
       else
@@ -648,12 +645,17 @@ virgule_site_serve (VirguleReq *vr)
 
 	  root = doc->xmlRootNode;
 	  return_code = virgule_site_render_page (vr, root, NULL, NULL, NULL);
-	  xmlFreeDoc (doc);
+	  virgule_db_xml_free (r->pool, doc);
 	  return return_code;
 	}
     }
   else
     {
+      val = virgule_db_get (db, key, &val_size);
+
+      if (val == NULL)
+	return DECLINED;
+
       virgule_buffer_write (b, val, val_size);
     }
 
@@ -1,8 +1,24 @@
 /* This is glue code to run the trust metric as HTML. */
+
+/* The trust metric runs over the cert graph kept by certgraph.c, which
+   also stores the levels of flow each node got last time. After certs
+   change, virgule_tmetric_update applies the graph's change log and
+   reruns only the levels for which some changed cert leaves a node
+   reachable from the seeds; certs from unreachable nodes can't change
+   any flow. New accounts and name changes can't change any level, so
+   they are left in the log for the next update or crank to list.
+   /admin/crank-tmetric.html reruns every level, picking up new seeds,
+   and /admin/rebuild-certgraph.html first rebuilds the graph from the
+   account profiles. */
+
 #include <ctype.h>
 #include <unistd.h>
 
 #include <apr.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_file_io.h>
+#include <apr_thread_proc.h>
 #include <httpd.h>
 #include <http_log.h>
 #include <http_protocol.h>
@@ -16,17 +32,17 @@
 #include "buffer.h"
 #include "db.h"
 #include "req.h"
-#include "db_xml.h"
-#include "acct_maint.h"
-#include "xml_util.h"
 #include "certs.h"
 #include "style.h"
 #include "util.h"
 
 #include "net_flow.h"
+#include "certgraph.h"
 #include "tmetric.h"
+#include "tmetric_table.h"
 
 typedef struct _NodeInfo NodeInfo;
+typedef struct _FlowJob FlowJob;
 
 struct _NodeInfo {
   const char *name;
@@ -36,157 +52,260 @@ struct _NodeInfo {
 };
 
 static int cert_level_n;
+static int flow_engine;
 
-static int
-tmetric_find_node (apr_array_header_t *info, NetFlow *flows[], const char *u)
+/* The level of a node is the highest level at which it gets flow. */
+static CertLevel
+tmetric_node_level (const CertGraphNode *n)
 {
-  int idx;
+  CertLevel level = CERT_LEVEL_NONE;
+  int i;
 
-  idx = virgule_net_flow_find_node (flows[1], u);
-  if (idx >= info->nelts)
-    {
-      NodeInfo *ni = (NodeInfo *)apr_array_push (info);
-      int i;
-
-      ni->name = u;
-      ni->surname = NULL;
-      ni->level = CERT_LEVEL_NONE;
-      for (i = 2; i < cert_level_n; i++)
-	if (idx != virgule_net_flow_find_node (flows[i], u))
-	  /* todo: warning */;
-    }
-  return idx;
+  for (i = 1; i < cert_level_n; i++)
+    if (n->flows & (1 << i))
+      level = i;
+  return level;
 }
 
+/* Count the seeds and capacities in the site config. */
 static void
-tmetric_set_name (apr_array_header_t *info, NetFlow *flows[], const char *u,
-		  const char *givenname, const char *surname, VirguleReq *vr)
+tmetric_params (VirguleReq *vr, int *n_seeds, int *n_caps)
 {
-  int idx;
+  for (*n_seeds = 0;; (*n_seeds)++)
+    if (!vr->priv->seeds[*n_seeds])
+      break;
+  for (*n_caps = 0;; (*n_caps)++)
+    if (!vr->priv->caps[*n_caps])
+      break;
+}
 
-  idx = tmetric_find_node (info, flows, u);
-  if (idx >= 0)
-    {
-      ((NodeInfo *)info->elts)[idx].givenname = givenname;
-      ((NodeInfo *)info->elts)[idx].surname = surname;
-    }
-  else
-    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, vr->r, "tmetric_find_node() returned bad value for user: %s", u);
+/* One level's max flow, which can run on its own thread: it only
+   reads the cert graph. */
+struct _FlowJob {
+  CertGraph *g;
+  CertLevel level;
+  const int *seeds;	/* node indices */
+  int n_seeds;
+  const int *caps;
+  int n_caps;
+  int *result;	/* per node, nonzero if it got flow; g_free() it */
+};
+
+/**
+ * tmetric_flow: Run the trust metric for one level.
+ * @job: The level to run, and where to put the result.
+ *
+ * Computes the network flow over the certs at the job's level or
+ * above.
+ **/
+static void
+tmetric_flow (FlowJob *job)
+{
+  CertGraph *g = job->g;
+  CertGraphEdge *edges = (CertGraphEdge *)g->edges->elts;
+  NetFlow *flow;
+  int j;
+
+  /* the flow graph nodes are numbered the same as the cert graph */
+  flow = virgule_net_flow_new_nodes (g->nodes->nelts);
+
+  for (j = 0; j < job->n_seeds; j++)
+    virgule_net_flow_add_edge_ix (flow, 0, job->seeds[j]);
+  for (j = 0; j < g->edges->nelts; j++)
+    if (edges[j].level >= job->level)
+      virgule_net_flow_add_edge_ix (flow, edges[j].issuer, edges[j].subj);
+
+  if (flow_engine == TMETRIC_ENGINE_AUGMENT)
+    virgule_net_flow_set_engine (flow, NET_FLOW_AUGMENT);
+  else if (flow_engine == TMETRIC_ENGINE_DINIC)
+    virgule_net_flow_set_engine (flow, NET_FLOW_DINIC);
+  virgule_net_flow_max_flow (flow, 0, job->caps, job->n_caps);
+  job->result = virgule_net_flow_extract (flow);
+  virgule_net_flow_free (flow);
 }
 
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC
+tmetric_flow_thread (apr_thread_t *thd, void *data)
+{
+  tmetric_flow ((FlowJob *)data);
+  apr_thread_exit (thd, APR_SUCCESS);
+  return NULL;
+}
+#endif
+
 /**
- * tmetric_run: Run trust metric.
+ * tmetric_flows: Run the trust metric for a set of levels.
  * @vr: The request context.
- * @seeds: An array of usernames for the seed.
- * @n_seeds: Size of @seeds.
- * @caps: Capacity array.
- * @n_caps: Size of @caps.
+ * @g: The cert graph.
+ * @run: Array of flags, one per level, set for the levels to run.
+ *
+ * The levels are independent, so each runs on its own thread where
+ * threads are available. Afterwards each node records which levels it
+ * got flow at.
  *
- * Return value: NodeInfo array or NULL on error
+ * Return value: TRUE if any node's flow changed.
  **/
-static apr_array_header_t *
-tmetric_run (VirguleReq *vr,
-	     const char *seeds[], int n_seeds,
-	     const int *caps, int n_caps)
+static int
+tmetric_flows (VirguleReq *vr, CertGraph *g, const char *run)
 {
   apr_pool_t *p = vr->r->pool;
-  Db *db = vr->db;
-  NetFlow *flows[cert_level_n];
-  apr_array_header_t *result;
-  int i, j;
-  int seed;
-  int idx;
-  DbCursor *dbc;
-  char *issuer;
+  CertGraphNode *nodes = (CertGraphNode *)g->nodes->elts;
+  FlowJob *jobs;
+  int *seeds;
+  int *sp;
+  int n_seeds, n_caps;
+  int changed = FALSE;
+  int i, idx;
+#if APR_HAS_THREADS
+  apr_pool_t *tp;
+  apr_thread_t **threads;
+  apr_status_t thread_status;
+#endif
 
-  result = apr_array_make (vr->r->pool, 16, sizeof(NodeInfo));
+  tmetric_params (vr, &n_seeds, &n_caps);
+  seeds = (int *)apr_palloc (p, (n_seeds + 1) * sizeof (int));
+  for (i = 0, n_seeds = 0; vr->priv->seeds[i]; i++)
+    {
+      sp = apr_hash_get (g->node_ix, vr->priv->seeds[i], APR_HASH_KEY_STRING);
+      if (sp != NULL)
+	seeds[n_seeds++] = *sp;
+    }
 
+  jobs = (FlowJob *)apr_pcalloc (p, cert_level_n * sizeof (FlowJob));
   for (i = 1; i < cert_level_n; i++)
-    flows[i] = virgule_net_flow_new ();
-
-  seed = tmetric_find_node (result, flows, "-");
-
-  for (j = 0; j < n_seeds; j++)
     {
-      (void) tmetric_find_node (result, flows, seeds[j]);
-      for (i = 1; i < cert_level_n; i++)
-	virgule_net_flow_add_edge (flows[i], "-", seeds[j]);
+      jobs[i].g = g;
+      jobs[i].level = i;
+      jobs[i].seeds = seeds;
+      jobs[i].n_seeds = n_seeds;
+      jobs[i].caps = vr->priv->caps;
+      jobs[i].n_caps = n_caps;
     }
 
-  dbc = virgule_db_open_dir (db, "acct");
-  while ((issuer = virgule_db_read_dir_raw (dbc)) != NULL)
+#if APR_HAS_THREADS
+  threads = (apr_thread_t **)apr_pcalloc (p, cert_level_n *
+					  sizeof (apr_thread_t *));
+  /* each thread's pool is a child of the one it is created from, and
+     is destroyed by the thread on exit: keep them off the request
+     pool's allocator */
+  if (virgule_pool_create_private (&tp, 1) != APR_SUCCESS)
+    tp = NULL;
+  for (i = 1; i < cert_level_n; i++)
+    if (tp == NULL || !run[i] ||
+	apr_thread_create (&threads[i], NULL, tmetric_flow_thread, &jobs[i],
+			   tp) != APR_SUCCESS)
+      threads[i] = NULL;
+  for (i = 1; i < cert_level_n; i++)
     {
-      char *db_key;
-      xmlDoc *profile = NULL;
-      xmlNode *tree = NULL;
-      xmlNode *cert;
-      const char *givenname, *surname;
-
-#if 0
-      issuer = ((NodeInfo *)(result->elts))[idx].name;
-      virgule_buffer_printf (vr->b, "issuer = %s\n", issuer);
+      if (threads[i] != NULL)
+	apr_thread_join (&thread_status, threads[i]);
+      else if (run[i])
+	tmetric_flow (&jobs[i]);
+    }
+  if (tp != NULL)
+    apr_pool_destroy (tp);
+#else
+  for (i = 1; i < cert_level_n; i++)
+    if (run[i])
+      tmetric_flow (&jobs[i]);
 #endif
 
-      db_key = virgule_acct_dbkey (vr, issuer);
+  for (i = 1; i < cert_level_n; i++)
+    {
+      unsigned int bit = 1 << i;
 
-      if(db_key == NULL) 
-        continue;
+      if (!run[i])
+	continue;
+      for (idx = 1; idx < g->nodes->nelts; idx++)
+	{
+	  unsigned int old = nodes[idx].flows;
+
+	  if (jobs[i].result[idx])
+	    nodes[idx].flows |= bit;
+	  else
+	    nodes[idx].flows &= ~bit;
+	  if (old != nodes[idx].flows)
+	    changed = TRUE;
+	}
+      g_free (jobs[i].result);
+    }
+
+  return changed;
+}
 
-      profile = virgule_db_xml_get (p, db, db_key);
-      if (profile != NULL)
-        tree = virgule_xml_find_child (profile->xmlRootNode, "info");
-      if (tree != NULL)
+/**
+ * tmetric_reaches: Find out if any of a set of nodes is reachable.
+ * @g: The cert graph.
+ * @level: The cert level.
+ * @seeds: An array of usernames for the seed.
+ * @n_seeds: Size of @seeds.
+ * @targets: Array of flags, one per node.
+ *
+ * Searches from the seeds along certs that are at @level or above
+ * either before or after the last changes applied to @g.
+ *
+ * Return value: TRUE if a node flagged in @targets is reachable.
+ **/
+static int
+tmetric_reaches (CertGraph *g, CertLevel level,
+		 const char *seeds[], int n_seeds, const char *targets)
+{
+  apr_pool_t *p;
+  CertGraphEdge *edges = (CertGraphEdge *)g->edges->elts;
+  int n = g->nodes->nelts;
+  int *n_out, *out_start, *out, *queue;
+  char *seen;
+  int head = 0, tail = 0;
+  int found = FALSE;
+  int idx, j;
+
+  apr_pool_create (&p, g->pool);
+  n_out = (int *)apr_pcalloc (p, (n + 1) * sizeof (int));
+  out_start = (int *)apr_palloc (p, (n + 1) * sizeof (int));
+  out = (int *)apr_palloc (p, (g->edges->nelts + 1) * sizeof (int));
+  queue = (int *)apr_palloc (p, n * sizeof (int));
+  seen = (char *)apr_pcalloc (p, n);
+
+  for (j = 0; j < g->edges->nelts; j++)
+    if (edges[j].level >= level || edges[j].prev >= level)
+      n_out[edges[j].issuer]++;
+  out_start[0] = 0;
+  for (idx = 0; idx < n; idx++)
+    out_start[idx + 1] = out_start[idx] + n_out[idx];
+  memset (n_out, 0, n * sizeof (int));
+  for (j = 0; j < g->edges->nelts; j++)
+    if (edges[j].level >= level || edges[j].prev >= level)
+      out[out_start[edges[j].issuer] + n_out[edges[j].issuer]++] =
+	edges[j].subj;
+
+  seen[0] = 1;
+  queue[tail++] = 0;
+  for (j = 0; j < n_seeds; j++)
+    {
+      int *sp = apr_hash_get (g->node_ix, seeds[j], APR_HASH_KEY_STRING);
+      if (sp != NULL && !seen[*sp])
 	{
-	  tmetric_find_node (result, flows, issuer);
-	  givenname = virgule_xml_get_prop (p, tree, (xmlChar *)"givenname");
-	  surname = virgule_xml_get_prop (p, tree, (xmlChar *)"surname");
-	  tmetric_set_name (result, flows, issuer, givenname, surname, vr);
-	  tree = virgule_xml_find_child (profile->xmlRootNode, "certs");
-	  if (tree == NULL)
-	    continue;
-	  for (cert = tree->children; cert != NULL; cert = cert->next)
-	    {
-	      if (cert->type == XML_ELEMENT_NODE &&
-		  !strcmp ((char *)cert->name, "cert"))
-		{
-		  char *cert_subj;
-		  
-		  cert_subj = virgule_xml_get_prop (p, cert, (xmlChar *)"subj");
-		  if (cert_subj)
-		    {
-		      char *cert_level;
-		      CertLevel level;
-		      
-		      (void) tmetric_find_node (result, flows, cert_subj);
-		      cert_level = (char *)xmlGetProp (cert, (xmlChar *)"level");
-		      level = virgule_cert_level_from_name (vr, cert_level);
-		      xmlFree (cert_level);
-#if 0
-		      virgule_buffer_printf (vr->b, "cert_subj = %s, level %d\n", cert_subj, level);
-#endif
-		      for (i = 1; i <= level; i++)
-			virgule_net_flow_add_edge (flows[i], issuer, cert_subj);
-		    }
-		}
-	    }
-	}	
-      virgule_db_xml_free (p, profile);
+	  seen[*sp] = 1;
+	  queue[tail++] = *sp;
+	}
     }
-  virgule_db_close_dir (dbc);
 
-  for (i = 1; i < cert_level_n; i++)
+  while (head < tail && !found)
     {
-      int *flow;
-      virgule_net_flow_max_flow (flows[i], seed, caps, n_caps);
-      flow = virgule_net_flow_extract (flows[i]);
-      virgule_net_flow_free (flows[i]);
-      for (idx = 1; idx < result->nelts; idx++)
-	if (flow[idx])
-	  ((NodeInfo *)(result->elts))[idx].level = i;
-      g_free (flow);
+      idx = queue[head++];
+      if (targets[idx])
+	found = TRUE;
+      for (j = out_start[idx]; j < out_start[idx + 1]; j++)
+	if (!seen[out[j]])
+	  {
+	    seen[out[j]] = 1;
+	    queue[tail++] = out[j];
+	  }
     }
 
-  return result;
+  apr_pool_destroy (p);
+  return found;
 }
 
 static int
@@ -211,53 +330,259 @@ node_info_compare (const void *ni1, const void *ni2)
   return name1[i];
 }
 
-
 /**
- * Runs the trust metric and generates an updated tmetric cache file
+ * tmetric_publish: Write the trust metric results.
+ * @vr: The request context.
+ * @g: The cert graph with flows computed.
+ *
+ * @table: Whether levels may have changed.
+ *
+ * Writes the "tmetric/default" cache read by virgule_req_get_tmetric()
+ * and, if @table is set, the binary table shared between processes.
+ * Accounts are listed, along with the seeds and anyone certified. The
+ * table holds only names and levels, so account changes alone leave it
+ * as it is.
+ *
+ * Return value: NULL on success, or a description of what failed.
  **/
-static int
-tmetric_index_serve (VirguleReq *vr)
+static const char *
+tmetric_publish (VirguleReq *vr, CertGraph *g, int table)
 {
   apr_pool_t *p = vr->r->pool;
-  Db *db = vr->db;
-  apr_array_header_t *nodeinfo;
-  int n_seeds, n_caps;
-  int i;
+  CertGraphNode *nodes = (CertGraphNode *)g->nodes->elts;
+  CertGraphEdge *edges = (CertGraphEdge *)g->edges->elts;
+  NodeInfo *info;
   NodeInfo *ni;
-  int status;
+  char *listed;
   Buffer *cb;
   char *cache_str;
-
-  for (n_seeds = 0;; n_seeds++)
-    if (!vr->priv->seeds[n_seeds])
-      break;
-  for (n_caps = 0;; n_caps++)
-    if (!vr->priv->caps[n_caps])
-      break;
-
-  nodeinfo = tmetric_run (vr, vr->priv->seeds, n_seeds, vr->priv->caps, n_caps);
-
-  qsort (nodeinfo->elts, nodeinfo->nelts, sizeof(NodeInfo),
-	 node_info_compare);
+  const char **names;
+  int *levels;
+  int *idx;
+  int i, n_info, n;
+
+  listed = (char *)apr_pcalloc (p, g->nodes->nelts);
+  for (i = 0; i < g->nodes->nelts; i++)
+    listed[i] = nodes[i].is_acct;
+  for (i = 0; i < g->edges->nelts; i++)
+    if (edges[i].level > CERT_LEVEL_NONE)
+      listed[edges[i].subj] = 1;
+  for (i = 0; vr->priv->seeds[i]; i++)
+    {
+      idx = apr_hash_get (g->node_ix, vr->priv->seeds[i], APR_HASH_KEY_STRING);
+      if (idx != NULL)
+	listed[*idx] = 1;
+    }
+  /* Skip the root node */
+  listed[0] = 0;
+
+  info = (NodeInfo *)apr_palloc (p, g->nodes->nelts * sizeof(NodeInfo));
+  for (i = 0, n_info = 0; i < g->nodes->nelts; i++)
+    if (listed[i])
+      {
+	ni = &info[n_info++];
+	ni->name = nodes[i].name;
+	ni->givenname = nodes[i].givenname;
+	ni->surname = nodes[i].surname;
+	ni->level = tmetric_node_level (&nodes[i]);
+      }
+  qsort (info, n_info, sizeof(NodeInfo), node_info_compare);
 
   cb = virgule_buffer_new (p);
-  for (i = 0; i < nodeinfo->nelts; i++)
+  names = (const char **)apr_palloc (p, (n_info + 1) * sizeof(char *));
+  levels = (int *)apr_palloc (p, (n_info + 1) * sizeof(int));
+  n = 0;
+  for (i = 0; i < n_info; i++)
     {
-      ni = &((NodeInfo *)(nodeinfo->elts))[i];
-      if (strcmp(((NodeInfo *)ni)->name, "-") == 0) {
-	/* Skip the root node */
-	continue;
-      }
+      ni = &info[i];
       virgule_buffer_printf (cb, "%s %s\n", ap_escape_uri(vr->r->pool,ni->name), virgule_cert_level_to_name (vr, ni->level));
+      if (ni->level > CERT_LEVEL_NONE)
+	{
+	  names[n] = ni->name;
+	  levels[n] = ni->level;
+	  n++;
+	}
     }
 
   cache_str = virgule_buffer_extract (cb);
-  status = virgule_db_put (db, "tmetric/default", cache_str, strlen (cache_str));
+  if (virgule_db_put (vr->db, "tmetric/default", cache_str, strlen (cache_str)))
+    return "Error writing tmetric cache.";
+
+  /* The binary table shared by all threads and children */
+  if (table &&
+      virgule_tmetric_table_write (p, vr->priv->base_path, names, levels, n,
+				   cert_level_n))
+    return "Error writing tmetric table.";
+
+  return NULL;
+}
+
+/**
+ * tmetric_apply_changes: Apply the cert graph change log and rerun the
+ * levels it affects.
+ * @vr: The request context.
+ * @g: The cert graph.
+ * @levels: Set to TRUE if any level changed.
+ *
+ * Return value: TRUE if the results need publishing.
+ **/
+static int
+tmetric_apply_changes (VirguleReq *vr, CertGraph *g, int *levels)
+{
+  apr_pool_t *p = vr->r->pool;
+  apr_array_header_t *changes;
+  CertGraphEdge *e;
+  char **targets;
+  char *run;
+  int n_seeds, n_caps;
+  CertLevel lo, hi;
+  int changed;
+  int any_run = FALSE;
+  int i, j;
+
+  *levels = FALSE;
+  changes = apr_array_make (p, 16, sizeof (int));
+  if (virgule_certgraph_apply_log (vr, g, changes) == 0)
+    return FALSE;
+  changed = g->nodes_changed;
+
+  /* targets[level][node] is set if a cert from node at level changed */
+  targets = (char **)apr_pcalloc (p, cert_level_n * sizeof (char *));
+  for (j = 0; j < changes->nelts; j++)
+    {
+      e = &((CertGraphEdge *)g->edges->elts)[((int *)changes->elts)[j]];
+      lo = e->prev < e->level ? e->prev : e->level;
+      hi = e->prev < e->level ? e->level : e->prev;
+      for (i = lo + 1; i <= hi; i++)
+	{
+	  if (targets[i] == NULL)
+	    targets[i] = (char *)apr_pcalloc (p, g->nodes->nelts);
+	  targets[i][e->issuer] = 1;
+	}
+      /* someone without a profile may have been certified for the
+	 first time, or no longer be certified by anyone */
+      if (lo == CERT_LEVEL_NONE && hi != CERT_LEVEL_NONE &&
+	  !((CertGraphNode *)g->nodes->elts)[e->subj].is_acct)
+	changed = TRUE;
+    }
+
+  /* only levels where a changed cert is reachable can change */
+  tmetric_params (vr, &n_seeds, &n_caps);
+  run = (char *)apr_pcalloc (p, cert_level_n);
+  for (i = 1; i < cert_level_n; i++)
+    {
+      run[i] = targets[i] != NULL &&
+	tmetric_reaches (g, i, vr->priv->seeds, n_seeds, targets[i]);
+      any_run |= run[i];
+    }
+  /* account records alone only change the listing */
+  if (any_run && tmetric_flows (vr, g, run))
+    changed = *levels = TRUE;
+  return changed;
+}
 
-  if (status)
-    return virgule_send_error_page (vr, vERROR, "tmetric", "Error writing tmetric cache.");
+/**
+ * tmetric_update: Bring the trust metric results up to date with the
+ * cert graph change log.
+ * @vr: The request context.
+ *
+ * Does nothing if another request is already updating, since it will
+ * pick up our changes before it finishes, or if no cert graph has been
+ * stored yet.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_tmetric_update (VirguleReq *vr)
+{
+  apr_file_t *lock;
+  CertGraph *g;
+  const char *err = NULL;
+  apr_off_t done = 0;
+  int progress;
+  int levels;
+
+  cert_level_n = virgule_cert_num_levels (vr);
+  flow_engine = vr->priv->tmetric_engine;
+
+  do
+    {
+      lock = virgule_certgraph_lock (vr, FALSE);
+      if (lock == NULL)
+	break;
+
+      g = virgule_certgraph_load (vr);
+      progress = FALSE;
+      if (g != NULL && g->log_off < virgule_certgraph_log_size (vr))
+	{
+	  done = g->log_off;
+	  if (tmetric_apply_changes (vr, g, &levels))
+	    err = tmetric_publish (vr, g, levels);
+	  progress = g->log_off > done;
+	  /* saving also drops a torn line left by a writer that died */
+	  if (err == NULL && virgule_certgraph_save (vr, g))
+	    err = "Error writing cert graph.";
+	}
+      done = g != NULL ? g->log_off : 0;
+      virgule_certgraph_unlock (lock);
+
+      if (err != NULL)
+	ap_log_rerror (APLOG_MARK, APLOG_ERR, 0, vr->r,
+		       "mod_virgule: tmetric update: %s", err);
+    }
+  /* changes recorded while we held the lock were not waited for; a
+     pass that read no whole record has nothing more to wait for */
+  while (err == NULL && g != NULL && progress &&
+	 virgule_certgraph_log_size (vr) > done);
+
+  return err == NULL ? 0 : -1;
+}
+
+/**
+ * Runs the trust metric and generates an updated tmetric cache file.
+ * The stored cert graph is used unless @rebuild is set or there is
+ * none, in which case it is built from the account profiles.
+ **/
+static int
+tmetric_index_serve (VirguleReq *vr, int rebuild)
+{
+  CertGraph *g = NULL;
+  apr_file_t *lock;
+  char *run;
+  int n_seeds, n_caps;
+  int i;
+  const char *err;
+
+  tmetric_params (vr, &n_seeds, &n_caps);
+
+  lock = virgule_certgraph_lock (vr, TRUE);
+  if (lock == NULL)
+    return virgule_send_error_page (vr, vERROR, "tmetric", "Error locking cert graph.");
+
+  if (!rebuild)
+    g = virgule_certgraph_load (vr);
+  if (g != NULL)
+    virgule_certgraph_apply_log (vr, g, NULL);
   else
-    return virgule_send_error_page (vr, vINFO, "tmetric", "Wrote tmetric cache.");
+    g = virgule_certgraph_build (vr);
+  /* seeds may have been added to the config since the graph was built */
+  for (i = 0; i < n_seeds; i++)
+    (void) virgule_certgraph_node (g, vr->priv->seeds[i]);
+
+  run = (char *)apr_palloc (vr->r->pool, cert_level_n);
+  memset (run, 1, cert_level_n);
+  tmetric_flows (vr, g, run);
+
+  err = tmetric_publish (vr, g, TRUE);
+  if (err == NULL && virgule_certgraph_save (vr, g))
+    err = "Error writing cert graph.";
+  virgule_certgraph_unlock (lock);
+
+  if (err != NULL)
+    return virgule_send_error_page (vr, vERROR, "tmetric", err);
+
+  virgule_tmetric_update (vr);
+  return virgule_send_error_page (vr, vINFO, "tmetric", "Wrote tmetric cache.");
 }
 
 
@@ -268,9 +593,12 @@ virgule_tmetric_serve (VirguleReq *vr)
   char *uri = vr->uri;
 
   cert_level_n = virgule_cert_num_levels (vr);
+  flow_engine = vr->priv->tmetric_engine;
 
   if (!strcmp (uri, "/admin/crank-tmetric.html"))
-    return tmetric_index_serve (vr);
+    return tmetric_index_serve (vr, FALSE);
+  if (!strcmp (uri, "/admin/rebuild-certgraph.html"))
+    return tmetric_index_serve (vr, TRUE);
   return DECLINED;
 }
 
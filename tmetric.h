@@ -4,3 +4,6 @@ virgule_tmetric_serve (VirguleReq *vr);
 char *
 virgule_tmetric_get (VirguleReq *vr);
 
+
+int
+virgule_tmetric_update (VirguleReq *vr);
@@ -0,0 +1,261 @@
+/* Standalone trust metric benchmark.
+
+   Generates a synthetic cert graph with power-law out-degrees and
+   runs the trust metric over it the way tmetric.c does: one max flow
+   per cert level over the certs at that level or above, every level
+   numbered like the cert graph, and each account's level the highest
+   one it gets flow at. Reports the time and augmentations for each
+   level, the resulting level histogram, and peak memory, so changes
+   to the trust metric can be tried on a production sized graph
+   without a running site.
+
+   Build with "make tmetric_bench". Usage:
+
+     tmetric_bench [-n accounts] [-d mean_certs] [-a alpha] [-s seeds]
+		   [-c cap,cap,...] [-l levels] [-e augment|dinic] [-r rand]
+
+   -a is the exponent of the out-degree distribution (default 2.5);
+   -l is the number of cert levels including None (default 4); the
+   default caps are those of the sample site config. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+#include "net_flow.h"
+#include "bench.h"
+
+#define MAX_CAPS 64
+
+static const char *bench_level_names[] = {
+  "None", "Apprentice", "Journeyer", "Master"
+};
+
+/* Uniform on (0, 1]. */
+static double
+bench_uniform (void)
+{
+  return ((bench_rand () >> 8) + 1) / 16777216.0;
+}
+
+static long
+bench_peak_kb (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+static const char *
+bench_level_name (int level, int n_levels)
+{
+  static char buf[32];
+
+  if (n_levels == 4)
+    return bench_level_names[level];
+  sprintf (buf, "level %d", level);
+  return buf;
+}
+
+typedef struct {
+  int n_nodes;	/* node 0 is the root; accounts are 1 to n_nodes - 1 */
+  int n_edges;
+  int *issuer;
+  int *subj;
+  int *level;
+} BenchGraph;
+
+/* Generate the certs. Out-degrees follow a power law with exponent
+   @alpha scaled to a mean of about @mean; subjects are drawn with a
+   similar skew, so a few accounts collect most of the certs, and
+   higher levels are rarer than lower ones. The seeds are the first
+   accounts, which collect the most certs. */
+static void
+bench_graph (BenchGraph *bg, int n_accts, int n_seeds, double mean,
+	     double alpha, int n_levels)
+{
+  int max_edges = 1024;
+  double x_min = mean * (alpha - 2) / (alpha - 1);
+  int i, j, deg;
+
+  if (x_min < 0.5)
+    x_min = 0.5;
+  bg->n_nodes = n_accts + 1;
+  bg->n_edges = 0;
+  bg->issuer = g_new (int, max_edges);
+  bg->subj = g_new (int, max_edges);
+  bg->level = g_new (int, max_edges);
+
+  for (i = 1; i <= n_accts; i++)
+    {
+      deg = (int)(x_min * pow (bench_uniform (), -1.0 / (alpha - 1)));
+      /* the seeds are active certifiers */
+      if (i <= n_seeds && deg < 100)
+	deg = 100;
+      if (deg > n_accts - 1)
+	deg = n_accts - 1;
+      for (j = 0; j < deg; j++)
+	{
+	  int level, subj;
+
+	  subj = 1 + (int)((n_accts - 1) * pow (bench_uniform (), 2.0));
+	  if (subj == i)
+	    continue;
+	  for (level = 1; level < n_levels - 1; level++)
+	    if (bench_rand () % 5 < 3)
+	      break;
+
+	  if (bg->n_edges == max_edges)
+	    {
+	      max_edges <<= 1;
+	      bg->issuer = g_realloc (bg->issuer, max_edges * sizeof (int));
+	      bg->subj = g_realloc (bg->subj, max_edges * sizeof (int));
+	      bg->level = g_realloc (bg->level, max_edges * sizeof (int));
+	    }
+	  bg->issuer[bg->n_edges] = i;
+	  bg->subj[bg->n_edges] = subj;
+	  bg->level[bg->n_edges] = level;
+	  bg->n_edges++;
+	}
+    }
+}
+
+static int
+bench_parse_caps (const char *s, int *caps)
+{
+  int n = 0;
+
+  while (*s && n < MAX_CAPS)
+    {
+      caps[n++] = atoi (s);
+      s = strchr (s, ',');
+      if (s == NULL)
+	break;
+      s++;
+    }
+  return n;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int default_caps[] = { 800, 200, 50, 12, 4, 2, 1 };
+  int caps[MAX_CAPS];
+  int n_caps = sizeof (default_caps) / sizeof (default_caps[0]);
+  int n_accts = 100000, n_seeds = 4, n_levels = 4;
+  double mean = 6, alpha = 2.5;
+  NetFlowEngine engine = NET_FLOW_AUGMENT;
+  BenchGraph bg;
+  int *node_level;
+  int *hist;
+  double t0, t1, t_total;
+  int i, level, status = 0;
+
+  memcpy (caps, default_caps, sizeof (default_caps));
+  bench_srand (2463534242u);
+
+  for (i = 1; i < argc; i++)
+    {
+      if (!strcmp (argv[i], "-n") && i + 1 < argc)
+	n_accts = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-d") && i + 1 < argc)
+	mean = atof (argv[++i]);
+      else if (!strcmp (argv[i], "-a") && i + 1 < argc)
+	alpha = atof (argv[++i]);
+      else if (!strcmp (argv[i], "-s") && i + 1 < argc)
+	n_seeds = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-c") && i + 1 < argc)
+	n_caps = bench_parse_caps (argv[++i], caps);
+      else if (!strcmp (argv[i], "-l") && i + 1 < argc)
+	n_levels = atoi (argv[++i]);
+      else if (!strcmp (argv[i], "-e") && i + 1 < argc)
+	engine = !strcmp (argv[++i], "dinic") ? NET_FLOW_DINIC : NET_FLOW_AUGMENT;
+      else if (!strcmp (argv[i], "-r") && i + 1 < argc)
+	bench_srand (strtoul (argv[++i], NULL, 0) | 1);
+      else
+	{
+	  fprintf (stderr, "usage: %s [-n accounts] [-d mean_certs] [-a alpha] "
+		   "[-s seeds] [-c cap,cap,...] [-l levels] "
+		   "[-e augment|dinic] [-r rand]\n", argv[0]);
+	  return 2;
+	}
+    }
+  if (n_accts < 2 || n_seeds < 1 || n_seeds > n_accts || n_levels < 2 ||
+      n_levels > 31 || n_caps < 1 || alpha <= 2)
+    {
+      fprintf (stderr, "%s: bad parameters\n", argv[0]);
+      return 2;
+    }
+
+  t0 = bench_now ();
+  bench_graph (&bg, n_accts, n_seeds, mean, alpha, n_levels);
+  t1 = bench_now ();
+  printf ("%d accounts, %d certs, %d seeds, %d levels, %s engine; "
+	  "generated in %.3fs\n",
+	  n_accts, bg.n_edges, n_seeds, n_levels,
+	  engine == NET_FLOW_DINIC ? "dinic" : "augment", t1 - t0);
+
+  node_level = g_new0 (int, bg.n_nodes);
+  t_total = 0;
+  for (level = 1; level < n_levels; level++)
+    {
+      NetFlow *flow;
+      int *result;
+      int n_edges = 0, accepted = 0, n_aug, ok;
+
+      t0 = bench_now ();
+      flow = virgule_net_flow_new_nodes (bg.n_nodes);
+      for (i = 0; i < n_seeds; i++)
+	virgule_net_flow_add_edge_ix (flow, 0, 1 + i);
+      for (i = 0; i < bg.n_edges; i++)
+	if (bg.level[i] >= level)
+	  {
+	    virgule_net_flow_add_edge_ix (flow, bg.issuer[i], bg.subj[i]);
+	    n_edges++;
+	  }
+      virgule_net_flow_set_engine (flow, engine);
+      virgule_net_flow_max_flow (flow, 0, caps, n_caps);
+      t1 = bench_now ();
+
+      n_aug = flow->n_augment;
+      ok = virgule_net_flow_sanity_check (flow, 0) == 0;
+      result = virgule_net_flow_extract (flow);
+      virgule_net_flow_free (flow);
+      for (i = 1; i < bg.n_nodes; i++)
+	if (result[i])
+	  {
+	    node_level[i] = level;
+	    accepted++;
+	  }
+      g_free (result);
+
+      printf ("  %-12s %9d certs  %8.3fs  %8d augmentations  "
+	      "%7d accepted  %s\n",
+	      bench_level_name (level, n_levels), n_edges, t1 - t0, n_aug,
+	      accepted, ok ? "ok" : "SANITY CHECK FAILED");
+      t_total += t1 - t0;
+      if (!ok)
+	status = 1;
+    }
+
+  hist = g_new0 (int, n_levels);
+  for (i = 1; i < bg.n_nodes; i++)
+    hist[node_level[i]]++;
+  printf ("level histogram:\n");
+  for (level = n_levels - 1; level >= 0; level--)
+    printf ("  %-12s %9d\n", bench_level_name (level, n_levels), hist[level]);
+  printf ("trust metric %.3fs, peak memory %ld KB\n", t_total,
+	  bench_peak_kb ());
+
+  g_free (hist);
+  g_free (node_level);
+  g_free (bg.issuer);
+  g_free (bg.subj);
+  g_free (bg.level);
+
+  return status;
+}
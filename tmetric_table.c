@@ -0,0 +1,443 @@
+/* A compact binary form of the trust metric cache that every thread of
+   every child maps read-only, instead of each thread loading and
+   indexing its own copy of the "tmetric/default" text.
+
+   The file, "tmetric/default.tbl" in the database directory, is a
+   TmetricTableHeader followed by n_entries TmetricTableEntry records
+   sorted by account name (strcmp order), followed by the
+   NUL-terminated names themselves. Lookups are a binary search.
+
+   A new crank writes a complete new table to a temporary file and
+   renames it into place, so a mapping never sees a partial table. The
+   writer then sets the stale flag in the header of the table it
+   replaced. Since mappings are shared, readers in all processes see
+   the flag without a system call and remap the new file. A table that
+   is still in use by a request when it goes stale is unmapped when
+   the last reference is released. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr.h>
+#include <apr_strings.h>
+#include <apr_hash.h>
+#include <apr_thread_mutex.h>
+#include <httpd.h>
+
+#include "tmetric_table.h"
+
+#define TMETRIC_TABLE_NAME "tmetric/default.tbl"
+#define TMETRIC_TABLE_MAGIC 0x56544d54 /* "VTMT" */
+#define TMETRIC_TABLE_VERSION 1
+
+/* How long to wait before looking for a table again after failing to
+   map one (for example, before the first crank with this code). */
+#define TMETRIC_TABLE_RETRY apr_time_from_sec (10)
+
+typedef struct {
+  apr_uint32_t magic;
+  apr_uint32_t version;
+  apr_uint64_t generation;
+  apr_int64_t mtime;
+  apr_uint32_t n_levels;
+  apr_uint32_t n_entries;
+  apr_uint32_t names_size;
+  apr_uint32_t stale;
+} TmetricTableHeader;
+
+typedef struct {
+  apr_uint32_t name;  /* offset into the names */
+  apr_uint32_t level;
+} TmetricTableEntry;
+
+struct _TmetricTable {
+  void *addr;
+  size_t size;
+  const TmetricTableHeader *hdr;
+  const TmetricTableEntry *entries;
+  const char *names;
+  int refcount;
+  int superseded;
+};
+
+/* One per database directory */
+typedef struct {
+  char *pathname;
+  TmetricTable *current;
+  apr_time_t last_try;
+} TmetricTableSlot;
+
+typedef struct {
+  const char *name;
+  int level;
+} TmetricTableRow;
+
+static apr_pool_t *table_pool = NULL;
+static apr_thread_mutex_t *table_lock = NULL;
+static apr_hash_t *table_slots = NULL;
+
+/**
+ * tmetric_table_init: Set up the shared tmetric table for this process.
+ * @p: Process pool.
+ *
+ * Return value: APR_SUCCESS on success.
+ **/
+apr_status_t
+virgule_tmetric_table_init (apr_pool_t *p)
+{
+  table_pool = p;
+  table_slots = apr_hash_make (p);
+  return apr_thread_mutex_create (&table_lock, APR_THREAD_MUTEX_DEFAULT, p);
+}
+
+static void
+tmetric_table_unmap (TmetricTable *t)
+{
+  munmap (t->addr, t->size);
+  free (t);
+}
+
+/* Map and validate the table file, or return NULL. */
+static TmetricTable *
+tmetric_table_map (const char *pathname)
+{
+  TmetricTable *t;
+  const TmetricTableHeader *hdr;
+  struct stat st;
+  void *addr;
+  size_t names_off;
+  apr_uint32_t i;
+  int fd;
+
+  fd = open (pathname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) < 0 || st.st_size < (off_t)sizeof (TmetricTableHeader))
+    {
+      close (fd);
+      return NULL;
+    }
+  addr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  hdr = (const TmetricTableHeader *)addr;
+  names_off = sizeof (TmetricTableHeader) +
+    (size_t)hdr->n_entries * sizeof (TmetricTableEntry);
+  if (hdr->magic != TMETRIC_TABLE_MAGIC ||
+      hdr->version != TMETRIC_TABLE_VERSION ||
+      hdr->stale ||
+      names_off + hdr->names_size != (size_t)st.st_size ||
+      (hdr->names_size > 0 &&
+       ((const char *)addr)[st.st_size - 1] != 0))
+    {
+      munmap (addr, st.st_size);
+      return NULL;
+    }
+
+  t = (TmetricTable *)calloc (1, sizeof (TmetricTable));
+  if (t == NULL)
+    {
+      munmap (addr, st.st_size);
+      return NULL;
+    }
+  t->addr = addr;
+  t->size = st.st_size;
+  t->hdr = hdr;
+  t->entries = (const TmetricTableEntry *)(hdr + 1);
+  t->names = (const char *)addr + names_off;
+
+  for (i = 0; i < hdr->n_entries; i++)
+    if (t->entries[i].name >= hdr->names_size)
+      {
+	tmetric_table_unmap (t);
+	return NULL;
+      }
+  return t;
+}
+
+static apr_status_t
+tmetric_table_release (void *data)
+{
+  TmetricTable *t = (TmetricTable *)data;
+
+  apr_thread_mutex_lock (table_lock);
+  if (--t->refcount == 0 && t->superseded)
+    tmetric_table_unmap (t);
+  apr_thread_mutex_unlock (table_lock);
+  return APR_SUCCESS;
+}
+
+/**
+ * tmetric_table_acquire: Get the current trust metric table.
+ * @p: Pool; the reference to the table is released when it is cleared.
+ * @base_pathname: The database directory.
+ *
+ * If the mapped table has been replaced by a newer crank, the new one
+ * is mapped in its place. Otherwise this does no system calls.
+ *
+ * Return value: The table, or NULL if there is no usable table yet.
+ **/
+const TmetricTable *
+virgule_tmetric_table_acquire (apr_pool_t *p, const char *base_pathname)
+{
+  TmetricTableSlot *slot;
+  TmetricTable *t;
+  apr_time_t now;
+
+  if (table_lock == NULL)
+    return NULL;
+
+  apr_thread_mutex_lock (table_lock);
+  slot = apr_hash_get (table_slots, base_pathname, APR_HASH_KEY_STRING);
+  if (slot == NULL)
+    {
+      slot = (TmetricTableSlot *)apr_pcalloc (table_pool,
+					      sizeof (TmetricTableSlot));
+      slot->pathname = apr_pstrcat (table_pool, base_pathname, "/",
+				    TMETRIC_TABLE_NAME, NULL);
+      apr_hash_set (table_slots, apr_pstrdup (table_pool, base_pathname),
+		    APR_HASH_KEY_STRING, slot);
+    }
+
+  t = slot->current;
+  if (t != NULL && ((volatile const TmetricTableHeader *)t->hdr)->stale)
+    {
+      slot->current = NULL;
+      t->superseded = 1;
+      if (t->refcount == 0)
+	tmetric_table_unmap (t);
+      t = NULL;
+      slot->last_try = 0;
+    }
+
+  if (t == NULL)
+    {
+      now = apr_time_now ();
+      if (now - slot->last_try >= TMETRIC_TABLE_RETRY)
+	{
+	  slot->last_try = now;
+	  t = tmetric_table_map (slot->pathname);
+	  slot->current = t;
+	}
+    }
+
+  if (t != NULL)
+    {
+      t->refcount++;
+      apr_pool_cleanup_register (p, t, tmetric_table_release,
+				 apr_pool_cleanup_null);
+    }
+  apr_thread_mutex_unlock (table_lock);
+
+  return t;
+}
+
+/**
+ * tmetric_table_lookup: Look up the cert level of an account.
+ * @t: The table.
+ * @u: The account name.
+ *
+ * Return value: The level, or -1 if @u is not in the table.
+ **/
+int
+virgule_tmetric_table_lookup (const TmetricTable *t, const char *u)
+{
+  apr_uint32_t lo = 0, hi = t->hdr->n_entries, mid;
+  int c;
+
+  while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      c = strcmp (u, t->names + t->entries[mid].name);
+      if (c == 0)
+	return t->entries[mid].level;
+      if (c < 0)
+	hi = mid;
+      else
+	lo = mid + 1;
+    }
+  return -1;
+}
+
+/**
+ * tmetric_table_get_info: Describe a table.
+ * @t: The table.
+ * @info: Filled in with the table's header fields.
+ **/
+void
+virgule_tmetric_table_get_info (const TmetricTable *t, TmetricTableInfo *info)
+{
+  info->generation = t->hdr->generation;
+  info->mtime = t->hdr->mtime;
+  info->n_levels = t->hdr->n_levels;
+  info->n_entries = t->hdr->n_entries;
+  info->bytes = t->size;
+}
+
+static int
+tmetric_table_row_compare (const void *a, const void *b)
+{
+  return strcmp (((const TmetricTableRow *)a)->name,
+		 ((const TmetricTableRow *)b)->name);
+}
+
+/* Write all of @len bytes. */
+static int
+tmetric_table_write_all (int fd, const void *buf, size_t len)
+{
+  const char *c = (const char *)buf;
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = write (fd, c, len);
+      if (n < 0)
+	return -1;
+      c += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/**
+ * tmetric_table_write: Write a new trust metric table.
+ * @p: Pool for temporary allocations.
+ * @base_pathname: The database directory.
+ * @names: Account names, unescaped.
+ * @levels: Cert level of each account.
+ * @n: Number of accounts.
+ * @n_levels: Number of cert levels configured for the site.
+ *
+ * Writes the table to a temporary file, renames it into place and
+ * marks the table it replaced as stale. Writers are serialized with a
+ * lock on the table directory's lock file.
+ *
+ * Return value: 0 on success.
+ **/
+int
+virgule_tmetric_table_write (apr_pool_t *p, const char *base_pathname,
+			     const char **names, const int *levels, int n,
+			     int n_levels)
+{
+  char *dir, *pathname, *tmp_pathname, *lock_pathname;
+  TmetricTableHeader hdr, old;
+  TmetricTableRow *rows;
+  TmetricTableEntry *entries;
+  apr_uint32_t names_size;
+  int lock_fd, fd, old_fd;
+  int status = -1;
+  int i;
+
+  dir = apr_pstrcat (p, base_pathname, "/tmetric", NULL);
+  pathname = apr_pstrcat (p, base_pathname, "/", TMETRIC_TABLE_NAME, NULL);
+  tmp_pathname = apr_psprintf (p, "%s.%ld", pathname, (long)getpid ());
+  lock_pathname = apr_pstrcat (p, pathname, ".lock", NULL);
+
+  rows = (TmetricTableRow *)apr_palloc (p, (n + 1) * sizeof (TmetricTableRow));
+  for (i = 0; i < n; i++)
+    {
+      rows[i].name = names[i];
+      rows[i].level = levels[i];
+    }
+  qsort (rows, n, sizeof (TmetricTableRow), tmetric_table_row_compare);
+
+  entries = (TmetricTableEntry *)apr_palloc (p, (n + 1) *
+					     sizeof (TmetricTableEntry));
+  names_size = 0;
+  for (i = 0; i < n; i++)
+    {
+      entries[i].name = names_size;
+      entries[i].level = rows[i].level;
+      names_size += strlen (rows[i].name) + 1;
+    }
+
+  /* with the log backend the directory may not exist yet */
+  if (mkdir (dir, 0775) < 0 && errno != EEXIST)
+    return -1;
+
+  lock_fd = open (lock_pathname, O_RDWR | O_CREAT, 0664);
+  if (lock_fd < 0)
+    return -1;
+  if (flock (lock_fd, LOCK_EX) < 0)
+    {
+      close (lock_fd);
+      return -1;
+    }
+
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.magic = TMETRIC_TABLE_MAGIC;
+  hdr.version = TMETRIC_TABLE_VERSION;
+  hdr.generation = 1;
+  hdr.mtime = apr_time_now ();
+  hdr.n_levels = n_levels;
+  hdr.n_entries = n;
+  hdr.names_size = names_size;
+
+  /* Hold the old table open so it can be marked stale once replaced */
+  old_fd = open (pathname, O_RDWR);
+  if (old_fd >= 0 &&
+      pread (old_fd, &old, sizeof (old), 0) == sizeof (old) &&
+      old.magic == TMETRIC_TABLE_MAGIC)
+    hdr.generation = old.generation + 1;
+
+  fd = open (tmp_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+  if (fd < 0)
+    goto out;
+  if (tmetric_table_write_all (fd, &hdr, sizeof (hdr)) ||
+      tmetric_table_write_all (fd, entries, n * sizeof (TmetricTableEntry)))
+    goto out_unlink;
+  for (i = 0; i < n; i++)
+    if (tmetric_table_write_all (fd, rows[i].name, strlen (rows[i].name) + 1))
+      goto out_unlink;
+  if (close (fd) < 0)
+    {
+      fd = -1;
+      goto out_unlink;
+    }
+  fd = -1;
+
+  if (rename (tmp_pathname, pathname) < 0)
+    goto out_unlink;
+
+  if (old_fd >= 0)
+    {
+      apr_uint32_t stale = 1;
+
+      pwrite (old_fd, &stale, sizeof (stale),
+	      APR_OFFSETOF (TmetricTableHeader, stale));
+    }
+
+  /* Don't make this process wait out the retry interval either */
+  if (table_lock != NULL)
+    {
+      TmetricTableSlot *slot;
+
+      apr_thread_mutex_lock (table_lock);
+      slot = apr_hash_get (table_slots, base_pathname, APR_HASH_KEY_STRING);
+      if (slot != NULL)
+	slot->last_try = 0;
+      apr_thread_mutex_unlock (table_lock);
+    }
+  status = 0;
+  goto out;
+
+ out_unlink:
+  if (fd >= 0)
+    close (fd);
+  unlink (tmp_pathname);
+ out:
+  if (old_fd >= 0)
+    close (old_fd);
+  flock (lock_fd, LOCK_UN);
+  close (lock_fd);
+  return status;
+}
@@ -0,0 +1,27 @@
+typedef struct _TmetricTable TmetricTable;
+typedef struct _TmetricTableInfo TmetricTableInfo;
+
+struct _TmetricTableInfo {
+  apr_uint64_t generation;
+  apr_time_t mtime;
+  int n_levels;
+  unsigned long n_entries;
+  apr_size_t bytes;
+};
+
+apr_status_t
+virgule_tmetric_table_init (apr_pool_t *p);
+
+const TmetricTable *
+virgule_tmetric_table_acquire (apr_pool_t *p, const char *base_pathname);
+
+int
+virgule_tmetric_table_lookup (const TmetricTable *t, const char *u);
+
+void
+virgule_tmetric_table_get_info (const TmetricTable *t, TmetricTableInfo *info);
+
+int
+virgule_tmetric_table_write (apr_pool_t *p, const char *base_pathname,
+			     const char **names, const int *levels, int n,
+			     int n_levels);
@@ -3,6 +3,8 @@
 
 #include <apr.h>
 #include <apr_strings.h>
+#include <apr_allocator.h>
+#include <apr_thread_mutex.h>
 #include <apr_file_io.h>
 #include <apr_date.h>
 #include <apr_sha1.h>
@@ -1494,6 +1496,55 @@ virgule_encode_textarea (apr_pool_t *p, const char *raw)
 }
 
 
+/**
+ * virgule_pool_create_private: Create a pool with its own allocator.
+ * @p_pool: Where to store the pool.
+ * @locked: TRUE to give the allocator a mutex.
+ *
+ * A thread may allocate from such a pool while other threads allocate
+ * from theirs, which subpools of a shared pool don't allow. With
+ * @locked, subpools of the pool, such as those apr_thread_create makes,
+ * may also be created and destroyed from several threads at once. The
+ * pool has no parent: the caller must destroy it, which also destroys
+ * the allocator.
+ *
+ * Return value: APR_SUCCESS, or an error status.
+ **/
+apr_status_t
+virgule_pool_create_private (apr_pool_t **p_pool, int locked)
+{
+  apr_allocator_t *allocator;
+  apr_status_t status;
+
+  status = apr_allocator_create (&allocator);
+  if (status != APR_SUCCESS)
+    return status;
+  status = apr_pool_create_ex (p_pool, NULL, NULL, allocator);
+  if (status != APR_SUCCESS)
+    {
+      apr_allocator_destroy (allocator);
+      return status;
+    }
+  apr_allocator_owner_set (allocator, *p_pool);
+#if APR_HAS_THREADS
+  if (locked)
+    {
+      apr_thread_mutex_t *mutex;
+
+      status = apr_thread_mutex_create (&mutex, APR_THREAD_MUTEX_DEFAULT,
+					*p_pool);
+      if (status != APR_SUCCESS)
+	{
+	  apr_pool_destroy (*p_pool);
+	  return status;
+	}
+      apr_allocator_mutex_set (allocator, mutex);
+    }
+#endif
+  return APR_SUCCESS;
+}
+
+
 /**
  * virgule_strsub - Return a newly allocated copy of str with any 
  * occurances of string o(ld) replaced with string n(ew).
@@ -102,5 +102,8 @@ virgule_encode_textarea (apr_pool_t *p, const char *raw);
 char *
 virgule_decode_textarea (apr_pool_t *p, const char *raw);
 
+apr_status_t
+virgule_pool_create_private (apr_pool_t **p_pool, int locked);
+
 //char *
 //virgule_strsub(apr_pool_t *pool, const char *str, const char *o, const char *n);